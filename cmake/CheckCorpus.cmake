@@ -0,0 +1,14 @@
+## runs oniontrace-corpus on a corpus of control lines and fails if the callbacks
+## it prints differ from the expected ones. called by ctest as
+##   cmake -DPROGRAM=... -DCORPUS=... -DEXPECTED=... -DOUTPUT=... -P CheckCorpus.cmake
+
+execute_process(COMMAND ${PROGRAM} ${CORPUS} ${OUTPUT} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${PROGRAM} failed on ${CORPUS}")
+endif()
+
+file(READ ${EXPECTED} expected)
+file(READ ${OUTPUT} actual)
+if(NOT expected STREQUAL actual)
+    message(FATAL_ERROR "the callbacks in ${OUTPUT} differ from ${EXPECTED}, compare them with diff")
+endif()
@@ -0,0 +1,70 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* wraps the allocation functions of glibc to count them. this is only
+ * compiled into oniontrace-replay and oniontrace-bench, and must never be
+ * part of oniontrace-core, because it replaces malloc for the whole program. */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "oniontrace-allocations.h"
+
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t numMembers, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+/* the benchmarks only run on the main thread */
+static gsize numAllocations = 0;
+
+void* malloc(size_t size) {
+    numAllocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t numMembers, size_t size) {
+    numAllocations++;
+    return __libc_calloc(numMembers, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    numAllocations++;
+    return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    /* the alignment must be a power of two multiple of sizeof(void*) */
+    if(alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+
+    numAllocations++;
+    void* memory = __libc_memalign(alignment, size);
+    if(!memory) {
+        return ENOMEM;
+    }
+
+    *pointer = memory;
+    return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    numAllocations++;
+    return __libc_memalign(alignment, size);
+}
+
+gsize oniontraceallocations_getCount() {
+    return numAllocations;
+}
+
+#else
+
+gsize oniontraceallocations_getCount() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef SRC_ONIONTRACE_ALLOCATIONS_H_
+#define SRC_ONIONTRACE_ALLOCATIONS_H_
+
+#include <glib.h>
+
+/* programs that compile oniontrace-allocations.c count their allocations by
+ * wrapping the glibc allocator, which glib uses too. the sanitizers bring
+ * their own allocator, so we can't count with them. */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define ONIONTRACE_COUNT_ALLOCATIONS 1
+#endif
+
+/* the number of allocations so far, only counted if ONIONTRACE_COUNT_ALLOCATIONS is set */
+gsize oniontraceallocations_getCount();
+
+#endif /* SRC_ONIONTRACE_ALLOCATIONS_H_ */
@@ -0,0 +1,632 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* micro-benchmarks for the hot paths of oniontrace. each benchmark runs for
+ * at least MinTime milliseconds, the best of Repeat runs is reported as the
+ * time and number of allocations per operation, and the results can be
+ * written as JSON so that runs can be compared across commits. */
+
+#include <sys/eventfd.h>
+
+#include "oniontrace.h"
+#include "oniontrace-allocations.h"
+
+/* a trace of a day-long experiment with many clients has about this many circuits */
+#define BENCH_DEFAULT_TRACE_CIRCUITS 1000000
+
+#define BENCH_PATH "$FF197204099FA0E507FA46D41FED97D3337B4BAA~guard," \
+    "$F63C257B0819549FCD3E476FB534C08E550AC29D~middle," \
+    "$4EBB385C80A2CA5D671E16F1C722FBFB5F176891~exit"
+
+#define BENCH_STREAM_LINE "650 STREAM 21 NEW 0 11.0.0.6:18080 SOURCE_ADDR=127.0.0.1:21437 " \
+    "PURPOSE=USER USERNAME=session-7"
+
+/* the events of a typical busy client, as tor sends them */
+static const gchar* benchControlLines[] = {
+    "650 BW 7130 8340",
+    "650 CIRC 3 LAUNCHED BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=2017-01-01T00:00:00.000000",
+    "650 CIRC 3 EXTENDED $FF197204099FA0E507FA46D41FED97D3337B4BAA~guard BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL",
+    "650 CIRC 3 BUILT " BENCH_PATH " BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=2017-01-01T00:00:00.000000",
+    BENCH_STREAM_LINE,
+    "650 STREAM 21 SENTCONNECT 3 11.0.0.6:18080",
+    "650 STREAM 21 SUCCEEDED 3 11.0.0.6:18080",
+    "650 BW 1024 65536",
+    "650 STREAM 21 CLOSED 3 11.0.0.6:18080 REASON=DONE",
+    "650 CIRC 3 CLOSED " BENCH_PATH " BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL REASON=FINISHED",
+};
+
+typedef struct _BenchConfig {
+    gchar* filter;
+    guint minTimeMillis;
+    guint repeat;
+    guint numTraceCircuits;
+    gchar* outputFilename;
+    gchar* label;
+} BenchConfig;
+
+typedef struct _BenchState {
+    GString* buffer;
+    gchar* line;
+    gsize lineLength;
+    OnionTraceTorCtl* torctl;
+    OnionTraceCircuit* circuit;
+    gchar* traceFilename;
+    guint numTraceCircuits;
+    struct timespec offset;
+    guint64 counter;
+    guint64 target;
+    OnionTraceEventManager* manager;
+    gint descriptor;
+    gint savedStdout;
+} BenchState;
+
+/* runs the operation the given number of times, and returns how many operations
+ * that was, which differs for benchmarks that handle a batch per iteration */
+typedef guint64 (*BenchRunFunc)(BenchState* state, guint64 iterations);
+typedef void (*BenchStateFunc)(BenchState* state);
+
+typedef struct _Bench {
+    const gchar* name;
+    BenchStateFunc setup;
+    BenchRunFunc run;
+    BenchStateFunc teardown;
+} Bench;
+
+typedef struct _BenchResult {
+    const gchar* name;
+    guint64 numOps;
+    gdouble nanosPerOp;
+    gdouble allocationsPerOp;
+} BenchResult;
+
+/* control lines */
+
+static void _oniontracebench_setupStreamLine(BenchState* state) {
+    state->line = g_strdup(BENCH_STREAM_LINE);
+    state->lineLength = strlen(BENCH_STREAM_LINE);
+}
+
+static guint64 _oniontracebench_runTokenize(BenchState* state, guint64 iterations) {
+    TorCtlLine parsed;
+    guint64 numArgs = 0;
+
+    for(guint64 i = 0; i < iterations; i++) {
+        oniontracetorctl_tokenize(state->line, state->lineLength, TRUE, &parsed);
+        numArgs += parsed.numArgs + parsed.numKeywords;
+    }
+
+    state->counter += numArgs;
+    return iterations;
+}
+
+static void _oniontracebench_onCircuitStatus(BenchState* state, CircuitStatus status,
+        gint circuitID, gchar* path, gchar* reason) {
+    state->counter++;
+}
+
+static void _oniontracebench_onStreamStatus(BenchState* state, StreamStatus status,
+        gint circuitID, gint streamID, gchar* username) {
+    state->counter++;
+}
+
+static void _oniontracebench_setupProcessLines(BenchState* state) {
+    state->buffer = g_string_new(NULL);
+    for(guint i = 0; i < G_N_ELEMENTS(benchControlLines); i++) {
+        g_string_append_printf(state->buffer, "%s\r\n", benchControlLines[i]);
+    }
+
+    state->torctl = oniontracetorctl_newReplay();
+    oniontracetorctl_setCircuitStatusCallback(state->torctl,
+            (OnCircuitStatusFunc)_oniontracebench_onCircuitStatus, state);
+    oniontracetorctl_setStreamStatusCallback(state->torctl,
+            (OnStreamStatusFunc)_oniontracebench_onStreamStatus, state);
+}
+
+/* feeds the lines through the receive buffer and the line handlers, as if received from tor */
+static guint64 _oniontracebench_runProcessLines(BenchState* state, guint64 iterations) {
+    for(guint64 i = 0; i < iterations; i++) {
+        oniontracetorctl_replayBytes(state->torctl, state->buffer->str, state->buffer->len);
+    }
+    return iterations * G_N_ELEMENTS(benchControlLines);
+}
+
+/* trace files */
+
+static void _oniontracebench_setupCircuit(BenchState* state) {
+    clock_gettime(CLOCK_REALTIME, &state->offset);
+    struct timespec launchTime = {state->offset.tv_sec + 12, 345678901};
+
+    state->circuit = oniontracecircuit_new();
+    oniontracecircuit_setLaunchTime(state->circuit, &launchTime);
+    oniontracecircuit_setSessionID(state->circuit, "session-7");
+    oniontracecircuit_setPath(state->circuit, BENCH_PATH);
+
+    state->buffer = g_string_new(NULL);
+    oniontracecircuit_toCSV(state->circuit, &state->offset, state->buffer);
+}
+
+static guint64 _oniontracebench_runCircuitFromCSV(BenchState* state, guint64 iterations) {
+    /* the line ends with a newline, which the trace reader does not pass on */
+    gsize length = state->buffer->len - 1;
+
+    for(guint64 i = 0; i < iterations; i++) {
+        OnionTraceCircuit* circuit = oniontracecircuit_fromCSV(state->buffer->str, length, &state->offset);
+        oniontracecircuit_free(circuit);
+    }
+    return iterations;
+}
+
+static guint64 _oniontracebench_runCircuitToCSV(BenchState* state, guint64 iterations) {
+    for(guint64 i = 0; i < iterations; i++) {
+        g_string_truncate(state->buffer, 0);
+        oniontracecircuit_toCSV(state->circuit, &state->offset, state->buffer);
+    }
+    return iterations;
+}
+
+static void _oniontracebench_setupTraceFile(BenchState* state) {
+    gint descriptor = g_file_open_tmp("oniontrace-bench-XXXXXX.csv", &state->traceFilename, NULL);
+    if(descriptor < 0) {
+        return;
+    }
+    close(descriptor);
+
+    OnionTraceFile* otfile = oniontracefile_newWriter(state->traceFilename);
+    if(!otfile) {
+        return;
+    }
+
+    /* launch times are mostly increasing, like the sessions of a recorded trace */
+    struct timespec zero = {0, 0};
+    OnionTraceCircuit* circuit = oniontracecircuit_new();
+    oniontracecircuit_setPath(circuit, BENCH_PATH);
+
+    for(guint i = 0; i < state->numTraceCircuits; i++) {
+        struct timespec launchTime = {(time_t)(i / 10) + (i % 7), (long)(i % 1000) * 1000000};
+        gchar* sessionID = g_strdup_printf("session-%u", i % 100);
+
+        oniontracecircuit_setLaunchTime(circuit, &launchTime);
+        oniontracecircuit_setSessionID(circuit, sessionID);
+        oniontracefile_writeCircuit(otfile, circuit, &zero);
+
+        g_free(sessionID);
+    }
+
+    oniontracecircuit_free(circuit);
+    oniontracefile_free(otfile);
+    clock_gettime(CLOCK_REALTIME, &state->offset);
+}
+
+static guint64 _oniontracebench_runTraceLoad(BenchState* state, guint64 iterations) {
+    guint64 numCircuits = 0;
+
+    if(!state->traceFilename) {
+        return 0;
+    }
+
+    for(guint64 i = 0; i < iterations; i++) {
+        OnionTraceFile* otfile = oniontracefile_newReader(state->traceFilename);
+        if(!otfile) {
+            break;
+        }
+
+        GPtrArray* circuits = oniontracefile_parseCircuits(otfile, &state->offset);
+        oniontracefile_free(otfile);
+
+        numCircuits += circuits->len;
+        for(guint j = 0; j < circuits->len; j++) {
+            oniontracecircuit_free(g_ptr_array_index(circuits, j));
+        }
+        g_ptr_array_free(circuits, TRUE);
+    }
+
+    return numCircuits;
+}
+
+static void _oniontracebench_teardownTraceFile(BenchState* state) {
+    if(state->traceFilename) {
+        g_unlink(state->traceFilename);
+    }
+}
+
+/* timers */
+
+static guint64 _oniontracebench_runTimespecAdd(BenchState* state, guint64 iterations) {
+    struct timespec sum = {0, 0};
+    struct timespec step = {0, 999999999};
+
+    for(guint64 i = 0; i < iterations; i++) {
+        oniontracetimer_timespecadd(&sum, &sum, &step);
+    }
+
+    state->counter += (guint64)sum.tv_sec;
+    return iterations;
+}
+
+static guint64 _oniontracebench_runTimespecSubtract(BenchState* state, guint64 iterations) {
+    struct timespec difference = {0, 0};
+    struct timespec start = {1000, 999999999};
+    struct timespec end = {2000, 1};
+
+    for(guint64 i = 0; i < iterations; i++) {
+        end.tv_nsec = (long)(i % 1000000000);
+        oniontracetimer_timespecsubtract(&difference, &start, &end);
+        state->counter += (guint64)difference.tv_nsec;
+    }
+
+    return iterations;
+}
+
+static void _oniontracebench_onEventReadable(BenchState* state, OnionTraceEventFlag type) {
+    guint64 value = 0;
+    if(read(state->descriptor, &value, sizeof(value)) < 0) {
+        oniontraceeventmanager_stopMainLoop(state->manager);
+        return;
+    }
+
+    /* make the descriptor readable again for the next round through the main loop */
+    state->counter++;
+    value = 1;
+    if(state->counter >= state->target || write(state->descriptor, &value, sizeof(value)) < 0) {
+        oniontraceeventmanager_stopMainLoop(state->manager);
+    }
+}
+
+/* measures one pass through the main loop, from epoll_wait to the callback */
+static guint64 _oniontracebench_runEventDispatch(BenchState* state, guint64 iterations) {
+    state->manager = oniontraceeventmanager_new();
+    state->descriptor = eventfd(0, EFD_NONBLOCK);
+    state->counter = 0;
+    state->target = iterations;
+
+    guint64 value = 1;
+    if(state->manager && state->descriptor >= 0 &&
+            oniontraceeventmanager_register(state->manager, state->descriptor, ONIONTRACE_EVENT_READ,
+                    (OnionTraceOnEventFunc)_oniontracebench_onEventReadable, state) &&
+            write(state->descriptor, &value, sizeof(value)) == sizeof(value)) {
+        oniontraceeventmanager_runMainLoop(state->manager);
+    }
+
+    if(state->manager && state->descriptor >= 0) {
+        oniontraceeventmanager_deregister(state->manager, state->descriptor);
+        close(state->descriptor);
+    }
+    if(state->manager) {
+        oniontraceeventmanager_free(state->manager);
+    }
+    state->manager = NULL;
+
+    return state->counter;
+}
+
+static void _oniontracebench_onTimerExpired(BenchState* state, gpointer unused) {
+    state->counter++;
+
+    if(state->counter >= state->target) {
+        oniontraceeventmanager_stopMainLoop(state->manager);
+    } else {
+        /* a zero delay expires on the next pass through the main loop */
+        struct timespec delay = {0, 0};
+        oniontraceeventmanager_addTimer(state->manager, &delay, NULL,
+                (GFunc)_oniontracebench_onTimerExpired, state, NULL);
+    }
+}
+
+/* measures adding a timer and running it from the main loop */
+static guint64 _oniontracebench_runTimerDispatch(BenchState* state, guint64 iterations) {
+    state->manager = oniontraceeventmanager_new();
+    state->counter = 0;
+    state->target = iterations;
+
+    if(state->manager) {
+        struct timespec delay = {0, 0};
+        oniontraceeventmanager_addTimer(state->manager, &delay, NULL,
+                (GFunc)_oniontracebench_onTimerExpired, state, NULL);
+        oniontraceeventmanager_runMainLoop(state->manager);
+        oniontraceeventmanager_free(state->manager);
+    }
+    state->manager = NULL;
+
+    return state->counter;
+}
+
+/* logging */
+
+static void _oniontracebench_setupLog(BenchState* state) {
+    /* the log is written to stdout, which we need for our own results */
+    fflush(stdout);
+    oniontrace_flushLog();
+    state->savedStdout = dup(STDOUT_FILENO);
+
+    gint devNull = open("/dev/null", O_WRONLY);
+    if(devNull >= 0) {
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+    }
+}
+
+static guint64 _oniontracebench_runLog(BenchState* state, guint64 iterations) {
+    for(guint64 i = 0; i < iterations; i++) {
+        /* critical lines are flushed right away, warnings are buffered like most of our lines */
+        oniontrace_log(G_LOG_LEVEL_WARNING, __FUNCTION__,
+                "%s: [oniontrace-bench] circuit %i status %s path %s", "Controller-9051",
+                (gint)(i % 10000), "BUILT", BENCH_PATH);
+    }
+    return iterations;
+}
+
+/* the log function as it was before lines were buffered, so that both can be compared */
+static void _oniontracebench_logGLib(const gchar* levelName, const gchar* functionName, const gchar* format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+
+    GDateTime* dt = g_date_time_new_now_local();
+    GString* newformat = g_string_new(NULL);
+
+    g_string_append_printf(newformat, "%04i-%02i-%02i %02i:%02i:%02i %"G_GINT64_FORMAT".%06i [%s] [%s] %s",
+            g_date_time_get_year(dt), g_date_time_get_month(dt), g_date_time_get_day_of_month(dt),
+            g_date_time_get_hour(dt), g_date_time_get_minute(dt), g_date_time_get_second(dt),
+            g_date_time_to_unix(dt), g_date_time_get_microsecond(dt),
+            levelName, functionName, format);
+
+    gchar* message = g_strdup_vprintf(newformat->str, vargs);
+    g_print("%s\n", message);
+    g_free(message);
+
+    g_string_free(newformat, TRUE);
+    g_date_time_unref(dt);
+
+    va_end(vargs);
+}
+
+static guint64 _oniontracebench_runLogGLib(BenchState* state, guint64 iterations) {
+    for(guint64 i = 0; i < iterations; i++) {
+        _oniontracebench_logGLib("warning", __FUNCTION__,
+                "%s: [oniontrace-bench] circuit %i status %s path %s", "Controller-9051",
+                (gint)(i % 10000), "BUILT", BENCH_PATH);
+    }
+    return iterations;
+}
+
+static void _oniontracebench_teardownLog(BenchState* state) {
+    oniontrace_flushLog();
+    /* g_print buffers in stdio, which must not reach the real stdout */
+    fflush(stdout);
+
+    if(state->savedStdout >= 0) {
+        dup2(state->savedStdout, STDOUT_FILENO);
+        close(state->savedStdout);
+    }
+}
+
+static const Bench benches[] = {
+    {"torctl_tokenize", _oniontracebench_setupStreamLine, _oniontracebench_runTokenize, NULL},
+    {"torctl_process_line", _oniontracebench_setupProcessLines, _oniontracebench_runProcessLines, NULL},
+    {"circuit_from_csv", _oniontracebench_setupCircuit, _oniontracebench_runCircuitFromCSV, NULL},
+    {"circuit_to_csv", _oniontracebench_setupCircuit, _oniontracebench_runCircuitToCSV, NULL},
+    {"trace_load_circuit", _oniontracebench_setupTraceFile, _oniontracebench_runTraceLoad,
+            _oniontracebench_teardownTraceFile},
+    {"timer_timespec_add", NULL, _oniontracebench_runTimespecAdd, NULL},
+    {"timer_timespec_subtract", NULL, _oniontracebench_runTimespecSubtract, NULL},
+    {"eventmanager_dispatch", NULL, _oniontracebench_runEventDispatch, NULL},
+    {"eventmanager_timer", NULL, _oniontracebench_runTimerDispatch, NULL},
+    {"log_format", _oniontracebench_setupLog, _oniontracebench_runLog, _oniontracebench_teardownLog},
+    {"log_format_glib", _oniontracebench_setupLog, _oniontracebench_runLogGLib, _oniontracebench_teardownLog},
+};
+
+static void _oniontracebench_freeState(BenchState* state) {
+    if(state->buffer) {
+        g_string_free(state->buffer, TRUE);
+    }
+    if(state->torctl) {
+        oniontracetorctl_free(state->torctl);
+    }
+    if(state->circuit) {
+        oniontracecircuit_free(state->circuit);
+    }
+    g_free(state->line);
+    g_free(state->traceFilename);
+}
+
+static void _oniontracebench_run(const Bench* bench, BenchConfig* config, BenchResult* result) {
+    BenchState state;
+    memset(&state, 0, sizeof(BenchState));
+    state.descriptor = -1;
+    state.savedStdout = -1;
+    state.numTraceCircuits = config->numTraceCircuits;
+
+    if(bench->setup) {
+        bench->setup(&state);
+    }
+
+    guint64 minTime = (guint64)config->minTimeMillis * 1000000UL;
+    result->name = bench->name;
+    result->nanosPerOp = -1.0;
+    result->allocationsPerOp = 0.0;
+
+    /* warm up the caches and find how many iterations fill the minimum time */
+    guint64 iterations = 1;
+    while(TRUE) {
+        guint64 startTime = oniontracetimer_getMonotonicNanos();
+        bench->run(&state, iterations);
+        guint64 elapsed = oniontracetimer_getMonotonicNanos() - startTime;
+
+        if(elapsed >= minTime / 4 || iterations >= G_MAXUINT32) {
+            iterations = elapsed > 0 ? MAX(iterations, (guint64)((gdouble)iterations * minTime / elapsed)) : iterations;
+            break;
+        }
+        iterations *= 2;
+    }
+
+    for(guint i = 0; i < config->repeat; i++) {
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+        gsize allocationsBefore = oniontraceallocations_getCount();
+#endif
+        guint64 startTime = oniontracetimer_getMonotonicNanos();
+        guint64 numOps = bench->run(&state, iterations);
+        guint64 elapsed = oniontracetimer_getMonotonicNanos() - startTime;
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+        gsize allocations = oniontraceallocations_getCount() - allocationsBefore;
+#else
+        gsize allocations = 0;
+#endif
+
+        if(numOps == 0) {
+            continue;
+        }
+
+        /* the fastest run is the one least disturbed by everything else on the machine */
+        gdouble nanosPerOp = (gdouble)elapsed / (gdouble)numOps;
+        if(result->nanosPerOp < 0.0 || nanosPerOp < result->nanosPerOp) {
+            result->numOps = numOps;
+            result->nanosPerOp = nanosPerOp;
+            result->allocationsPerOp = (gdouble)allocations / (gdouble)numOps;
+        }
+    }
+
+    if(bench->teardown) {
+        bench->teardown(&state);
+    }
+    _oniontracebench_freeState(&state);
+}
+
+static gboolean _oniontracebench_writeJSON(BenchConfig* config, GArray* results) {
+    GString* json = g_string_new("{\n");
+
+    g_string_append_printf(json, "  \"version\": \"%s\",\n", ONIONTRACE_VERSION);
+    g_string_append_printf(json, "  \"time\": %"G_GINT64_FORMAT",\n", (gint64)time(NULL));
+    if(config->label) {
+        gchar* label = g_strescape(config->label, NULL);
+        g_string_append_printf(json, "  \"label\": \"%s\",\n", label);
+        g_free(label);
+    }
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+    g_string_append(json, "  \"counts_allocations\": true,\n");
+#else
+    g_string_append(json, "  \"counts_allocations\": false,\n");
+#endif
+    g_string_append_printf(json, "  \"trace_circuits\": %u,\n", config->numTraceCircuits);
+    g_string_append(json, "  \"results\": [\n");
+
+    for(guint i = 0; i < results->len; i++) {
+        BenchResult* result = &g_array_index(results, BenchResult, i);
+        g_string_append_printf(json, "    {\"name\": \"%s\", \"ops\": %"G_GUINT64_FORMAT", "
+                "\"ns_per_op\": %.3f, \"allocations_per_op\": %.3f}%s\n",
+                result->name, result->numOps, result->nanosPerOp, result->allocationsPerOp,
+                (i + 1 < results->len) ? "," : "");
+    }
+
+    g_string_append(json, "  ]\n}\n");
+
+    GError* error = NULL;
+    gboolean success = g_file_set_contents(config->outputFilename, json->str, (gssize)json->len, &error);
+    if(!success) {
+        critical("unable to write results to '%s': %s", config->outputFilename, error->message);
+        g_error_free(error);
+    } else {
+        message("Bench: wrote results to '%s'", config->outputFilename);
+    }
+
+    g_string_free(json, TRUE);
+    return success;
+}
+
+static gboolean _oniontracebench_parseConfigEntry(BenchConfig* config, const gchar* key, gchar* value) {
+    gboolean isValid = TRUE;
+
+    if(!g_ascii_strcasecmp(key, "Filter")) {
+        g_free(config->filter);
+        config->filter = g_strdup(value);
+    } else if(!g_ascii_strcasecmp(key, "MinTime")) {
+        gint minTime = atoi(value);
+        isValid = (minTime > 0);
+        config->minTimeMillis = (guint)MAX(minTime, 0);
+    } else if(!g_ascii_strcasecmp(key, "Repeat")) {
+        gint repeat = atoi(value);
+        isValid = (repeat > 0);
+        config->repeat = (guint)MAX(repeat, 0);
+    } else if(!g_ascii_strcasecmp(key, "TraceCircuits")) {
+        gint numTraceCircuits = atoi(value);
+        isValid = (numTraceCircuits > 0);
+        config->numTraceCircuits = (guint)MAX(numTraceCircuits, 0);
+    } else if(!g_ascii_strcasecmp(key, "OutputFile")) {
+        g_free(config->outputFilename);
+        config->outputFilename = g_strdup(value);
+    } else if(!g_ascii_strcasecmp(key, "Label")) {
+        g_free(config->label);
+        config->label = g_strdup(value);
+    } else {
+        warning("unrecognized key '%s' in config", key);
+        isValid = FALSE;
+    }
+
+    return isValid;
+}
+
+static gboolean _oniontracebench_parseConfig(BenchConfig* config, gint argc, gchar* argv[]) {
+    config->minTimeMillis = 200;
+    config->repeat = 3;
+    config->numTraceCircuits = BENCH_DEFAULT_TRACE_CIRCUITS;
+
+    if(!oniontraceconfig_parseArgs(argc, argv, (OnionTraceConfigEntryFunc)_oniontracebench_parseConfigEntry, config)) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig config;
+    memset(&config, 0, sizeof(BenchConfig));
+
+    globalLogFilterLevel = G_LOG_LEVEL_MESSAGE;
+
+    if(!_oniontracebench_parseConfig(&config, argc, argv)) {
+        oniontrace_flushLog();
+        return EXIT_FAILURE;
+    }
+
+    GArray* results = g_array_new(FALSE, TRUE, sizeof(BenchResult));
+
+    for(guint i = 0; i < G_N_ELEMENTS(benches); i++) {
+        if(config.filter && !strstr(benches[i].name, config.filter)) {
+            continue;
+        }
+
+        /* the main loop logs when it starts and stops, which we don't want to time */
+        globalLogFilterLevel = G_LOG_LEVEL_WARNING;
+        BenchResult result;
+        memset(&result, 0, sizeof(BenchResult));
+        _oniontracebench_run(&benches[i], &config, &result);
+        globalLogFilterLevel = G_LOG_LEVEL_MESSAGE;
+
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+        message("Bench: %-24s %12.1f ns/op %8.3f allocations/op (%"G_GUINT64_FORMAT" ops)",
+                result.name, result.nanosPerOp, result.allocationsPerOp, result.numOps);
+#else
+        message("Bench: %-24s %12.1f ns/op (%"G_GUINT64_FORMAT" ops)",
+                result.name, result.nanosPerOp, result.numOps);
+#endif
+        oniontrace_flushLog();
+
+        g_array_append_val(results, result);
+    }
+
+#ifndef ONIONTRACE_COUNT_ALLOCATIONS
+    message("Bench: allocations are only counted in builds with glibc and without sanitizers");
+#endif
+
+    gboolean success = TRUE;
+    if(config.outputFilename) {
+        success = _oniontracebench_writeJSON(&config, results);
+    }
+
+    g_array_free(results, TRUE);
+    g_free(config.filter);
+    g_free(config.outputFilename);
+    g_free(config.label);
+
+    oniontrace_flushLog();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
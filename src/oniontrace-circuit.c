@@ -6,9 +6,15 @@
 
 struct _OnionTraceCircuit {
     struct timespec launchTime;
+    /* when we last asked tor to build it during playback */
+    struct timespec buildStartTime;
     gint circuitID;
-    gchar* path;
     gchar* sessionID;
+    /* the path as interned relays. paths with more hops are kept as text. */
+    OnionTraceRelayID path[ONIONTRACE_CIRCUIT_MAX_HOPS];
+    guint8 pathLength;
+    gboolean hasPath;
+    gchar* longPath;
     guint numStreams;
     guint numFailures;
 
@@ -22,8 +28,8 @@ OnionTraceCircuit* oniontracecircuit_new() {
 
 void oniontracecircuit_free(OnionTraceCircuit* circuit) {
     g_assert(circuit);
-    if(circuit->path) {
-        g_free(circuit->path);
+    if(circuit->longPath) {
+        g_free(circuit->longPath);
     }
     if(circuit->sessionID) {
         g_free(circuit->sessionID);
@@ -31,53 +37,113 @@ void oniontracecircuit_free(OnionTraceCircuit* circuit) {
     g_free(circuit);
 }
 
-OnionTraceCircuit* oniontracecircuit_fromCSV(const gchar* line, struct timespec* offset) {
-    OnionTraceCircuit* circuit = NULL;
-
-    if(line && offset) {
-        gchar** parts = g_strsplit(line, ";", 0);
+/* parses the leading decimal digits of the field, like atol() would */
+static glong _oniontracecircuit_parseDigits(const gchar* field, gsize length) {
+    glong value = 0;
+    for(gsize i = 0; i < length && g_ascii_isdigit(field[i]); i++) {
+        value = (value * 10) + (field[i] - '0');
+    }
+    return value;
+}
 
-        if(parts[0] && parts[1] && parts[2]) {
-            /* each line represents a circuit */
-            circuit = oniontracecircuit_new();
+/* stores the ','-separated path entries as relay ids */
+static void _oniontracecircuit_setPathLen(OnionTraceCircuit* circuit, const gchar* path, gsize length) {
+    if(circuit->longPath) {
+        g_free(circuit->longPath);
+        circuit->longPath = NULL;
+    }
+    circuit->pathLength = 0;
+    circuit->hasPath = TRUE;
+
+    const gchar* end = path + length;
+    const gchar* cursor = path;
+    while(cursor < end) {
+        const gchar* separator = memchr(cursor, ',', (gsize)(end - cursor));
+        const gchar* entryEnd = separator ? separator : end;
+
+        if(circuit->pathLength >= ONIONTRACE_CIRCUIT_MAX_HOPS) {
+            /* tor does not build paths this long, but we still want to play them back */
+            circuit->pathLength = 0;
+            circuit->longPath = g_strndup(path, length);
+            return;
+        }
 
-            /* parse the creation time */
-            gchar** times = g_strsplit(parts[0], ".", 0);
-            if(times[0] && times[1]) {
-                struct timespec createTimeRel;
-                memset(&createTimeRel, 0, sizeof(struct timespec));
-                createTimeRel.tv_sec = (__time_t)atol(times[0]);
-                createTimeRel.tv_nsec = (__syscall_slong_t)atol(times[1]);
+        circuit->path[circuit->pathLength++] = oniontracerelay_intern(cursor, (gsize)(entryEnd - cursor));
+        cursor = separator ? separator + 1 : end;
+    }
+}
 
-                struct timespec createTimeAbs;
-                memset(&createTimeAbs, 0, sizeof(struct timespec));
-                oniontracetimer_timespecadd(&createTimeAbs, offset, &createTimeRel);
+static gboolean _oniontracecircuit_isNullField(const gchar* field, gsize length) {
+    return length == 4 && !g_ascii_strncasecmp(field, "NULL", 4);
+}
 
-                oniontracecircuit_setLaunchTime(circuit, &createTimeAbs);
-            }
-            g_strfreev(times);
+/* parses a 'seconds.nanos;session;path' record of the given length. the line does
+ * not need to be NUL-terminated, so it can point directly into a mapped file. */
+OnionTraceCircuit* oniontracecircuit_fromCSV(const gchar* line, gsize length, struct timespec* offset) {
+    if(!line || !offset) {
+        return NULL;
+    }
 
-            /* the session id is a string */
-            if(g_ascii_strcasecmp(parts[1], "NULL")) {
-               /* its not equal to NULL, so it must be valid */
-                oniontracecircuit_setSessionID(circuit, parts[1]);
-            }
+    /* find the three ';'-separated fields; anything after a third ';' is ignored */
+    const gchar* end = line + length;
+    const gchar* fields[3];
+    gsize fieldLengths[3];
 
-            /* the path is a string */
-            if(g_ascii_strcasecmp(parts[2], "NULL")) {
-               /* its not equal to NULL, so it must be valid */
-                oniontracecircuit_setPath(circuit, parts[2]);
-            }
+    const gchar* cursor = line;
+    for(gint i = 0; i < 3; i++) {
+        if(!cursor) {
+            /* the line has fewer than three fields */
+            return NULL;
         }
 
-        g_strfreev(parts);
+        const gchar* separator = memchr(cursor, ';', (gsize)(end - cursor));
+        const gchar* fieldEnd = separator ? separator : end;
+
+        fields[i] = cursor;
+        fieldLengths[i] = (gsize)(fieldEnd - cursor);
+
+        /* the next field starts after the separator, if there is one */
+        cursor = separator ? separator + 1 : NULL;
+    }
+
+    /* each line represents a circuit */
+    OnionTraceCircuit* circuit = oniontracecircuit_new();
+
+    /* parse the creation time */
+    const gchar* dot = memchr(fields[0], '.', fieldLengths[0]);
+    if(dot) {
+        gsize secondsLength = (gsize)(dot - fields[0]);
+
+        struct timespec createTimeRel;
+        memset(&createTimeRel, 0, sizeof(struct timespec));
+        createTimeRel.tv_sec = (__time_t)_oniontracecircuit_parseDigits(fields[0], secondsLength);
+        createTimeRel.tv_nsec = (__syscall_slong_t)_oniontracecircuit_parseDigits(dot + 1,
+                fieldLengths[0] - secondsLength - 1);
+
+        oniontracetimer_timespecadd(&circuit->launchTime, offset, &createTimeRel);
+    }
+
+    /* the session id is a string */
+    if(!_oniontracecircuit_isNullField(fields[1], fieldLengths[1])) {
+        /* its not equal to NULL, so it must be valid */
+        circuit->sessionID = g_strndup(fields[1], fieldLengths[1]);
+    }
+
+    /* the path is a list of relays */
+    if(!_oniontracecircuit_isNullField(fields[2], fieldLengths[2])) {
+        /* its not equal to NULL, so it must be valid */
+        _oniontracecircuit_setPathLen(circuit, fields[2], fieldLengths[2]);
     }
 
     return circuit;
 }
 
-/* offset is the time that oniontrace started running */
-GString* oniontracecircuit_toCSV(OnionTraceCircuit* circuit, struct timespec* offset) {
+/* offset is the time that oniontrace started running.
+ * the record is appended to the given buffer. */
+void oniontracecircuit_toCSV(OnionTraceCircuit* circuit, struct timespec* offset, GString* buffer) {
+    g_assert(circuit);
+    g_assert(buffer);
+
     /* compute the elapsed time until the circuit should be created */
     struct timespec startTime;
     memset(&startTime, 0, sizeof(struct timespec));
@@ -92,16 +158,17 @@ GString* oniontracecircuit_toCSV(OnionTraceCircuit* circuit, struct timespec* of
 
     /* get the other circuit elements */
     const gchar* sessionID = oniontracecircuit_getSessionID(circuit);
-    const gchar* path = oniontracecircuit_getPath(circuit);
-
-    GString* string = g_string_new("");
 
     /* print using ';'-separated values, because the path already has commas in it */
-    g_string_append_printf(string, "%"G_GSIZE_FORMAT".%09"G_GSIZE_FORMAT";%s;%s\n",
-            (gsize)elapsed.tv_sec, (gsize)elapsed.tv_nsec,
-            sessionID ? sessionID : "NULL", path ? path : "NULL");
+    g_string_append_printf(buffer, "%"G_GSIZE_FORMAT".%09"G_GSIZE_FORMAT";%s;",
+            (gsize)elapsed.tv_sec, (gsize)elapsed.tv_nsec, sessionID ? sessionID : "NULL");
 
-    return string;
+    if(circuit->hasPath) {
+        oniontracecircuit_appendPath(circuit, buffer);
+    } else {
+        g_string_append_len(buffer, "NULL", 4);
+    }
+    g_string_append_c(buffer, '\n');
 }
 
 gint* oniontracecircuit_getID(OnionTraceCircuit* circuit) {
@@ -121,6 +188,18 @@ struct timespec* oniontracecircuit_getLaunchTime(OnionTraceCircuit* circuit) {
     return &circuit->launchTime;
 }
 
+void oniontracecircuit_setBuildStartTime(OnionTraceCircuit* circuit, struct timespec* buildStartTime) {
+    g_assert(circuit);
+    if(buildStartTime) {
+        circuit->buildStartTime = *buildStartTime;
+    }
+}
+
+struct timespec* oniontracecircuit_getBuildStartTime(OnionTraceCircuit* circuit) {
+    g_assert(circuit);
+    return &circuit->buildStartTime;
+}
+
 void oniontracecircuit_setCircuitID(OnionTraceCircuit* circuit, gint circuitID) {
     g_assert(circuit);
     circuit->circuitID = circuitID;
@@ -154,17 +233,114 @@ const gchar* oniontracecircuit_getSessionID(OnionTraceCircuit* circuit) {
     return circuit->sessionID;
 }
 
+/* returns TRUE if the path text is the one we already store */
+static gboolean _oniontracecircuit_isPath(OnionTraceCircuit* circuit, const gchar* path, gsize length) {
+    if(!circuit->hasPath) {
+        return FALSE;
+    }
+
+    if(circuit->longPath) {
+        return strlen(circuit->longPath) == length && !memcmp(circuit->longPath, path, length);
+    }
+
+    const gchar* end = path + length;
+    const gchar* cursor = path;
+    for(guint i = 0; i < circuit->pathLength; i++) {
+        if(i > 0) {
+            if(cursor >= end || *cursor != ',') {
+                return FALSE;
+            }
+            cursor++;
+        }
+
+        gsize nameLength = oniontracerelay_getNameLength(circuit->path[i]);
+        if((gsize)(end - cursor) < nameLength ||
+                memcmp(cursor, oniontracerelay_getName(circuit->path[i]), nameLength)) {
+            return FALSE;
+        }
+        cursor += nameLength;
+    }
+
+    return cursor == end;
+}
+
 void oniontracecircuit_setPath(OnionTraceCircuit* circuit, const gchar* path) {
     g_assert(circuit);
-    if(circuit->path) {
-        g_free(circuit->path);
+    if(path) {
+        gsize length = strlen(path);
+        /* tor repeats the path of the last EXTENDED event when the circuit is BUILT */
+        if(!_oniontracecircuit_isPath(circuit, path, length)) {
+            _oniontracecircuit_setPathLen(circuit, path, length);
+        }
+    } else {
+        oniontracecircuit_clearPath(circuit);
+    }
+}
+
+void oniontracecircuit_clearPath(OnionTraceCircuit* circuit) {
+    g_assert(circuit);
+    if(circuit->longPath) {
+        g_free(circuit->longPath);
+        circuit->longPath = NULL;
+    }
+    circuit->pathLength = 0;
+    circuit->hasPath = FALSE;
+}
+
+gboolean oniontracecircuit_hasPath(OnionTraceCircuit* circuit) {
+    g_assert(circuit);
+    return circuit->hasPath;
+}
+
+/* rebuilds the control protocol text of the path, like '$FP~nick,$FP~nick,$FP~nick' */
+void oniontracecircuit_appendPath(OnionTraceCircuit* circuit, GString* buffer) {
+    g_assert(circuit);
+    g_assert(buffer);
+
+    if(circuit->longPath) {
+        g_string_append(buffer, circuit->longPath);
+        return;
+    }
+
+    for(guint i = 0; i < circuit->pathLength; i++) {
+        if(i > 0) {
+            g_string_append_c(buffer, ',');
+        }
+        g_string_append_len(buffer, oniontracerelay_getName(circuit->path[i]),
+                (gssize)oniontracerelay_getNameLength(circuit->path[i]));
     }
-    circuit->path = g_strdup(path);
 }
 
-const gchar* oniontracecircuit_getPath(OnionTraceCircuit* circuit) {
+/* the number of bytes the text of the path takes, without a terminating NUL */
+gsize oniontracecircuit_getPathTextLength(OnionTraceCircuit* circuit) {
+    g_assert(circuit);
+
+    if(circuit->longPath) {
+        return strlen(circuit->longPath);
+    }
+
+    gsize length = circuit->pathLength > 0 ? circuit->pathLength - 1 : 0;
+    for(guint i = 0; i < circuit->pathLength; i++) {
+        length += oniontracerelay_getNameLength(circuit->path[i]);
+    }
+    return length;
+}
+
+guint oniontracecircuit_getPathLength(OnionTraceCircuit* circuit) {
+    g_assert(circuit);
+    return circuit->pathLength;
+}
+
+OnionTraceRelayID oniontracecircuit_getPathRelay(OnionTraceCircuit* circuit, guint hop) {
+    g_assert(circuit);
+    g_assert(hop < circuit->pathLength);
+    return circuit->path[hop];
+}
+
+void oniontracecircuit_setPathRelay(OnionTraceCircuit* circuit, guint hop, OnionTraceRelayID relayID) {
     g_assert(circuit);
-    return circuit->path;
+    g_assert(hop < circuit->pathLength);
+    circuit->path[hop] = relayID;
 }
 
 void oniontracecircuit_incrementStreamCounter(OnionTraceCircuit* circuit) {
@@ -8,19 +8,25 @@
 #include <time.h>
 #include <glib.h>
 
+/* longer paths are stored as text instead of relay ids */
+#define ONIONTRACE_CIRCUIT_MAX_HOPS 8
+
 typedef struct _OnionTraceCircuit OnionTraceCircuit;
 
 OnionTraceCircuit* oniontracecircuit_new();
 void oniontracecircuit_free(OnionTraceCircuit* circuit);
 
-OnionTraceCircuit* oniontracecircuit_fromCSV(const gchar* line, struct timespec* offset);
-GString* oniontracecircuit_toCSV(OnionTraceCircuit* circuit, struct timespec* offset);
+OnionTraceCircuit* oniontracecircuit_fromCSV(const gchar* line, gsize length, struct timespec* offset);
+void oniontracecircuit_toCSV(OnionTraceCircuit* circuit, struct timespec* offset, GString* buffer);
 
 gint* oniontracecircuit_getID(OnionTraceCircuit* circuit);
 
 void oniontracecircuit_setLaunchTime(OnionTraceCircuit* circuit, struct timespec* launchTime);
 struct timespec* oniontracecircuit_getLaunchTime(OnionTraceCircuit* circuit);
 
+void oniontracecircuit_setBuildStartTime(OnionTraceCircuit* circuit, struct timespec* buildStartTime);
+struct timespec* oniontracecircuit_getBuildStartTime(OnionTraceCircuit* circuit);
+
 void oniontracecircuit_setCircuitID(OnionTraceCircuit* circuit, gint circuitID);
 gint oniontracecircuit_getCircuitID(OnionTraceCircuit* circuit);
 
@@ -30,8 +36,16 @@ const gchar* oniontracecircuit_getSessionID(OnionTraceCircuit* circuit);
 void oniontracecircuit_setCircuitStatus(OnionTraceCircuit* circuit, CircuitStatus status);
 CircuitStatus oniontracecircuit_getCircuitStatus(OnionTraceCircuit* circuit);
 
+/* paths are stored as relay ids, and only turned back into text when needed */
 void oniontracecircuit_setPath(OnionTraceCircuit* circuit, const gchar* path);
-const gchar* oniontracecircuit_getPath(OnionTraceCircuit* circuit);
+void oniontracecircuit_clearPath(OnionTraceCircuit* circuit);
+gboolean oniontracecircuit_hasPath(OnionTraceCircuit* circuit);
+void oniontracecircuit_appendPath(OnionTraceCircuit* circuit, GString* buffer);
+gsize oniontracecircuit_getPathTextLength(OnionTraceCircuit* circuit);
+/* the hops of the path; paths longer than ONIONTRACE_CIRCUIT_MAX_HOPS have length 0 */
+guint oniontracecircuit_getPathLength(OnionTraceCircuit* circuit);
+OnionTraceRelayID oniontracecircuit_getPathRelay(OnionTraceCircuit* circuit, guint hop);
+void oniontracecircuit_setPathRelay(OnionTraceCircuit* circuit, guint hop, OnionTraceRelayID relayID);
 
 void oniontracecircuit_incrementStreamCounter(OnionTraceCircuit* circuit);
 guint oniontracecircuit_getStreamCounter(OnionTraceCircuit* circuit);
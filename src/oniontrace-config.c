@@ -9,11 +9,42 @@ struct _OnionTraceConfig {
     OnionTraceMode mode;
 
     gint runTimeSeconds;
-    in_port_t torControlPort;
+    /* one instance is traced per control port, each identified by an id string */
+    GArray* torControlPorts;
+    GPtrArray* instanceIDs;
     GLogLevelFlags logLevel;
     gchar* filename;
     /* space-delimited events like 'BW CIRC STREAM', suitable for sending in control command */
     gchar* events;
+    /* max number of circuit launches that may await a reply from tor at once */
+    gint maxPendingLaunches;
+    /* if positive, only read the trace this many seconds ahead of playback */
+    gint playWindowSeconds;
+    /* circuits are built ahead of their launch time by this quantile of the
+     * measured build times, kept between the min and max */
+    gdouble buildLeadQuantile;
+    gint buildLeadMinMillis;
+    gint buildLeadMaxMillis;
+    /* when to write buffered trace records in record mode; 0 disables a threshold */
+    gint traceFlushBytes;
+    gint traceFlushCircuits;
+    gint traceFlushIntervalSeconds;
+    /* how long an open circuit may hold back the circuits launched after it */
+    gint traceReorderSeconds;
+    /* how the logger writes BW, CIRC, and STREAM events, and where if not text */
+    OnionTraceOutputFormat outputFormat;
+    gchar* outputFilename;
+    /* if positive, the logger aggregates events and logs a summary this often */
+    gint summaryIntervalSeconds;
+    gboolean summaryOnly;
+    /* the instances are divided among this many threads, each with its own main loop */
+    gint numShards;
+    /* if set, the raw bytes received from tor are written to this file */
+    gchar* captureFilename;
+    /* if set, the relay index of each consensus is kept in this directory */
+    gchar* consensusCacheDir;
+    /* whether to fix paths through relays that left the consensus before launching them */
+    gboolean checkPaths;
 };
 
 static gchar* _oniontrace_getHomePath(const gchar* path) {
@@ -45,18 +76,112 @@ static gboolean _oniontraceconfig_parseMode(OnionTraceConfig* config, gchar* val
     return TRUE;
 }
 
+static gboolean _oniontraceconfig_addInstance(OnionTraceConfig* config, gint port, const gchar* instanceID) {
+    g_assert(config);
+
+    if(port < 1 || port > G_MAXUINT16) {
+        warning("invalid Tor control port '%i' provided, see README for valid values", port);
+        return FALSE;
+    }
+
+    for(guint i = 0; i < config->torControlPorts->len; i++) {
+        if(g_array_index(config->torControlPorts, in_port_t, i) == (in_port_t)port) {
+            warning("Tor control port '%i' was provided more than once", port);
+            return FALSE;
+        }
+    }
+
+    /* the id is used in file names, so keep it to a single path component */
+    if(instanceID && (instanceID[0] == '\0' || strchr(instanceID, '/'))) {
+        warning("invalid instance id '%s' provided, see README for valid values", instanceID);
+        return FALSE;
+    }
+
+    in_port_t controlPort = (in_port_t)port;
+    g_array_append_val(config->torControlPorts, controlPort);
+    g_ptr_array_add(config->instanceIDs,
+            instanceID ? g_strdup(instanceID) : g_strdup_printf("%i", port));
+
+    return TRUE;
+}
+
 static gboolean _oniontraceconfig_parseTorControlPort(OnionTraceConfig* config, gchar* value) {
     g_assert(config && value);
 
-    gint port = atoi(value);
+    /* a comma-delimited list of ports and port ranges, like '9051,9100-9199' */
+    gchar** portStrs = g_strsplit(value, ",", 0);
+    gboolean success = TRUE;
 
-    if(port < 1 || port > G_MAXUINT16) {
+    for(gint i = 0; success && portStrs[i] != NULL; i++) {
+        gchar** rangeStrs = g_strsplit(portStrs[i], "-", 2);
+        gint first = atoi(rangeStrs[0]);
+        gint last = rangeStrs[1] ? atoi(rangeStrs[1]) : first;
+
+        if(last < first) {
+            warning("invalid Tor control port range '%s' provided, see README for valid values", portStrs[i]);
+            success = FALSE;
+        }
+
+        for(gint port = first; success && port <= last; port++) {
+            success = _oniontraceconfig_addInstance(config, port, NULL);
+        }
+
+        g_strfreev(rangeStrs);
+    }
+
+    g_strfreev(portStrs);
+    return success;
+}
+
+static gboolean _oniontraceconfig_parseTorControlPortFile(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gchar* filename = _oniontrace_getHomePath(value);
+    gchar* contents = NULL;
+    GError* error = NULL;
+
+    if(!g_file_get_contents(filename, &contents, NULL, &error)) {
+        warning("unable to read Tor control port file '%s': %s", filename, error->message);
+        g_error_free(error);
+        g_free(filename);
         return FALSE;
     }
 
-    config->torControlPort = (in_port_t)port;
+    /* each line is '<port> [<instance id>]', and '#' starts a comment */
+    gchar** lines = g_strsplit(contents, "\n", 0);
+    gboolean success = TRUE;
 
-    return TRUE;
+    for(gint i = 0; success && lines[i] != NULL; i++) {
+        gchar* comment = strchr(lines[i], '#');
+        if(comment) {
+            *comment = '\0';
+        }
+
+        gchar** parts = g_strsplit_set(g_strstrip(lines[i]), " \t", 0);
+        gchar* portStr = NULL;
+        gchar* instanceID = NULL;
+
+        for(gint j = 0; parts[j] != NULL; j++) {
+            if(parts[j][0] == '\0') {
+                continue;
+            } else if(!portStr) {
+                portStr = parts[j];
+            } else if(!instanceID) {
+                instanceID = parts[j];
+            }
+        }
+
+        if(portStr) {
+            success = _oniontraceconfig_addInstance(config, atoi(portStr), instanceID);
+        }
+
+        g_strfreev(parts);
+    }
+
+    g_strfreev(lines);
+    g_free(contents);
+    g_free(filename);
+    return success;
 }
 
 static gboolean _oniontraceconfig_parseRunTimeSeconds(OnionTraceConfig* config, gchar* value) {
@@ -69,17 +194,93 @@ static gboolean _oniontraceconfig_parseRunTimeSeconds(OnionTraceConfig* config,
     return TRUE;
 }
 
-static gboolean _oniontraceconfig_parseLogLevel(OnionTraceConfig* config, gchar* value) {
+static gboolean _oniontraceconfig_parseMaxPendingLaunches(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gint numLaunches = atoi(value);
+
+    if(numLaunches < 1) {
+        warning("invalid max pending launches '%s' provided, see README for valid values", value);
+        return FALSE;
+    }
+
+    config->maxPendingLaunches = numLaunches;
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parsePlayWindowSeconds(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    gint numSeconds = atoi(value);
+
+    if(numSeconds < 0) {
+        warning("invalid play window '%s' provided, see README for valid values", value);
+        return FALSE;
+    }
+
+    config->playWindowSeconds = numSeconds;
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseBuildLeadQuantile(OnionTraceConfig* config, gchar* value) {
     g_assert(config && value);
 
+    gchar* end = NULL;
+    gdouble quantile = g_ascii_strtod(value, &end);
+
+    if(end == value || *end != '\0' || quantile <= 0.0 || quantile > 1.0) {
+        warning("invalid build lead quantile '%s' provided, see README for valid values", value);
+        return FALSE;
+    }
+
+    config->buildLeadQuantile = quantile;
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseNonNegative(gint* result, const gchar* key, gchar* value) {
+    g_assert(result && key && value);
+
+    gint number = atoi(value);
+
+    if(number < 0) {
+        warning("invalid %s '%s' provided, see README for valid values", key, value);
+        return FALSE;
+    }
+
+    *result = number;
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseBoolean(gboolean* result, const gchar* key, gchar* value) {
+    g_assert(result && key && value);
+
+    if(!g_ascii_strcasecmp(value, "true") || !g_ascii_strcasecmp(value, "1")) {
+        *result = TRUE;
+    } else if(!g_ascii_strcasecmp(value, "false") || !g_ascii_strcasecmp(value, "0")) {
+        *result = FALSE;
+    } else {
+        warning("invalid %s '%s' provided, see README for valid values", key, value);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean oniontraceconfig_parseLogLevel(const gchar* value, GLogLevelFlags* logLevel) {
+    g_assert(value && logLevel);
+
     if(!g_ascii_strcasecmp(value, "debug")) {
-        config->logLevel = G_LOG_LEVEL_DEBUG;
+        *logLevel = G_LOG_LEVEL_DEBUG;
     } else if(!g_ascii_strcasecmp(value, "info")) {
-        config->logLevel = G_LOG_LEVEL_INFO;
+        *logLevel = G_LOG_LEVEL_INFO;
     } else if(!g_ascii_strcasecmp(value, "message")) {
-        config->logLevel = G_LOG_LEVEL_MESSAGE;
+        *logLevel = G_LOG_LEVEL_MESSAGE;
     } else if(!g_ascii_strcasecmp(value, "warning")) {
-        config->logLevel = G_LOG_LEVEL_WARNING;
+        *logLevel = G_LOG_LEVEL_WARNING;
     } else {
         warning("invalid log level '%s' provided, see README for valid values", value);
         return FALSE;
@@ -104,6 +305,56 @@ static gboolean _oniontraceconfig_parseTraceFile(OnionTraceConfig* config, gchar
     return TRUE;
 }
 
+static gboolean _oniontraceconfig_parseOutputFormat(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    if(!g_ascii_strcasecmp(value, "text")) {
+        config->outputFormat = ONIONTRACE_OUTPUT_TEXT;
+    } else if(!g_ascii_strcasecmp(value, "binary")) {
+        config->outputFormat = ONIONTRACE_OUTPUT_BINARY;
+    } else if(!g_ascii_strcasecmp(value, "jsonl")) {
+        config->outputFormat = ONIONTRACE_OUTPUT_JSONL;
+    } else {
+        warning("invalid output format '%s' provided, see README for valid values", value);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseOutputFile(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    if(config->outputFilename) {
+        g_free(config->outputFilename);
+    }
+    config->outputFilename = _oniontrace_getHomePath(value);
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseCaptureFile(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    if(config->captureFilename) {
+        g_free(config->captureFilename);
+    }
+    config->captureFilename = _oniontrace_getHomePath(value);
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconfig_parseConsensusCacheDir(OnionTraceConfig* config, gchar* value) {
+    g_assert(config && value);
+
+    if(config->consensusCacheDir) {
+        g_free(config->consensusCacheDir);
+    }
+    config->consensusCacheDir = _oniontrace_getHomePath(value);
+
+    return TRUE;
+}
+
 static gboolean _oniontraceconfig_parseCommaDelimitedEvents(OnionTraceConfig* config, gchar* value) {
     g_assert(config && value);
 
@@ -126,17 +377,116 @@ static gboolean _oniontraceconfig_parseCommaDelimitedEvents(OnionTraceConfig* co
     }
 }
 
-OnionTraceConfig* oniontraceconfig_new(gint argc, gchar* argv[]) {
-    gboolean hasError = FALSE;
+static gboolean _oniontraceconfig_parseEntry(OnionTraceConfig* config, const gchar* key, gchar* value) {
+    gboolean isValid = TRUE;
 
-    OnionTraceConfig* config = g_new0(OnionTraceConfig, 1);
+    if(!g_ascii_strcasecmp(key, "Mode")) {
+        if(!_oniontraceconfig_parseMode(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TorControlPort")) {
+        if(!_oniontraceconfig_parseTorControlPort(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TorControlPortFile")) {
+        if(!_oniontraceconfig_parseTorControlPortFile(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "LogLevel")) {
+        if(!oniontraceconfig_parseLogLevel(value, &config->logLevel)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TraceFile")) {
+        if(!_oniontraceconfig_parseTraceFile(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "RunTime")) {
+        if(!_oniontraceconfig_parseRunTimeSeconds(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "MaxPendingLaunches")) {
+        if(!_oniontraceconfig_parseMaxPendingLaunches(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "PlayWindow")) {
+        if(!_oniontraceconfig_parsePlayWindowSeconds(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "BuildLeadQuantile")) {
+        if(!_oniontraceconfig_parseBuildLeadQuantile(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "BuildLeadMin")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->buildLeadMinMillis, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "BuildLeadMax")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->buildLeadMaxMillis, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TraceFlushBytes")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->traceFlushBytes, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TraceFlushCircuits")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->traceFlushCircuits, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TraceFlushInterval")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->traceFlushIntervalSeconds, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "TraceReorderWindow")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->traceReorderSeconds, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "OutputFormat")) {
+        if(!_oniontraceconfig_parseOutputFormat(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "OutputFile")) {
+        if(!_oniontraceconfig_parseOutputFile(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "SummaryInterval")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->summaryIntervalSeconds, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "SummaryOnly")) {
+        if(!_oniontraceconfig_parseBoolean(&config->summaryOnly, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "Shards")) {
+        if(!_oniontraceconfig_parseNonNegative(&config->numShards, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "CaptureFile")) {
+        if(!_oniontraceconfig_parseCaptureFile(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "ConsensusCacheDir")) {
+        if(!_oniontraceconfig_parseConsensusCacheDir(config, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "CheckPaths")) {
+        if(!_oniontraceconfig_parseBoolean(&config->checkPaths, key, value)) {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "Events")) {
+        if(!_oniontraceconfig_parseCommaDelimitedEvents(config, value)) {
+            isValid = FALSE;
+        }
+    } else {
+        warning("unrecognized key '%s' in config", key);
+        isValid = FALSE;
+    }
 
-    /* set defaults, which will get overwritten if set in args */
-    config->mode = ONIONTRACE_MODE_LOG;
-    config->runTimeSeconds = 0;
-    config->logLevel = G_LOG_LEVEL_INFO;
-    config->filename = g_strdup("oniontrace.csv");
-    config->events = g_strdup("BW");
+    return isValid;
+}
+
+gboolean oniontraceconfig_parseArgs(gint argc, gchar* argv[],
+        OnionTraceConfigEntryFunc parseEntry, gpointer userData) {
+    g_assert(parseEntry);
 
     /* parse all of the key=value pairs, skip the first program name arg */
     for(gint i = 1; i < argc; i++) {
@@ -145,39 +495,12 @@ OnionTraceConfig* oniontraceconfig_new(gint argc, gchar* argv[]) {
         gchar** parts = g_strsplit(entry, "=", 2);
         gchar* key = parts[0];
         gchar* value = parts[1];
+        gboolean hasError = FALSE;
 
         if(key != NULL && value != NULL) {
             /* we have both key and value in key=value entry */
-            if(!g_ascii_strcasecmp(key, "Mode")) {
-                if(!_oniontraceconfig_parseMode(config, value)) {
-                    hasError = TRUE;
-                }
-            } else if(!g_ascii_strcasecmp(key, "TorControlPort")) {
-                if(!_oniontraceconfig_parseTorControlPort(config, value)) {
-                    hasError = TRUE;
-                }
-            } else if(!g_ascii_strcasecmp(key, "LogLevel")) {
-                if(!_oniontraceconfig_parseLogLevel(config, value)) {
-                    hasError = TRUE;
-                }
-            } else if(!g_ascii_strcasecmp(key, "TraceFile")) {
-                if(!_oniontraceconfig_parseTraceFile(config, value)) {
-                    hasError = TRUE;
-                }
-            } else if(!g_ascii_strcasecmp(key, "RunTime")) {
-                if(!_oniontraceconfig_parseRunTimeSeconds(config, value)) {
-                    hasError = TRUE;
-                }
-            } else if(!g_ascii_strcasecmp(key, "Events")) {
-                if(!_oniontraceconfig_parseCommaDelimitedEvents(config, value)) {
-                    hasError = TRUE;
-                }
-            } else {
-                warning("unrecognized key '%s' in config", key);
+            if(!parseEntry(userData, key, value)) {
                 hasError = TRUE;
-            }
-
-            if(hasError) {
                 critical("error in config: key='%s' value='%s'", key, value);
             } else {
                 message("successfully parsed key='%s' value='%s'", key, value);
@@ -196,27 +519,97 @@ OnionTraceConfig* oniontraceconfig_new(gint argc, gchar* argv[]) {
         g_strfreev(parts);
 
         if(hasError) {
-            oniontraceconfig_free(config);
-            return NULL;
+            return FALSE;
         }
     }
 
+    return TRUE;
+}
+
+OnionTraceConfig* oniontraceconfig_new(gint argc, gchar* argv[]) {
+    OnionTraceConfig* config = g_new0(OnionTraceConfig, 1);
+
+    /* set defaults, which will get overwritten if set in args */
+    config->mode = ONIONTRACE_MODE_LOG;
+    config->torControlPorts = g_array_new(FALSE, FALSE, sizeof(in_port_t));
+    config->instanceIDs = g_ptr_array_new_with_free_func(g_free);
+    config->runTimeSeconds = 0;
+    config->logLevel = G_LOG_LEVEL_INFO;
+    config->filename = g_strdup("oniontrace.csv");
+    config->events = g_strdup("BW");
+    config->maxPendingLaunches = 10;
+    config->playWindowSeconds = 0;
+    config->buildLeadQuantile = 0.9;
+    config->buildLeadMinMillis = 1000;
+    config->buildLeadMaxMillis = 10000;
+    config->traceFlushBytes = 65536;
+    config->traceFlushCircuits = 0;
+    config->traceFlushIntervalSeconds = 1;
+    config->traceReorderSeconds = ONIONTRACE_RECORDER_DEFAULT_REORDER_SECONDS;
+    config->outputFormat = ONIONTRACE_OUTPUT_TEXT;
+    config->outputFilename = NULL;
+    config->summaryIntervalSeconds = 0;
+    config->summaryOnly = FALSE;
+    config->numShards = 1;
+    config->captureFilename = NULL;
+    config->consensusCacheDir = NULL;
+    config->checkPaths = FALSE;
+
+    if(!oniontraceconfig_parseArgs(argc, argv, (OnionTraceConfigEntryFunc)_oniontraceconfig_parseEntry, config)) {
+        oniontraceconfig_free(config);
+        return NULL;
+    }
+
     /* now make sure we have the required arguments */
 
     /* we always need a tor control port */
-    if(config->torControlPort == 0) {
+    if(config->torControlPorts->len == 0) {
         critical("missing required valid Tor control port argument `TorControlPort`");
         oniontraceconfig_free(config);
         return NULL;
     }
 
-    /* if we are playing, then the trace file better exist */
+    /* if we are playing, then the trace files better exist */
     if(config->mode == ONIONTRACE_MODE_PLAY) {
-        if(!config->filename ||
-                !g_file_test(config->filename, G_FILE_TEST_IS_REGULAR|G_FILE_TEST_EXISTS)) {
-            critical("path '%s' to trace file is not valid or does not exist", config->filename);
-            oniontraceconfig_free(config);
-            return NULL;
+        for(guint i = 0; i < config->torControlPorts->len; i++) {
+            gchar* filename = config->filename ? oniontraceconfig_getInstanceFileName(config, config->filename, i) : NULL;
+            gboolean exists = filename && g_file_test(filename, G_FILE_TEST_IS_REGULAR|G_FILE_TEST_EXISTS);
+
+            if(!exists) {
+                critical("path '%s' to trace file is not valid or does not exist", filename);
+            }
+
+            g_free(filename);
+
+            if(!exists) {
+                oniontraceconfig_free(config);
+                return NULL;
+            }
+        }
+    }
+
+    if(config->buildLeadMinMillis > config->buildLeadMaxMillis) {
+        critical("`BuildLeadMin` (%i) must not be larger than `BuildLeadMax` (%i)",
+                config->buildLeadMinMillis, config->buildLeadMaxMillis);
+        oniontraceconfig_free(config);
+        return NULL;
+    }
+
+    /* 0 shards means one per core, and a shard without an instance would just sit idle */
+    if(config->numShards == 0) {
+        config->numShards = (gint)g_get_num_processors();
+    }
+    config->numShards = MIN(config->numShards, (gint)config->torControlPorts->len);
+
+    /* structured output goes to its own file, named by format unless configured.
+     * when tracing several instances, each logs its events to its own text file. */
+    if(!config->outputFilename) {
+        if(config->outputFormat == ONIONTRACE_OUTPUT_BINARY) {
+            config->outputFilename = g_strdup("oniontrace.events");
+        } else if(config->outputFormat == ONIONTRACE_OUTPUT_JSONL) {
+            config->outputFilename = g_strdup("oniontrace.jsonl");
+        } else if(config->torControlPorts->len > 1) {
+            config->outputFilename = g_strdup("oniontrace.log");
         }
     }
 
@@ -234,12 +627,58 @@ void oniontraceconfig_free(OnionTraceConfig* config) {
         g_free(config->events);
     }
 
+    if(config->outputFilename) {
+        g_free(config->outputFilename);
+    }
+
+    if(config->captureFilename) {
+        g_free(config->captureFilename);
+    }
+
+    if(config->consensusCacheDir) {
+        g_free(config->consensusCacheDir);
+    }
+
+    g_array_free(config->torControlPorts, TRUE);
+    g_ptr_array_free(config->instanceIDs, TRUE);
+
     g_free(config);
 }
 
-in_port_t oniontraceconfig_getTorControlPort(OnionTraceConfig* config) {
+guint oniontraceconfig_getNumInstances(OnionTraceConfig* config) {
     g_assert(config);
-    return config->torControlPort;
+    return config->torControlPorts->len;
+}
+
+in_port_t oniontraceconfig_getTorControlPort(OnionTraceConfig* config, guint instance) {
+    g_assert(config && instance < config->torControlPorts->len);
+    return g_array_index(config->torControlPorts, in_port_t, instance);
+}
+
+const gchar* oniontraceconfig_getInstanceID(OnionTraceConfig* config, guint instance) {
+    g_assert(config && instance < config->instanceIDs->len);
+    return g_ptr_array_index(config->instanceIDs, instance);
+}
+
+/* returns a newly allocated file name for the instance. when tracing several
+ * instances, the instance id is inserted before the extension, so that e.g.
+ * 'oniontrace.csv' becomes 'oniontrace.9051.csv'. */
+gchar* oniontraceconfig_getInstanceFileName(OnionTraceConfig* config, const gchar* filename, guint instance) {
+    g_assert(config && filename);
+
+    if(config->torControlPorts->len <= 1) {
+        return g_strdup(filename);
+    }
+
+    const gchar* instanceID = oniontraceconfig_getInstanceID(config, instance);
+    const gchar* base = strrchr(filename, '/');
+    const gchar* extension = strrchr(base ? base : filename, '.');
+
+    if(!extension || extension == (base ? base + 1 : filename)) {
+        return g_strdup_printf("%s.%s", filename, instanceID);
+    }
+
+    return g_strdup_printf("%.*s.%s%s", (gint)(extension - filename), filename, instanceID, extension);
 }
 
 gint oniontraceconfig_getRunTimeSeconds(OnionTraceConfig* config) {
@@ -266,3 +705,88 @@ const gchar* oniontraceconfig_getSpaceDelimitedEvents(OnionTraceConfig* config)
     g_assert(config);
     return config->events ? config->events : NULL;
 }
+
+gint oniontraceconfig_getMaxPendingLaunches(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->maxPendingLaunches;
+}
+
+gint oniontraceconfig_getPlayWindowSeconds(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->playWindowSeconds;
+}
+
+gdouble oniontraceconfig_getBuildLeadQuantile(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->buildLeadQuantile;
+}
+
+gint oniontraceconfig_getBuildLeadMinMillis(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->buildLeadMinMillis;
+}
+
+gint oniontraceconfig_getBuildLeadMaxMillis(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->buildLeadMaxMillis;
+}
+
+gint oniontraceconfig_getTraceFlushBytes(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->traceFlushBytes;
+}
+
+gint oniontraceconfig_getTraceFlushCircuits(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->traceFlushCircuits;
+}
+
+gint oniontraceconfig_getTraceFlushIntervalSeconds(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->traceFlushIntervalSeconds;
+}
+
+gint oniontraceconfig_getTraceReorderSeconds(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->traceReorderSeconds;
+}
+
+OnionTraceOutputFormat oniontraceconfig_getOutputFormat(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->outputFormat;
+}
+
+const gchar* oniontraceconfig_getOutputFileName(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->outputFilename;
+}
+
+gint oniontraceconfig_getSummaryIntervalSeconds(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->summaryIntervalSeconds;
+}
+
+gboolean oniontraceconfig_getSummaryOnly(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->summaryOnly;
+}
+
+guint oniontraceconfig_getNumShards(OnionTraceConfig* config) {
+    g_assert(config);
+    return (guint)config->numShards;
+}
+
+const gchar* oniontraceconfig_getCaptureFileName(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->captureFilename;
+}
+
+const gchar* oniontraceconfig_getConsensusCacheDir(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->consensusCacheDir;
+}
+
+gboolean oniontraceconfig_getCheckPaths(OnionTraceConfig* config) {
+    g_assert(config);
+    return config->checkPaths;
+}
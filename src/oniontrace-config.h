@@ -14,16 +14,52 @@ enum _OnionTraceMode {
     ONIONTRACE_MODE_RECORD, ONIONTRACE_MODE_PLAY, ONIONTRACE_MODE_LOG,
 };
 
+typedef enum _OnionTraceOutputFormat OnionTraceOutputFormat;
+enum _OnionTraceOutputFormat {
+    ONIONTRACE_OUTPUT_TEXT, ONIONTRACE_OUTPUT_BINARY, ONIONTRACE_OUTPUT_JSONL,
+};
+
 typedef struct _OnionTraceConfig OnionTraceConfig;
 
+/* called with each key=value argument, returns FALSE if it is invalid */
+typedef gboolean (*OnionTraceConfigEntryFunc)(gpointer userData, const gchar* key, gchar* value);
+
+/* all of our programs take their arguments as key=value pairs. calls parseEntry
+ * for each argument after the program name, and returns FALSE at the first one
+ * that is not a key=value pair or that parseEntry rejects. */
+gboolean oniontraceconfig_parseArgs(gint argc, gchar* argv[],
+        OnionTraceConfigEntryFunc parseEntry, gpointer userData);
+/* parses a `LogLevel` value, see README for the valid ones */
+gboolean oniontraceconfig_parseLogLevel(const gchar* value, GLogLevelFlags* logLevel);
+
 OnionTraceConfig* oniontraceconfig_new(gint argc, gchar* argv[]);
 void oniontraceconfig_free(OnionTraceConfig* config);
 
 OnionTraceMode oniontraceconfig_getMode(OnionTraceConfig* config);
 GLogLevelFlags oniontraceconfig_getLogLevel(OnionTraceConfig* config);
-in_port_t oniontraceconfig_getTorControlPort(OnionTraceConfig* config);
+guint oniontraceconfig_getNumInstances(OnionTraceConfig* config);
+guint oniontraceconfig_getNumShards(OnionTraceConfig* config);
+in_port_t oniontraceconfig_getTorControlPort(OnionTraceConfig* config, guint instance);
+const gchar* oniontraceconfig_getInstanceID(OnionTraceConfig* config, guint instance);
+gchar* oniontraceconfig_getInstanceFileName(OnionTraceConfig* config, const gchar* filename, guint instance);
 gint oniontraceconfig_getRunTimeSeconds(OnionTraceConfig* config);
 const gchar* oniontraceconfig_getTraceFileName(OnionTraceConfig* config);
 const gchar* oniontraceconfig_getSpaceDelimitedEvents(OnionTraceConfig* config);
+gint oniontraceconfig_getMaxPendingLaunches(OnionTraceConfig* config);
+gint oniontraceconfig_getPlayWindowSeconds(OnionTraceConfig* config);
+gdouble oniontraceconfig_getBuildLeadQuantile(OnionTraceConfig* config);
+gint oniontraceconfig_getBuildLeadMinMillis(OnionTraceConfig* config);
+gint oniontraceconfig_getBuildLeadMaxMillis(OnionTraceConfig* config);
+gint oniontraceconfig_getTraceFlushBytes(OnionTraceConfig* config);
+gint oniontraceconfig_getTraceFlushCircuits(OnionTraceConfig* config);
+gint oniontraceconfig_getTraceFlushIntervalSeconds(OnionTraceConfig* config);
+gint oniontraceconfig_getTraceReorderSeconds(OnionTraceConfig* config);
+OnionTraceOutputFormat oniontraceconfig_getOutputFormat(OnionTraceConfig* config);
+const gchar* oniontraceconfig_getOutputFileName(OnionTraceConfig* config);
+gint oniontraceconfig_getSummaryIntervalSeconds(OnionTraceConfig* config);
+gboolean oniontraceconfig_getSummaryOnly(OnionTraceConfig* config);
+const gchar* oniontraceconfig_getCaptureFileName(OnionTraceConfig* config);
+const gchar* oniontraceconfig_getConsensusCacheDir(OnionTraceConfig* config);
+gboolean oniontraceconfig_getCheckPaths(OnionTraceConfig* config);
 
 #endif /* SRC_ONIONTRACE_CONFIG_H_ */
@@ -0,0 +1,504 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "oniontrace.h"
+
+/* the cache file starts with a fixed header, which is followed by the router
+ * statuses and then the hash buckets. integers are in host byte order, because
+ * the file is only shared by processes on the same machine; the byte order mark
+ * rejects files from anywhere else. each bucket is a u32 holding the index of a
+ * router status plus one, or 0 if the bucket is empty. the identity is already
+ * a hash, so its first bytes select the bucket, and collisions use the next one. */
+#define CONSENSUS_CACHE_MAGIC "OTCONS01"
+#define CONSENSUS_CACHE_MAGIC_LENGTH 8
+#define CONSENSUS_CACHE_BYTE_ORDER 0x01020304
+#define CONSENSUS_MIN_BUCKETS 16
+
+typedef struct _ConsensusCacheHeader {
+    gchar magic[CONSENSUS_CACHE_MAGIC_LENGTH];
+    guint32 byteOrder;
+    guint32 statusSize;
+    gint64 validAfter;
+    guint32 numRelays;
+    guint32 numBuckets;
+} ConsensusCacheHeader;
+
+G_STATIC_ASSERT(sizeof(ConsensusCacheHeader) == 32);
+G_STATIC_ASSERT(sizeof(OnionTraceRouterStatus) == 56);
+
+/* a word in a router status line, which is not NUL-terminated */
+typedef struct _ConsensusWord {
+    const gchar* str;
+    gsize len;
+} ConsensusWord;
+
+#define CONSENSUS_MAX_WORDS 16
+
+struct _OnionTraceConsensus {
+    gint64 validAfter;
+
+    /* the statuses we parsed so far, until we are finished */
+    GArray* parsedStatuses;
+    /* the 's' and 'w' lines belong to the status of the 'r' line before them */
+    gboolean hasCurrentStatus;
+
+    /* these point into the map of a cache file, or into the buffer we built */
+    const ConsensusCacheHeader* header;
+    const OnionTraceRouterStatus* statuses;
+    const guint32* buckets;
+
+    gchar* buffer;
+    gsize bufferSize;
+    gpointer map;
+    gsize mapSize;
+};
+
+static const struct {
+    const gchar* name;
+    OnionTraceRelayFlag flag;
+} relayFlagNames[] = {
+    {"Authority", ONIONTRACE_RELAY_FLAG_AUTHORITY},
+    {"BadExit", ONIONTRACE_RELAY_FLAG_BADEXIT},
+    {"Exit", ONIONTRACE_RELAY_FLAG_EXIT},
+    {"Fast", ONIONTRACE_RELAY_FLAG_FAST},
+    {"Guard", ONIONTRACE_RELAY_FLAG_GUARD},
+    {"HSDir", ONIONTRACE_RELAY_FLAG_HSDIR},
+    {"Running", ONIONTRACE_RELAY_FLAG_RUNNING},
+    {"Stable", ONIONTRACE_RELAY_FLAG_STABLE},
+    {"V2Dir", ONIONTRACE_RELAY_FLAG_V2DIR},
+    {"Valid", ONIONTRACE_RELAY_FLAG_VALID},
+};
+
+OnionTraceConsensus* oniontraceconsensus_new(gint64 validAfter) {
+    OnionTraceConsensus* consensus = g_new0(OnionTraceConsensus, 1);
+    consensus->validAfter = validAfter;
+    consensus->parsedStatuses = g_array_new(FALSE, TRUE, sizeof(OnionTraceRouterStatus));
+    return consensus;
+}
+
+void oniontraceconsensus_free(OnionTraceConsensus* consensus) {
+    g_assert(consensus);
+
+    if(consensus->parsedStatuses) {
+        g_array_free(consensus->parsedStatuses, TRUE);
+    }
+    if(consensus->buffer) {
+        g_free(consensus->buffer);
+    }
+    if(consensus->map) {
+        munmap(consensus->map, consensus->mapSize);
+    }
+
+    g_free(consensus);
+}
+
+static guint _oniontraceconsensus_splitWords(const gchar* line, gsize length, ConsensusWord* words) {
+    guint numWords = 0;
+    gsize i = 0;
+
+    while(i < length && numWords < CONSENSUS_MAX_WORDS) {
+        while(i < length && line[i] == ' ') {
+            i++;
+        }
+        gsize start = i;
+        while(i < length && line[i] != ' ') {
+            i++;
+        }
+        if(i > start) {
+            words[numWords].str = &line[start];
+            words[numWords].len = i - start;
+            numWords++;
+        }
+    }
+
+    return numWords;
+}
+
+static gboolean _oniontraceconsensus_wordEquals(ConsensusWord* word, const gchar* str) {
+    gsize len = strlen(str);
+    return word->len == len && !strncmp(word->str, str, len);
+}
+
+static guint32 _oniontraceconsensus_parseUInt(const gchar* str, gsize length) {
+    guint32 value = 0;
+    for(gsize i = 0; i < length && g_ascii_isdigit(str[i]); i++) {
+        value = (value * 10) + (guint32)(str[i] - '0');
+    }
+    return value;
+}
+
+/* the identity is base64 without the trailing '=' padding */
+static gboolean _oniontraceconsensus_decodeIdentity(ConsensusWord* word, guint8* identity) {
+    if(word->len != 27) {
+        return FALSE;
+    }
+
+    gchar encoded[28];
+    memcpy(encoded, word->str, 27);
+    encoded[27] = '=';
+
+    guchar decoded[24];
+    gint state = 0;
+    guint save = 0;
+    gsize length = g_base64_decode_step(encoded, sizeof(encoded), decoded, &state, &save);
+
+    if(length != ONIONTRACE_RELAY_IDENTITY_LENGTH) {
+        return FALSE;
+    }
+
+    memcpy(identity, decoded, ONIONTRACE_RELAY_IDENTITY_LENGTH);
+    return TRUE;
+}
+
+static void _oniontraceconsensus_parseRouter(OnionTraceConsensus* consensus, ConsensusWord* words, guint numWords) {
+    /* r <nickname> <identity> <digest> <date> <time> <address> <orport> <dirport> */
+    consensus->hasCurrentStatus = FALSE;
+
+    if(numWords < 8) {
+        return;
+    }
+
+    OnionTraceRouterStatus status;
+    memset(&status, 0, sizeof(status));
+
+    if(!_oniontraceconsensus_decodeIdentity(&words[2], status.identity)) {
+        info("ignoring router status with invalid identity '%.*s'", (gint)words[2].len, words[2].str);
+        return;
+    }
+
+    memcpy(status.nickname, words[1].str, MIN(words[1].len, ONIONTRACE_RELAY_NICKNAME_LENGTH - 1));
+
+    gchar address[INET_ADDRSTRLEN];
+    if(words[6].len < sizeof(address)) {
+        memcpy(address, words[6].str, words[6].len);
+        address[words[6].len] = '\0';
+        inet_pton(AF_INET, address, &status.address);
+    }
+
+    status.orPort = (guint16)_oniontraceconsensus_parseUInt(words[7].str, words[7].len);
+
+    g_array_append_val(consensus->parsedStatuses, status);
+    consensus->hasCurrentStatus = TRUE;
+}
+
+static OnionTraceRouterStatus* _oniontraceconsensus_getCurrentStatus(OnionTraceConsensus* consensus) {
+    if(!consensus->hasCurrentStatus) {
+        return NULL;
+    }
+    return &g_array_index(consensus->parsedStatuses, OnionTraceRouterStatus,
+            consensus->parsedStatuses->len - 1);
+}
+
+/* handles one line of the 'GETINFO ns/all' reply */
+void oniontraceconsensus_parseLine(OnionTraceConsensus* consensus, const gchar* line, gsize length) {
+    g_assert(consensus);
+    g_assert(consensus->parsedStatuses);
+
+    if(length < 2 || line[1] != ' ') {
+        return;
+    }
+
+    ConsensusWord words[CONSENSUS_MAX_WORDS];
+    guint numWords = _oniontraceconsensus_splitWords(line, length, words);
+
+    if(line[0] == 'r') {
+        _oniontraceconsensus_parseRouter(consensus, words, numWords);
+    } else if(line[0] == 's') {
+        OnionTraceRouterStatus* status = _oniontraceconsensus_getCurrentStatus(consensus);
+        if(status) {
+            status->flags = 0;
+            for(guint i = 1; i < numWords; i++) {
+                for(guint j = 0; j < G_N_ELEMENTS(relayFlagNames); j++) {
+                    if(_oniontraceconsensus_wordEquals(&words[i], relayFlagNames[j].name)) {
+                        status->flags |= relayFlagNames[j].flag;
+                        break;
+                    }
+                }
+            }
+        }
+    } else if(line[0] == 'w') {
+        OnionTraceRouterStatus* status = _oniontraceconsensus_getCurrentStatus(consensus);
+        for(guint i = 1; status && i < numWords; i++) {
+            if(words[i].len > 10 && !strncmp(words[i].str, "Bandwidth=", 10)) {
+                status->bandwidth = _oniontraceconsensus_parseUInt(&words[i].str[10], words[i].len - 10);
+            }
+        }
+    }
+}
+
+static guint32 _oniontraceconsensus_getBucket(const guint8* identity, guint32 numBuckets) {
+    guint32 hash;
+    memcpy(&hash, identity, sizeof(hash));
+    return hash & (numBuckets - 1);
+}
+
+static const OnionTraceRouterStatus* _oniontraceconsensus_find(const OnionTraceRouterStatus* statuses,
+        const guint32* buckets, guint32 numBuckets, const guint8* identity, guint32* bucketOut) {
+    guint32 bucket = _oniontraceconsensus_getBucket(identity, numBuckets);
+
+    /* there are always more buckets than relays, so we find an empty one eventually */
+    while(buckets[bucket] != 0) {
+        const OnionTraceRouterStatus* status = &statuses[buckets[bucket] - 1];
+        if(!memcmp(status->identity, identity, ONIONTRACE_RELAY_IDENTITY_LENGTH)) {
+            return status;
+        }
+        bucket = (bucket + 1) & (numBuckets - 1);
+    }
+
+    if(bucketOut) {
+        *bucketOut = bucket;
+    }
+    return NULL;
+}
+
+static void _oniontraceconsensus_setLayout(OnionTraceConsensus* consensus, const gchar* bytes) {
+    consensus->header = (const ConsensusCacheHeader*)bytes;
+    consensus->statuses = (const OnionTraceRouterStatus*)&bytes[sizeof(ConsensusCacheHeader)];
+    consensus->buckets = (const guint32*)&consensus->statuses[consensus->header->numRelays];
+}
+
+/* builds the index from the parsed lines, after which we can look up relays */
+void oniontraceconsensus_finish(OnionTraceConsensus* consensus) {
+    g_assert(consensus);
+    g_assert(consensus->parsedStatuses);
+
+    guint32 numParsed = consensus->parsedStatuses->len;
+
+    /* keep the buckets at most half full, so that the probe sequences stay short */
+    guint32 numBuckets = CONSENSUS_MIN_BUCKETS;
+    while(numBuckets < 2 * numParsed) {
+        numBuckets <<= 1;
+    }
+
+    consensus->bufferSize = sizeof(ConsensusCacheHeader) +
+            (numParsed * sizeof(OnionTraceRouterStatus)) + (numBuckets * sizeof(guint32));
+    consensus->buffer = g_malloc0(consensus->bufferSize);
+
+    ConsensusCacheHeader* header = (ConsensusCacheHeader*)consensus->buffer;
+    OnionTraceRouterStatus* statuses = (OnionTraceRouterStatus*)&consensus->buffer[sizeof(ConsensusCacheHeader)];
+    guint32* buckets = (guint32*)&statuses[numParsed];
+
+    /* a relay listed twice keeps its first status */
+    guint32 numRelays = 0;
+    for(guint32 i = 0; i < numParsed; i++) {
+        OnionTraceRouterStatus* status = &g_array_index(consensus->parsedStatuses, OnionTraceRouterStatus, i);
+        guint32 bucket = 0;
+        if(!_oniontraceconsensus_find(statuses, buckets, numBuckets, status->identity, &bucket)) {
+            statuses[numRelays] = *status;
+            buckets[bucket] = ++numRelays;
+        }
+    }
+
+    if(numRelays < numParsed) {
+        /* the buckets follow the statuses, so close the gap left by the duplicates */
+        memmove(&statuses[numRelays], buckets, numBuckets * sizeof(guint32));
+        consensus->bufferSize -= (numParsed - numRelays) * sizeof(OnionTraceRouterStatus);
+    }
+
+    memcpy(header->magic, CONSENSUS_CACHE_MAGIC, CONSENSUS_CACHE_MAGIC_LENGTH);
+    header->byteOrder = CONSENSUS_CACHE_BYTE_ORDER;
+    header->statusSize = sizeof(OnionTraceRouterStatus);
+    header->validAfter = consensus->validAfter;
+    header->numRelays = numRelays;
+    header->numBuckets = numBuckets;
+
+    _oniontraceconsensus_setLayout(consensus, consensus->buffer);
+
+    g_array_free(consensus->parsedStatuses, TRUE);
+    consensus->parsedStatuses = NULL;
+    consensus->hasCurrentStatus = FALSE;
+}
+
+/* writes the index to a temporary file that is renamed to the filename, so that
+ * other processes never map a partially written file */
+gboolean oniontraceconsensus_save(OnionTraceConsensus* consensus, const gchar* filename) {
+    g_assert(consensus);
+    g_assert(consensus->buffer);
+
+    GError* error = NULL;
+    if(!g_file_set_contents(filename, consensus->buffer, (gssize)consensus->bufferSize, &error)) {
+        warning("Failed to write consensus cache file %s: %s", filename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean _oniontraceconsensus_isValidCache(const gchar* bytes, gsize size, gint64 validAfter) {
+    if(size < sizeof(ConsensusCacheHeader)) {
+        return FALSE;
+    }
+
+    const ConsensusCacheHeader* header = (const ConsensusCacheHeader*)bytes;
+
+    if(memcmp(header->magic, CONSENSUS_CACHE_MAGIC, CONSENSUS_CACHE_MAGIC_LENGTH) ||
+            header->byteOrder != CONSENSUS_CACHE_BYTE_ORDER ||
+            header->statusSize != sizeof(OnionTraceRouterStatus) ||
+            header->validAfter != validAfter) {
+        return FALSE;
+    }
+
+    /* lookups only terminate if there is an empty bucket */
+    guint32 numBuckets = header->numBuckets;
+    if(numBuckets == 0 || (numBuckets & (numBuckets - 1)) != 0 || numBuckets <= header->numRelays) {
+        return FALSE;
+    }
+
+    guint64 expectedSize = sizeof(ConsensusCacheHeader) +
+            ((guint64)header->numRelays * sizeof(OnionTraceRouterStatus)) +
+            ((guint64)numBuckets * sizeof(guint32));
+    if(expectedSize != size) {
+        return FALSE;
+    }
+
+    /* a damaged bucket could point past the statuses, or fill the last empty one */
+    const guint32* buckets = (const guint32*)&bytes[sizeof(ConsensusCacheHeader) +
+            ((gsize)header->numRelays * sizeof(OnionTraceRouterStatus))];
+    gboolean hasEmptyBucket = FALSE;
+
+    for(guint32 i = 0; i < numBuckets; i++) {
+        if(buckets[i] > header->numRelays) {
+            return FALSE;
+        } else if(buckets[i] == 0) {
+            hasEmptyBucket = TRUE;
+        }
+    }
+
+    return hasEmptyBucket;
+}
+
+OnionTraceConsensus* oniontraceconsensus_load(const gchar* filename, gint64 validAfter) {
+    gint descriptor = open(filename, O_RDONLY);
+    if(descriptor < 0) {
+        if(errno != ENOENT) {
+            warning("Failed to open consensus cache file %s: error %i, %s",
+                    filename, errno, g_strerror(errno));
+        }
+        return NULL;
+    }
+
+    struct stat fileStat;
+    if(fstat(descriptor, &fileStat) < 0 || fileStat.st_size == 0) {
+        close(descriptor);
+        return NULL;
+    }
+
+    /* shared, so that all processes using the cache share its pages */
+    gsize mapSize = (gsize)fileStat.st_size;
+    gpointer map = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, descriptor, 0);
+
+    /* the mapping stays valid after closing the descriptor */
+    close(descriptor);
+
+    if(map == MAP_FAILED) {
+        warning("Failed to map consensus cache file %s: error %i, %s",
+                filename, errno, g_strerror(errno));
+        return NULL;
+    }
+
+    if(!_oniontraceconsensus_isValidCache(map, mapSize, validAfter)) {
+        warning("Ignoring invalid consensus cache file %s", filename);
+        munmap(map, mapSize);
+        return NULL;
+    }
+
+    OnionTraceConsensus* consensus = g_new0(OnionTraceConsensus, 1);
+    consensus->validAfter = validAfter;
+    consensus->map = map;
+    consensus->mapSize = mapSize;
+    _oniontraceconsensus_setLayout(consensus, map);
+
+    return consensus;
+}
+
+gchar* oniontraceconsensus_getCacheFileName(const gchar* directory, gint64 validAfter) {
+    gchar* name = g_strdup_printf("consensus-%"G_GINT64_FORMAT".idx", validAfter);
+    gchar* filename = g_build_filename(directory, name, NULL);
+    g_free(name);
+    return filename;
+}
+
+/* returns -1 if the time could not be parsed */
+gint64 oniontraceconsensus_parseTime(const gchar* str, gsize length) {
+    gchar buffer[32];
+    if(length >= sizeof(buffer)) {
+        return -1;
+    }
+    memcpy(buffer, str, length);
+    buffer[length] = '\0';
+
+    struct tm parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    if(sscanf(buffer, "%d-%d-%d %d:%d:%d", &parsed.tm_year, &parsed.tm_mon, &parsed.tm_mday,
+            &parsed.tm_hour, &parsed.tm_min, &parsed.tm_sec) != 6) {
+        return -1;
+    }
+
+    parsed.tm_year -= 1900;
+    parsed.tm_mon -= 1;
+    return (gint64)timegm(&parsed);
+}
+
+gint64 oniontraceconsensus_getValidAfter(OnionTraceConsensus* consensus) {
+    g_assert(consensus);
+    return consensus->validAfter;
+}
+
+guint oniontraceconsensus_getNumRelays(OnionTraceConsensus* consensus) {
+    g_assert(consensus);
+    return consensus->header ? consensus->header->numRelays : consensus->parsedStatuses->len;
+}
+
+gboolean oniontraceconsensus_isMapped(OnionTraceConsensus* consensus) {
+    g_assert(consensus);
+    return consensus->map != NULL;
+}
+
+const OnionTraceRouterStatus* oniontraceconsensus_getRelay(OnionTraceConsensus* consensus, guint index) {
+    g_assert(consensus);
+    g_assert(consensus->header);
+    g_assert(index < consensus->header->numRelays);
+    return &consensus->statuses[index];
+}
+
+const OnionTraceRouterStatus* oniontraceconsensus_lookup(OnionTraceConsensus* consensus,
+        const guint8* identity) {
+    g_assert(consensus);
+    g_assert(consensus->header);
+    return _oniontraceconsensus_find(consensus->statuses, consensus->buckets,
+            consensus->header->numBuckets, identity, NULL);
+}
+
+const OnionTraceRouterStatus* oniontraceconsensus_lookupPathEntry(OnionTraceConsensus* consensus,
+        const gchar* entry, gsize length) {
+    /* the fingerprint is the hex encoded identity */
+    if(length < 1 + (2 * ONIONTRACE_RELAY_IDENTITY_LENGTH) || entry[0] != '$') {
+        return NULL;
+    }
+
+    guint8 identity[ONIONTRACE_RELAY_IDENTITY_LENGTH];
+    for(guint i = 0; i < ONIONTRACE_RELAY_IDENTITY_LENGTH; i++) {
+        gint high = g_ascii_xdigit_value(entry[1 + (2 * i)]);
+        gint low = g_ascii_xdigit_value(entry[2 + (2 * i)]);
+        if(high < 0 || low < 0) {
+            return NULL;
+        }
+        identity[i] = (guint8)((high << 4) | low);
+    }
+
+    return oniontraceconsensus_lookup(consensus, identity);
+}
+
+void oniontraceconsensus_appendPathEntry(const OnionTraceRouterStatus* status, GString* buffer) {
+    g_assert(status);
+    g_assert(buffer);
+
+    g_string_append_c(buffer, '$');
+    for(guint i = 0; i < ONIONTRACE_RELAY_IDENTITY_LENGTH; i++) {
+        g_string_append_printf(buffer, "%02X", status->identity[i]);
+    }
+    g_string_append_c(buffer, '~');
+    g_string_append(buffer, status->nickname);
+}
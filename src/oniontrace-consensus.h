@@ -0,0 +1,78 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef SRC_ONIONTRACE_CONSENSUS_H_
+#define SRC_ONIONTRACE_CONSENSUS_H_
+
+#include <glib.h>
+
+#define ONIONTRACE_RELAY_IDENTITY_LENGTH 20
+#define ONIONTRACE_RELAY_NICKNAME_LENGTH 20
+
+/* the flags of a relay from the 's' line of its router status */
+typedef enum _OnionTraceRelayFlag OnionTraceRelayFlag;
+enum _OnionTraceRelayFlag {
+    ONIONTRACE_RELAY_FLAG_AUTHORITY = 1 << 0,
+    ONIONTRACE_RELAY_FLAG_BADEXIT = 1 << 1,
+    ONIONTRACE_RELAY_FLAG_EXIT = 1 << 2,
+    ONIONTRACE_RELAY_FLAG_FAST = 1 << 3,
+    ONIONTRACE_RELAY_FLAG_GUARD = 1 << 4,
+    ONIONTRACE_RELAY_FLAG_HSDIR = 1 << 5,
+    ONIONTRACE_RELAY_FLAG_RUNNING = 1 << 6,
+    ONIONTRACE_RELAY_FLAG_STABLE = 1 << 7,
+    ONIONTRACE_RELAY_FLAG_V2DIR = 1 << 8,
+    ONIONTRACE_RELAY_FLAG_VALID = 1 << 9,
+};
+
+/* one relay in the index. this is also the layout in the cache file, so it
+ * has a fixed size and alignment and the strings are NUL-padded. */
+typedef struct _OnionTraceRouterStatus {
+    guint8 identity[ONIONTRACE_RELAY_IDENTITY_LENGTH];
+    guint32 flags;
+    /* the consensus weight from the 'w' line */
+    guint32 bandwidth;
+    /* the IPv4 address in network byte order */
+    guint32 address;
+    guint16 orPort;
+    gchar nickname[ONIONTRACE_RELAY_NICKNAME_LENGTH];
+    guint16 reserved;
+} OnionTraceRouterStatus;
+
+/* an index of the relays in a consensus that looks up relays by identity in
+ * constant time. it is built from the lines of the 'GETINFO ns/all' reply, and
+ * can be saved to a cache file that other processes map instead of asking tor. */
+typedef struct _OnionTraceConsensus OnionTraceConsensus;
+
+/* validAfter is the unix time when the consensus became valid, which keys the cache */
+OnionTraceConsensus* oniontraceconsensus_new(gint64 validAfter);
+void oniontraceconsensus_parseLine(OnionTraceConsensus* consensus, const gchar* line, gsize length);
+void oniontraceconsensus_finish(OnionTraceConsensus* consensus);
+gboolean oniontraceconsensus_save(OnionTraceConsensus* consensus, const gchar* filename);
+
+/* returns NULL if there is no valid cache file for the consensus */
+OnionTraceConsensus* oniontraceconsensus_load(const gchar* filename, gint64 validAfter);
+void oniontraceconsensus_free(OnionTraceConsensus* consensus);
+
+/* the name of the cache file for the consensus in the given directory */
+gchar* oniontraceconsensus_getCacheFileName(const gchar* directory, gint64 validAfter);
+/* parses a time like '2020-01-01 00:00:00' as returned by 'GETINFO consensus/valid-after' */
+gint64 oniontraceconsensus_parseTime(const gchar* str, gsize length);
+
+gint64 oniontraceconsensus_getValidAfter(OnionTraceConsensus* consensus);
+guint oniontraceconsensus_getNumRelays(OnionTraceConsensus* consensus);
+gboolean oniontraceconsensus_isMapped(OnionTraceConsensus* consensus);
+
+/* the relays in no particular order, for index < getNumRelays() */
+const OnionTraceRouterStatus* oniontraceconsensus_getRelay(OnionTraceConsensus* consensus, guint index);
+
+/* the lookups return NULL if the relay is not in the consensus. path entries look
+ * like '$FINGERPRINT~nick' or '$FINGERPRINT', and need not be NUL-terminated. */
+const OnionTraceRouterStatus* oniontraceconsensus_lookup(OnionTraceConsensus* consensus,
+        const guint8* identity);
+const OnionTraceRouterStatus* oniontraceconsensus_lookupPathEntry(OnionTraceConsensus* consensus,
+        const gchar* entry, gsize length);
+/* appends the relay as a path entry like '$FINGERPRINT~nick' */
+void oniontraceconsensus_appendPathEntry(const OnionTraceRouterStatus* status, GString* buffer);
+
+#endif /* SRC_ONIONTRACE_CONSENSUS_H_ */
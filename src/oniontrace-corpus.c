@@ -0,0 +1,122 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* feeds a file of control lines through a replay controller, one line at a
+ * time as tor would send it, and prints one line for every circuit, stream, and
+ * GETINFO reply callback. test/torctl-corpus.txt is checked against the
+ * callbacks that we expect in test/torctl-corpus.expected with ctest, so that
+ * changes to the parser can not silently change what the recorder and player see.
+ * replies are only handed to a GETINFO handler while its command is pending, so
+ * corpus lines like '> GETINFO key1 key2' issue such a command instead of being fed. */
+
+#include "oniontrace.h"
+
+/* indexed by CircuitStatus and StreamStatus */
+static const gchar* circuitStatusNames[] = {
+    "NONE", "ASSIGNED", "LAUNCHED", "BUILT", "EXTENDED", "FAILED", "CLOSED"
+};
+static const gchar* streamStatusNames[] = {
+    "NONE", "NEW", "SUCCEEDED", "DETACHED", "FAILED", "CLOSED"
+};
+
+static void _oniontracecorpus_onCircuitStatus(FILE* output, CircuitStatus status, gint circuitID,
+        gchar* path, gchar* reason) {
+    fprintf(output, "circuit %i %s path=%s", circuitID, circuitStatusNames[status], path ? path : "-");
+    if(reason) {
+        fprintf(output, " reason=%s", reason);
+    }
+    fprintf(output, "\n");
+}
+
+static void _oniontracecorpus_onStreamStatus(FILE* output, StreamStatus status, gint circuitID,
+        gint streamID, gchar* username) {
+    fprintf(output, "stream %i %s circuit=%i username=%s\n", streamID, streamStatusNames[status],
+            circuitID, username ? username : "-");
+}
+
+static void _oniontracecorpus_onGetInfoBegin(FILE* output, TorCtlToken* key) {
+    fprintf(output, "getinfo key=%.*s\n", (gint)key->len, key->str);
+}
+
+static void _oniontracecorpus_onGetInfoLine(FILE* output, gchar* line, gsize length) {
+    fprintf(output, "getinfo line=%.*s\n", (gint)length, line);
+}
+
+static void _oniontracecorpus_onGetInfoEnd(FILE* output, gboolean success) {
+    fprintf(output, "getinfo end success=%s\n", success ? "yes" : "no");
+}
+
+static const TorCtlDataReplyHandler getInfoHandler = {
+    (OnDataReplyBeginFunc)_oniontracecorpus_onGetInfoBegin,
+    (OnDataReplyLineFunc)_oniontracecorpus_onGetInfoLine,
+    (OnDataReplyEndFunc)_oniontracecorpus_onGetInfoEnd
+};
+
+int main(int argc, char *argv[]) {
+    if(argc < 2 || argc > 3) {
+        g_printerr("usage: %s corpus.txt [output.txt]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    gchar* contents = NULL;
+    GError* error = NULL;
+    if(!g_file_get_contents(argv[1], &contents, NULL, &error)) {
+        g_printerr("unable to read corpus '%s': %s\n", argv[1], error->message);
+        g_error_free(error);
+        return EXIT_FAILURE;
+    }
+
+    FILE* output = stdout;
+    if(argc == 3) {
+        output = fopen(argv[2], "w");
+        if(!output) {
+            g_printerr("unable to open output '%s': %s\n", argv[2], g_strerror(errno));
+            g_free(contents);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* only log problems, the callbacks go to the output */
+    globalLogFilterLevel = G_LOG_LEVEL_WARNING;
+
+    OnionTraceTorCtl* torctl = oniontracetorctl_newReplay();
+    oniontracetorctl_setCircuitStatusCallback(torctl,
+            (OnCircuitStatusFunc)_oniontracecorpus_onCircuitStatus, output);
+    oniontracetorctl_setStreamStatusCallback(torctl,
+            (OnStreamStatusFunc)_oniontracecorpus_onStreamStatus, output);
+
+    /* the corpus has one line per line, lines starting with '#' are comments,
+     * and lines starting with '>' are commands */
+    gchar** lines = g_strsplit(contents, "\n", 0);
+    for(gint i = 0; lines[i] != NULL; i++) {
+        gchar* line = lines[i];
+        gsize length = strlen(line);
+        if(length > 0 && line[length-1] == '\r') {
+            line[--length] = '\0';
+        }
+        if(length == 0 || line[0] == '#') {
+            continue;
+        }
+        if(g_str_has_prefix(line, "> GETINFO ")) {
+            oniontracetorctl_commandGetInfo(torctl, &line[10], &getInfoHandler, output);
+            continue;
+        }
+
+        gchar* received = g_strdup_printf("%s\r\n", line);
+        oniontracetorctl_replayBytes(torctl, received, length + 2);
+        g_free(received);
+    }
+    g_strfreev(lines);
+
+    oniontracetorctl_free(torctl);
+    g_free(contents);
+
+    oniontrace_flushLog();
+
+    gboolean success = (fflush(output) == 0);
+    if(output != stdout) {
+        success = (fclose(output) == 0) && success;
+    }
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -10,9 +10,11 @@ enum _OnionTraceDriverState {
     ONIONTRACE_DRIVER_CONNECTING,
     ONIONTRACE_DRIVER_AUTHENTICATING,
     ONIONTRACE_DRIVER_BOOTSTRAPPING,
+    ONIONTRACE_DRIVER_LOADING_CONSENSUS,
     ONIONTRACE_DRIVER_RECORDING,
     ONIONTRACE_DRIVER_PLAYING,
     ONIONTRACE_DRIVER_LOGGING,
+    ONIONTRACE_DRIVER_FAILED,
 };
 
 struct _OnionTraceDriver {
@@ -22,16 +24,29 @@ struct _OnionTraceDriver {
 
     /* objects/data we own */
     OnionTraceDriverState state;
+    /* TRUE while we keep the main loop running, from start until we fail or stop */
+    gboolean isHoldingMainLoop;
     gchar* id;
-    OnionTraceTimer* heartbeatTimer;
-    OnionTraceTimer* shutdownTimer;
-    OnionTraceTimer* cleanupTimer;
+    /* which of the configured Tor instances we trace */
+    guint instance;
+    in_port_t controlPort;
+    /* ids of the timers we scheduled in the event manager, 0 if none */
+    guint64 heartbeatTimerID;
+    guint64 shutdownTimerID;
+    guint64 cleanupTimerID;
+    guint64 playTimerID;
+    guint64 flushTimerID;
+    guint64 summaryTimerID;
     struct timespec nowCached;
 
     OnionTraceTorCtl* torctl;
     OnionTraceRecorder* recorder;
     OnionTracePlayer* player;
     OnionTraceLogger* logger;
+
+    /* the relays in the current consensus, and when it became valid (-1 if unknown) */
+    OnionTraceConsensus* consensus;
+    gint64 consensusValidAfter;
 };
 
 const gchar* _oniontracedriver_stateToString(OnionTraceDriverState state) {
@@ -40,102 +55,98 @@ const gchar* _oniontracedriver_stateToString(OnionTraceDriverState state) {
         case ONIONTRACE_DRIVER_CONNECTING: return "CONNECTING";
         case ONIONTRACE_DRIVER_AUTHENTICATING: return "AUTHENTICATING";
         case ONIONTRACE_DRIVER_BOOTSTRAPPING: return "BOOTSTRAPPING";
+        case ONIONTRACE_DRIVER_LOADING_CONSENSUS: return "LOADING_CONSENSUS";
         case ONIONTRACE_DRIVER_RECORDING: return "RECORDING";
         case ONIONTRACE_DRIVER_PLAYING: return "PLAYING";
         case ONIONTRACE_DRIVER_LOGGING: return "LOGGING";
+        case ONIONTRACE_DRIVER_FAILED: return "FAILED";
         default: return "NONE";
     }
 }
 
-static void _oniontracedriver_playTimerReadable(OnionTraceTimer* timer, OnionTraceEventFlag type) {
-    g_assert(timer);
-    g_assert(type & ONIONTRACE_EVENT_READ);
-
-    /* if the timer triggered, this will call the timer callback function */
-    gboolean calledNotify = oniontracetimer_check(timer);
-    if(!calledNotify) {
-        warning("Authority unable to execute play timer callback function.");
-    }
-    /* free the timer since we don't track it anywhere else */
-    oniontracetimer_free(timer);
-}
-
 static void _oniontracedriver_playCallback(OnionTraceDriver* driver, gpointer unused) {
     g_assert(driver);
 
-    /* compute the time until the next circuit should be created */
-    struct itimerspec armTime;
-    memset(&armTime, 0, sizeof(struct itimerspec));
+    /* this timer does not repeat, so it is gone now */
+    driver->playTimerID = 0;
 
     /* build the circuit that we should be building now, and get next circuit time */
-    armTime.it_value = oniontraceplayer_launchNextCircuit(driver->player);
+    struct timespec nextLaunchDelay = oniontraceplayer_launchNextCircuit(driver->player);
 
     /* schedule another timer for the next circuit */
-    if(armTime.it_value.tv_sec > 0 || armTime.it_value.tv_nsec > 0) {
+    if(nextLaunchDelay.tv_sec > 0 || nextLaunchDelay.tv_nsec > 0) {
         info("%s: launching next circuit in %"G_GSIZE_FORMAT".%09"G_GSIZE_FORMAT" seconds",
-                driver->id, (gsize)armTime.it_value.tv_sec, (gsize)armTime.it_value.tv_nsec);
+                driver->id, (gsize)nextLaunchDelay.tv_sec, (gsize)nextLaunchDelay.tv_nsec);
 
-        OnionTraceTimer* timer = oniontracetimer_new((GFunc)_oniontracedriver_playCallback, driver, NULL);
-        oniontracetimer_armGranular(timer, &armTime);
-
-        gint timerFD = oniontracetimer_getFD(timer);
-        oniontraceeventmanager_register(driver->manager, timerFD, ONIONTRACE_EVENT_READ,
-                (OnionTraceOnEventFunc)_oniontracedriver_playTimerReadable, timer);
-    }
-}
-
-static void _oniontracedriver_genericTimerReadable(OnionTraceTimer* timer, OnionTraceEventFlag type) {
-    g_assert(timer);
-    g_assert(type & ONIONTRACE_EVENT_READ);
-
-    /* if the timer triggered, this will call the timer callback function */
-    gboolean calledNotify = oniontracetimer_check(timer);
-    if(!calledNotify) {
-        warning("Authority unable to execute timer callback function. "
-                "The timer might trigger again since we did not delete it.");
+        driver->playTimerID = oniontraceeventmanager_addTimer(driver->manager, &nextLaunchDelay, NULL,
+                (GFunc)_oniontracedriver_playCallback, driver, NULL);
     }
 }
 
 static void _oniontracedriver_shutdown(OnionTraceDriver* driver, gpointer unused) {
     g_assert(driver);
+    driver->shutdownTimerID = 0;
     oniontraceeventmanager_stopMainLoop(driver->manager);
 }
 
 static void _oniontracedriver_registerShutdown(OnionTraceDriver* driver, guint seconds) {
-    driver->shutdownTimer = oniontracetimer_new((GFunc)_oniontracedriver_shutdown, driver, NULL);
-    oniontracetimer_arm(driver->shutdownTimer, seconds, 0);
-
-    gint timerFD = oniontracetimer_getFD(driver->shutdownTimer);
-    oniontraceeventmanager_register(driver->manager, timerFD, ONIONTRACE_EVENT_READ,
-            (OnionTraceOnEventFunc)_oniontracedriver_genericTimerReadable, driver->shutdownTimer);
+    struct timespec delay = {.tv_sec = seconds, .tv_nsec = 0};
+    driver->shutdownTimerID = oniontraceeventmanager_addTimer(driver->manager, &delay, NULL,
+            (GFunc)_oniontracedriver_shutdown, driver, NULL);
 }
 
 static void _oniontracedriver_cleanup(OnionTraceDriver* driver, gpointer unused) {
     g_assert(driver);
 
+    driver->cleanupTimerID = 0;
+
     if(driver->state == ONIONTRACE_DRIVER_RECORDING && driver->recorder != NULL) {
         oniontracerecorder_cleanup(driver->recorder);
     }
 }
 
 static void _oniontracedriver_registerCleanup(OnionTraceDriver* driver, guint seconds) {
-    driver->cleanupTimer = oniontracetimer_new((GFunc)_oniontracedriver_cleanup, driver, NULL);
-    oniontracetimer_arm(driver->cleanupTimer, seconds, 0);
+    struct timespec delay = {.tv_sec = seconds, .tv_nsec = 0};
+    driver->cleanupTimerID = oniontraceeventmanager_addTimer(driver->manager, &delay, NULL,
+            (GFunc)_oniontracedriver_cleanup, driver, NULL);
+}
 
-    gint timerFD = oniontracetimer_getFD(driver->cleanupTimer);
-    oniontraceeventmanager_register(driver->manager, timerFD, ONIONTRACE_EVENT_READ,
-            (OnionTraceOnEventFunc)_oniontracedriver_genericTimerReadable, driver->cleanupTimer);
+static void _oniontracedriver_flushTrace(OnionTraceDriver* driver, gpointer unused) {
+    g_assert(driver);
+
+    if(driver->state == ONIONTRACE_DRIVER_RECORDING && driver->recorder != NULL) {
+        oniontracerecorder_flush(driver->recorder);
+    } else if(driver->state == ONIONTRACE_DRIVER_LOGGING && driver->logger != NULL) {
+        oniontracelogger_flush(driver->logger);
+    }
 }
 
-static void _oniontracedriver_heartbeat(OnionTraceDriver* driver, gpointer unused) {
+static void _oniontracedriver_registerFlush(OnionTraceDriver* driver, guint seconds) {
+    struct timespec interval = {.tv_sec = seconds, .tv_nsec = 0};
+    driver->flushTimerID = oniontraceeventmanager_addTimer(driver->manager, &interval, &interval,
+            (GFunc)_oniontracedriver_flushTrace, driver, NULL);
+}
+
+static void _oniontracedriver_logSummary(OnionTraceDriver* driver, gpointer unused) {
     g_assert(driver);
 
-    clock_gettime(CLOCK_REALTIME, &driver->nowCached);
+    if(driver->state == ONIONTRACE_DRIVER_LOGGING && driver->logger != NULL) {
+        oniontracelogger_logSummary(driver->logger);
+    }
+}
 
-    /* log some generally useful info as a status update */
-    GString* msg = g_string_new("");
-    g_string_append_printf(msg, "%s: heartbeat: state=%s",
-            driver->id, _oniontracedriver_stateToString(driver->state));
+static void _oniontracedriver_registerSummary(OnionTraceDriver* driver, guint seconds) {
+    struct timespec interval = {.tv_sec = seconds, .tv_nsec = 0};
+    driver->summaryTimerID = oniontraceeventmanager_addTimer(driver->manager, &interval, &interval,
+            (GFunc)_oniontracedriver_logSummary, driver, NULL);
+}
+
+/* returns the state and the status of the active component */
+gchar* oniontracedriver_toString(OnionTraceDriver* driver) {
+    g_assert(driver);
+
+    GString* string = g_string_new("");
+    g_string_append_printf(string, "state=%s", _oniontracedriver_stateToString(driver->state));
 
     gchar* status = NULL;
 
@@ -148,73 +159,251 @@ static void _oniontracedriver_heartbeat(OnionTraceDriver* driver, gpointer unuse
     }
 
     if(status) {
-        g_string_append_printf(msg, " %s", status);
+        g_string_append_printf(string, " %s", status);
         g_free(status);
     }
 
-    message("%s", msg->str);
-    g_string_free(msg, TRUE);
+    return g_string_free(string, FALSE);
+}
+
+static void _oniontracedriver_heartbeat(OnionTraceDriver* driver, gpointer unused) {
+    g_assert(driver);
+
+    clock_gettime(CLOCK_REALTIME, &driver->nowCached);
+
+    /* log some generally useful info as a status update */
+    gchar* status = oniontracedriver_toString(driver);
+    message("%s: heartbeat: %s", driver->id, status);
+    g_free(status);
 }
 
 static void _oniontracedriver_registerHeartbeat(OnionTraceDriver* driver) {
     g_assert(driver);
 
-    if(driver->heartbeatTimer) {
-        oniontracetimer_free(driver->heartbeatTimer);
+    if(driver->heartbeatTimerID) {
+        oniontraceeventmanager_cancelTimer(driver->manager, driver->heartbeatTimerID);
     }
 
     /* log heartbeat message every 1 second */
-    driver->heartbeatTimer = oniontracetimer_new((GFunc)_oniontracedriver_heartbeat, driver, NULL);
-    oniontracetimer_arm(driver->heartbeatTimer, 1, 1);
-
-    gint timerFD = oniontracetimer_getFD(driver->heartbeatTimer);
-    oniontraceeventmanager_register(driver->manager, timerFD, ONIONTRACE_EVENT_READ,
-            (OnionTraceOnEventFunc)_oniontracedriver_genericTimerReadable, driver->heartbeatTimer);
+    struct timespec interval = {.tv_sec = 1, .tv_nsec = 0};
+    driver->heartbeatTimerID = oniontraceeventmanager_addTimer(driver->manager, &interval, &interval,
+            (GFunc)_oniontracedriver_heartbeat, driver, NULL);
 }
 
-static void _oniontracedriver_onBootstrapped(OnionTraceDriver* driver) {
+static void _oniontracedriver_cancelTimers(OnionTraceDriver* driver) {
     g_assert(driver);
 
-    in_port_t clientPort = oniontracetorctl_getControlClientPort(driver->torctl);
+    guint64* timerIDs[] = {&driver->heartbeatTimerID, &driver->shutdownTimerID,
+            &driver->cleanupTimerID, &driver->playTimerID, &driver->flushTimerID,
+            &driver->summaryTimerID};
 
-    message("%s: successfully bootstrapped client port %u", driver->id, clientPort);
+    for(guint i = 0; i < G_N_ELEMENTS(timerIDs); i++) {
+        if(*timerIDs[i]) {
+            oniontraceeventmanager_cancelTimer(driver->manager, *timerIDs[i]);
+            *timerIDs[i] = 0;
+        }
+    }
+}
+
+static void _oniontracedriver_releaseMainLoop(OnionTraceDriver* driver) {
+    if(driver->isHoldingMainLoop) {
+        driver->isHoldingMainLoop = FALSE;
+        oniontraceeventmanager_release(driver->manager);
+    }
+}
 
-    const gchar* filename = oniontraceconfig_getTraceFileName(driver->config);
+/* gives up on our instance. the main loop stops once no other instance in it
+ * could still make progress without us. stop() still has to clean up after us. */
+static void _oniontracedriver_fail(OnionTraceDriver* driver) {
+    driver->state = ONIONTRACE_DRIVER_FAILED;
+    _oniontracedriver_releaseMainLoop(driver);
+}
+
+static void _oniontracedriver_startMode(OnionTraceDriver* driver) {
+    g_assert(driver);
+
+    /* each instance has its own trace file when we trace several of them */
+    gchar* filename = oniontraceconfig_getInstanceFileName(driver->config,
+            oniontraceconfig_getTraceFileName(driver->config), driver->instance);
 
     OnionTraceMode configuredMode = oniontraceconfig_getMode(driver->config);
 
     if(configuredMode == ONIONTRACE_MODE_RECORD) {
         driver->state = ONIONTRACE_DRIVER_RECORDING;
-        driver->recorder = oniontracerecorder_new(driver->torctl, filename);
+        driver->recorder = oniontracerecorder_new(driver->torctl, filename,
+                (gsize)oniontraceconfig_getTraceFlushBytes(driver->config),
+                (guint)oniontraceconfig_getTraceFlushCircuits(driver->config),
+                (guint)oniontraceconfig_getTraceReorderSeconds(driver->config));
+        g_free(filename);
         if(!driver->recorder) {
             critical("%s: Error creating recorder instance, cannot proceed", driver->id);
-            driver->state = ONIONTRACE_DRIVER_IDLE;
-            oniontraceeventmanager_stopMainLoop(driver->manager);
+            _oniontracedriver_fail(driver);
             return;
         }
+
+        /* write buffered records out periodically, even when few circuits close */
+        gint flushIntervalSeconds = oniontraceconfig_getTraceFlushIntervalSeconds(driver->config);
+        if(flushIntervalSeconds > 0) {
+            _oniontracedriver_registerFlush(driver, (guint)flushIntervalSeconds);
+        }
     } else if(configuredMode == ONIONTRACE_MODE_PLAY) {
         driver->state = ONIONTRACE_DRIVER_PLAYING;
 
-        driver->player = oniontraceplayer_new(driver->torctl, filename);
+        driver->player = oniontraceplayer_new(driver->manager, driver->torctl, filename,
+                (guint)oniontraceconfig_getMaxPendingLaunches(driver->config),
+                (guint)oniontraceconfig_getPlayWindowSeconds(driver->config));
+        g_free(filename);
         if(!driver->player) {
             critical("%s: Error creating player instance, cannot proceed", driver->id);
-            driver->state = ONIONTRACE_DRIVER_IDLE;
-            oniontraceeventmanager_stopMainLoop(driver->manager);
+            _oniontracedriver_fail(driver);
             return;
         }
 
+        oniontraceplayer_setBuildLead(driver->player,
+                oniontraceconfig_getBuildLeadQuantile(driver->config),
+                (guint)oniontraceconfig_getBuildLeadMinMillis(driver->config),
+                (guint)oniontraceconfig_getBuildLeadMaxMillis(driver->config));
+
+        if(driver->consensus && oniontraceconfig_getCheckPaths(driver->config)) {
+            oniontraceplayer_setConsensus(driver->player, driver->consensus);
+        }
+
         /* start building circuits according to the schedule */
         _oniontracedriver_playCallback(driver, NULL);
     } else {
+        g_free(filename);
         driver->state = ONIONTRACE_DRIVER_LOGGING;
         const gchar* spaceDelimitedEvents = oniontraceconfig_getSpaceDelimitedEvents(driver->config);
-        driver->logger = oniontracelogger_new(driver->torctl, spaceDelimitedEvents);
+        OnionTraceOutputFormat outputFormat = oniontraceconfig_getOutputFormat(driver->config);
+        gint summaryIntervalSeconds = oniontraceconfig_getSummaryIntervalSeconds(driver->config);
+        const gchar* outputFilename = oniontraceconfig_getOutputFileName(driver->config);
+        gchar* instanceFilename = outputFilename ?
+                oniontraceconfig_getInstanceFileName(driver->config, outputFilename, driver->instance) : NULL;
+        driver->logger = oniontracelogger_new(driver->torctl, spaceDelimitedEvents, outputFormat,
+                instanceFilename, (gsize)oniontraceconfig_getTraceFlushBytes(driver->config),
+                summaryIntervalSeconds > 0, oniontraceconfig_getSummaryOnly(driver->config),
+                oniontraceconfig_getInstanceID(driver->config, driver->instance));
+        g_free(instanceFilename);
         if(!driver->logger) {
             critical("%s: Error creating logger instance, cannot proceed", driver->id);
-            driver->state = ONIONTRACE_DRIVER_IDLE;
-            oniontraceeventmanager_stopMainLoop(driver->manager);
+            _oniontracedriver_fail(driver);
+            return;
+        }
+
+        /* records in our own file are buffered like trace records in record mode */
+        gint flushIntervalSeconds = oniontraceconfig_getTraceFlushIntervalSeconds(driver->config);
+        if(outputFilename && flushIntervalSeconds > 0) {
+            _oniontracedriver_registerFlush(driver, (guint)flushIntervalSeconds);
+        }
+
+        if(summaryIntervalSeconds > 0) {
+            _oniontracedriver_registerSummary(driver, (guint)summaryIntervalSeconds);
+        }
+    }
+}
+
+static void _oniontracedriver_onConsensusLine(OnionTraceDriver* driver, gchar* line, gsize length) {
+    oniontraceconsensus_parseLine(driver->consensus, line, length);
+}
+
+static void _oniontracedriver_onConsensusEnd(OnionTraceDriver* driver, gboolean success) {
+    g_assert(driver);
+
+    if(!success) {
+        warning("%s: unable to get the consensus from Tor, continuing without it", driver->id);
+        oniontraceconsensus_free(driver->consensus);
+        driver->consensus = NULL;
+        _oniontracedriver_startMode(driver);
+        return;
+    }
+
+    oniontraceconsensus_finish(driver->consensus);
+    message("%s: got %u relays in the consensus from Tor", driver->id,
+            oniontraceconsensus_getNumRelays(driver->consensus));
+
+    /* save it for the next run and for the other processes using this consensus */
+    const gchar* cacheDir = oniontraceconfig_getConsensusCacheDir(driver->config);
+    if(cacheDir && driver->consensusValidAfter >= 0 && g_mkdir_with_parents(cacheDir, 0755) == 0) {
+        gchar* filename = oniontraceconsensus_getCacheFileName(cacheDir, driver->consensusValidAfter);
+        if(oniontraceconsensus_save(driver->consensus, filename)) {
+            info("%s: saved the consensus to cache file %s", driver->id, filename);
+        }
+        g_free(filename);
+    }
+
+    _oniontracedriver_startMode(driver);
+}
+
+static const TorCtlDataReplyHandler consensusHandler = {
+    NULL, (OnDataReplyLineFunc)_oniontracedriver_onConsensusLine,
+    (OnDataReplyEndFunc)_oniontracedriver_onConsensusEnd
+};
+
+static void _oniontracedriver_fetchConsensus(OnionTraceDriver* driver) {
+    /* the reply is parsed as it arrives, so we never hold all of its lines */
+    driver->consensus = oniontraceconsensus_new(driver->consensusValidAfter);
+    oniontracetorctl_commandGetDescriptorInfo(driver->torctl, &consensusHandler, driver);
+}
+
+static void _oniontracedriver_onValidAfterLine(OnionTraceDriver* driver, gchar* line, gsize length) {
+    driver->consensusValidAfter = oniontraceconsensus_parseTime(line, length);
+}
+
+static void _oniontracedriver_onValidAfterEnd(OnionTraceDriver* driver, gboolean success) {
+    g_assert(driver);
+
+    if(success && driver->consensusValidAfter >= 0) {
+        /* a sibling process or an earlier run may have saved this consensus already */
+        gchar* filename = oniontraceconsensus_getCacheFileName(
+                oniontraceconfig_getConsensusCacheDir(driver->config), driver->consensusValidAfter);
+        driver->consensus = oniontraceconsensus_load(filename, driver->consensusValidAfter);
+
+        if(driver->consensus) {
+            message("%s: mapped %u relays in the consensus from cache file %s", driver->id,
+                    oniontraceconsensus_getNumRelays(driver->consensus), filename);
+            g_free(filename);
+            _oniontracedriver_startMode(driver);
             return;
         }
+
+        g_free(filename);
+    } else {
+        warning("%s: unable to get the consensus valid-after time from Tor, the consensus will not be cached",
+                driver->id);
+        driver->consensusValidAfter = -1;
+    }
+
+    _oniontracedriver_fetchConsensus(driver);
+}
+
+static const TorCtlDataReplyHandler validAfterHandler = {
+    NULL, (OnDataReplyLineFunc)_oniontracedriver_onValidAfterLine,
+    (OnDataReplyEndFunc)_oniontracedriver_onValidAfterEnd
+};
+
+static void _oniontracedriver_onBootstrapped(OnionTraceDriver* driver) {
+    g_assert(driver);
+
+    in_port_t clientPort = oniontracetorctl_getControlClientPort(driver->torctl);
+
+    message("%s: successfully bootstrapped client port %u", driver->id, clientPort);
+
+    gboolean wantsConsensus = oniontraceconfig_getMode(driver->config) == ONIONTRACE_MODE_PLAY &&
+            (oniontraceconfig_getCheckPaths(driver->config) || oniontraceconfig_getConsensusCacheDir(driver->config));
+
+    if(!wantsConsensus) {
+        _oniontracedriver_startMode(driver);
+        return;
+    }
+
+    driver->state = ONIONTRACE_DRIVER_LOADING_CONSENSUS;
+    driver->consensusValidAfter = -1;
+
+    if(oniontraceconfig_getConsensusCacheDir(driver->config)) {
+        /* the consensus is looked up in the cache by when it became valid */
+        oniontracetorctl_commandGetInfo(driver->torctl, "consensus/valid-after", &validAfterHandler, driver);
+    } else {
+        _oniontracedriver_fetchConsensus(driver);
     }
 }
 
@@ -232,13 +421,28 @@ static void _oniontracedriver_onAuthenticated(OnionTraceDriver* driver) {
     driver->state = ONIONTRACE_DRIVER_BOOTSTRAPPING;
 }
 
+static void _oniontracedriver_onDisconnected(OnionTraceDriver* driver) {
+    g_assert(driver);
+
+    critical("%s: lost the connection to Tor while %s, giving up on this instance",
+            driver->id, _oniontracedriver_stateToString(driver->state));
+
+    /* stop launching circuits; the recorder and logger keep what they have until we are freed */
+    if(driver->playTimerID) {
+        oniontraceeventmanager_cancelTimer(driver->manager, driver->playTimerID);
+        driver->playTimerID = 0;
+    }
+
+    _oniontracedriver_fail(driver);
+}
+
 static void _oniontracedriver_onConnected(OnionTraceDriver* driver) {
     g_assert(driver);
 
     in_port_t clientPort = oniontracetorctl_getControlClientPort(driver->torctl);
 
     message("%s: connection attempt finished on client port %u to Tor control server port %u",
-            driver->id, clientPort, oniontraceconfig_getTorControlPort(driver->config));
+            driver->id, clientPort, driver->controlPort);
 
     message("%s: attempting to authenticate on client port %u", driver->id, clientPort);
 
@@ -258,7 +462,7 @@ gboolean oniontracedriver_start(OnionTraceDriver* driver) {
     message("%s: creating control client to connect to Tor", driver->id);
 
     /* set up our torctl instance to get the descriptors before starting attack */
-    in_port_t controlPort = oniontraceconfig_getTorControlPort(driver->config);
+    in_port_t controlPort = driver->controlPort;
 
     driver->torctl = oniontracetorctl_new(driver->manager, controlPort,
             (OnConnectedFunc)_oniontracedriver_onConnected, driver);
@@ -268,12 +472,34 @@ gboolean oniontracedriver_start(OnionTraceDriver* driver) {
         return FALSE;
     }
 
+    oniontracetorctl_setDisconnectedCallback(driver->torctl,
+            (OnDisconnectedFunc)_oniontracedriver_onDisconnected, driver);
+
+    /* capture everything tor sends us, so it can be replayed offline later */
+    const gchar* captureFilename = oniontraceconfig_getCaptureFileName(driver->config);
+    if(captureFilename) {
+        gchar* instanceFilename = oniontraceconfig_getInstanceFileName(driver->config,
+                captureFilename, driver->instance);
+        gboolean success = oniontracetorctl_setCaptureFile(driver->torctl, instanceFilename);
+        g_free(instanceFilename);
+
+        if(!success) {
+            critical("%s: error creating capture file, cannot proceed", driver->id);
+            oniontracetorctl_free(driver->torctl);
+            driver->torctl = NULL;
+            return FALSE;
+        }
+    }
+
     message("%s: created tor controller instance, connecting to port %u",
             driver->id, controlPort);
     driver->state = ONIONTRACE_DRIVER_CONNECTING;
 
-    /* now set up the heartbeat so we can log progress over time */
-    _oniontracedriver_registerHeartbeat(driver);
+    /* now set up the heartbeat so we can log progress over time. when tracing
+     * several instances, the main loop logs a single heartbeat for all of them. */
+    if(oniontraceconfig_getNumInstances(driver->config) == 1) {
+        _oniontracedriver_registerHeartbeat(driver);
+    }
 
     gint runTimeSeconds = oniontraceconfig_getRunTimeSeconds(driver->config);
     if(runTimeSeconds > 0) {
@@ -281,6 +507,10 @@ gboolean oniontracedriver_start(OnionTraceDriver* driver) {
         _oniontracedriver_registerShutdown(driver, runTimeSeconds);
     }
 
+    /* the other instances in our main loop keep running while we are alive */
+    oniontraceeventmanager_hold(driver->manager);
+    driver->isHoldingMainLoop = TRUE;
+
     return TRUE;
 }
 
@@ -308,34 +538,40 @@ gboolean oniontracedriver_stop(OnionTraceDriver* driver) {
         driver->logger = NULL;
     }
 
-    if(driver->heartbeatTimer) {
-        oniontracetimer_free(driver->heartbeatTimer);
-        driver->heartbeatTimer = NULL;
-    }
-
-    if(driver->shutdownTimer) {
-        oniontracetimer_free(driver->shutdownTimer);
-        driver->shutdownTimer = NULL;
-    }
+    /* make sure none of our timers fire after we stopped */
+    _oniontracedriver_cancelTimers(driver);
+    _oniontracedriver_releaseMainLoop(driver);
 
     if(driver->torctl) {
         oniontracetorctl_free(driver->torctl);
         driver->torctl = NULL;
     }
 
+    if(driver->consensus) {
+        oniontraceconsensus_free(driver->consensus);
+        driver->consensus = NULL;
+    }
+
     driver->state = ONIONTRACE_DRIVER_IDLE;
 
     return TRUE;
 }
 
-OnionTraceDriver* oniontracedriver_new(OnionTraceConfig* config, OnionTraceEventManager* manager) {
+OnionTraceDriver* oniontracedriver_new(OnionTraceConfig* config, OnionTraceEventManager* manager, guint instance) {
     OnionTraceDriver* driver = g_new0(OnionTraceDriver, 1);
 
     driver->manager = manager;
     driver->config = config;
 
+    driver->instance = instance;
+    driver->controlPort = oniontraceconfig_getTorControlPort(config, instance);
+
     GString* idbuf = g_string_new(NULL);
-    g_string_printf(idbuf, "Driver");
+    if(oniontraceconfig_getNumInstances(config) > 1) {
+        g_string_printf(idbuf, "Driver-%s", oniontraceconfig_getInstanceID(config, instance));
+    } else {
+        g_string_printf(idbuf, "Driver");
+    }
     driver->id = g_string_free(idbuf, FALSE);
 
     driver->state = ONIONTRACE_DRIVER_IDLE;
@@ -358,18 +594,16 @@ void oniontracedriver_free(OnionTraceDriver* driver) {
         oniontracelogger_free(driver->logger);
     }
 
-    if(driver->heartbeatTimer) {
-        oniontracetimer_free(driver->heartbeatTimer);
-    }
-
-    if(driver->shutdownTimer) {
-        oniontracetimer_free(driver->shutdownTimer);
-    }
+    _oniontracedriver_cancelTimers(driver);
 
     if(driver->torctl) {
         oniontracetorctl_free(driver->torctl);
     }
 
+    if(driver->consensus) {
+        oniontraceconsensus_free(driver->consensus);
+    }
+
     if(driver->id) {
         g_free(driver->id);
     }
@@ -10,10 +10,12 @@
 
 typedef struct _OnionTraceDriver OnionTraceDriver;
 
-OnionTraceDriver* oniontracedriver_new(OnionTraceConfig* config, OnionTraceEventManager* manager);
+OnionTraceDriver* oniontracedriver_new(OnionTraceConfig* config, OnionTraceEventManager* manager, guint instance);
 void oniontracedriver_free(OnionTraceDriver* driver);
 
 gboolean oniontracedriver_start(OnionTraceDriver* driver);
 gboolean oniontracedriver_stop(OnionTraceDriver* driver);
 
+gchar* oniontracedriver_toString(OnionTraceDriver* driver);
+
 #endif /* SRC_ONIONTRACE_DRIVER_H_ */
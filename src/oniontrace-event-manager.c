@@ -4,20 +4,223 @@
 
 #include "oniontrace.h"
 
+typedef struct _OnionTraceTimerEntry OnionTraceTimerEntry;
+struct _OnionTraceTimerEntry {
+    guint64 id;
+    /* absolute CLOCK_MONOTONIC times in nanoseconds */
+    guint64 expireTime;
+    guint64 period;
+    guint heapIndex;
+    gboolean isCancelled;
+    GFunc func;
+    gpointer arg1;
+    gpointer arg2;
+};
+
 struct _OnionTraceEventManager {
     gint epollDescriptor;
     gboolean shouldStopLoop;
-    GHashTable* watches;
+    /* the number of clients that still need the main loop */
+    guint numHolds;
+    /* watch objects indexed by descriptor; entries stay allocated once created
+     * so that pointers stored in epoll events never dangle */
+    GPtrArray* watches;
+
+    /* all timers share a single timerfd that is armed for the earliest expiration */
+    gint timerDescriptor;
+    guint64 timerDescriptorExpireTime;
+    /* min-heap of pending timers ordered by expiration time */
+    GPtrArray* timerHeap;
+    /* timer id to timer object, for cancellation */
+    GHashTable* timers;
+    guint64 nextTimerID;
+    /* the timer whose callback is currently running, if any */
+    OnionTraceTimerEntry* timerFiring;
 };
 
 typedef struct _OnionTraceWatch OnionTraceWatch;
 struct _OnionTraceWatch {
     gint descriptor;
+    gboolean isRegistered;
+    /* incremented on every deregistration, so that events epoll reported for an
+     * earlier registration of the same descriptor can be recognized as stale */
+    guint generation;
     OnionTraceEventFlag type;
     OnionTraceOnEventFunc onEvent;
     gpointer onEventArg;
 };
 
+#define NANOS_PER_SECOND 1000000000UL
+
+static guint64 _oniontraceeventmanager_timespecToNanos(const struct timespec* ts) {
+    if(!ts || ts->tv_sec < 0 || ts->tv_nsec < 0) {
+        return 0;
+    }
+    return ((guint64)ts->tv_sec * NANOS_PER_SECOND) + (guint64)ts->tv_nsec;
+}
+
+static guint64 _oniontraceeventmanager_getNowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return _oniontraceeventmanager_timespecToNanos(&now);
+}
+
+static gboolean _oniontraceeventmanager_timerIsEarlier(OnionTraceTimerEntry* a, OnionTraceTimerEntry* b) {
+    /* break ties by id so that timers with equal expiration run in the order they were added */
+    return a->expireTime < b->expireTime || (a->expireTime == b->expireTime && a->id < b->id);
+}
+
+static void _oniontraceeventmanager_heapSet(OnionTraceEventManager* manager,
+        guint index, OnionTraceTimerEntry* timer) {
+    g_ptr_array_index(manager->timerHeap, index) = timer;
+    timer->heapIndex = index;
+}
+
+static void _oniontraceeventmanager_heapSiftUp(OnionTraceEventManager* manager, guint index) {
+    OnionTraceTimerEntry* timer = g_ptr_array_index(manager->timerHeap, index);
+
+    while(index > 0) {
+        guint parentIndex = (index - 1) / 2;
+        OnionTraceTimerEntry* parent = g_ptr_array_index(manager->timerHeap, parentIndex);
+        if(!_oniontraceeventmanager_timerIsEarlier(timer, parent)) {
+            break;
+        }
+        _oniontraceeventmanager_heapSet(manager, index, parent);
+        index = parentIndex;
+    }
+
+    _oniontraceeventmanager_heapSet(manager, index, timer);
+}
+
+static void _oniontraceeventmanager_heapSiftDown(OnionTraceEventManager* manager, guint index) {
+    guint length = manager->timerHeap->len;
+    OnionTraceTimerEntry* timer = g_ptr_array_index(manager->timerHeap, index);
+
+    while(TRUE) {
+        guint childIndex = 2 * index + 1;
+        if(childIndex >= length) {
+            break;
+        }
+
+        OnionTraceTimerEntry* child = g_ptr_array_index(manager->timerHeap, childIndex);
+        if(childIndex + 1 < length) {
+            OnionTraceTimerEntry* rightChild = g_ptr_array_index(manager->timerHeap, childIndex + 1);
+            if(_oniontraceeventmanager_timerIsEarlier(rightChild, child)) {
+                childIndex++;
+                child = rightChild;
+            }
+        }
+
+        if(!_oniontraceeventmanager_timerIsEarlier(child, timer)) {
+            break;
+        }
+        _oniontraceeventmanager_heapSet(manager, index, child);
+        index = childIndex;
+    }
+
+    _oniontraceeventmanager_heapSet(manager, index, timer);
+}
+
+static void _oniontraceeventmanager_heapPush(OnionTraceEventManager* manager, OnionTraceTimerEntry* timer) {
+    g_ptr_array_add(manager->timerHeap, timer);
+    _oniontraceeventmanager_heapSiftUp(manager, manager->timerHeap->len - 1);
+}
+
+static void _oniontraceeventmanager_heapRemove(OnionTraceEventManager* manager, OnionTraceTimerEntry* timer) {
+    guint index = timer->heapIndex;
+    guint lastIndex = manager->timerHeap->len - 1;
+    g_assert(index <= lastIndex && g_ptr_array_index(manager->timerHeap, index) == timer);
+
+    OnionTraceTimerEntry* last = g_ptr_array_index(manager->timerHeap, lastIndex);
+    g_ptr_array_set_size(manager->timerHeap, lastIndex);
+
+    if(last != timer) {
+        /* move the last timer into the hole and restore the heap order */
+        _oniontraceeventmanager_heapSet(manager, index, last);
+        _oniontraceeventmanager_heapSiftUp(manager, index);
+        _oniontraceeventmanager_heapSiftDown(manager, last->heapIndex);
+    }
+}
+
+static void _oniontraceeventmanager_armTimerDescriptor(OnionTraceEventManager* manager) {
+    g_assert(manager);
+
+    OnionTraceTimerEntry* earliest = manager->timerHeap->len > 0 ?
+            g_ptr_array_index(manager->timerHeap, 0) : NULL;
+    guint64 expireTime = earliest ? earliest->expireTime : 0;
+
+    /* only touch the timerfd when the earliest expiration actually changed */
+    if(expireTime == manager->timerDescriptorExpireTime) {
+        return;
+    }
+
+    struct itimerspec arm;
+    memset(&arm, 0, sizeof(struct itimerspec));
+
+    /* a 0 value disarms the timerfd; an absolute time in the past expires immediately */
+    if(expireTime > 0) {
+        arm.it_value.tv_sec = (time_t)(expireTime / NANOS_PER_SECOND);
+        arm.it_value.tv_nsec = (long)(expireTime % NANOS_PER_SECOND);
+    }
+
+    if(timerfd_settime(manager->timerDescriptor, TFD_TIMER_ABSTIME, &arm, NULL) < 0) {
+        warning("timerfd_settime failed on descriptor %i: %s",
+                manager->timerDescriptor, g_strerror(errno));
+        manager->timerDescriptorExpireTime = 0;
+        return;
+    }
+
+    manager->timerDescriptorExpireTime = expireTime;
+}
+
+static void _oniontraceeventmanager_onTimerDescriptorReadable(OnionTraceEventManager* manager,
+        OnionTraceEventFlag type) {
+    g_assert(manager);
+
+    /* clear the event from the descriptor */
+    guint64 numExpirations = 0;
+    ssize_t result = read(manager->timerDescriptor, &numExpirations, sizeof(guint64));
+    if(result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        warning("error reading timer descriptor %i: %s", manager->timerDescriptor, g_strerror(errno));
+    }
+
+    /* the timerfd is disarmed now, make sure we rearm it below */
+    manager->timerDescriptorExpireTime = 0;
+
+    /* only run timers that were due on entry, so that callbacks adding new
+     * timers with a zero delay can't keep us here forever */
+    guint64 now = _oniontraceeventmanager_getNowNanos();
+
+    while(manager->timerHeap->len > 0) {
+        OnionTraceTimerEntry* timer = g_ptr_array_index(manager->timerHeap, 0);
+        if(timer->expireTime > now) {
+            break;
+        }
+
+        _oniontraceeventmanager_heapRemove(manager, timer);
+
+        manager->timerFiring = timer;
+        if(timer->func) {
+            timer->func(timer->arg1, timer->arg2);
+        }
+        manager->timerFiring = NULL;
+
+        if(timer->period > 0 && !timer->isCancelled) {
+            /* like timerfd, coalesce any expirations we missed into one */
+            timer->expireTime += timer->period;
+            if(timer->expireTime <= now) {
+                timer->expireTime += ((now - timer->expireTime) / timer->period + 1) * timer->period;
+            }
+            _oniontraceeventmanager_heapPush(manager, timer);
+        } else {
+            /* this will call g_free on the timer object */
+            g_hash_table_remove(manager->timers, &timer->id);
+        }
+    }
+
+    _oniontraceeventmanager_armTimerDescriptor(manager);
+}
+
 OnionTraceEventManager* oniontraceeventmanager_new() {
     OnionTraceEventManager* manager = g_new0(OnionTraceEventManager, 1);
 
@@ -31,7 +234,21 @@ OnionTraceEventManager* oniontraceeventmanager_new() {
         return NULL;
     }
 
-    manager->watches = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, g_free);
+    manager->watches = g_ptr_array_new_with_free_func(g_free);
+
+    manager->timerHeap = g_ptr_array_new();
+    manager->timers = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    manager->nextTimerID = 1;
+
+    /* all timers are multiplexed onto this one descriptor */
+    manager->timerDescriptor = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(manager->timerDescriptor < 0 ||
+            !oniontraceeventmanager_register(manager, manager->timerDescriptor, ONIONTRACE_EVENT_READ,
+                    (OnionTraceOnEventFunc)_oniontraceeventmanager_onTimerDescriptorReadable, manager)) {
+        critical("Error creating main timer descriptor");
+        oniontraceeventmanager_free(manager);
+        return NULL;
+    }
 
     return manager;
 }
@@ -41,12 +258,36 @@ void oniontraceeventmanager_free(OnionTraceEventManager* manager) {
 
     if(manager->watches) {
         /* this will call g_free on all of the watch objects */
-        g_hash_table_destroy(manager->watches);
+        g_ptr_array_free(manager->watches, TRUE);
+    }
+
+    if(manager->timerHeap) {
+        g_ptr_array_free(manager->timerHeap, TRUE);
+    }
+
+    if(manager->timers) {
+        /* this will call g_free on all of the timer objects */
+        g_hash_table_destroy(manager->timers);
+    }
+
+    if(manager->timerDescriptor > 0) {
+        close(manager->timerDescriptor);
+    }
+
+    if(manager->epollDescriptor > 0) {
+        close(manager->epollDescriptor);
     }
 
     g_free(manager);
 }
 
+static OnionTraceWatch* _oniontraceeventmanager_getWatch(OnionTraceEventManager* manager, gint descriptor) {
+    if(descriptor < 0 || (guint)descriptor >= manager->watches->len) {
+        return NULL;
+    }
+    return g_ptr_array_index(manager->watches, descriptor);
+}
+
 gboolean oniontraceeventmanager_register(OnionTraceEventManager* manager,
         gint descriptor, OnionTraceEventFlag eventType,
         OnionTraceOnEventFunc onEvent, gpointer onEventArg) {
@@ -67,29 +308,35 @@ gboolean oniontraceeventmanager_register(OnionTraceEventManager* manager,
         return FALSE;
     }
 
-    epev.data.fd = descriptor;
-
-    /* if it's already registered, we have to remove it first */
-    if(g_hash_table_lookup(manager->watches, &descriptor) != NULL) {
-        oniontraceeventmanager_deregister(manager, descriptor);
+    OnionTraceWatch* watch = _oniontraceeventmanager_getWatch(manager, descriptor);
+    if(watch == NULL) {
+        if((guint)descriptor >= manager->watches->len) {
+            g_ptr_array_set_size(manager->watches, descriptor + 1);
+        }
+        watch = g_new0(OnionTraceWatch, 1);
+        watch->descriptor = descriptor;
+        g_ptr_array_index(manager->watches, descriptor) = watch;
     }
 
+    epev.data.ptr = watch;
+
+    /* if it's already registered, we only need to change the events epoll watches */
+    gint operation = watch->isRegistered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
     /* tell epoll to watch it */
-    int result = epoll_ctl(manager->epollDescriptor, EPOLL_CTL_ADD, epev.data.fd, &epev);
+    int result = epoll_ctl(manager->epollDescriptor, operation, descriptor, &epev);
     if(result < 0) {
-        warning("epoll_ctl failed to add descriptor %i", descriptor);
+        warning("epoll_ctl failed to %s descriptor %i",
+                operation == EPOLL_CTL_MOD ? "modify" : "add", descriptor);
         return FALSE;
     }
 
     /* now store the variables we need to take action when events occur */
-    OnionTraceWatch* watch = g_new0(OnionTraceWatch, 1);
-    watch->descriptor = descriptor;
+    watch->isRegistered = TRUE;
     watch->type = eventType;
     watch->onEvent = onEvent;
     watch->onEventArg = onEventArg;
 
-    g_hash_table_replace(manager->watches, &(watch->descriptor), watch);
-
     /* successfully registered */
     return TRUE;
 }
@@ -98,8 +345,8 @@ gboolean oniontraceeventmanager_deregister(OnionTraceEventManager* manager, gint
     g_assert(manager);
 
     /* de-register the epoll descriptor */
-    OnionTraceWatch* watch = g_hash_table_lookup(manager->watches, &descriptor);
-    if(watch == NULL) {
+    OnionTraceWatch* watch = _oniontraceeventmanager_getWatch(manager, descriptor);
+    if(watch == NULL || !watch->isRegistered) {
         /* couldn't find a registered watch, so nothing was deregistered */
         return FALSE;
     }
@@ -107,23 +354,28 @@ gboolean oniontraceeventmanager_deregister(OnionTraceEventManager* manager, gint
     struct epoll_event epev;
     memset(&epev, 0, sizeof(struct epoll_event));
 
-    epev.data.fd = descriptor;
-
-    int result = epoll_ctl(manager->epollDescriptor, EPOLL_CTL_DEL, epev.data.fd, &epev);
+    int result = epoll_ctl(manager->epollDescriptor, EPOLL_CTL_DEL, descriptor, &epev);
     if(result < 0) {
         warning("epoll_ctl failed to delete descriptor %i", descriptor);
         return FALSE;
     }
 
-    /* this will call g_free on the watch object */
-    g_hash_table_remove(manager->watches, &descriptor);
+    /* keep the watch object for reuse, but invalidate any pending events for it */
+    watch->isRegistered = FALSE;
+    watch->generation++;
+    watch->onEvent = NULL;
+    watch->onEventArg = NULL;
 
     /* successfully deregistered */
     return TRUE;
 }
 
-static void _oniontraceventmanager_processEvent(OnionTraceEventManager* manager, gint descriptor, OnionTraceEventFlag event) {
+static void _oniontraceventmanager_processEvent(OnionTraceEventManager* manager,
+        OnionTraceWatch* watch, guint generation, OnionTraceEventFlag event) {
     g_assert(manager);
+    g_assert(watch);
+
+    gint descriptor = watch->descriptor;
 
     debug("started processing event %s for descriptor %i",
             (event == ONIONTRACE_EVENT_READ) ? "READ" :
@@ -131,9 +383,8 @@ static void _oniontraceventmanager_processEvent(OnionTraceEventManager* manager,
             (event == (ONIONTRACE_EVENT_READ|ONIONTRACE_EVENT_WRITE)) ? "READ|WRITE" :
             "NONE", descriptor);
 
-    OnionTraceWatch* watch = g_hash_table_lookup(manager->watches, &descriptor);
-    if(watch == NULL) {
-        /* couldn't find a registered watch, so nothing was deregistered */
+    if(!watch->isRegistered || watch->generation != generation) {
+        /* the descriptor was deregistered by an earlier callback in this batch */
         warning("missing watch object to handle event %s for descriptor %i",
                     (event == ONIONTRACE_EVENT_READ) ? "READ" :
                     (event == ONIONTRACE_EVENT_WRITE) ? "WRITE" :
@@ -155,26 +406,94 @@ static void _oniontraceventmanager_processEvent(OnionTraceEventManager* manager,
                 "NONE", descriptor);
 }
 
+guint64 oniontraceeventmanager_addTimer(OnionTraceEventManager* manager,
+        const struct timespec* delay, const struct timespec* period,
+        GFunc func, gpointer arg1, gpointer arg2) {
+    g_assert(manager);
+
+    OnionTraceTimerEntry* timer = g_new0(OnionTraceTimerEntry, 1);
+    timer->id = manager->nextTimerID++;
+    timer->period = _oniontraceeventmanager_timespecToNanos(period);
+    timer->func = func;
+    timer->arg1 = arg1;
+    timer->arg2 = arg2;
+
+    /* a zero delay runs the timer as close to now as possible */
+    guint64 delayNanos = _oniontraceeventmanager_timespecToNanos(delay);
+    timer->expireTime = _oniontraceeventmanager_getNowNanos() + MAX(delayNanos, 1);
+
+    g_hash_table_replace(manager->timers, &timer->id, timer);
+    _oniontraceeventmanager_heapPush(manager, timer);
+
+    /* rearm if this is now the earliest timer, unless we are running timers
+     * right now, in which case we rearm once they are done */
+    if(!manager->timerFiring) {
+        _oniontraceeventmanager_armTimerDescriptor(manager);
+    }
+
+    return timer->id;
+}
+
+gboolean oniontraceeventmanager_cancelTimer(OnionTraceEventManager* manager, guint64 timerID) {
+    g_assert(manager);
+
+    OnionTraceTimerEntry* timer = g_hash_table_lookup(manager->timers, &timerID);
+    if(timer == NULL || timer->isCancelled) {
+        /* the timer already expired or was cancelled */
+        return FALSE;
+    }
+
+    if(timer == manager->timerFiring) {
+        /* it is not in the heap while its callback runs; it will be freed
+         * once the callback returns */
+        timer->isCancelled = TRUE;
+        return TRUE;
+    }
+
+    _oniontraceeventmanager_heapRemove(manager, timer);
+
+    /* this will call g_free on the timer object */
+    g_hash_table_remove(manager->timers, &timerID);
+
+    if(!manager->timerFiring) {
+        _oniontraceeventmanager_armTimerDescriptor(manager);
+    }
+
+    return TRUE;
+}
+
 gboolean oniontraceeventmanager_runMainLoop(OnionTraceEventManager* manager) {
     g_assert(manager);
 
     /* main loop - wait for events from the descriptors */
     struct epoll_event events[100];
+    guint generations[100];
     gint nReadyFDs;
     message("entering main loop to watch descriptors");
 
     while(1) {
         /* wait for some events */
         debug("waiting for events");
+
+        /* write out everything we logged before we might block for a while */
+        oniontrace_flushLog();
+
         nReadyFDs = epoll_wait(manager->epollDescriptor, events, 100, -1);
         if(nReadyFDs == -1) {
             critical("Error in client epoll_wait in main loop");
             return FALSE;
         }
 
+        /* remember which registration each event belongs to before any callback
+         * gets a chance to deregister or reuse a descriptor */
+        for(gint i = 0; i < nReadyFDs; i++) {
+            OnionTraceWatch* watch = events[i].data.ptr;
+            generations[i] = watch->generation;
+        }
+
         /* process every descriptor that's ready */
         for(gint i = 0; i < nReadyFDs; i++) {
-            gint descriptor = events[i].data.fd;
+            OnionTraceWatch* watch = events[i].data.ptr;
 
             OnionTraceEventFlag eventFlag = ONIONTRACE_EVENT_NONE;
             if(events[i].events & EPOLLIN) {
@@ -184,7 +503,7 @@ gboolean oniontraceeventmanager_runMainLoop(OnionTraceEventManager* manager) {
                 eventFlag |= ONIONTRACE_EVENT_WRITE;
             }
 
-            _oniontraceventmanager_processEvent(manager, descriptor, eventFlag);
+            _oniontraceventmanager_processEvent(manager, watch, generations[i], eventFlag);
         }
 
         /* break out if done */
@@ -202,3 +521,20 @@ void oniontraceeventmanager_stopMainLoop(OnionTraceEventManager* manager) {
 
     manager->shouldStopLoop = TRUE;
 }
+
+void oniontraceeventmanager_hold(OnionTraceEventManager* manager) {
+    g_assert(manager);
+
+    manager->numHolds++;
+}
+
+void oniontraceeventmanager_release(OnionTraceEventManager* manager) {
+    g_assert(manager);
+    g_assert(manager->numHolds > 0);
+
+    manager->numHolds--;
+    if(manager->numHolds == 0) {
+        info("no client needs the main loop anymore, stopping it");
+        oniontraceeventmanager_stopMainLoop(manager);
+    }
+}
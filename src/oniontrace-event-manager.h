@@ -5,6 +5,8 @@
 #ifndef SRC_ONIONTRACE_EVENT_MANAGER_H_
 #define SRC_ONIONTRACE_EVENT_MANAGER_H_
 
+#include <time.h>
+
 #include <glib.h>
 
 typedef enum _OnionTraceEventFlag OnionTraceEventFlag;
@@ -41,6 +43,19 @@ gboolean oniontraceeventmanager_register(OnionTraceEventManager* manager,
  * returns TRUE if the descriptor was previously registered, FALSE otherwise. */
 gboolean oniontraceeventmanager_deregister(OnionTraceEventManager* manager, gint descriptor);
 
+/* schedules func(arg1, arg2) to be called from the main loop once the given
+ * delay elapses, and then repeatedly every period if period is non-NULL and
+ * non-zero. all timers share a single descriptor.
+ * returns an id that can be passed to cancelTimer(); ids are never 0. */
+guint64 oniontraceeventmanager_addTimer(OnionTraceEventManager* manager,
+        const struct timespec* delay, const struct timespec* period,
+        GFunc func, gpointer arg1, gpointer arg2);
+
+/* stops a timer previously scheduled with addTimer() from running again. this
+ * is safe to call from within any timer callback, including the timer's own.
+ * returns TRUE if the timer was pending, FALSE if it already ran or was cancelled. */
+gboolean oniontraceeventmanager_cancelTimer(OnionTraceEventManager* manager, guint64 timerID);
+
 /* instructs the event manager to start waiting for events from all registered descriptors.
  * when events occur, the registered callback functions will be executed. */
 gboolean oniontraceeventmanager_runMainLoop(OnionTraceEventManager* manager);
@@ -49,4 +64,9 @@ gboolean oniontraceeventmanager_runMainLoop(OnionTraceEventManager* manager);
  * this will probably stop the program. */
 void oniontraceeventmanager_stopMainLoop(OnionTraceEventManager* manager);
 
+/* a client, such as a driver, holds the main loop while it can still make
+ * progress. once every client that held it released it again, the main loop stops. */
+void oniontraceeventmanager_hold(OnionTraceEventManager* manager);
+void oniontraceeventmanager_release(OnionTraceEventManager* manager);
+
 #endif /* SRC_ONIONTRACE_EVENT_MANAGER_H_ */
@@ -10,158 +10,259 @@ enum _OnionTraceFileMode {
     ONIONTRACE_FILE_WRITE,
 };
 
+/* default size of the write buffer, which also is the default flush threshold */
+#define ONIONTRACE_FILE_WRITE_BUFFER_SIZE 65536
+
 struct _OnionTraceFile {
-    FILE* stream;
     OnionTraceFileMode mode;
+
+    /* writers collect records in the buffer and write it out in one call
+     * once one of the flush thresholds is reached, or when flushed explicitly */
+    gint descriptor;
+    GString* writeBuffer;
+    guint numPendingRecords;
+    gsize flushBytes;
+    guint flushRecords;
+
+    /* readers map the whole file and parse records directly from the mapping,
+     * so player processes reading the same file share its page cache */
+    gchar* map;
+    gsize mapSize;
+    gsize readOffset;
 };
 
 OnionTraceFile* oniontracefile_newWriter(const gchar* filename) {
-    FILE* stream = fopen(filename, "w");
-    if(!stream) {
+    gint descriptor = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if(descriptor < 0) {
         warning("Failed to open tracefile for writing using path %s: error %i, %s",
                 filename, errno, g_strerror(errno));
         return NULL;
     }
 
     OnionTraceFile* file = g_new0(OnionTraceFile, 1);
-    file->stream = stream;
+    file->descriptor = descriptor;
     file->mode = ONIONTRACE_FILE_WRITE;
+    file->writeBuffer = g_string_sized_new(ONIONTRACE_FILE_WRITE_BUFFER_SIZE);
+    file->flushBytes = ONIONTRACE_FILE_WRITE_BUFFER_SIZE;
     return file;
 }
 
 OnionTraceFile* oniontracefile_newReader(const gchar* filename) {
-    FILE* stream = fopen(filename, "r");
-    if(!stream) {
+    gint descriptor = open(filename, O_RDONLY);
+    if(descriptor < 0) {
         warning("Failed to open tracefile for reading using path %s: error %i, %s",
                 filename, errno, g_strerror(errno));
         return NULL;
     }
 
+    struct stat fileStat;
+    if(fstat(descriptor, &fileStat) < 0) {
+        warning("Failed to stat tracefile using path %s: error %i, %s",
+                filename, errno, g_strerror(errno));
+        close(descriptor);
+        return NULL;
+    }
+
     OnionTraceFile* file = g_new0(OnionTraceFile, 1);
-    file->stream = stream;
+    file->descriptor = -1;
     file->mode = ONIONTRACE_FILE_READ;
+    file->mapSize = (gsize)fileStat.st_size;
+
+    /* an empty file can't be mapped, but it also has nothing to read */
+    if(file->mapSize > 0) {
+        file->map = mmap(NULL, file->mapSize, PROT_READ, MAP_PRIVATE, descriptor, 0);
+
+        if(file->map == MAP_FAILED) {
+            warning("Failed to map tracefile using path %s: error %i, %s",
+                    filename, errno, g_strerror(errno));
+            close(descriptor);
+            g_free(file);
+            return NULL;
+        }
+
+        /* we read the file from front to back */
+        madvise(file->map, file->mapSize, MADV_SEQUENTIAL);
+    }
+
+    /* the mapping stays valid after closing the descriptor */
+    close(descriptor);
+
     return file;
 }
 
 void oniontracefile_free(OnionTraceFile* otfile) {
     g_assert(otfile);
-    if(otfile->stream) {
-        fclose(otfile->stream);
+    if(otfile->writeBuffer) {
+        /* make sure we don't lose any buffered records */
+        oniontracefile_flush(otfile);
+        g_string_free(otfile->writeBuffer, TRUE);
+    }
+    if(otfile->descriptor >= 0) {
+        close(otfile->descriptor);
+    }
+    if(otfile->map) {
+        munmap(otfile->map, otfile->mapSize);
     }
     g_free(otfile);
 }
 
-gboolean oniontracefile_writeCircuit(OnionTraceFile* otfile, OnionTraceCircuit* circuit, struct timespec* offset) {
+/* a threshold of 0 disables flushing by that criterion */
+void oniontracefile_setFlushPolicy(OnionTraceFile* otfile, gsize flushBytes, guint flushRecords) {
     g_assert(otfile);
+    otfile->flushBytes = flushBytes;
+    otfile->flushRecords = flushRecords;
+}
 
-    if(!circuit || otfile->mode != ONIONTRACE_FILE_WRITE) {
+/* writes all buffered records to the file */
+gboolean oniontracefile_flush(OnionTraceFile* otfile) {
+    g_assert(otfile);
+
+    if(otfile->mode != ONIONTRACE_FILE_WRITE) {
         return FALSE;
     }
 
-    GString* line = oniontracecircuit_toCSV(circuit, offset);
+    gsize offset = 0;
+    while(offset < otfile->writeBuffer->len) {
+        gssize bytes = write(otfile->descriptor, &otfile->writeBuffer->str[offset],
+                otfile->writeBuffer->len - offset);
+
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            warning("Failed to write %"G_GSIZE_FORMAT" bytes to tracefile: error %i, %s",
+                    otfile->writeBuffer->len - offset, errno, g_strerror(errno));
+            break;
+        }
 
-    if(line) {
-        /* write it to the file */
-        fwrite(line->str, 1, line->len, otfile->stream);
-        fflush(otfile->stream);
+        offset += (gsize)bytes;
     }
 
-    g_string_free(line, TRUE);
+    gboolean success = (offset == otfile->writeBuffer->len);
+
+    /* on error, we drop the records rather than growing the buffer forever */
+    g_string_truncate(otfile->writeBuffer, 0);
+    otfile->numPendingRecords = 0;
+
+    return success;
+}
+
+gsize oniontracefile_getPendingBytes(OnionTraceFile* otfile) {
+    g_assert(otfile);
+    return otfile->writeBuffer ? otfile->writeBuffer->len : 0;
+}
+
+/* returns the buffer that the caller appends the next record to. the caller
+ * must call oniontracefile_endRecord once the record is complete. */
+GString* oniontracefile_beginRecord(OnionTraceFile* otfile) {
+    g_assert(otfile);
+    g_assert(otfile->mode == ONIONTRACE_FILE_WRITE);
+    return otfile->writeBuffer;
+}
+
+/* counts the record appended to the write buffer, and flushes if needed */
+gboolean oniontracefile_endRecord(OnionTraceFile* otfile) {
+    g_assert(otfile);
+
+    otfile->numPendingRecords++;
+
+    if((otfile->flushBytes > 0 && otfile->writeBuffer->len >= otfile->flushBytes) ||
+            (otfile->flushRecords > 0 && otfile->numPendingRecords >= otfile->flushRecords)) {
+        return oniontracefile_flush(otfile);
+    }
 
     return TRUE;
 }
 
-static GQueue* _oniontracefile_getLines(OnionTraceFile* otfile) {
-    GQueue* lineQueue = g_queue_new();
+gboolean oniontracefile_writeCircuit(OnionTraceFile* otfile, OnionTraceCircuit* circuit, struct timespec* offset) {
+    g_assert(otfile);
 
-    gchar recvbuf[1024];
-    gchar* partialLastLine = NULL;
+    if(!circuit || otfile->mode != ONIONTRACE_FILE_WRITE) {
+        return FALSE;
+    }
 
-    while(TRUE) {
-        memset(recvbuf, 0, 1024);
-        size_t n_bytes = fread(recvbuf, 1, 1023, otfile->stream);
-        if(n_bytes < 1) {
-            break;
-        }
+    /* format the record directly into the write buffer */
+    oniontracecircuit_toCSV(circuit, offset, oniontracefile_beginRecord(otfile));
+    return oniontracefile_endRecord(otfile);
+}
 
-        gboolean lastIsPartial = (recvbuf[n_bytes-1] != '\n') ? TRUE : FALSE;
+/* finds the next non-empty line in the mapping, without its line ending.
+ * returns FALSE once we reached the end of the file. */
+static gboolean _oniontracefile_nextLine(OnionTraceFile* otfile, const gchar** line, gsize* length) {
+    while(otfile->readOffset < otfile->mapSize) {
+        const gchar* start = otfile->map + otfile->readOffset;
+        gsize remaining = otfile->mapSize - otfile->readOffset;
 
-        gchar** lines = g_strsplit(recvbuf, "\n", 0);
+        const gchar* newline = memchr(start, '\n', remaining);
+        gsize lineLength = newline ? (gsize)(newline - start) : remaining;
 
-        for(gint i = 0; lines[i] != NULL; i++) {
-            /* ignore empty lines */
-            if(!g_ascii_strcasecmp(lines[i], "")) {
-                continue;
-            }
+        /* the next line starts after the newline; the last line may not have one */
+        otfile->readOffset += newline ? lineLength + 1 : lineLength;
 
-            /* need to check if we have a \n if this is the last line */
-            if(lines[i+1] == NULL && lastIsPartial) {
-                partialLastLine = g_strdup(lines[i]);
-            } else {
-                /* if this is the first line and we have a partial line waiting, append them */
-                if(i == 0 && partialLastLine) {
-                    GString* string = g_string_new("");
-                    g_string_append_printf(string, "%s%s", partialLastLine, lines[i]);
-                    g_queue_push_tail(lineQueue, g_string_free(string, FALSE));
-                    g_free(partialLastLine);
-                    partialLastLine = NULL;
-                } else {
-                    /* take the full line as it is */
-                    g_queue_push_tail(lineQueue, g_strdup(lines[i]));
-                }
-            }
+        if(lineLength > 0 && start[lineLength-1] == '\r') {
+            lineLength--;
         }
 
-        g_strfreev(lines);
+        /* ignore empty lines */
+        if(lineLength > 0) {
+            *line = start;
+            *length = lineLength;
+            return TRUE;
+        }
     }
 
-    return lineQueue;
+    return FALSE;
 }
 
-/* returns a queue of OnionTraceCircuit* objects sorted by launch time */
-GQueue* oniontracefile_parseCircuits(OnionTraceFile* otfile, struct timespec* offset) {
+/* returns the next circuit in the file, or NULL once the end of the file is reached.
+ * unlike parseCircuits(), this does not sort. */
+OnionTraceCircuit* oniontracefile_readCircuit(OnionTraceFile* otfile, struct timespec* offset) {
     g_assert(otfile);
 
     if(otfile->mode != ONIONTRACE_FILE_READ) {
         return NULL;
     }
 
-    /* reset the file position to the beginning if needed */
-    glong pos = ftell(otfile->stream);
-    if(pos < 0) {
-        warning("Unable to get position of trace file: error %i: %s", errno, g_strerror(errno));
-        return NULL;
-    }
+    const gchar* line = NULL;
+    gsize length = 0;
 
-    if(pos > 0) {
-        rewind(otfile->stream);
+    while(_oniontracefile_nextLine(otfile, &line, &length)) {
+        debug("importing line from trace file: %.*s", (gint)length, line);
+
+        OnionTraceCircuit* circuit = oniontracecircuit_fromCSV(line, length, offset);
+        if(circuit) {
+            return circuit;
+        }
     }
 
-    /* build a sorted queue of circuits */
-    GQueue* circuits = g_queue_new();
+    return NULL;
+}
 
-    /* helper to get the file contents as a queue of lines */
-    GQueue* lines = _oniontracefile_getLines(otfile);
+static gint _oniontracefile_compareCircuitPointers(gconstpointer a, gconstpointer b) {
+    return oniontracecircuit_compareLaunchTime(*(OnionTraceCircuit**)a, *(OnionTraceCircuit**)b, NULL);
+}
 
-    /* now start parsing */
-    while(!g_queue_is_empty(lines)) {
-        gchar* line = g_queue_pop_head(lines);
+/* returns an array of OnionTraceCircuit* objects sorted by launch time */
+GPtrArray* oniontracefile_parseCircuits(OnionTraceFile* otfile, struct timespec* offset) {
+    g_assert(otfile);
 
-        info("importing line from trace file: %s", line);
+    if(otfile->mode != ONIONTRACE_FILE_READ) {
+        return NULL;
+    }
 
-        /* parse the line into a circuit object */
-        OnionTraceCircuit* circuit = oniontracecircuit_fromCSV(line, offset);
+    /* start from the beginning of the file */
+    otfile->readOffset = 0;
 
-        /* if parsing succeeded, store the circuits in chronological order */
-        if(circuit) {
-            g_queue_insert_sorted(circuits, circuit,
-                    (GCompareDataFunc)oniontracecircuit_compareLaunchTime, NULL);
-        }
+    /* collect the circuits in file order, then sort them once at the end */
+    GPtrArray* circuits = g_ptr_array_new();
 
-        g_free(line);
+    OnionTraceCircuit* circuit = NULL;
+    while((circuit = oniontracefile_readCircuit(otfile, offset)) != NULL) {
+        g_ptr_array_add(circuits, circuit);
     }
 
-    g_queue_free(lines);
+    /* this sort is stable, so circuits with equal launch times keep their file order */
+    g_ptr_array_sort(circuits, _oniontracefile_compareCircuitPointers);
 
     return circuits;
 }
@@ -14,7 +14,13 @@ OnionTraceFile* oniontracefile_newWriter(const gchar* filename);
 OnionTraceFile* oniontracefile_newReader(const gchar* filename);
 void oniontracefile_free(OnionTraceFile* otfile);
 
+void oniontracefile_setFlushPolicy(OnionTraceFile* otfile, gsize flushBytes, guint flushRecords);
+GString* oniontracefile_beginRecord(OnionTraceFile* otfile);
+gboolean oniontracefile_endRecord(OnionTraceFile* otfile);
 gboolean oniontracefile_writeCircuit(OnionTraceFile* otfile, OnionTraceCircuit* circuit, struct timespec* offset);
-GQueue* oniontracefile_parseCircuits(OnionTraceFile* otfile, struct timespec* offset);
+gboolean oniontracefile_flush(OnionTraceFile* otfile);
+gsize oniontracefile_getPendingBytes(OnionTraceFile* otfile);
+GPtrArray* oniontracefile_parseCircuits(OnionTraceFile* otfile, struct timespec* offset);
+OnionTraceCircuit* oniontracefile_readCircuit(OnionTraceFile* otfile, struct timespec* offset);
 
 #endif /* SRC_ONIONTRACE_FILE_H_ */
@@ -0,0 +1,139 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "oniontrace.h"
+
+/* values below 2^HISTOGRAM_SUB_BITS get their own bucket. larger values are
+ * grouped by their highest set bit, and each such power-of-two range is split
+ * into 2^HISTOGRAM_SUB_BITS equal buckets. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NUM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (64 - HISTOGRAM_SUB_BITS + 1))
+
+struct _OnionTraceHistogram {
+    guint64 counts[HISTOGRAM_NUM_BUCKETS];
+    guint64 count;
+    guint64 min;
+    guint64 max;
+    /* running mean and sum of squared differences (Welford's method) */
+    gdouble mean;
+    gdouble m2;
+};
+
+static guint _oniontracehistogram_getBucket(guint64 value) {
+    if(value < HISTOGRAM_SUB_BUCKETS) {
+        return (guint)value;
+    }
+
+    guint highBit = 63 - (guint)__builtin_clzll(value);
+    guint shift = highBit - HISTOGRAM_SUB_BITS;
+    guint sub = (guint)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+
+    return HISTOGRAM_SUB_BUCKETS + (shift * HISTOGRAM_SUB_BUCKETS) + sub;
+}
+
+/* returns the middle of the range of values that fall into the bucket */
+static guint64 _oniontracehistogram_getBucketValue(guint bucket) {
+    if(bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    guint shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    guint64 sub = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    guint64 lower = (HISTOGRAM_SUB_BUCKETS | sub) << shift;
+
+    return lower + (((guint64)1 << shift) / 2);
+}
+
+OnionTraceHistogram* oniontracehistogram_new() {
+    OnionTraceHistogram* histogram = g_new0(OnionTraceHistogram, 1);
+    return histogram;
+}
+
+void oniontracehistogram_free(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    g_free(histogram);
+}
+
+void oniontracehistogram_add(OnionTraceHistogram* histogram, guint64 value) {
+    g_assert(histogram);
+
+    histogram->counts[_oniontracehistogram_getBucket(value)]++;
+
+    if(histogram->count == 0 || value < histogram->min) {
+        histogram->min = value;
+    }
+    if(histogram->count == 0 || value > histogram->max) {
+        histogram->max = value;
+    }
+
+    histogram->count++;
+
+    gdouble delta = (gdouble)value - histogram->mean;
+    histogram->mean += delta / (gdouble)histogram->count;
+    histogram->m2 += delta * ((gdouble)value - histogram->mean);
+}
+
+guint64 oniontracehistogram_getCount(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    return histogram->count;
+}
+
+guint64 oniontracehistogram_getMin(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    return histogram->min;
+}
+
+guint64 oniontracehistogram_getMax(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    return histogram->max;
+}
+
+gdouble oniontracehistogram_getMean(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    return histogram->mean;
+}
+
+/* the population standard deviation, like numpy.std() */
+gdouble oniontracehistogram_getStdDev(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    if(histogram->count == 0) {
+        return 0.0;
+    }
+    return sqrt(histogram->m2 / (gdouble)histogram->count);
+}
+
+/* returns an estimate of the value at the given quantile in [0, 1] */
+guint64 oniontracehistogram_getQuantile(OnionTraceHistogram* histogram, gdouble quantile) {
+    g_assert(histogram);
+
+    if(histogram->count == 0) {
+        return 0;
+    }
+
+    quantile = CLAMP(quantile, 0.0, 1.0);
+    guint64 rank = (guint64)(quantile * (gdouble)(histogram->count - 1));
+    guint64 seen = 0;
+
+    for(guint i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if(seen > rank) {
+            guint64 value = _oniontracehistogram_getBucketValue(i);
+            return CLAMP(value, histogram->min, histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
+
+/* returns a newly allocated string like 'count=10 min=1 p50=4 p90=8 p99=9 max=9 mean=4.5' */
+gchar* oniontracehistogram_toString(OnionTraceHistogram* histogram) {
+    g_assert(histogram);
+    return g_strdup_printf("count=%"G_GUINT64_FORMAT" min=%"G_GUINT64_FORMAT" p50=%"G_GUINT64_FORMAT
+            " p90=%"G_GUINT64_FORMAT" p99=%"G_GUINT64_FORMAT" max=%"G_GUINT64_FORMAT" mean=%.1f",
+            histogram->count, oniontracehistogram_getMin(histogram),
+            oniontracehistogram_getQuantile(histogram, 0.5), oniontracehistogram_getQuantile(histogram, 0.9),
+            oniontracehistogram_getQuantile(histogram, 0.99), oniontracehistogram_getMax(histogram),
+            oniontracehistogram_getMean(histogram));
+}
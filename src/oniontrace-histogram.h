@@ -0,0 +1,29 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef SRC_ONIONTRACE_HISTOGRAM_H_
+#define SRC_ONIONTRACE_HISTOGRAM_H_
+
+#include <glib.h>
+
+/* a fixed-size log-linear histogram for summarizing a stream of values
+ * without storing them. min, max, mean, and standard deviation are exact,
+ * while quantiles are accurate to within about 3% of the value. */
+typedef struct _OnionTraceHistogram OnionTraceHistogram;
+
+OnionTraceHistogram* oniontracehistogram_new();
+void oniontracehistogram_free(OnionTraceHistogram* histogram);
+
+void oniontracehistogram_add(OnionTraceHistogram* histogram, guint64 value);
+
+guint64 oniontracehistogram_getCount(OnionTraceHistogram* histogram);
+guint64 oniontracehistogram_getMin(OnionTraceHistogram* histogram);
+guint64 oniontracehistogram_getMax(OnionTraceHistogram* histogram);
+gdouble oniontracehistogram_getMean(OnionTraceHistogram* histogram);
+gdouble oniontracehistogram_getStdDev(OnionTraceHistogram* histogram);
+guint64 oniontracehistogram_getQuantile(OnionTraceHistogram* histogram, gdouble quantile);
+
+gchar* oniontracehistogram_toString(OnionTraceHistogram* histogram);
+
+#endif /* SRC_ONIONTRACE_HISTOGRAM_H_ */
@@ -5,6 +5,57 @@
 
 #include "oniontrace.h"
 
+/* the structured output formats write one record per BW, CIRC, and STREAM event.
+ * every record carries the CLOCK_MONOTONIC time in nanoseconds at which we
+ * received the event, and the first record is a START record that maps the
+ * monotonic clock to the unix time.
+ *
+ * in the binary format, all integers are little-endian and each record is:
+ *   u32 length of the rest of the record, u8 type, u64 monotonic ns, fields...
+ * where strings are written as a u16 length followed by the bytes. the fields are:
+ *   START:  u32 version, u64 unix ns
+ *   BW:     u64 bytes read, u64 bytes written
+ *   CIRC:   u32 circuit id, u8 CircuitStatus, i64 TIME_CREATED unix us (0 if unknown),
+ *           str path, str PURPOSE, str REASON
+ *   STREAM: u32 stream id, u8 StreamStatus, u32 circuit id, str target, str REASON
+ *
+ * the jsonl format writes the same fields as one JSON object per line, with the
+ * status as given by tor and absent strings left out. */
+#define ONIONTRACE_LOGGER_FORMAT_VERSION 1
+
+typedef enum _OnionTraceLoggerRecordType OnionTraceLoggerRecordType;
+enum _OnionTraceLoggerRecordType {
+    ONIONTRACE_LOGGER_RECORD_START,
+    ONIONTRACE_LOGGER_RECORD_BW,
+    ONIONTRACE_LOGGER_RECORD_CIRC,
+    ONIONTRACE_LOGGER_RECORD_STREAM,
+};
+
+/* running totals for the periodic summaries, which use the same keys as the
+ * bandwidth_summary and circuit_summary in oniontracetools analysis results */
+typedef struct _OnionTraceLoggerSummary {
+    /* BW events are summed per second of wall clock time, like the analysis does */
+    gint64 currentSecond;
+    guint64 currentBytesRead;
+    guint64 currentBytesWritten;
+    guint64 bytesReadTotal;
+    guint64 bytesWrittenTotal;
+    OnionTraceHistogram* bytesRead;
+    OnionTraceHistogram* bytesWritten;
+
+    /* build and fail times in microseconds, from TIME_CREATED until the event */
+    OnionTraceHistogram* buildTimes;
+    OnionTraceHistogram* failTimes;
+    guint64 circuitsBuilt;
+    guint64 cannibalizedCircuitsBuilt;
+    /* failure reason string to count */
+    GHashTable* circuitsFailed;
+    GHashTable* cannibalizedCircuitsFailed;
+    /* ids of open circuits we saw get built or fail; later events for them are from
+     * cannibalization. ids are removed when the circuit closes. */
+    GHashTable* circuitIDsBuilt;
+} OnionTraceLoggerSummary;
+
 struct _OnionTraceLogger {
     /* objects we don't own */
     OnionTraceTorCtl* torctl;
@@ -13,14 +64,477 @@ struct _OnionTraceLogger {
     gchar* id;
     struct timespec startTime;
 
+    OnionTraceOutputFormat format;
+    /* the structured records go here, or the text lines when tracing several instances */
+    OnionTraceFile* outputFile;
+
+    /* NULL unless we aggregate events into summaries */
+    OnionTraceLoggerSummary* summary;
+    /* don't log the raw lines of events that go into the summary */
+    gboolean summaryOnly;
+
     gsize messagesLogged;
+    gsize recordsWritten;
+    /* every line we got from tor, whether or not we logged it */
+    gsize linesReceived;
 };
 
-void _oniontracelogger_logControlLine(OnionTraceLogger* logger, gchar* line) {
+static guint64 _oniontracelogger_tokenToUInt64(TorCtlToken* token) {
+    guint64 value = 0;
+    if(token) {
+        for(gsize i = 0; i < token->len && g_ascii_isdigit(token->str[i]); i++) {
+            value = (value * 10) + (guint64)(token->str[i] - '0');
+        }
+    }
+    return value;
+}
+
+/* converts a TIME_CREATED value like 2019-01-01T00:00:00.123456 to unix microseconds */
+static gint64 _oniontracelogger_parseTimeCreated(TorCtlToken* token) {
+    if(!token || token->len < 19) {
+        return 0;
+    }
+
+    /* the token is followed by a space or the end of the line, so sscanf stops there */
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+    gint consumed = 0;
+    if(sscanf(token->str, "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+            &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6) {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    gint64 micros = (gint64)timegm(&tm) * 1000000;
+
+    if((gsize)consumed < token->len && token->str[consumed] == '.') {
+        gint64 scale = 100000;
+        for(gsize i = (gsize)consumed + 1; i < token->len && g_ascii_isdigit(token->str[i]) && scale > 0; i++) {
+            micros += (token->str[i] - '0') * scale;
+            scale /= 10;
+        }
+    }
+
+    return micros;
+}
+
+static void _oniontracelogger_appendU8(GString* buffer, guint8 value) {
+    g_string_append_c(buffer, (gchar)value);
+}
+
+static void _oniontracelogger_appendU32(GString* buffer, guint32 value) {
+    value = GUINT32_TO_LE(value);
+    g_string_append_len(buffer, (const gchar*)&value, sizeof(value));
+}
+
+static void _oniontracelogger_appendU64(GString* buffer, guint64 value) {
+    value = GUINT64_TO_LE(value);
+    g_string_append_len(buffer, (const gchar*)&value, sizeof(value));
+}
+
+static void _oniontracelogger_appendString(GString* buffer, TorCtlToken* token) {
+    guint16 len = token ? (guint16)MIN(token->len, G_MAXUINT16) : 0;
+    guint16 value = GUINT16_TO_LE(len);
+    g_string_append_len(buffer, (const gchar*)&value, sizeof(value));
+    if(len > 0) {
+        g_string_append_len(buffer, token->str, len);
+    }
+}
+
+/* appends the record header and returns the offset of the length to patch when done */
+static gsize _oniontracelogger_beginBinaryRecord(GString* buffer,
+        OnionTraceLoggerRecordType type, guint64 timestamp) {
+    gsize lengthOffset = buffer->len;
+    _oniontracelogger_appendU32(buffer, 0);
+    _oniontracelogger_appendU8(buffer, (guint8)type);
+    _oniontracelogger_appendU64(buffer, timestamp);
+    return lengthOffset;
+}
+
+static void _oniontracelogger_endBinaryRecord(GString* buffer, gsize lengthOffset) {
+    guint32 length = GUINT32_TO_LE((guint32)(buffer->len - lengthOffset - sizeof(guint32)));
+    memcpy(&buffer->str[lengthOffset], &length, sizeof(length));
+}
+
+static void _oniontracelogger_appendJSONString(GString* buffer, const gchar* name, TorCtlToken* token) {
+    if(!token) {
+        return;
+    }
+
+    g_string_append_printf(buffer, ",\"%s\":\"", name);
+    for(gsize i = 0; i < token->len; i++) {
+        guchar c = (guchar)token->str[i];
+        if(c == '"' || c == '\\') {
+            g_string_append_c(buffer, '\\');
+            g_string_append_c(buffer, (gchar)c);
+        } else if(c < 0x20) {
+            g_string_append_printf(buffer, "\\u%04x", c);
+        } else {
+            g_string_append_c(buffer, (gchar)c);
+        }
+    }
+    g_string_append_c(buffer, '"');
+}
+
+static void _oniontracelogger_beginJSONRecord(GString* buffer, const gchar* type, guint64 timestamp) {
+    g_string_append_printf(buffer, "{\"type\":\"%s\",\"ts\":%"G_GUINT64_FORMAT, type, timestamp);
+}
+
+static void _oniontracelogger_writeStartRecord(OnionTraceLogger* logger) {
+    guint64 timestamp = oniontracetimer_getMonotonicNanos();
+    guint64 unixNanos = ((guint64)logger->startTime.tv_sec * 1000000000UL) + (guint64)logger->startTime.tv_nsec;
+
+    GString* buffer = oniontracefile_beginRecord(logger->outputFile);
+
+    if(logger->format == ONIONTRACE_OUTPUT_BINARY) {
+        gsize lengthOffset = _oniontracelogger_beginBinaryRecord(buffer, ONIONTRACE_LOGGER_RECORD_START, timestamp);
+        _oniontracelogger_appendU32(buffer, ONIONTRACE_LOGGER_FORMAT_VERSION);
+        _oniontracelogger_appendU64(buffer, unixNanos);
+        _oniontracelogger_endBinaryRecord(buffer, lengthOffset);
+    } else {
+        _oniontracelogger_beginJSONRecord(buffer, "START", timestamp);
+        g_string_append_printf(buffer, ",\"version\":%i,\"unix_ns\":%"G_GUINT64_FORMAT"}\n",
+                ONIONTRACE_LOGGER_FORMAT_VERSION, unixNanos);
+    }
+
+    oniontracefile_endRecord(logger->outputFile);
+    logger->recordsWritten++;
+}
+
+/* returns the record type of BW, CIRC, and STREAM events, or START for other lines */
+static OnionTraceLoggerRecordType _oniontracelogger_getEventType(TorCtlLine* parsed) {
+    if(parsed->code != 650 || parsed->separator != ' ') {
+        return ONIONTRACE_LOGGER_RECORD_START;
+    } else if(oniontracetorctl_tokenEquals(&parsed->keyword, "BW")) {
+        return ONIONTRACE_LOGGER_RECORD_BW;
+    } else if(oniontracetorctl_tokenEquals(&parsed->keyword, "CIRC")) {
+        return ONIONTRACE_LOGGER_RECORD_CIRC;
+    } else if(oniontracetorctl_tokenEquals(&parsed->keyword, "STREAM")) {
+        return ONIONTRACE_LOGGER_RECORD_STREAM;
+    } else {
+        return ONIONTRACE_LOGGER_RECORD_START;
+    }
+}
+
+/* writes a typed record for a BW, CIRC, or STREAM event */
+static void _oniontracelogger_writeEventRecord(OnionTraceLogger* logger,
+        OnionTraceLoggerRecordType type, TorCtlLine* parsed) {
+    guint64 timestamp = oniontracetimer_getMonotonicNanos();
+    GString* buffer = oniontracefile_beginRecord(logger->outputFile);
+    gboolean isBinary = (logger->format == ONIONTRACE_OUTPUT_BINARY);
+    gsize lengthOffset = 0;
+
+    if(type == ONIONTRACE_LOGGER_RECORD_BW) {
+        /* args are: <bytesRead> <bytesWritten> */
+        guint64 bytesRead = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 0));
+        guint64 bytesWritten = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 1));
+
+        if(isBinary) {
+            lengthOffset = _oniontracelogger_beginBinaryRecord(buffer, type, timestamp);
+            _oniontracelogger_appendU64(buffer, bytesRead);
+            _oniontracelogger_appendU64(buffer, bytesWritten);
+        } else {
+            _oniontracelogger_beginJSONRecord(buffer, "BW", timestamp);
+            g_string_append_printf(buffer, ",\"read\":%"G_GUINT64_FORMAT",\"written\":%"G_GUINT64_FORMAT,
+                    bytesRead, bytesWritten);
+        }
+    } else if(type == ONIONTRACE_LOGGER_RECORD_CIRC) {
+        /* args are: <circuitID> <status> [<path>] */
+        guint64 circuitID = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 0));
+        TorCtlToken* statusStr = oniontracetorctl_getArg(parsed, 1);
+        TorCtlToken* path = oniontracetorctl_getArg(parsed, 2);
+        TorCtlToken* purpose = oniontracetorctl_getKeywordValue(parsed, "PURPOSE");
+        TorCtlToken* reason = oniontracetorctl_getKeywordValue(parsed, "REASON");
+        gint64 timeCreated = _oniontracelogger_parseTimeCreated(
+                oniontracetorctl_getKeywordValue(parsed, "TIME_CREATED"));
+
+        if(isBinary) {
+            lengthOffset = _oniontracelogger_beginBinaryRecord(buffer, type, timestamp);
+            _oniontracelogger_appendU32(buffer, (guint32)circuitID);
+            _oniontracelogger_appendU8(buffer, (guint8)oniontracetorctl_parseCircuitStatus(statusStr));
+            _oniontracelogger_appendU64(buffer, (guint64)timeCreated);
+            _oniontracelogger_appendString(buffer, path);
+            _oniontracelogger_appendString(buffer, purpose);
+            _oniontracelogger_appendString(buffer, reason);
+        } else {
+            _oniontracelogger_beginJSONRecord(buffer, "CIRC", timestamp);
+            g_string_append_printf(buffer, ",\"circuit_id\":%"G_GUINT64_FORMAT, circuitID);
+            _oniontracelogger_appendJSONString(buffer, "status", statusStr);
+            if(timeCreated != 0) {
+                g_string_append_printf(buffer, ",\"time_created_us\":%"G_GINT64_FORMAT, timeCreated);
+            }
+            _oniontracelogger_appendJSONString(buffer, "path", path);
+            _oniontracelogger_appendJSONString(buffer, "purpose", purpose);
+            _oniontracelogger_appendJSONString(buffer, "reason", reason);
+        }
+    } else {
+        /* args are: <streamID> <status> <circuitID> <target> */
+        guint64 streamID = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 0));
+        TorCtlToken* statusStr = oniontracetorctl_getArg(parsed, 1);
+        guint64 circuitID = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 2));
+        TorCtlToken* target = oniontracetorctl_getArg(parsed, 3);
+        TorCtlToken* reason = oniontracetorctl_getKeywordValue(parsed, "REASON");
+
+        if(isBinary) {
+            lengthOffset = _oniontracelogger_beginBinaryRecord(buffer, type, timestamp);
+            _oniontracelogger_appendU32(buffer, (guint32)streamID);
+            _oniontracelogger_appendU8(buffer, (guint8)oniontracetorctl_parseStreamStatus(statusStr));
+            _oniontracelogger_appendU32(buffer, (guint32)circuitID);
+            _oniontracelogger_appendString(buffer, target);
+            _oniontracelogger_appendString(buffer, reason);
+        } else {
+            _oniontracelogger_beginJSONRecord(buffer, "STREAM", timestamp);
+            g_string_append_printf(buffer, ",\"stream_id\":%"G_GUINT64_FORMAT",\"circuit_id\":%"G_GUINT64_FORMAT,
+                    streamID, circuitID);
+            _oniontracelogger_appendJSONString(buffer, "status", statusStr);
+            _oniontracelogger_appendJSONString(buffer, "target", target);
+            _oniontracelogger_appendJSONString(buffer, "reason", reason);
+        }
+    }
+
+    if(isBinary) {
+        _oniontracelogger_endBinaryRecord(buffer, lengthOffset);
+    } else {
+        g_string_append(buffer, "}\n");
+    }
+
+    oniontracefile_endRecord(logger->outputFile);
+    logger->recordsWritten++;
+}
+
+/* logs the line to our own file if we have one for text, or to the main log otherwise.
+ * these messages are always logged no matter what the log level is set at. */
+static void _oniontracelogger_log(OnionTraceLogger* logger, const gchar* functionName,
+        const gchar* line) {
+    if(logger->outputFile && logger->format == ONIONTRACE_OUTPUT_TEXT) {
+        oniontrace_formatLog(oniontracefile_beginRecord(logger->outputFile), 0, functionName,
+                "%s: %s", logger->id, line);
+        oniontracefile_endRecord(logger->outputFile);
+    } else {
+        oniontrace_log(0, functionName, "%s: %s", logger->id, line);
+    }
+}
+
+static void _oniontracelogger_countReason(GHashTable* counts, TorCtlToken* reason) {
+    gchar* key = reason ? g_strndup(reason->str, reason->len) : g_strdup("NONE");
+    gpointer count = g_hash_table_lookup(counts, key);
+    g_hash_table_replace(counts, key, GSIZE_TO_POINTER(GPOINTER_TO_SIZE(count) + 1));
+}
+
+/* adds the bytes we counted during the current second to the per-second stats */
+static void _oniontracelogger_finishSummarySecond(OnionTraceLoggerSummary* summary) {
+    if(summary->currentSecond > 0) {
+        oniontracehistogram_add(summary->bytesRead, summary->currentBytesRead);
+        oniontracehistogram_add(summary->bytesWritten, summary->currentBytesWritten);
+    }
+    summary->currentSecond = 0;
+    summary->currentBytesRead = 0;
+    summary->currentBytesWritten = 0;
+}
+
+/* returns TRUE if the event was added to the summary */
+static gboolean _oniontracelogger_summarizeEvent(OnionTraceLoggerSummary* summary,
+        OnionTraceLoggerRecordType type, TorCtlLine* parsed) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if(type == ONIONTRACE_LOGGER_RECORD_BW) {
+        /* args are: <bytesRead> <bytesWritten> */
+        if(summary->currentSecond != (gint64)now.tv_sec) {
+            _oniontracelogger_finishSummarySecond(summary);
+            summary->currentSecond = (gint64)now.tv_sec;
+        }
+
+        guint64 bytesRead = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 0));
+        guint64 bytesWritten = _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 1));
+
+        summary->currentBytesRead += bytesRead;
+        summary->currentBytesWritten += bytesWritten;
+        summary->bytesReadTotal += bytesRead;
+        summary->bytesWrittenTotal += bytesWritten;
+        return TRUE;
+    } else if(type == ONIONTRACE_LOGGER_RECORD_CIRC) {
+        /* args are: <circuitID> <status> [<path>] */
+        CircuitStatus status = oniontracetorctl_parseCircuitStatus(oniontracetorctl_getArg(parsed, 1));
+        if(status != CIRCUIT_STATUS_BUILT && status != CIRCUIT_STATUS_FAILED &&
+                status != CIRCUIT_STATUS_CLOSED) {
+            return TRUE;
+        }
+
+        gpointer circuitID = GSIZE_TO_POINTER(
+                _oniontracelogger_tokenToUInt64(oniontracetorctl_getArg(parsed, 0)));
+
+        /* tor sends no more events for a closed circuit, so we forget it.
+         * this keeps the set as small as the number of open circuits. */
+        if(status == CIRCUIT_STATUS_CLOSED) {
+            g_hash_table_remove(summary->circuitIDsBuilt, circuitID);
+            return TRUE;
+        }
+        TorCtlToken* reason = oniontracetorctl_getKeywordValue(parsed, "REASON");
+
+        /* events for circuits we already saw built are due to cannibalization,
+         * and we can't compute accurate build or fail times for them */
+        if(g_hash_table_contains(summary->circuitIDsBuilt, circuitID)) {
+            if(status == CIRCUIT_STATUS_BUILT) {
+                summary->cannibalizedCircuitsBuilt++;
+            } else {
+                _oniontracelogger_countReason(summary->cannibalizedCircuitsFailed, reason);
+            }
+            return TRUE;
+        }
+        g_hash_table_add(summary->circuitIDsBuilt, circuitID);
+
+        gint64 timeCreated = _oniontracelogger_parseTimeCreated(
+                oniontracetorctl_getKeywordValue(parsed, "TIME_CREATED"));
+        if(timeCreated == 0) {
+            return TRUE;
+        }
+
+        gint64 nowMicros = ((gint64)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+        guint64 elapsed = (guint64)MAX(nowMicros - timeCreated, 0);
+
+        if(status == CIRCUIT_STATUS_BUILT) {
+            oniontracehistogram_add(summary->buildTimes, elapsed);
+            summary->circuitsBuilt++;
+        } else {
+            oniontracehistogram_add(summary->failTimes, elapsed);
+            _oniontracelogger_countReason(summary->circuitsFailed, reason);
+        }
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void _oniontracelogger_appendReasonCounts(GString* string, const gchar* name, GHashTable* counts) {
+    g_string_append_printf(string, ",\"%s\":{", name);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    gboolean isFirst = TRUE;
+
+    g_hash_table_iter_init(&iter, counts);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(string, "%s\"%s\":%"G_GSIZE_FORMAT,
+                isFirst ? "" : ",", (gchar*)key, GPOINTER_TO_SIZE(value));
+        isFirst = FALSE;
+    }
+
+    g_string_append_c(string, '}');
+}
+
+static void _oniontracelogger_appendByteStats(GString* string, const gchar* name, OnionTraceHistogram* histogram) {
+    g_string_append_printf(string,
+            ",\"%s_min\":%"G_GUINT64_FORMAT",\"%s_max\":%"G_GUINT64_FORMAT",\"%s_median\":%"G_GUINT64_FORMAT
+            ",\"%s_mean\":%"G_GUINT64_FORMAT",\"%s_std\":%"G_GUINT64_FORMAT,
+            name, oniontracehistogram_getMin(histogram), name, oniontracehistogram_getMax(histogram),
+            name, oniontracehistogram_getQuantile(histogram, 0.5),
+            name, (guint64)oniontracehistogram_getMean(histogram),
+            name, (guint64)oniontracehistogram_getStdDev(histogram));
+}
+
+static void _oniontracelogger_appendTimeStats(GString* string, const gchar* name, OnionTraceHistogram* histogram) {
+    /* the histograms hold microseconds, but the summary has seconds */
+    g_string_append_printf(string,
+            ",\"%s_min\":%.6f,\"%s_max\":%.6f,\"%s_median\":%.6f,\"%s_mean\":%.6f,\"%s_std\":%.6f",
+            name, oniontracehistogram_getMin(histogram) / 1000000.0,
+            name, oniontracehistogram_getMax(histogram) / 1000000.0,
+            name, oniontracehistogram_getQuantile(histogram, 0.5) / 1000000.0,
+            name, oniontracehistogram_getMean(histogram) / 1000000.0,
+            name, oniontracehistogram_getStdDev(histogram) / 1000000.0);
+}
+
+/* logs the totals since we started as a single JSON object, which the
+ * analysis tools load in place of parsing the raw event lines */
+void oniontracelogger_logSummary(OnionTraceLogger* logger) {
+    g_assert(logger);
+
+    OnionTraceLoggerSummary* summary = logger->summary;
+    if(!summary) {
+        return;
+    }
+
+    GString* string = g_string_new("{\"bandwidth_summary\":{");
+
+    g_string_append_printf(string, "\"bytes_read_total\":%"G_GUINT64_FORMAT",\"bytes_written_total\":%"G_GUINT64_FORMAT,
+            summary->bytesReadTotal, summary->bytesWrittenTotal);
+    if(oniontracehistogram_getCount(summary->bytesRead) > 0) {
+        _oniontracelogger_appendByteStats(string, "bytes_read", summary->bytesRead);
+        _oniontracelogger_appendByteStats(string, "bytes_written", summary->bytesWritten);
+    }
+
+    g_string_append_printf(string, "},\"circuit_summary\":{\"circuits_built_total\":%"G_GUINT64_FORMAT
+            ",\"cannibalized_circuits_built_total\":%"G_GUINT64_FORMAT,
+            summary->circuitsBuilt, summary->cannibalizedCircuitsBuilt);
+    _oniontracelogger_appendReasonCounts(string, "circuits_failed_total", summary->circuitsFailed);
+    _oniontracelogger_appendReasonCounts(string, "cannibalized_circuits_failed_total",
+            summary->cannibalizedCircuitsFailed);
+    if(oniontracehistogram_getCount(summary->buildTimes) > 0) {
+        _oniontracelogger_appendTimeStats(string, "build_time", summary->buildTimes);
+    }
+    if(oniontracehistogram_getCount(summary->failTimes) > 0) {
+        _oniontracelogger_appendTimeStats(string, "fail_time", summary->failTimes);
+    }
+
+    g_string_append(string, "}}");
+    g_string_prepend(string, "summary ");
+
+    _oniontracelogger_log(logger, __FUNCTION__, string->str);
+    g_string_free(string, TRUE);
+}
+
+static OnionTraceLoggerSummary* _oniontracelogger_newSummary() {
+    OnionTraceLoggerSummary* summary = g_new0(OnionTraceLoggerSummary, 1);
+    summary->bytesRead = oniontracehistogram_new();
+    summary->bytesWritten = oniontracehistogram_new();
+    summary->buildTimes = oniontracehistogram_new();
+    summary->failTimes = oniontracehistogram_new();
+    summary->circuitsFailed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    summary->cannibalizedCircuitsFailed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    summary->circuitIDsBuilt = g_hash_table_new(g_direct_hash, g_direct_equal);
+    return summary;
+}
+
+static void _oniontracelogger_freeSummary(OnionTraceLoggerSummary* summary) {
+    oniontracehistogram_free(summary->bytesRead);
+    oniontracehistogram_free(summary->bytesWritten);
+    oniontracehistogram_free(summary->buildTimes);
+    oniontracehistogram_free(summary->failTimes);
+    g_hash_table_destroy(summary->circuitsFailed);
+    g_hash_table_destroy(summary->cannibalizedCircuitsFailed);
+    g_hash_table_destroy(summary->circuitIDsBuilt);
+    g_free(summary);
+}
+
+void _oniontracelogger_logControlLine(OnionTraceLogger* logger, gchar* line, gsize length) {
     g_assert(logger);
     if(line != NULL) {
-        /* always log these messages no matter what the log level is set at */
-        oniontrace_log(0, __FUNCTION__, "%s: %s", logger->id, line);
+        logger->linesReceived++;
+
+        gboolean isStructured = (logger->format != ONIONTRACE_OUTPUT_TEXT);
+
+        /* events are the only lines starting with a 6, so we can skip tokenizing the rest */
+        if((isStructured || logger->summary) && line[0] == '6') {
+            TorCtlLine parsed;
+            oniontracetorctl_tokenize(line, length, TRUE, &parsed);
+
+            OnionTraceLoggerRecordType type = _oniontracelogger_getEventType(&parsed);
+            gboolean isSummarized = FALSE;
+
+            if(logger->summary && type != ONIONTRACE_LOGGER_RECORD_START) {
+                isSummarized = _oniontracelogger_summarizeEvent(logger->summary, type, &parsed);
+            }
+
+            if(isStructured && type != ONIONTRACE_LOGGER_RECORD_START) {
+                _oniontracelogger_writeEventRecord(logger, type, &parsed);
+                return;
+            } else if(isSummarized && logger->summaryOnly) {
+                return;
+            }
+        }
+
+        _oniontracelogger_log(logger, __FUNCTION__, line);
         logger->messagesLogged++;
     }
 }
@@ -29,13 +543,33 @@ void _oniontracelogger_logControlLine(OnionTraceLogger* logger, gchar* line) {
 gchar* oniontracelogger_toString(OnionTraceLogger* logger) {
     GString* string = g_string_new("");
     g_string_append_printf(string, "n_msgs_logged=%zu", logger->messagesLogged);
+    if(logger->outputFile && logger->format != ONIONTRACE_OUTPUT_TEXT) {
+        g_string_append_printf(string, " n_records_written=%zu n_bytes_pending=%zu",
+                logger->recordsWritten, oniontracefile_getPendingBytes(logger->outputFile));
+    }
     return g_string_free(string, FALSE);
 }
 
-OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedEvents) {
+/* writes any buffered records to the output file */
+void oniontracelogger_flush(OnionTraceLogger* logger) {
+    g_assert(logger);
+    if(logger->outputFile) {
+        oniontracefile_flush(logger->outputFile);
+    }
+}
+
+OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedEvents,
+        OnionTraceOutputFormat format, const gchar* outputFilename, gsize flushBytes,
+        gboolean summarize, gboolean summaryOnly, const gchar* instanceID) {
     OnionTraceLogger* logger = g_new0(OnionTraceLogger, 1);
 
     logger->torctl = torctl;
+    logger->format = format;
+
+    if(summarize) {
+        logger->summary = _oniontracelogger_newSummary();
+        logger->summaryOnly = summaryOnly;
+    }
 
     clock_gettime(CLOCK_REALTIME, &logger->startTime);
 
@@ -43,6 +577,38 @@ OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* sp
     g_string_printf(idbuf, "Logger");
     logger->id = g_string_free(idbuf, FALSE);
 
+    /* text goes to the main log unless we were given a file for it */
+    if(outputFilename) {
+        logger->outputFile = oniontracefile_newWriter(outputFilename);
+        if(!logger->outputFile) {
+            oniontracelogger_free(logger);
+            return NULL;
+        }
+
+        oniontracefile_setFlushPolicy(logger->outputFile, flushBytes, 0);
+
+        if(format != ONIONTRACE_OUTPUT_TEXT) {
+            _oniontracelogger_writeStartRecord(logger);
+        } else {
+            /* start the file like the main log, so the analysis tools can parse
+             * it on its own and name the results after the instance */
+            gchar hostname[128];
+            memset(hostname, 0, 128);
+            gethostname(hostname, 127);
+
+            GString* buffer = oniontracefile_beginRecord(logger->outputFile);
+            oniontrace_formatLog(buffer, G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+                    "Starting OnionTrace v%s on host %s-%s process id %i",
+                    ONIONTRACE_VERSION, hostname, instanceID ? instanceID : "0", (gint)getpid());
+            oniontrace_formatLog(buffer, G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+                    "%s: logging events of Tor instance %s, which is ready (Bootstrapped 100)",
+                    logger->id, instanceID ? instanceID : "0");
+            oniontracefile_endRecord(logger->outputFile);
+        }
+    } else {
+        g_assert(format == ONIONTRACE_OUTPUT_TEXT);
+    }
+
     oniontracetorctl_setLineReceivedCallback(logger->torctl,
             (OnLineReceivedFunc)_oniontracelogger_logControlLine, logger);
 
@@ -55,6 +621,27 @@ OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* sp
 void oniontracelogger_free(OnionTraceLogger* logger) {
     g_assert(logger);
 
+    struct timespec now, elapsed;
+    clock_gettime(CLOCK_REALTIME, &now);
+    oniontracetimer_timespecsubtract(&elapsed, &logger->startTime, &now);
+    gdouble seconds = (gdouble)elapsed.tv_sec + ((gdouble)elapsed.tv_nsec / 1000000000.0);
+    if(logger->linesReceived > 0 && seconds > 0.0) {
+        message("%s: handled %zu control lines in %.3f seconds (%.1f lines/s)", logger->id,
+                logger->linesReceived, seconds, (gdouble)logger->linesReceived / seconds);
+    }
+
+    if(logger->summary) {
+        /* the final summary includes the last partial second */
+        _oniontracelogger_finishSummarySecond(logger->summary);
+        oniontracelogger_logSummary(logger);
+        _oniontracelogger_freeSummary(logger->summary);
+    }
+
+    if(logger->outputFile) {
+        /* this writes out the records that are still buffered */
+        oniontracefile_free(logger->outputFile);
+    }
+
     if(logger->id) {
         g_free(logger->id);
     }
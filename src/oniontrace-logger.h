@@ -5,13 +5,19 @@
 #ifndef SRC_ONIONTRACE_LOGGER_H_
 #define SRC_ONIONTRACE_LOGGER_H_
 
+#include "oniontrace-config.h"
 #include "oniontrace-torctl.h"
 
 typedef struct _OnionTraceLogger OnionTraceLogger;
 
-OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedEvents);
+OnionTraceLogger* oniontracelogger_new(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedEvents,
+        OnionTraceOutputFormat format, const gchar* outputFilename, gsize flushBytes,
+        gboolean summarize, gboolean summaryOnly, const gchar* instanceID);
 void oniontracelogger_free(OnionTraceLogger* logger);
 
+void oniontracelogger_flush(OnionTraceLogger* logger);
+void oniontracelogger_logSummary(OnionTraceLogger* logger);
+
 gchar* oniontracelogger_toString(OnionTraceLogger* logger);
 
 #endif /* SRC_ONIONTRACE_LOGGER_H_ */
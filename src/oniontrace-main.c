@@ -0,0 +1,388 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "oniontrace.h"
+
+/* the counters of several driver status strings. states are counted, as in
+ * n_RUNNING=2, times in milliseconds (keys ending in _ms) are the maximum of
+ * all instances, and everything else is summed. we keep the keys in the order
+ * we first see them. */
+typedef struct _OnionTraceStatusSums {
+    guint numInstances;
+    GPtrArray* keys;
+    GArray* sums;
+    GHashTable* keyIndices;
+} OnionTraceStatusSums;
+
+/* the instances are divided among shards, each of which runs its own main loop
+ * and touches only its own drivers. */
+typedef struct _OnionTraceShard OnionTraceShard;
+
+/* the coordinator waits for the shards and logs the merged heartbeat. the lock
+ * is only taken once per second by each shard, never while handling events. */
+typedef struct _OnionTraceCoordinator {
+    GMutex lock;
+    GCond cond;
+    guint numRunning;
+} OnionTraceCoordinator;
+
+struct _OnionTraceShard {
+    guint index;
+    OnionTraceEventManager* manager;
+    GPtrArray* drivers;
+    gboolean isStarted;
+    gboolean success;
+    GThread* thread;
+    OnionTraceCoordinator* coordinator;
+    /* the latest status of our drivers, protected by the coordinator lock */
+    OnionTraceStatusSums* snapshot;
+};
+
+static OnionTraceStatusSums* _oniontrace_newStatusSums() {
+    OnionTraceStatusSums* statusSums = g_new0(OnionTraceStatusSums, 1);
+    statusSums->keys = g_ptr_array_new_with_free_func(g_free);
+    statusSums->sums = g_array_new(FALSE, TRUE, sizeof(guint64));
+    statusSums->keyIndices = g_hash_table_new(g_str_hash, g_str_equal);
+    return statusSums;
+}
+
+static void _oniontrace_freeStatusSums(OnionTraceStatusSums* statusSums) {
+    g_assert(statusSums);
+    g_hash_table_destroy(statusSums->keyIndices);
+    g_array_free(statusSums->sums, TRUE);
+    g_ptr_array_free(statusSums->keys, TRUE);
+    g_free(statusSums);
+}
+
+/* takes ownership of the key */
+static void _oniontrace_addStatusValue(OnionTraceStatusSums* statusSums, gchar* key, guint64 value) {
+    gpointer index = NULL;
+    if(g_hash_table_lookup_extended(statusSums->keyIndices, key, NULL, &index)) {
+        guint64* sum = &g_array_index(statusSums->sums, guint64, GPOINTER_TO_UINT(index));
+        if(g_str_has_suffix(key, "_ms")) {
+            *sum = MAX(*sum, value);
+        } else {
+            *sum += value;
+        }
+        g_free(key);
+    } else {
+        g_hash_table_insert(statusSums->keyIndices, key, GUINT_TO_POINTER(statusSums->keys->len));
+        g_ptr_array_add(statusSums->keys, key);
+        g_array_append_val(statusSums->sums, value);
+    }
+}
+
+static void _oniontrace_addDriverStatus(OnionTraceStatusSums* statusSums, OnionTraceDriver* driver) {
+    gchar* status = oniontracedriver_toString(driver);
+    gchar** parts = g_strsplit(status, " ", 0);
+
+    for(gint j = 0; parts[j] != NULL; j++) {
+        gchar* equals = strchr(parts[j], '=');
+        if(!equals) {
+            continue;
+        }
+
+        if(!strncmp(parts[j], "state=", 6)) {
+            _oniontrace_addStatusValue(statusSums, g_strdup_printf("n_%s", &equals[1]), 1);
+        } else {
+            _oniontrace_addStatusValue(statusSums, g_strndup(parts[j], (gsize)(equals - parts[j])),
+                    g_ascii_strtoull(&equals[1], NULL, 10));
+        }
+    }
+
+    g_strfreev(parts);
+    g_free(status);
+
+    statusSums->numInstances++;
+}
+
+static void _oniontrace_mergeStatusSums(OnionTraceStatusSums* statusSums, OnionTraceStatusSums* other) {
+    for(guint i = 0; i < other->keys->len; i++) {
+        _oniontrace_addStatusValue(statusSums, g_strdup(g_ptr_array_index(other->keys, i)),
+                g_array_index(other->sums, guint64, i));
+    }
+    statusSums->numInstances += other->numInstances;
+}
+
+static void _oniontrace_logHeartbeat(OnionTraceStatusSums* statusSums) {
+    GString* msg = g_string_new("");
+    g_string_append_printf(msg, "Main: heartbeat: n_instances=%u", statusSums->numInstances);
+    for(guint i = 0; i < statusSums->keys->len; i++) {
+        g_string_append_printf(msg, " %s=%"G_GUINT64_FORMAT,
+                (gchar*)g_ptr_array_index(statusSums->keys, i),
+                g_array_index(statusSums->sums, guint64, i));
+    }
+
+    message("%s", msg->str);
+
+    g_string_free(msg, TRUE);
+}
+
+static OnionTraceStatusSums* _oniontrace_sumDriverStatus(GPtrArray* drivers) {
+    OnionTraceStatusSums* statusSums = _oniontrace_newStatusSums();
+    for(guint i = 0; i < drivers->len; i++) {
+        _oniontrace_addDriverStatus(statusSums, g_ptr_array_index(drivers, i));
+    }
+    return statusSums;
+}
+
+/* logs the number of instances in each state and the sums of their status counters */
+static void _oniontrace_heartbeat(GPtrArray* drivers, gpointer unused) {
+    OnionTraceStatusSums* statusSums = _oniontrace_sumDriverStatus(drivers);
+    _oniontrace_logHeartbeat(statusSums);
+    _oniontrace_freeStatusSums(statusSums);
+}
+
+/* runs on the shard's own thread; hands the status of its drivers to the coordinator */
+static void _oniontrace_snapshotShard(OnionTraceShard* shard, gpointer unused) {
+    OnionTraceStatusSums* statusSums = _oniontrace_sumDriverStatus(shard->drivers);
+
+    g_mutex_lock(&shard->coordinator->lock);
+    OnionTraceStatusSums* previous = shard->snapshot;
+    shard->snapshot = statusSums;
+    g_mutex_unlock(&shard->coordinator->lock);
+
+    if(previous) {
+        _oniontrace_freeStatusSums(previous);
+    }
+}
+
+static void _oniontrace_stopShardDrivers(OnionTraceShard* shard) {
+    for(guint i = 0; i < shard->drivers->len; i++) {
+        OnionTraceDriver* driver = g_ptr_array_index(shard->drivers, i);
+        oniontracedriver_stop(driver);
+        oniontracedriver_free(driver);
+    }
+    g_ptr_array_set_size(shard->drivers, 0);
+}
+
+static gpointer _oniontrace_runShard(OnionTraceShard* shard) {
+    shard->success = oniontraceeventmanager_runMainLoop(shard->manager);
+    info("Main loop of shard %u returned", shard->index);
+
+    /* our drivers belong to this thread, so clean them up here too */
+    _oniontrace_stopShardDrivers(shard);
+    oniontrace_flushLog();
+
+    g_mutex_lock(&shard->coordinator->lock);
+    shard->coordinator->numRunning--;
+    g_cond_signal(&shard->coordinator->cond);
+    g_mutex_unlock(&shard->coordinator->lock);
+
+    return NULL;
+}
+
+/* waits for all running shards to stop, logging their merged heartbeat each second */
+static void _oniontrace_coordinate(OnionTraceCoordinator* coordinator, GPtrArray* shards) {
+    gint64 nextHeartbeat = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
+
+    g_mutex_lock(&coordinator->lock);
+
+    while(coordinator->numRunning > 0) {
+        if(g_cond_wait_until(&coordinator->cond, &coordinator->lock, nextHeartbeat)) {
+            /* a shard stopped, or a spurious wakeup */
+            continue;
+        }
+
+        OnionTraceStatusSums* statusSums = _oniontrace_newStatusSums();
+        for(guint i = 0; i < shards->len; i++) {
+            OnionTraceShard* shard = g_ptr_array_index(shards, i);
+            if(shard->snapshot) {
+                _oniontrace_mergeStatusSums(statusSums, shard->snapshot);
+            }
+        }
+
+        /* don't make the shards wait while we write */
+        g_mutex_unlock(&coordinator->lock);
+        _oniontrace_logHeartbeat(statusSums);
+        _oniontrace_freeStatusSums(statusSums);
+        oniontrace_flushLog();
+        g_mutex_lock(&coordinator->lock);
+
+        nextHeartbeat += G_TIME_SPAN_SECOND;
+    }
+
+    g_mutex_unlock(&coordinator->lock);
+}
+
+static OnionTraceShard* _oniontrace_newShard(guint index, OnionTraceCoordinator* coordinator) {
+    OnionTraceEventManager* manager = oniontraceeventmanager_new();
+    if(manager == NULL) {
+        return NULL;
+    }
+
+    OnionTraceShard* shard = g_new0(OnionTraceShard, 1);
+    shard->index = index;
+    shard->manager = manager;
+    shard->drivers = g_ptr_array_new();
+    shard->coordinator = coordinator;
+    return shard;
+}
+
+static void _oniontrace_freeShard(OnionTraceShard* shard) {
+    g_assert(shard);
+
+    _oniontrace_stopShardDrivers(shard);
+    g_ptr_array_free(shard->drivers, TRUE);
+
+    if(shard->snapshot) {
+        _oniontrace_freeStatusSums(shard->snapshot);
+    }
+
+    oniontraceeventmanager_free(shard->manager);
+    g_free(shard);
+}
+
+int main(int argc, char *argv[]) {
+    gchar hostname[128];
+    memset(hostname, 0, 128);
+    gethostname(hostname, 128);
+    message("Starting OnionTrace v%s on host %s process id %i",
+            ONIONTRACE_VERSION, hostname, (gint )getpid());
+
+    /* a closed control connection should fail the write, not kill all instances */
+    signal(SIGPIPE, SIG_IGN);
+
+    message("Parsing program arguments");
+    OnionTraceConfig* config = oniontraceconfig_new(argc, argv);
+    if (config == NULL) {
+        message("Parsing config failed, exiting with failure");
+        oniontrace_flushLog();
+        return EXIT_FAILURE;
+    }
+
+    /* update to the configured log level */
+    globalLogFilterLevel = oniontraceconfig_getLogLevel(config);
+
+    guint numInstances = oniontraceconfig_getNumInstances(config);
+    guint numShards = oniontraceconfig_getNumShards(config);
+
+    OnionTraceCoordinator coordinator;
+    memset(&coordinator, 0, sizeof(OnionTraceCoordinator));
+    g_mutex_init(&coordinator.lock);
+    g_cond_init(&coordinator.cond);
+
+    GPtrArray* shards = g_ptr_array_new();
+    gboolean success = TRUE;
+
+    if(numShards == 1) {
+        message("Creating event manager to run main loop");
+    } else {
+        message("Creating %u event managers to run %u shards", numShards, numShards);
+    }
+
+    for(guint i = 0; i < numShards; i++) {
+        OnionTraceShard* shard = _oniontrace_newShard(i, &coordinator);
+        if (shard == NULL) {
+            message("Creating event manager failed, exiting with failure");
+            success = FALSE;
+            break;
+        }
+        g_ptr_array_add(shards, shard);
+    }
+
+    if(success) {
+        if(numInstances == 1) {
+            message("Creating driver");
+        } else {
+            message("Creating %u drivers", numInstances);
+        }
+
+        success = FALSE;
+
+        /* the instances are dealt round-robin to the shards, and each instance
+         * works on its own in the main loop of its shard */
+        for(guint i = 0; i < numInstances; i++) {
+            OnionTraceShard* shard = g_ptr_array_index(shards, i % numShards);
+
+            OnionTraceDriver* driver = oniontracedriver_new(config, shard->manager, i);
+            if (driver == NULL) {
+                message("Creating driver for instance %s failed",
+                        oniontraceconfig_getInstanceID(config, i));
+                continue;
+            }
+
+            g_ptr_array_add(shard->drivers, driver);
+
+            if(oniontracedriver_start(driver)) {
+                shard->isStarted = TRUE;
+                success = TRUE;
+            }
+        }
+
+        if (!success) {
+            message("No driver could be started, exiting with failure");
+        }
+    }
+
+    if (success && numShards == 1) {
+        OnionTraceShard* shard = g_ptr_array_index(shards, 0);
+
+        if (numInstances > 1) {
+            /* one heartbeat line for all instances instead of one line each */
+            struct timespec interval = {.tv_sec = 1, .tv_nsec = 0};
+            oniontraceeventmanager_addTimer(shard->manager, &interval, &interval,
+                    (GFunc)_oniontrace_heartbeat, shard->drivers, NULL);
+        }
+
+        /* the recorder should be waiting for circuit and stream events, and
+         * when those occur, new actions will be taken. */
+        message("Running main loop");
+        success = oniontraceeventmanager_runMainLoop(shard->manager);
+        message("Main loop returned, cleaning up");
+    } else if (success) {
+        /* a shard whose drivers all failed to start would have nothing to do */
+        for(guint i = 0; i < shards->len; i++) {
+            OnionTraceShard* shard = g_ptr_array_index(shards, i);
+            if(!shard->isStarted) {
+                continue;
+            }
+
+            /* take the first snapshot now so that the first heartbeat is complete */
+            _oniontrace_snapshotShard(shard, NULL);
+            struct timespec interval = {.tv_sec = 1, .tv_nsec = 0};
+            oniontraceeventmanager_addTimer(shard->manager, &interval, &interval,
+                    (GFunc)_oniontrace_snapshotShard, shard, NULL);
+
+            coordinator.numRunning++;
+        }
+
+        message("Running %u main loops in shard threads", coordinator.numRunning);
+        oniontrace_flushLog();
+
+        for(guint i = 0; i < shards->len; i++) {
+            OnionTraceShard* shard = g_ptr_array_index(shards, i);
+            if(shard->isStarted) {
+                gchar* name = g_strdup_printf("shard-%u", shard->index);
+                shard->thread = g_thread_new(name, (GThreadFunc)_oniontrace_runShard, shard);
+                g_free(name);
+            }
+        }
+
+        _oniontrace_coordinate(&coordinator, shards);
+
+        for(guint i = 0; i < shards->len; i++) {
+            OnionTraceShard* shard = g_ptr_array_index(shards, i);
+            if(shard->thread) {
+                g_thread_join(shard->thread);
+                success = success && shard->success;
+            }
+        }
+        message("Main loops returned, cleaning up");
+    }
+
+    for(guint i = 0; i < shards->len; i++) {
+        _oniontrace_freeShard(g_ptr_array_index(shards, i));
+    }
+    g_ptr_array_free(shards, TRUE);
+
+    g_cond_clear(&coordinator.cond);
+    g_mutex_clear(&coordinator.lock);
+
+    oniontraceconfig_free(config);
+
+    message("Exiting cleanly with %s code", success ? "success" : "failure");
+    oniontrace_flushLog();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
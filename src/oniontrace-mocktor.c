@@ -0,0 +1,863 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* a mock Tor control port for testing and benchmarking oniontrace without Tor.
+ * it answers the commands that oniontrace sends and generates BW, CIRC, and
+ * STREAM events at configurable rates. circuits that oniontrace asks for are
+ * built or failed after a delay, so that oniontrace sees a plausible tor. */
+
+#include "oniontrace.h"
+
+/* how often we generate the events that are due */
+#define MOCKTOR_TICK_MILLIS 10
+/* stop generating events for a client that does not keep up with reading them */
+#define MOCKTOR_MAX_OUTPUT_BYTES (16*1024*1024)
+#define MOCKTOR_NUM_RELAYS 50
+#define MOCKTOR_NUM_USERNAMES 10
+
+typedef struct _MockTorConfig {
+    /* we listen on numControlPorts consecutive ports, starting at controlPort */
+    in_port_t controlPort;
+    guint numControlPorts;
+    gint runTimeSeconds;
+    GLogLevelFlags logLevel;
+    guint32 seed;
+    /* events per second for each client that enabled them */
+    gdouble bwRate;
+    gdouble circuitRate;
+    gdouble streamRate;
+    /* probabilities in [0,1] */
+    gdouble launchFailProbability;
+    gdouble circuitFailProbability;
+    /* how long circuits take to build, and stay open once built */
+    gint buildTimeMillis;
+    gint circuitLifetimeMillis;
+    /* if set, lines from this file are sent in a loop instead of generated events */
+    gchar* scriptFilename;
+    gdouble scriptRate;
+} MockTorConfig;
+
+typedef struct _OnionTraceMockTor OnionTraceMockTor;
+
+typedef struct _MockTorListener {
+    OnionTraceMockTor* mocktor;
+    gint descriptor;
+} MockTorListener;
+
+typedef enum _MockTorCircuitState {
+    MOCKTOR_CIRCUIT_LAUNCHED, MOCKTOR_CIRCUIT_BUILT,
+} MockTorCircuitState;
+
+typedef struct _MockTorClient MockTorClient;
+
+typedef struct _MockTorCircuit {
+    MockTorClient* client;
+    gint id;
+    MockTorCircuitState state;
+    gchar* path;
+    gchar timeCreated[32];
+    /* streams on a circuit share a socks username, picked for the first stream */
+    gint user;
+    /* the timer that builds or closes the circuit next */
+    guint64 timerID;
+} MockTorCircuit;
+
+struct _MockTorClient {
+    OnionTraceMockTor* mocktor;
+    gint descriptor;
+    gchar* id;
+    GRand* random;
+
+    /* the events the client asked for with SETEVENTS */
+    gboolean wantsBW;
+    gboolean wantsCircuits;
+    gboolean wantsStreams;
+
+    /* fractional events owed from previous ticks */
+    gdouble bwCredit;
+    gdouble circuitCredit;
+    gdouble streamCredit;
+    gdouble scriptCredit;
+    guint scriptPosition;
+
+    GString* input;
+    GString* output;
+    gsize outputOffset;
+    gboolean isWriteEventSet;
+
+    /* circuit id to MockTorCircuit */
+    GHashTable* circuits;
+    /* ids of built circuits, for attaching generated streams */
+    GArray* builtCircuitIDs;
+    gint nextCircuitID;
+    gint nextStreamID;
+
+    guint64 numCommands;
+    guint64 numEvents;
+    guint64 numEventsDropped;
+};
+
+struct _OnionTraceMockTor {
+    MockTorConfig config;
+    OnionTraceEventManager* manager;
+    /* one per control port, so that many oniontrace instances can share one mock */
+    MockTorListener* listeners;
+    guint numListeners;
+    GHashTable* clients;
+    guint64 nextClientIndex;
+
+    /* relays we pretend to know about, as '$FINGERPRINT~nickname' */
+    GPtrArray* relays;
+    gchar** scriptLines;
+    guint numScriptLines;
+
+    guint64 lastTickTime;
+    guint64 totalEvents;
+    guint64 totalCommands;
+    guint64 startTime;
+};
+
+static void _oniontracemocktor_getTimeCreated(gchar* buffer, gsize bufferSize) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct tm brokenDown;
+    gmtime_r(&now.tv_sec, &brokenDown);
+    gsize length = strftime(buffer, bufferSize, "%Y-%m-%dT%H:%M:%S", &brokenDown);
+    g_snprintf(&buffer[length], bufferSize - length, ".%06li", now.tv_nsec / 1000);
+}
+
+static void _oniontracemocktor_onClientEvent(MockTorClient* client, OnionTraceEventFlag eventType);
+
+static void _oniontracemocktor_setWriteEvent(MockTorClient* client, gboolean wantWrite) {
+    if(client->isWriteEventSet == wantWrite) {
+        return;
+    }
+
+    OnionTraceEventFlag eventType = ONIONTRACE_EVENT_READ;
+    if(wantWrite) {
+        eventType |= ONIONTRACE_EVENT_WRITE;
+    }
+
+    if(oniontraceeventmanager_register(client->mocktor->manager, client->descriptor, eventType,
+            (OnionTraceOnEventFunc)_oniontracemocktor_onClientEvent, client)) {
+        client->isWriteEventSet = wantWrite;
+    }
+}
+
+static void _oniontracemocktor_send(MockTorClient* client, const gchar* format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+    g_string_append_vprintf(client->output, format, vargs);
+    va_end(vargs);
+    g_string_append(client->output, "\r\n");
+    _oniontracemocktor_setWriteEvent(client, TRUE);
+}
+
+static gboolean _oniontracemocktor_canSendEvent(MockTorClient* client) {
+    if(client->output->len - client->outputOffset > MOCKTOR_MAX_OUTPUT_BYTES) {
+        client->numEventsDropped++;
+        return FALSE;
+    }
+    client->numEvents++;
+    client->mocktor->totalEvents++;
+    return TRUE;
+}
+
+static gchar* _oniontracemocktor_newPath(MockTorClient* client) {
+    GPtrArray* relays = client->mocktor->relays;
+    guint first = (guint)g_rand_int_range(client->random, 0, (gint32)relays->len);
+    guint second = (first + 1 + (guint)g_rand_int_range(client->random, 0, (gint32)relays->len - 2)) % relays->len;
+    guint third = second;
+    while(third == first || third == second) {
+        third = (guint)g_rand_int_range(client->random, 0, (gint32)relays->len);
+    }
+    return g_strdup_printf("%s,%s,%s", (gchar*)g_ptr_array_index(relays, first),
+            (gchar*)g_ptr_array_index(relays, second), (gchar*)g_ptr_array_index(relays, third));
+}
+
+static void _oniontracemocktor_freeCircuit(MockTorCircuit* circuit) {
+    if(circuit->timerID) {
+        oniontraceeventmanager_cancelTimer(circuit->client->mocktor->manager, circuit->timerID);
+    }
+    g_free(circuit->path);
+    g_free(circuit);
+}
+
+static void _oniontracemocktor_removeCircuit(MockTorClient* client, MockTorCircuit* circuit) {
+    if(circuit->state == MOCKTOR_CIRCUIT_BUILT) {
+        for(guint i = 0; i < client->builtCircuitIDs->len; i++) {
+            if(g_array_index(client->builtCircuitIDs, gint, i) == circuit->id) {
+                g_array_remove_index_fast(client->builtCircuitIDs, i);
+                break;
+            }
+        }
+    }
+    /* this frees the circuit */
+    g_hash_table_remove(client->circuits, GINT_TO_POINTER(circuit->id));
+}
+
+static void _oniontracemocktor_closeCircuit(MockTorClient* client, MockTorCircuit* circuit, const gchar* reason) {
+    if(client->wantsCircuits && _oniontracemocktor_canSendEvent(client)) {
+        _oniontracemocktor_send(client, "650 CIRC %i CLOSED %s BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=%s REASON=%s",
+                circuit->id, circuit->path, circuit->timeCreated, reason);
+    }
+    _oniontracemocktor_removeCircuit(client, circuit);
+}
+
+static void _oniontracemocktor_onCircuitExpired(MockTorClient* client, MockTorCircuit* circuit) {
+    circuit->timerID = 0;
+    _oniontracemocktor_closeCircuit(client, circuit, "FINISHED");
+}
+
+static void _oniontracemocktor_onCircuitBuildDone(MockTorClient* client, MockTorCircuit* circuit) {
+    MockTorConfig* config = &client->mocktor->config;
+    circuit->timerID = 0;
+
+    if(g_rand_double(client->random) < config->circuitFailProbability) {
+        if(client->wantsCircuits && _oniontracemocktor_canSendEvent(client)) {
+            _oniontracemocktor_send(client, "650 CIRC %i FAILED %s BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=%s REASON=TIMEOUT",
+                    circuit->id, circuit->path, circuit->timeCreated);
+        }
+        _oniontracemocktor_removeCircuit(client, circuit);
+        return;
+    }
+
+    circuit->state = MOCKTOR_CIRCUIT_BUILT;
+    g_array_append_val(client->builtCircuitIDs, circuit->id);
+
+    if(client->wantsCircuits && _oniontracemocktor_canSendEvent(client)) {
+        _oniontracemocktor_send(client, "650 CIRC %i BUILT %s BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=%s",
+                circuit->id, circuit->path, circuit->timeCreated);
+    }
+
+    if(config->circuitLifetimeMillis > 0) {
+        struct timespec delay = {.tv_sec = config->circuitLifetimeMillis / 1000,
+                .tv_nsec = (config->circuitLifetimeMillis % 1000) * 1000000L};
+        circuit->timerID = oniontraceeventmanager_addTimer(client->mocktor->manager, &delay, NULL,
+                (GFunc)_oniontracemocktor_onCircuitExpired, client, circuit);
+    }
+}
+
+static void _oniontracemocktor_sendLaunched(MockTorClient* client, MockTorCircuit* circuit) {
+    if(client->wantsCircuits && _oniontracemocktor_canSendEvent(client)) {
+        _oniontracemocktor_send(client, "650 CIRC %i LAUNCHED BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=%s",
+                circuit->id, circuit->timeCreated);
+    }
+}
+
+/* takes ownership of the path */
+static MockTorCircuit* _oniontracemocktor_launchCircuit(MockTorClient* client, gchar* path) {
+    MockTorConfig* config = &client->mocktor->config;
+
+    MockTorCircuit* circuit = g_new0(MockTorCircuit, 1);
+    circuit->client = client;
+    circuit->id = client->nextCircuitID++;
+    circuit->state = MOCKTOR_CIRCUIT_LAUNCHED;
+    circuit->path = path;
+    circuit->user = -1;
+    _oniontracemocktor_getTimeCreated(circuit->timeCreated, sizeof(circuit->timeCreated));
+    g_hash_table_insert(client->circuits, GINT_TO_POINTER(circuit->id), circuit);
+
+    /* build times vary between half and one and a half of the configured time */
+    gint64 buildNanos = (gint64)(config->buildTimeMillis * (0.5 + g_rand_double(client->random)) * 1000000.0);
+    struct timespec delay = {.tv_sec = buildNanos / 1000000000L, .tv_nsec = buildNanos % 1000000000L};
+    circuit->timerID = oniontraceeventmanager_addTimer(client->mocktor->manager, &delay, NULL,
+            (GFunc)_oniontracemocktor_onCircuitBuildDone, client, circuit);
+
+    return circuit;
+}
+
+static void _oniontracemocktor_generateStream(MockTorClient* client) {
+    if(client->builtCircuitIDs->len == 0 || !_oniontracemocktor_canSendEvent(client)) {
+        return;
+    }
+
+    guint index = (guint)g_rand_int_range(client->random, 0, (gint32)client->builtCircuitIDs->len);
+    gint circuitID = g_array_index(client->builtCircuitIDs, gint, index);
+    gint streamID = client->nextStreamID++;
+
+    MockTorCircuit* circuit = g_hash_table_lookup(client->circuits, GINT_TO_POINTER(circuitID));
+    if(circuit->user < 0) {
+        circuit->user = g_rand_int_range(client->random, 0, MOCKTOR_NUM_USERNAMES);
+    }
+    gint user = circuit->user;
+
+    _oniontracemocktor_send(client, "650 STREAM %i NEW 0 11.0.0.6:18080 SOURCE_ADDR=127.0.0.1:%i PURPOSE=USER USERNAME=user%i",
+            streamID, g_rand_int_range(client->random, 1024, 65535), user);
+    _oniontracemocktor_send(client, "650 STREAM %i SUCCEEDED %i 11.0.0.6:18080 USERNAME=user%i", streamID, circuitID, user);
+    _oniontracemocktor_send(client, "650 STREAM %i CLOSED %i 11.0.0.6:18080 REASON=DONE", streamID, circuitID);
+}
+
+static void _oniontracemocktor_generateEvents(MockTorClient* client, gdouble seconds) {
+    OnionTraceMockTor* mocktor = client->mocktor;
+    MockTorConfig* config = &mocktor->config;
+
+    if(mocktor->numScriptLines > 0) {
+        if(client->wantsBW || client->wantsCircuits || client->wantsStreams) {
+            client->scriptCredit += config->scriptRate * seconds;
+            while(client->scriptCredit >= 1.0) {
+                client->scriptCredit -= 1.0;
+                if(_oniontracemocktor_canSendEvent(client)) {
+                    _oniontracemocktor_send(client, "%s", mocktor->scriptLines[client->scriptPosition]);
+                }
+                client->scriptPosition = (client->scriptPosition + 1) % mocktor->numScriptLines;
+            }
+        }
+        return;
+    }
+
+    if(client->wantsBW) {
+        client->bwCredit += config->bwRate * seconds;
+        while(client->bwCredit >= 1.0) {
+            client->bwCredit -= 1.0;
+            if(_oniontracemocktor_canSendEvent(client)) {
+                _oniontracemocktor_send(client, "650 BW %i %i", g_rand_int_range(client->random, 0, 1000000),
+                        g_rand_int_range(client->random, 0, 1000000));
+            }
+        }
+    }
+
+    /* tor builds circuits of its own, which we only need to pretend when someone listens */
+    if(client->wantsCircuits) {
+        client->circuitCredit += config->circuitRate * seconds;
+        while(client->circuitCredit >= 1.0) {
+            client->circuitCredit -= 1.0;
+            _oniontracemocktor_sendLaunched(client, _oniontracemocktor_launchCircuit(client, _oniontracemocktor_newPath(client)));
+        }
+    }
+
+    if(client->wantsStreams) {
+        client->streamCredit += config->streamRate * seconds;
+        while(client->streamCredit >= 1.0) {
+            client->streamCredit -= 1.0;
+            _oniontracemocktor_generateStream(client);
+        }
+    }
+}
+
+static void _oniontracemocktor_onTick(OnionTraceMockTor* mocktor, gpointer unused) {
+    guint64 now = oniontracetimer_getMonotonicNanos();
+    gdouble seconds = (gdouble)(now - mocktor->lastTickTime) / 1000000000.0;
+    mocktor->lastTickTime = now;
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, mocktor->clients);
+    while(g_hash_table_iter_next(&iter, NULL, &value)) {
+        _oniontracemocktor_generateEvents(value, seconds);
+    }
+}
+
+static void _oniontracemocktor_heartbeat(OnionTraceMockTor* mocktor, gpointer unused) {
+    guint64 elapsed = oniontracetimer_getMonotonicNanos() - mocktor->startTime;
+    gdouble seconds = (gdouble)elapsed / 1000000000.0;
+
+    guint64 numCircuits = 0, numDropped = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, mocktor->clients);
+    while(g_hash_table_iter_next(&iter, NULL, &value)) {
+        MockTorClient* client = value;
+        numCircuits += g_hash_table_size(client->circuits);
+        numDropped += client->numEventsDropped;
+    }
+
+    message("MockTor: heartbeat: n_clients=%u n_circs_open=%"G_GUINT64_FORMAT" n_cmds=%"G_GUINT64_FORMAT
+            " n_events_sent=%"G_GUINT64_FORMAT" n_events_dropped=%"G_GUINT64_FORMAT" events_per_second=%.1f",
+            g_hash_table_size(mocktor->clients), numCircuits, mocktor->totalCommands,
+            mocktor->totalEvents, numDropped, seconds > 0.0 ? (gdouble)mocktor->totalEvents / seconds : 0.0);
+}
+
+static void _oniontracemocktor_sendDataReply(MockTorClient* client, const gchar* key, GString* body) {
+    _oniontracemocktor_send(client, "250+%s=", key);
+    g_string_append_len(client->output, body->str, (gssize)body->len);
+    _oniontracemocktor_send(client, ".");
+    _oniontracemocktor_send(client, "250 OK");
+}
+
+static void _oniontracemocktor_handleGetInfo(MockTorClient* client, const gchar* key) {
+    if(!g_ascii_strcasecmp(key, "status/bootstrap-phase")) {
+        _oniontracemocktor_send(client, "250-status/bootstrap-phase=NOTICE BOOTSTRAP PROGRESS=100 TAG=done SUMMARY=\"Done\"");
+        _oniontracemocktor_send(client, "250 OK");
+    } else if(!g_ascii_strcasecmp(key, "consensus/valid-after")) {
+        _oniontracemocktor_send(client, "250-consensus/valid-after=2020-01-01 00:00:00");
+        _oniontracemocktor_send(client, "250 OK");
+    } else if(!g_ascii_strcasecmp(key, "circuit-status")) {
+        GString* body = g_string_new(NULL);
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, client->circuits);
+        while(g_hash_table_iter_next(&iter, NULL, &value)) {
+            MockTorCircuit* circuit = value;
+            g_string_append_printf(body, "%i %s %s BUILD_FLAGS=NEED_CAPACITY PURPOSE=GENERAL TIME_CREATED=%s\r\n",
+                    circuit->id, circuit->state == MOCKTOR_CIRCUIT_BUILT ? "BUILT" : "LAUNCHED",
+                    circuit->path, circuit->timeCreated);
+        }
+        _oniontracemocktor_sendDataReply(client, key, body);
+        g_string_free(body, TRUE);
+    } else if(!g_ascii_strcasecmp(key, "ns/all")) {
+        GString* body = g_string_new(NULL);
+        for(guint i = 0; i < client->mocktor->relays->len; i++) {
+            gchar* relay = g_ptr_array_index(client->mocktor->relays, i);
+            guchar digest[20];
+            for(guint j = 0; j < 20; j++) {
+                gchar hex[3] = {relay[1 + (2 * j)], relay[2 + (2 * j)], '\0'};
+                digest[j] = (guchar)g_ascii_strtoull(hex, NULL, 16);
+            }
+            gchar* identity = g_base64_encode(digest, 20);
+            /* the consensus leaves out the base64 padding */
+            g_strdelimit(identity, "=", '\0');
+            g_string_append_printf(body, "r %s %s AAAAAAAAAAAAAAAAAAAAAAAAAAA 2020-01-01 00:00:00 11.0.0.%u 9111 0\r\n",
+                    &relay[42], identity, i + 1);
+            g_string_append_printf(body, "s Exit Fast Guard Running Stable Valid\r\nw Bandwidth=%u\r\n",
+                    1000 + (i * 100));
+            g_free(identity);
+        }
+        _oniontracemocktor_sendDataReply(client, key, body);
+        g_string_free(body, TRUE);
+    } else {
+        _oniontracemocktor_send(client, "552 Unrecognized key \"%s\"", key);
+    }
+}
+
+static void _oniontracemocktor_handleSetEvents(MockTorClient* client, gchar** words) {
+    client->wantsBW = FALSE;
+    client->wantsCircuits = FALSE;
+    client->wantsStreams = FALSE;
+
+    for(gint i = 1; words[i] != NULL; i++) {
+        if(!g_ascii_strcasecmp(words[i], "BW")) {
+            client->wantsBW = TRUE;
+        } else if(!g_ascii_strcasecmp(words[i], "CIRC")) {
+            client->wantsCircuits = TRUE;
+        } else if(!g_ascii_strcasecmp(words[i], "STREAM")) {
+            client->wantsStreams = TRUE;
+        }
+    }
+
+    _oniontracemocktor_send(client, "250 OK");
+}
+
+static void _oniontracemocktor_handleExtendCircuit(MockTorClient* client, gchar** words) {
+    if(g_rand_double(client->random) < client->mocktor->config.launchFailProbability) {
+        _oniontracemocktor_send(client, "552 No such router");
+        return;
+    }
+
+    /* 'EXTENDCIRCUIT 0 path' asks for a new circuit, with our own path if none is given */
+    gchar* path = (words[1] && words[2]) ? g_strdup(words[2]) : _oniontracemocktor_newPath(client);
+    MockTorCircuit* circuit = _oniontracemocktor_launchCircuit(client, path);
+
+    /* like tor, the reply goes out before the LAUNCHED event */
+    _oniontracemocktor_send(client, "250 EXTENDED %i", circuit->id);
+    _oniontracemocktor_sendLaunched(client, circuit);
+}
+
+static void _oniontracemocktor_handleCommand(MockTorClient* client, gchar* line) {
+    client->numCommands++;
+    client->mocktor->totalCommands++;
+
+    debug("%s: received command '%s'", client->id, line);
+
+    gchar** words = g_strsplit(line, " ", 0);
+    const gchar* command = words[0] ? words[0] : "";
+
+    if(!g_ascii_strcasecmp(command, "AUTHENTICATE") || !g_ascii_strcasecmp(command, "SETCONF") ||
+            !g_ascii_strcasecmp(command, "SIGNAL") || !g_ascii_strcasecmp(command, "CLOSESTREAM")) {
+        _oniontracemocktor_send(client, "250 OK");
+    } else if(!g_ascii_strcasecmp(command, "GETINFO") && words[1]) {
+        _oniontracemocktor_handleGetInfo(client, words[1]);
+    } else if(!g_ascii_strcasecmp(command, "SETEVENTS")) {
+        _oniontracemocktor_handleSetEvents(client, words);
+    } else if(!g_ascii_strcasecmp(command, "EXTENDCIRCUIT")) {
+        _oniontracemocktor_handleExtendCircuit(client, words);
+    } else if(!g_ascii_strcasecmp(command, "ATTACHSTREAM") && words[1] && words[2]) {
+        gint streamID = atoi(words[1]);
+        gint circuitID = atoi(words[2]);
+        MockTorCircuit* circuit = g_hash_table_lookup(client->circuits, GINT_TO_POINTER(circuitID));
+        if(circuit && circuit->state == MOCKTOR_CIRCUIT_BUILT) {
+            _oniontracemocktor_send(client, "250 OK");
+            if(client->wantsStreams && _oniontracemocktor_canSendEvent(client)) {
+                _oniontracemocktor_send(client, "650 STREAM %i SUCCEEDED %i 11.0.0.6:18080", streamID, circuitID);
+            }
+        } else {
+            _oniontracemocktor_send(client, "552 Unknown circuit \"%s\"", words[2]);
+        }
+    } else if(!g_ascii_strcasecmp(command, "CLOSECIRCUIT") && words[1]) {
+        MockTorCircuit* circuit = g_hash_table_lookup(client->circuits, GINT_TO_POINTER(atoi(words[1])));
+        if(circuit) {
+            _oniontracemocktor_send(client, "250 OK");
+            _oniontracemocktor_closeCircuit(client, circuit, "REQUESTED");
+        } else {
+            _oniontracemocktor_send(client, "552 Unknown circuit \"%s\"", words[1]);
+        }
+    } else {
+        _oniontracemocktor_send(client, "510 Unrecognized command \"%s\"", command);
+    }
+
+    g_strfreev(words);
+}
+
+static void _oniontracemocktor_freeClient(MockTorClient* client) {
+    message("%s: closing after %"G_GUINT64_FORMAT" commands and %"G_GUINT64_FORMAT" events (%"G_GUINT64_FORMAT" dropped)",
+            client->id, client->numCommands, client->numEvents, client->numEventsDropped);
+
+    oniontraceeventmanager_deregister(client->mocktor->manager, client->descriptor);
+    close(client->descriptor);
+
+    g_hash_table_destroy(client->circuits);
+    g_array_free(client->builtCircuitIDs, TRUE);
+    g_string_free(client->input, TRUE);
+    g_string_free(client->output, TRUE);
+    g_rand_free(client->random);
+    g_free(client->id);
+    g_free(client);
+}
+
+static void _oniontracemocktor_removeClient(MockTorClient* client) {
+    /* this frees the client */
+    g_hash_table_remove(client->mocktor->clients, GINT_TO_POINTER(client->descriptor));
+}
+
+static gboolean _oniontracemocktor_readCommands(MockTorClient* client) {
+    gchar buffer[16384];
+
+    while(TRUE) {
+        gssize bytes = recv(client->descriptor, buffer, sizeof(buffer), 0);
+        if(bytes == 0) {
+            return FALSE;
+        } else if(bytes < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+
+        g_string_append_len(client->input, buffer, bytes);
+
+        gsize start = 0;
+        gchar* end = NULL;
+        while((end = memchr(&client->input->str[start], '\n', client->input->len - start)) != NULL) {
+            gsize lineEnd = (gsize)(end - client->input->str);
+            gsize length = lineEnd - start;
+            if(length > 0 && client->input->str[start + length - 1] == '\r') {
+                length--;
+            }
+            client->input->str[start + length] = '\0';
+            _oniontracemocktor_handleCommand(client, &client->input->str[start]);
+            start = lineEnd + 1;
+        }
+        g_string_erase(client->input, 0, (gssize)start);
+    }
+}
+
+static gboolean _oniontracemocktor_writeOutput(MockTorClient* client) {
+    while(client->outputOffset < client->output->len) {
+        gssize bytes = send(client->descriptor, &client->output->str[client->outputOffset],
+                client->output->len - client->outputOffset, 0);
+        if(bytes < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        client->outputOffset += (gsize)bytes;
+    }
+
+    g_string_truncate(client->output, 0);
+    client->outputOffset = 0;
+    _oniontracemocktor_setWriteEvent(client, FALSE);
+    return TRUE;
+}
+
+static void _oniontracemocktor_onClientEvent(MockTorClient* client, OnionTraceEventFlag eventType) {
+    if((eventType & ONIONTRACE_EVENT_READ) && !_oniontracemocktor_readCommands(client)) {
+        _oniontracemocktor_removeClient(client);
+        return;
+    }
+
+    if((eventType & ONIONTRACE_EVENT_WRITE) && !_oniontracemocktor_writeOutput(client)) {
+        _oniontracemocktor_removeClient(client);
+        return;
+    }
+
+    /* don't let written-out space pile up at the front of a busy buffer */
+    if(client->outputOffset > 0 && client->outputOffset >= client->output->len / 2) {
+        g_string_erase(client->output, 0, (gssize)client->outputOffset);
+        client->outputOffset = 0;
+    }
+}
+
+static void _oniontracemocktor_onAccept(MockTorListener* listener, OnionTraceEventFlag eventType) {
+    OnionTraceMockTor* mocktor = listener->mocktor;
+
+    while(TRUE) {
+        gint descriptor = accept(listener->descriptor, NULL, NULL);
+        if(descriptor < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                warning("error %i in accept(): %s", errno, g_strerror(errno));
+            }
+            return;
+        }
+        fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+
+        MockTorClient* client = g_new0(MockTorClient, 1);
+        client->mocktor = mocktor;
+        client->descriptor = descriptor;
+        client->id = g_strdup_printf("Client-%"G_GUINT64_FORMAT, mocktor->nextClientIndex);
+        client->random = g_rand_new_with_seed(mocktor->config.seed + (guint32)mocktor->nextClientIndex);
+        mocktor->nextClientIndex++;
+        client->input = g_string_new(NULL);
+        client->output = g_string_new(NULL);
+        client->circuits = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                (GDestroyNotify)_oniontracemocktor_freeCircuit);
+        client->builtCircuitIDs = g_array_new(FALSE, FALSE, sizeof(gint));
+        client->nextCircuitID = 1;
+        client->nextStreamID = 1;
+
+        g_hash_table_insert(mocktor->clients, GINT_TO_POINTER(descriptor), client);
+
+        client->isWriteEventSet = TRUE;
+        _oniontracemocktor_setWriteEvent(client, FALSE);
+
+        message("%s: accepted control connection on descriptor %i", client->id, descriptor);
+    }
+}
+
+static gboolean _oniontracemocktor_parseProbability(gdouble* result, const gchar* key, const gchar* value) {
+    gdouble probability = g_ascii_strtod(value, NULL);
+    if(probability < 0.0 || probability > 1.0) {
+        warning("invalid %s '%s' provided, must be in [0,1]", key, value);
+        return FALSE;
+    }
+    *result = probability;
+    return TRUE;
+}
+
+static gboolean _oniontracemocktor_parseRate(gdouble* result, const gchar* key, const gchar* value) {
+    gdouble rate = g_ascii_strtod(value, NULL);
+    if(rate < 0.0) {
+        warning("invalid %s '%s' provided, must not be negative", key, value);
+        return FALSE;
+    }
+    *result = rate;
+    return TRUE;
+}
+
+static gboolean _oniontracemocktor_parseConfigEntry(MockTorConfig* config, const gchar* key, gchar* value) {
+    gboolean isValid = TRUE;
+
+    if(!g_ascii_strcasecmp(key, "ControlPort")) {
+        /* a port, or a range of ports like '9100-9199' */
+        gchar** rangeStrs = g_strsplit(value, "-", 2);
+        gint first = atoi(rangeStrs[0]);
+        gint last = rangeStrs[1] ? atoi(rangeStrs[1]) : first;
+        g_strfreev(rangeStrs);
+
+        isValid = (first > 0 && last >= first && last <= G_MAXUINT16);
+        config->controlPort = (in_port_t)first;
+        config->numControlPorts = (guint)(last - first + 1);
+    } else if(!g_ascii_strcasecmp(key, "RunTime")) {
+        config->runTimeSeconds = atoi(value);
+        isValid = (config->runTimeSeconds >= 0);
+    } else if(!g_ascii_strcasecmp(key, "LogLevel")) {
+        isValid = oniontraceconfig_parseLogLevel(value, &config->logLevel);
+    } else if(!g_ascii_strcasecmp(key, "Seed")) {
+        config->seed = (guint32)g_ascii_strtoull(value, NULL, 10);
+    } else if(!g_ascii_strcasecmp(key, "BWRate")) {
+        isValid = _oniontracemocktor_parseRate(&config->bwRate, key, value);
+    } else if(!g_ascii_strcasecmp(key, "CircuitRate")) {
+        isValid = _oniontracemocktor_parseRate(&config->circuitRate, key, value);
+    } else if(!g_ascii_strcasecmp(key, "StreamRate")) {
+        isValid = _oniontracemocktor_parseRate(&config->streamRate, key, value);
+    } else if(!g_ascii_strcasecmp(key, "ScriptRate")) {
+        isValid = _oniontracemocktor_parseRate(&config->scriptRate, key, value);
+    } else if(!g_ascii_strcasecmp(key, "LaunchFailProbability")) {
+        isValid = _oniontracemocktor_parseProbability(&config->launchFailProbability, key, value);
+    } else if(!g_ascii_strcasecmp(key, "CircuitFailProbability")) {
+        isValid = _oniontracemocktor_parseProbability(&config->circuitFailProbability, key, value);
+    } else if(!g_ascii_strcasecmp(key, "BuildTime")) {
+        config->buildTimeMillis = atoi(value);
+        isValid = (config->buildTimeMillis >= 0);
+    } else if(!g_ascii_strcasecmp(key, "CircuitLifetime")) {
+        config->circuitLifetimeMillis = atoi(value);
+        isValid = (config->circuitLifetimeMillis >= 0);
+    } else if(!g_ascii_strcasecmp(key, "Script")) {
+        g_free(config->scriptFilename);
+        config->scriptFilename = g_strdup(value);
+    } else {
+        warning("unrecognized key '%s' in config", key);
+        isValid = FALSE;
+    }
+
+    return isValid;
+}
+
+static gboolean _oniontracemocktor_parseConfig(MockTorConfig* config, gint argc, gchar* argv[]) {
+    config->runTimeSeconds = 0;
+    config->logLevel = G_LOG_LEVEL_MESSAGE;
+    config->seed = 1;
+    config->bwRate = 1.0;
+    config->circuitRate = 0.0;
+    config->streamRate = 0.0;
+    config->launchFailProbability = 0.0;
+    config->circuitFailProbability = 0.0;
+    config->buildTimeMillis = 100;
+    config->circuitLifetimeMillis = 10000;
+    config->scriptRate = 1.0;
+
+    if(!oniontraceconfig_parseArgs(argc, argv, (OnionTraceConfigEntryFunc)_oniontracemocktor_parseConfigEntry, config)) {
+        return FALSE;
+    }
+
+    if(config->controlPort == 0) {
+        critical("missing required argument `ControlPort`");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean _oniontracemocktor_loadScript(OnionTraceMockTor* mocktor) {
+    gchar* contents = NULL;
+    GError* error = NULL;
+
+    if(!g_file_get_contents(mocktor->config.scriptFilename, &contents, NULL, &error)) {
+        critical("unable to read script '%s': %s", mocktor->config.scriptFilename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    /* keep the event lines, skipping empty lines and comments */
+    gchar** lines = g_strsplit(contents, "\n", 0);
+    GPtrArray* scriptLines = g_ptr_array_new();
+    for(gint i = 0; lines[i] != NULL; i++) {
+        gchar* line = g_strstrip(lines[i]);
+        if(line[0] != '\0' && line[0] != '#') {
+            g_ptr_array_add(scriptLines, g_strdup(line));
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    mocktor->numScriptLines = scriptLines->len;
+    g_ptr_array_add(scriptLines, NULL);
+    mocktor->scriptLines = (gchar**)g_ptr_array_free(scriptLines, FALSE);
+
+    message("loaded %u event lines from script '%s'", mocktor->numScriptLines, mocktor->config.scriptFilename);
+    return mocktor->numScriptLines > 0;
+}
+
+static gboolean _oniontracemocktor_listenOn(OnionTraceMockTor* mocktor, MockTorListener* listener,
+        in_port_t port) {
+    listener->mocktor = mocktor;
+    listener->descriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(listener->descriptor < 0) {
+        critical("error %i in socket(): %s", errno, g_strerror(errno));
+        return FALSE;
+    }
+
+    gint reuse = 1;
+    setsockopt(listener->descriptor, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if(bind(listener->descriptor, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+            listen(listener->descriptor, 128) < 0) {
+        critical("unable to listen on port %u: error %i: %s", port, errno, g_strerror(errno));
+        return FALSE;
+    }
+
+    return oniontraceeventmanager_register(mocktor->manager, listener->descriptor, ONIONTRACE_EVENT_READ,
+            (OnionTraceOnEventFunc)_oniontracemocktor_onAccept, listener);
+}
+
+static gboolean _oniontracemocktor_listen(OnionTraceMockTor* mocktor) {
+    mocktor->listeners = g_new0(MockTorListener, mocktor->config.numControlPorts);
+
+    for(guint i = 0; i < mocktor->config.numControlPorts; i++) {
+        mocktor->numListeners++;
+        if(!_oniontracemocktor_listenOn(mocktor, &mocktor->listeners[i],
+                (in_port_t)(mocktor->config.controlPort + i))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void _oniontracemocktor_shutdown(OnionTraceMockTor* mocktor, gpointer unused) {
+    oniontraceeventmanager_stopMainLoop(mocktor->manager);
+}
+
+int main(int argc, char *argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+
+    OnionTraceMockTor mocktor;
+    memset(&mocktor, 0, sizeof(OnionTraceMockTor));
+
+    if(!_oniontracemocktor_parseConfig(&mocktor.config, argc, argv)) {
+        oniontrace_flushLog();
+        return EXIT_FAILURE;
+    }
+    globalLogFilterLevel = mocktor.config.logLevel;
+
+    mocktor.manager = oniontraceeventmanager_new();
+    mocktor.clients = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+            (GDestroyNotify)_oniontracemocktor_freeClient);
+
+    /* fingerprints are random but the same for every run with the same seed */
+    GRand* random = g_rand_new_with_seed(mocktor.config.seed);
+    mocktor.relays = g_ptr_array_new_with_free_func(g_free);
+    for(guint i = 0; i < MOCKTOR_NUM_RELAYS; i++) {
+        GString* relay = g_string_new("$");
+        for(guint j = 0; j < 5; j++) {
+            g_string_append_printf(relay, "%08X", g_rand_int(random));
+        }
+        g_string_append_printf(relay, "~relay%u", i);
+        g_ptr_array_add(mocktor.relays, g_string_free(relay, FALSE));
+    }
+    g_rand_free(random);
+
+    gboolean success = (mocktor.manager != NULL) &&
+            (!mocktor.config.scriptFilename || _oniontracemocktor_loadScript(&mocktor)) &&
+            _oniontracemocktor_listen(&mocktor);
+
+    if(success) {
+        message("MockTor: listening on %u control ports starting at %u",
+                mocktor.numListeners, mocktor.config.controlPort);
+
+        mocktor.startTime = oniontracetimer_getMonotonicNanos();
+        mocktor.lastTickTime = mocktor.startTime;
+
+        struct timespec tick = {.tv_sec = 0, .tv_nsec = MOCKTOR_TICK_MILLIS * 1000000L};
+        oniontraceeventmanager_addTimer(mocktor.manager, &tick, &tick, (GFunc)_oniontracemocktor_onTick, &mocktor, NULL);
+
+        struct timespec second = {.tv_sec = 1, .tv_nsec = 0};
+        oniontraceeventmanager_addTimer(mocktor.manager, &second, &second, (GFunc)_oniontracemocktor_heartbeat, &mocktor, NULL);
+
+        if(mocktor.config.runTimeSeconds > 0) {
+            struct timespec runTime = {.tv_sec = mocktor.config.runTimeSeconds, .tv_nsec = 0};
+            oniontraceeventmanager_addTimer(mocktor.manager, &runTime, NULL, (GFunc)_oniontracemocktor_shutdown, &mocktor, NULL);
+        }
+
+        success = oniontraceeventmanager_runMainLoop(mocktor.manager);
+        _oniontracemocktor_heartbeat(&mocktor, NULL);
+    }
+
+    g_hash_table_destroy(mocktor.clients);
+    for(guint i = 0; i < mocktor.numListeners; i++) {
+        if(mocktor.listeners[i].descriptor > 0) {
+            close(mocktor.listeners[i].descriptor);
+        }
+    }
+    g_free(mocktor.listeners);
+    if(mocktor.manager) {
+        oniontraceeventmanager_free(mocktor.manager);
+    }
+    g_ptr_array_free(mocktor.relays, TRUE);
+    g_strfreev(mocktor.scriptLines);
+    g_free(mocktor.config.scriptFilename);
+
+    oniontrace_flushLog();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -4,10 +4,64 @@
 
 #include "oniontrace.h"
 
+/* how often we look for sessions we can free */
+#define PLAYER_SESSION_REAP_INTERVAL_SECONDS 60
+/* a session that was not used for this long is done; tor stops using a circuit for new
+ * streams after MaxCircuitDirtiness (10 minutes by default), so this leaves enough room */
+#define PLAYER_SESSION_IDLE_TIMEOUT_SECONDS 1200
+/* until we measured this many circuit builds, we build circuits the max lead time early */
+#define PLAYER_BUILD_LEAD_MIN_SAMPLES 20
+/* how often we pick a random substitute before we give up on finding one not in the path */
+#define PLAYER_SUBSTITUTE_ATTEMPTS 8
+/* a session whose circuit failed retries after a random delay between half and all
+ * of its backoff, which starts here and doubles with each failure in a row */
+#define PLAYER_RETRY_BACKOFF_MIN_MILLIS 500
+#define PLAYER_RETRY_BACKOFF_MAX_MILLIS 60000
+/* each failure we blame on a relay adds 1 to its score, which halves over this time */
+#define PLAYER_RELAY_FAILURE_HALF_LIFE_SECONDS 600.0
+/* relays with at least this score are replaced in paths until it decays */
+#define PLAYER_RELAY_FAILURE_THRESHOLD 3.0
+
+/* the positions in a path, which need relays with different flags */
+typedef enum {
+    PLAYER_HOP_GUARD, PLAYER_HOP_MIDDLE, PLAYER_HOP_EXIT, PLAYER_NUM_HOP_KINDS
+} PlayerHopKind;
+
+/* a relay we may use as a substitute, weighted by its consensus weight */
+typedef struct _RelayCandidate {
+    const OnionTraceRouterStatus* status;
+    /* the sum of the weights of this and all previous candidates */
+    guint64 cumulativeWeight;
+} RelayCandidate;
+
+/* the failures we blamed on a relay, decayed until lastUpdateTime */
+typedef struct _RelayHealth {
+    gdouble failureScore;
+    gdouble lastUpdateTime;
+} RelayHealth;
+
+typedef struct _WaitingStream {
+    /* -1 asks for a circuit to be built preemptively, without a stream to attach */
+    gint streamID;
+    struct timespec waitStartTime;
+} WaitingStream;
+
 typedef struct _Session {
     gchar* id;
-    GQueue* circuitsSorted;
-    GQueue* waitingStreamIDs;
+    /* circuits sorted by launch time; the ones before circuitsHead were already used */
+    GPtrArray* circuitsSorted;
+    guint circuitsHead;
+    /* WaitingStream structs in the order the streams arrived */
+    GArray* waitingStreams;
+    /* number of entries in the launch schedule that refer to this session */
+    guint numLaunchesScheduled;
+    /* when we last launched a circuit or assigned a stream for this session */
+    time_t lastActiveTime;
+    /* circuits that failed since the last one was built, and the timer that
+     * launches the next one once we backed off, 0 if none */
+    guint numRetries;
+    guint64 retryTimerID;
+    struct timespec retryStartTime;
 } Session;
 
 typedef struct _LaunchInfo {
@@ -17,6 +71,7 @@ typedef struct _LaunchInfo {
 
 struct _OnionTracePlayer {
     /* objects we don't own */
+    OnionTraceEventManager* manager;
     OnionTraceTorCtl* torctl;
 
     /* objects/data we own */
@@ -26,11 +81,58 @@ struct _OnionTracePlayer {
     GHashTable* sessions;
     GHashTable* circuits;
 
-    GQueue* launches;
-
-    Session* sessionAwaitingAssignment;
+    /* LaunchInfo structs sorted by launch time; the ones before launchesHead were already launched */
+    GArray* launches;
+    guint launchesHead;
+
+    /* in streaming mode we keep the file open and only read circuits that launch
+     * within the next streamWindowSeconds */
+    OnionTraceFile* streamFile;
+    OnionTraceCircuit* streamNextCircuit;
+    guint streamWindowSeconds;
+    guint numParsedCircuits;
+    guint numSessionCircuits;
+    guint64 numPathTextBytes;
+
+    /* holds the text of the path we are about to ask tor to build */
+    GString* pathBuffer;
+
+    /* if set, we check paths against the consensus before we launch them. the
+     * status of each relay id is looked up once; relays tor can't use are
+     * unusableRelay. the candidates are built the first time we need one. */
+    OnionTraceConsensus* consensus;
+    GPtrArray* relayStatuses;
+    GArray* substituteCandidates[PLAYER_NUM_HOP_KINDS];
+    /* RelayHealth structs indexed by relay id, for the relays we blamed for a failure */
+    GArray* relayHealth;
+
+    time_t lastReapTime;
+
+    /* circuits we asked tor to launch that are still waiting for a circuit id */
+    guint numLaunchesPending;
+    guint maxLaunchesPending;
     GQueue* sessionAssignmentBacklog;
 
+    /* sessions backing off before they retry a failed circuit, and the microseconds
+     * that the retries which already launched spent backing off */
+    guint numRetriesPending;
+    guint64 retryBackoffMicros;
+
+    /* microseconds between when each circuit should have launched and when we got to it */
+    OnionTraceHistogram* launchLateness;
+
+    /* microseconds from asking tor to build each circuit until it was BUILT */
+    OnionTraceHistogram* buildTimes;
+    /* microseconds from when each stream arrived until we attached it to a circuit */
+    OnionTraceHistogram* streamWaitTimes;
+
+    /* we launch each circuit this long before its recorded launch time, so that it is
+     * built when the streams arrive. it follows the configured quantile of buildTimes. */
+    struct timespec buildLead;
+    gdouble buildLeadQuantile;
+    guint64 buildLeadMinMicros;
+    guint64 buildLeadMaxMicros;
+
     struct {
         guint streamsAssigning;
         guint streamsAssigned;
@@ -40,30 +142,43 @@ struct _OnionTracePlayer {
         guint circuitsBuilding;
         guint circuitsBuilt;
         guint circuitsFailed;
+        guint circuitsRetried;
+        guint relaysSubstituted;
+        guint relaysAvoided;
+        guint pathsDropped;
     } counts;
 };
 
+/* marks relays in relayStatuses that are not in the consensus or not running */
+static const OnionTraceRouterStatus unusableRelay;
+
 static Session* _oniontraceplayer_newSession(const gchar* sessionID) {
     Session* session = g_new0(Session, 1);
     session->id = g_strdup(sessionID);
-    session->circuitsSorted = g_queue_new();
-    session->waitingStreamIDs = g_queue_new();
+    session->circuitsSorted = g_ptr_array_new();
+    session->waitingStreams = g_array_new(FALSE, FALSE, sizeof(WaitingStream));
+    session->lastActiveTime = time(NULL);
     return session;
 }
 
+static OnionTraceCircuit* _oniontraceplayer_peekSessionCircuit(Session* session, guint n) {
+    guint index = session->circuitsHead + n;
+    return index < session->circuitsSorted->len ? g_ptr_array_index(session->circuitsSorted, index) : NULL;
+}
+
 static void _oniontraceplayer_freeSession(Session* session) {
     if(session->circuitsSorted) {
-        while(!g_queue_is_empty(session->circuitsSorted)) {
-            OnionTraceCircuit* circuit = g_queue_pop_head(session->circuitsSorted);
+        for(guint i = session->circuitsHead; i < session->circuitsSorted->len; i++) {
+            OnionTraceCircuit* circuit = g_ptr_array_index(session->circuitsSorted, i);
             if(circuit) {
                 oniontracecircuit_free(circuit);
             }
         }
-        g_queue_free(session->circuitsSorted);
+        g_ptr_array_free(session->circuitsSorted, TRUE);
     }
 
-    if(session->waitingStreamIDs) {
-        g_queue_free(session->waitingStreamIDs);
+    if(session->waitingStreams) {
+        g_array_free(session->waitingStreams, TRUE);
     }
 
     if(session->id) {
@@ -73,16 +188,53 @@ static void _oniontraceplayer_freeSession(Session* session) {
     g_free(session);
 }
 
+static void _oniontraceplayer_addWaitingStream(Session* session, gint streamID, struct timespec* now) {
+    WaitingStream waiting;
+    waiting.streamID = streamID;
+    waiting.waitStartTime = *now;
+    g_array_append_val(session->waitingStreams, waiting);
+}
+
+/* returns the microseconds from start until end, or 0 if end is not later */
+static guint64 _oniontraceplayer_getElapsedMicros(struct timespec* start, struct timespec* end) {
+    if(end->tv_sec < start->tv_sec || (end->tv_sec == start->tv_sec && end->tv_nsec <= start->tv_nsec)) {
+        return 0;
+    }
+
+    struct timespec elapsed;
+    oniontracetimer_timespecsubtract(&elapsed, start, end);
+    return ((guint64)elapsed.tv_sec * 1000000) + ((guint64)elapsed.tv_nsec / 1000);
+}
+
+/* the time at which we should ask tor to build a circuit with the given recorded launch time */
+static void _oniontraceplayer_getBuildTime(OnionTracePlayer* player, struct timespec* launchTime,
+        struct timespec* buildTime) {
+    oniontracetimer_timespecsubtract(buildTime, &player->buildLead, launchTime);
+}
+
+static void _oniontraceplayer_updateBuildLead(OnionTracePlayer* player) {
+    guint64 leadMicros = player->buildLeadMaxMicros;
+
+    if(oniontracehistogram_getCount(player->buildTimes) >= PLAYER_BUILD_LEAD_MIN_SAMPLES) {
+        leadMicros = oniontracehistogram_getQuantile(player->buildTimes, player->buildLeadQuantile);
+        leadMicros = CLAMP(leadMicros, player->buildLeadMinMicros, player->buildLeadMaxMicros);
+    }
+
+    player->buildLead.tv_sec = (time_t)(leadMicros / 1000000);
+    player->buildLead.tv_nsec = (long)(leadMicros % 1000000) * 1000;
+}
+
 static OnionTraceCircuit* _oniontraceplayer_getCurrentCircuit(OnionTracePlayer* player, Session* session) {
     g_assert(player);
     g_assert(session);
 
-    OnionTraceCircuit* circuit = g_queue_peek_head(session->circuitsSorted);
+    OnionTraceCircuit* circuit = _oniontraceplayer_peekSessionCircuit(session, 0);
     g_assert(circuit);
 
-    OnionTraceCircuit* nextCircuit = g_queue_peek_nth(session->circuitsSorted, 1);
+    OnionTraceCircuit* nextCircuit = _oniontraceplayer_peekSessionCircuit(session, 1);
 
-    if(!nextCircuit) {
+    /* don't rotate away from a circuit while tor is still assigning it an id */
+    if(!nextCircuit || oniontracecircuit_getCircuitStatus(circuit) == CIRCUIT_STATUS_LAUNCHED) {
         return circuit;
     }
 
@@ -102,7 +254,14 @@ static OnionTraceCircuit* _oniontraceplayer_getCurrentCircuit(OnionTracePlayer*
         info("%s: rotating from circuit %i to new circuit on session %s",
                 player->id, circuitID, session->id);
 
-        g_queue_pop_head(session->circuitsSorted);
+        g_ptr_array_index(session->circuitsSorted, session->circuitsHead) = NULL;
+        session->circuitsHead++;
+
+        /* drop the used slots once they make up most of the array */
+        if(session->circuitsHead >= 16 && session->circuitsHead * 2 >= session->circuitsSorted->len) {
+            g_ptr_array_remove_range(session->circuitsSorted, 0, session->circuitsHead);
+            session->circuitsHead = 0;
+        }
 
         g_hash_table_remove(player->circuits, &circuitID);
         oniontracecircuit_free(circuit);
@@ -114,6 +273,265 @@ static OnionTraceCircuit* _oniontraceplayer_getCurrentCircuit(OnionTracePlayer*
     }
 }
 
+/* returns the status of the relay if tor can build a circuit through it */
+static const OnionTraceRouterStatus* _oniontraceplayer_lookupRelay(OnionTracePlayer* player,
+        OnionTraceRelayID relayID) {
+    if(relayID >= player->relayStatuses->len) {
+        g_ptr_array_set_size(player->relayStatuses, (gint)relayID + 1);
+    }
+
+    const OnionTraceRouterStatus* status = g_ptr_array_index(player->relayStatuses, relayID);
+
+    if(!status) {
+        status = oniontraceconsensus_lookupPathEntry(player->consensus,
+                oniontracerelay_getName(relayID), oniontracerelay_getNameLength(relayID));
+
+        guint32 required = ONIONTRACE_RELAY_FLAG_RUNNING | ONIONTRACE_RELAY_FLAG_VALID;
+        if(!status || (status->flags & required) != required) {
+            status = &unusableRelay;
+        }
+
+        g_ptr_array_index(player->relayStatuses, relayID) = (gpointer)status;
+    }
+
+    return (status == &unusableRelay) ? NULL : status;
+}
+
+static GArray* _oniontraceplayer_getSubstituteCandidates(OnionTracePlayer* player, PlayerHopKind kind) {
+    if(player->substituteCandidates[kind]) {
+        return player->substituteCandidates[kind];
+    }
+
+    guint32 required = ONIONTRACE_RELAY_FLAG_RUNNING | ONIONTRACE_RELAY_FLAG_VALID;
+    if(kind == PLAYER_HOP_GUARD) {
+        required |= ONIONTRACE_RELAY_FLAG_GUARD;
+    } else if(kind == PLAYER_HOP_EXIT) {
+        required |= ONIONTRACE_RELAY_FLAG_EXIT;
+    } else {
+        required |= ONIONTRACE_RELAY_FLAG_FAST;
+    }
+
+    GArray* candidates = g_array_new(FALSE, FALSE, sizeof(RelayCandidate));
+    guint64 totalWeight = 0;
+
+    for(guint i = 0; i < oniontraceconsensus_getNumRelays(player->consensus); i++) {
+        const OnionTraceRouterStatus* status = oniontraceconsensus_getRelay(player->consensus, i);
+
+        if((status->flags & required) != required ||
+                (kind == PLAYER_HOP_EXIT && (status->flags & ONIONTRACE_RELAY_FLAG_BADEXIT))) {
+            continue;
+        }
+
+        /* relays without a measured weight can still be picked, just rarely */
+        totalWeight += MAX(status->bandwidth, 1);
+        RelayCandidate candidate = {status, totalWeight};
+        g_array_append_val(candidates, candidate);
+    }
+
+    info("%s: found %u relays in the consensus to substitute for %s relays", player->id, candidates->len,
+            kind == PLAYER_HOP_GUARD ? "guard" : (kind == PLAYER_HOP_EXIT ? "exit" : "middle"));
+
+    player->substituteCandidates[kind] = candidates;
+    return candidates;
+}
+
+static const OnionTraceRouterStatus* _oniontraceplayer_pickSubstitute(OnionTracePlayer* player, PlayerHopKind kind) {
+    GArray* candidates = _oniontraceplayer_getSubstituteCandidates(player, kind);
+    if(candidates->len == 0) {
+        return NULL;
+    }
+
+    /* pick by weight, like tor would; find the first candidate past the random point */
+    guint64 totalWeight = g_array_index(candidates, RelayCandidate, candidates->len - 1).cumulativeWeight;
+    guint64 point = (guint64)(g_random_double() * (gdouble)totalWeight);
+
+    guint low = 0, high = candidates->len - 1;
+    while(low < high) {
+        guint mid = low + ((high - low) / 2);
+        if(g_array_index(candidates, RelayCandidate, mid).cumulativeWeight > point) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return g_array_index(candidates, RelayCandidate, low).status;
+}
+
+static gboolean _oniontraceplayer_isInPath(OnionTracePlayer* player, OnionTraceCircuit* circuit,
+        const OnionTraceRouterStatus* status) {
+    for(guint hop = 0; hop < oniontracecircuit_getPathLength(circuit); hop++) {
+        if(_oniontraceplayer_lookupRelay(player, oniontracecircuit_getPathRelay(circuit, hop)) == status) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gdouble _oniontraceplayer_getSeconds(struct timespec* time) {
+    return (gdouble)time->tv_sec + ((gdouble)time->tv_nsec / 1000000000.0);
+}
+
+/* returns the failure score of the relay, decayed until now */
+static gdouble _oniontraceplayer_getFailureScore(OnionTracePlayer* player,
+        OnionTraceRelayID relayID, gdouble now) {
+    if(relayID >= player->relayHealth->len) {
+        return 0.0;
+    }
+
+    RelayHealth* health = &g_array_index(player->relayHealth, RelayHealth, relayID);
+
+    if(now > health->lastUpdateTime) {
+        health->failureScore *= exp2(-(now - health->lastUpdateTime) / PLAYER_RELAY_FAILURE_HALF_LIFE_SECONDS);
+        health->lastUpdateTime = now;
+    }
+
+    return health->failureScore;
+}
+
+static gboolean _oniontraceplayer_isFailing(OnionTracePlayer* player, OnionTraceRelayID relayID, gdouble now) {
+    return _oniontraceplayer_getFailureScore(player, relayID, now) >= PLAYER_RELAY_FAILURE_THRESHOLD;
+}
+
+/* the reasons of FAILED circuits that point at the relay we were extending to,
+ * rather than at our own tor or the way we used the circuit */
+static gboolean _oniontraceplayer_isRelayFailure(const gchar* reason) {
+    static const gchar* relayReasons[] = {
+        "TIMEOUT", "CONNECTFAILED", "CHANNEL_CLOSED", "DESTROYED",
+        "RESOURCELIMIT", "HIBERNATING", "TORPROTOCOL", "OR_IDENTITY",
+    };
+
+    for(guint i = 0; i < G_N_ELEMENTS(relayReasons); i++) {
+        if(!g_ascii_strcasecmp(reason, relayReasons[i])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* the path of a FAILED event holds the hops that were built, so we blame the
+ * next hop of the path we asked for */
+static void _oniontraceplayer_blameRelay(OnionTracePlayer* player, OnionTraceCircuit* circuit,
+        gchar* path, gchar* reason) {
+    guint pathLength = oniontracecircuit_getPathLength(circuit);
+
+    /* after too many failures we let tor pick the path, so we don't know it */
+    if(pathLength == 0 || oniontracecircuit_getFailureCounter(circuit) >= 3 ||
+            !reason || !_oniontraceplayer_isRelayFailure(reason)) {
+        return;
+    }
+
+    guint numBuilt = 0;
+    if(path && path[0] != '\0') {
+        numBuilt = 1;
+        for(gchar* c = path; *c != '\0'; c++) {
+            if(*c == ',') {
+                numBuilt++;
+            }
+        }
+    }
+
+    OnionTraceRelayID relayID = oniontracecircuit_getPathRelay(circuit, MIN(numBuilt, pathLength - 1));
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gdouble nowSeconds = _oniontraceplayer_getSeconds(&now);
+
+    gdouble score = _oniontraceplayer_getFailureScore(player, relayID, nowSeconds);
+
+    if(relayID >= player->relayHealth->len) {
+        g_array_set_size(player->relayHealth, relayID + 1);
+    }
+
+    RelayHealth* health = &g_array_index(player->relayHealth, RelayHealth, relayID);
+    health->failureScore = score + 1.0;
+    health->lastUpdateTime = nowSeconds;
+
+    if(score < PLAYER_RELAY_FAILURE_THRESHOLD && health->failureScore >= PLAYER_RELAY_FAILURE_THRESHOLD) {
+        message("%s: avoiding relay %s, which keeps failing circuits (last reason %s)",
+                player->id, oniontracerelay_getName(relayID), reason);
+    }
+}
+
+/* returns TRUE if a relay in the path of the circuit keeps failing our circuits */
+static gboolean _oniontraceplayer_hasFailingRelay(OnionTracePlayer* player, OnionTraceCircuit* circuit) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gdouble nowSeconds = _oniontraceplayer_getSeconds(&now);
+
+    for(guint hop = 0; hop < oniontracecircuit_getPathLength(circuit); hop++) {
+        OnionTraceRelayID relayID = oniontracecircuit_getPathRelay(circuit, hop);
+        if(_oniontraceplayer_isFailing(player, relayID, nowSeconds)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* replaces relays that tor can't use, or that keep failing our circuits, with relays
+ * from the consensus that have the flags their position needs.
+ * returns FALSE if the path can't be fixed. */
+static gboolean _oniontraceplayer_checkPath(OnionTracePlayer* player, OnionTraceCircuit* circuit) {
+    guint pathLength = oniontracecircuit_getPathLength(circuit);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gdouble nowSeconds = _oniontraceplayer_getSeconds(&now);
+
+    /* paths that are too long to be stored as relay ids are sent as they are */
+    for(guint hop = 0; hop < pathLength; hop++) {
+        OnionTraceRelayID relayID = oniontracecircuit_getPathRelay(circuit, hop);
+        gboolean isUsable = _oniontraceplayer_lookupRelay(player, relayID) != NULL;
+
+        if(isUsable && !_oniontraceplayer_isFailing(player, relayID, nowSeconds)) {
+            continue;
+        }
+
+        PlayerHopKind kind = PLAYER_HOP_MIDDLE;
+        if(hop == 0) {
+            kind = PLAYER_HOP_GUARD;
+        } else if(hop == pathLength - 1) {
+            kind = PLAYER_HOP_EXIT;
+        }
+
+        const OnionTraceRouterStatus* substitute = NULL;
+        OnionTraceRelayID substituteID = 0;
+        for(guint attempt = 0; !substitute && attempt < PLAYER_SUBSTITUTE_ATTEMPTS; attempt++) {
+            substitute = _oniontraceplayer_pickSubstitute(player, kind);
+            if(!substitute || _oniontraceplayer_isInPath(player, circuit, substitute)) {
+                substitute = NULL;
+                continue;
+            }
+
+            /* the substitute becomes a relay id like the recorded ones */
+            g_string_truncate(player->pathBuffer, 0);
+            oniontraceconsensus_appendPathEntry(substitute, player->pathBuffer);
+            substituteID = oniontracerelay_intern(player->pathBuffer->str, player->pathBuffer->len);
+
+            if(_oniontraceplayer_isFailing(player, substituteID, nowSeconds)) {
+                substitute = NULL;
+            }
+        }
+
+        if(!substitute) {
+            return FALSE;
+        }
+
+        oniontracecircuit_setPathRelay(circuit, hop, substituteID);
+
+        info("%s: substituted relay %s for %s, which %s",
+                player->id, player->pathBuffer->str, oniontracerelay_getName(relayID),
+                isUsable ? "keeps failing circuits" : "tor can't use");
+        if(isUsable) {
+            player->counts.relaysAvoided++;
+        } else {
+            player->counts.relaysSubstituted++;
+        }
+    }
+
+    return TRUE;
+}
+
 static void _oniontraceplayer_handleSession(OnionTracePlayer* player, Session* session) {
     g_assert(player);
     g_assert(session);
@@ -122,30 +540,60 @@ static void _oniontraceplayer_handleSession(OnionTracePlayer* player, Session* s
     gint circuitID = oniontracecircuit_getCircuitID(circuit);
     CircuitStatus status = oniontracecircuit_getCircuitStatus(circuit);
 
+    session->lastActiveTime = time(NULL);
+
     if(status == CIRCUIT_STATUS_NONE) {
-        if(player->sessionAwaitingAssignment && session == player->sessionAwaitingAssignment) {
-            info("%s: waiting for circuit id assignment for session %s",
-                    player->id, session->id);
-        } else if(player->sessionAwaitingAssignment) {
+        if(session->retryTimerID != 0) {
+            /* the retry timer launches the circuit for all of the streams that are waiting */
+            info("%s: session %s is backing off before it retries its circuit", player->id, session->id);
+        } else if(player->numLaunchesPending >= player->maxLaunchesPending) {
             info("%s: session %s entering assignment backlog", player->id, session->id);
             g_queue_push_tail(player->sessionAssignmentBacklog, session);
         } else {
-            /* launch new circuit */
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            oniontracecircuit_setBuildStartTime(circuit, &now);
+
+            /* launch new circuit, tor will tell us which session it belongs to when it replies */
             if(oniontracecircuit_getFailureCounter(circuit) >= 3) {
-                oniontracetorctl_commandBuildNewCircuit(player->torctl, NULL);
+                oniontracetorctl_commandBuildNewCircuit(player->torctl, NULL, session);
 
                 message("%s: launched new circuit on session %s without path "
                         "(original path failed too many times)",
                         player->id, session->id);
             } else {
-                const gchar* path = oniontracecircuit_getPath(circuit);
-                oniontracetorctl_commandBuildNewCircuit(player->torctl, path);
+                /* don't ask tor to build a path through relays that left the consensus
+                 * or that failed our recent circuits. without a consensus we have no
+                 * substitutes, so tor picks the path instead of a failing relay. */
+                if(player->consensus && oniontracecircuit_hasPath(circuit) &&
+                        !_oniontraceplayer_checkPath(player, circuit)) {
+                    info("%s: dropping the path of the next circuit on session %s, "
+                            "no substitute for a relay we can't use", player->id, session->id);
+                    oniontracecircuit_clearPath(circuit);
+                    player->counts.pathsDropped++;
+                } else if(!player->consensus && oniontracecircuit_hasPath(circuit) &&
+                        _oniontraceplayer_hasFailingRelay(player, circuit)) {
+                    info("%s: dropping the path of the next circuit on session %s, "
+                            "a relay in it keeps failing circuits", player->id, session->id);
+                    oniontracecircuit_clearPath(circuit);
+                    player->counts.relaysAvoided++;
+                    player->counts.pathsDropped++;
+                }
+
+                /* paths are stored as relay ids, so we rebuild the text for the command */
+                const gchar* path = NULL;
+                if(oniontracecircuit_hasPath(circuit)) {
+                    g_string_truncate(player->pathBuffer, 0);
+                    oniontracecircuit_appendPath(circuit, player->pathBuffer);
+                    path = player->pathBuffer->str;
+                }
+                oniontracetorctl_commandBuildNewCircuit(player->torctl, path, session);
 
                 message("%s: launched new circuit on session %s with path %s",
                         player->id, session->id, path ? path : "NULL");
             }
             player->counts.circuitsBuilding++;
-            player->sessionAwaitingAssignment = session;
+            player->numLaunchesPending++;
 
             /* update circuit status */
             oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_LAUNCHED);
@@ -159,11 +607,17 @@ static void _oniontraceplayer_handleSession(OnionTracePlayer* player, Session* s
         info("%s: waiting for circuit %i to be built for session %s",
                 player->id, circuitID, session->id);
     } else if(status == CIRCUIT_STATUS_BUILT) {
-        while(!g_queue_is_empty(session->waitingStreamIDs)) {
-            gint streamID = GPOINTER_TO_INT(g_queue_pop_head(session->waitingStreamIDs));
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        for(guint i = 0; i < session->waitingStreams->len; i++) {
+            WaitingStream* waiting = &g_array_index(session->waitingStreams, WaitingStream, i);
+            gint streamID = waiting->streamID;
 
             if(streamID >= 0) {
                 oniontracetorctl_commandAttachStreamToCircuit(player->torctl, streamID, circuitID);
+                oniontracehistogram_add(player->streamWaitTimes,
+                        _oniontraceplayer_getElapsedMicros(&waiting->waitStartTime, &now));
 
                 info("%s: assigned stream %i to circuit %i for session %s",
                         player->id, streamID, circuitID, session->id);
@@ -174,6 +628,8 @@ static void _oniontraceplayer_handleSession(OnionTracePlayer* player, Session* s
                         player->id, circuitID, session->id);
             }
         }
+
+        g_array_set_size(session->waitingStreams, 0);
     } else {
         gint circuitID = oniontracecircuit_getCircuitID(circuit);
         error("%s: status unknown for circuit %s on session %s", circuitID, session->id);
@@ -183,18 +639,74 @@ static void _oniontraceplayer_handleSession(OnionTracePlayer* player, Session* s
 static void _oniontraceplayer_handleSessionBacklog(OnionTracePlayer* player) {
     g_assert(player);
 
-    while(!player->sessionAwaitingAssignment && !g_queue_is_empty(player->sessionAssignmentBacklog)) {
+    while(player->numLaunchesPending < player->maxLaunchesPending &&
+            !g_queue_is_empty(player->sessionAssignmentBacklog)) {
         Session* session = g_queue_pop_head(player->sessionAssignmentBacklog);
         _oniontraceplayer_handleSession(player, session);
     }
 }
 
+static void _oniontraceplayer_onRetryTimer(OnionTracePlayer* player, Session* session) {
+    g_assert(player);
+    g_assert(session);
+
+    /* this timer does not repeat, so it is gone now */
+    session->retryTimerID = 0;
+    player->numRetriesPending--;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    player->retryBackoffMicros += _oniontraceplayer_getElapsedMicros(&session->retryStartTime, &now);
+
+    if(session->waitingStreams->len > 0) {
+        info("%s: retrying circuit on session %s after %u failures",
+                player->id, session->id, session->numRetries);
+
+        player->counts.circuitsRetried++;
+        g_queue_push_tail(player->sessionAssignmentBacklog, session);
+        _oniontraceplayer_handleSessionBacklog(player);
+    }
+}
+
+/* retries the failed circuit of the session once the backoff passed. the jitter keeps
+ * sessions that failed at the same time, e.g., on the same relay, from retrying together. */
+static void _oniontraceplayer_scheduleRetry(OnionTracePlayer* player, Session* session) {
+    g_assert(player);
+    g_assert(session);
+
+    if(session->retryTimerID != 0) {
+        return;
+    }
+
+    guint64 backoffMicros = (guint64)PLAYER_RETRY_BACKOFF_MIN_MILLIS * 1000 << MIN(session->numRetries, 16);
+    backoffMicros = MIN(backoffMicros, (guint64)PLAYER_RETRY_BACKOFF_MAX_MILLIS * 1000);
+    guint64 delayMicros = (backoffMicros / 2) + (guint64)(g_random_double() * (gdouble)(backoffMicros / 2));
+
+    session->numRetries++;
+    clock_gettime(CLOCK_REALTIME, &session->retryStartTime);
+
+    struct timespec delay;
+    delay.tv_sec = (time_t)(delayMicros / 1000000);
+    delay.tv_nsec = (long)(delayMicros % 1000000) * 1000;
+
+    session->retryTimerID = oniontraceeventmanager_addTimer(player->manager, &delay, NULL,
+            (GFunc)_oniontraceplayer_onRetryTimer, player, session);
+    player->numRetriesPending++;
+
+    info("%s: retrying circuit on session %s in %"G_GUINT64_FORMAT" milliseconds",
+            player->id, session->id, delayMicros / 1000);
+}
+
 static void _oniontraceplayer_onStreamStatus(OnionTracePlayer* player,
         StreamStatus status, gint circuitID, gint streamID, gchar* username) {
     g_assert(player);
 
     /* note: the sourcePort is only valid for STREAM_STATUS_NEW, otherwise its 0 */
 
+    struct timespec now;
+    memset(&now, 0, sizeof(struct timespec));
+    clock_gettime(CLOCK_REALTIME, &now);
+
     /* do the session lookup */
     Session* session = NULL;
     if(username) {
@@ -234,24 +746,22 @@ static void _oniontraceplayer_onStreamStatus(OnionTracePlayer* player,
 
             /* this could happen if an existing session ran out of circuits, or if we created a
              * new session from an id that we never seen before and so it has no circuits either */
-            if(g_queue_is_empty(session->circuitsSorted)) {
+            if(!_oniontraceplayer_peekSessionCircuit(session, 0)) {
                 warning("%s: no circuit exists for session %s; creating new circuit now with NULL path",
                                         player->id, session->id);
 
-                struct timespec now;
-                memset(&now, 0, sizeof(struct timespec));
-                clock_gettime(CLOCK_REALTIME, &now);
-
                 OnionTraceCircuit* circuit = oniontracecircuit_new();
                 oniontracecircuit_setSessionID(circuit, session->id);
                 oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_NONE);
                 oniontracecircuit_setLaunchTime(circuit, &now);
 
-                g_queue_insert_sorted(session->circuitsSorted, circuit,
-                        (GCompareDataFunc)oniontracecircuit_compareLaunchTime, NULL);
+                /* all previous circuits are used up, so we can reuse the array */
+                g_ptr_array_set_size(session->circuitsSorted, 0);
+                session->circuitsHead = 0;
+                g_ptr_array_add(session->circuitsSorted, circuit);
             }
 
-            g_queue_push_tail(session->waitingStreamIDs, GINT_TO_POINTER(streamID));
+            _oniontraceplayer_addWaitingStream(session, streamID, &now);
             player->counts.streamsAssigning++;
             g_queue_push_tail(player->sessionAssignmentBacklog, session);
             _oniontraceplayer_handleSessionBacklog(player);
@@ -283,38 +793,52 @@ static void _oniontraceplayer_onStreamStatus(OnionTracePlayer* player,
     }
 }
 
-static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
-        CircuitStatus status, gint circuitID, gchar* path) {
+static void _oniontraceplayer_onCircuitLaunched(OnionTracePlayer* player, Session* session, gint circuitID) {
     g_assert(player);
+    g_assert(session);
 
-    /* path is non-null only on EXTENDED and BUILT */
-
-    switch(status) {
-        case CIRCUIT_STATUS_ASSIGNED: {
-            info("%s: circuit %i ASSIGNED", player->id, circuitID);
+    player->numLaunchesPending--;
 
-            /* if we build a custom circuit, Tor will assign your path a
-             * circuit id and emit this status event to tell us the circuit id */
-            if(player->sessionAwaitingAssignment) {
-                Session* session = player->sessionAwaitingAssignment;
-                OnionTraceCircuit* circuit = g_queue_peek_head(session->circuitsSorted);
+    /* we never rotate away from a launched circuit, so it is still the current one */
+    OnionTraceCircuit* circuit = _oniontraceplayer_peekSessionCircuit(session, 0);
 
-                /* we now save the circuit id */
-                oniontracecircuit_setCircuitID(circuit, circuitID);
-                oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_ASSIGNED);
+    if(!circuit || oniontracecircuit_getCircuitStatus(circuit) != CIRCUIT_STATUS_LAUNCHED) {
+        warning("%s: session %s has no circuit waiting for launched circuit %i",
+                player->id, session->id, circuitID);
+    } else if(circuitID > 0) {
+        /* tor assigned our path a circuit id, so we now save the circuit id */
+        oniontracecircuit_setCircuitID(circuit, circuitID);
+        oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_ASSIGNED);
 
-                gint* circuitIDPtr = oniontracecircuit_getID(circuit);
-                g_hash_table_replace(player->circuits, circuitIDPtr, circuit);
+        gint* circuitIDPtr = oniontracecircuit_getID(circuit);
+        g_hash_table_replace(player->circuits, circuitIDPtr, circuit);
 
-                info("%s: circuit %i assigned id on session %s", player->id, circuitID, session->id);
+        info("%s: circuit %i assigned id on session %s", player->id, circuitID, session->id);
+    } else {
+        /* tor refused to launch it, e.g., because a relay in the path is unknown */
+        player->counts.circuitsBuilding--;
+        player->counts.circuitsFailed++;
+        oniontracecircuit_incrementFailureCounter(circuit);
+        oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_NONE);
 
-                player->sessionAwaitingAssignment = NULL;
-                _oniontraceplayer_handleSessionBacklog(player);
-            }
+        message("%s: failed to launch circuit on session %s", player->id, session->id);
 
-            break;
+        /* if we have waiting streams, we need to retry */
+        if(session->waitingStreams->len > 0) {
+            _oniontraceplayer_scheduleRetry(player, session);
         }
+    }
 
+    _oniontraceplayer_handleSessionBacklog(player);
+}
+
+static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
+        CircuitStatus status, gint circuitID, gchar* path, gchar* reason) {
+    g_assert(player);
+
+    /* path is non-null only on EXTENDED, BUILT, FAILED, and CLOSED */
+
+    switch(status) {
         case CIRCUIT_STATUS_BUILT: {
             info("%s: circuit %i BUILT", player->id, circuitID);
 
@@ -322,6 +846,14 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
             if(circuit) {
                 player->counts.circuitsBuilding--;
                 player->counts.circuitsBuilt++;
+
+                /* the builds we measure decide how early we launch the circuits to come */
+                struct timespec now;
+                clock_gettime(CLOCK_REALTIME, &now);
+                oniontracehistogram_add(player->buildTimes,
+                        _oniontraceplayer_getElapsedMicros(oniontracecircuit_getBuildStartTime(circuit), &now));
+                _oniontraceplayer_updateBuildLead(player);
+
                 oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_BUILT);
 
                 /* now that its built, we can assign any waiting streams to it */
@@ -331,6 +863,7 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
                 if(session) {
                     message("%s: circuit %i is built for session %s and path %s",
                             player->id, circuitID, sessionID, path);
+                    session->numRetries = 0;
                     _oniontraceplayer_handleSession(player, session);
                 }
             }
@@ -340,14 +873,19 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
 
         case CIRCUIT_STATUS_FAILED:
         case CIRCUIT_STATUS_CLOSED: {
-            info("%s: circuit %i %s", player->id, circuitID,
-                    status == CIRCUIT_STATUS_FAILED ? "FAILED" : "CLOSED");
+            info("%s: circuit %i %s with reason %s", player->id, circuitID,
+                    status == CIRCUIT_STATUS_FAILED ? "FAILED" : "CLOSED", reason ? reason : "NONE");
 
             /* try again if it's one of our circuits */
             OnionTraceCircuit* circuit = g_hash_table_lookup(player->circuits, &circuitID);
             if(circuit) {
+                /* a circuit that closes before it was built failed too, so we back off */
+                gboolean isFailure = status == CIRCUIT_STATUS_FAILED ||
+                        oniontracecircuit_getCircuitStatus(circuit) != CIRCUIT_STATUS_BUILT;
+
                 if(status == CIRCUIT_STATUS_FAILED) {
                     player->counts.circuitsFailed++;
+                    _oniontraceplayer_blameRelay(player, circuit, path, reason);
                     oniontracecircuit_incrementFailureCounter(circuit);
                 }
                 g_hash_table_remove(player->circuits, &circuitID);
@@ -361,13 +899,16 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
                     oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_NONE);
 
                     /* if we have waiting streams, we need to retry */
-                    if(!g_queue_is_empty(session->waitingStreamIDs)) {
-                        const gchar* circuitPath = oniontracecircuit_getPath(circuit);
-                        info("%s: retrying circuit on session %s with path %s",
-                                player->id, sessionID, circuitPath ? circuitPath : "NULL");
-
-                        g_queue_push_tail(player->sessionAssignmentBacklog, session);
-                        _oniontraceplayer_handleSessionBacklog(player);
+                    if(session->waitingStreams->len > 0) {
+                        if(isFailure) {
+                            _oniontraceplayer_scheduleRetry(player, session);
+                        } else {
+                            info("%s: replacing closed circuit %i on session %s",
+                                    player->id, circuitID, sessionID);
+
+                            g_queue_push_tail(player->sessionAssignmentBacklog, session);
+                            _oniontraceplayer_handleSessionBacklog(player);
+                        }
                     }
                 }
             }
@@ -375,6 +916,7 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
             break;
         }
 
+        case CIRCUIT_STATUS_ASSIGNED:
         case CIRCUIT_STATUS_EXTENDED:
         case CIRCUIT_STATUS_LAUNCHED:
         case CIRCUIT_STATUS_NONE:
@@ -386,6 +928,172 @@ static void _oniontraceplayer_onCircuitStatus(OnionTracePlayer* player,
     }
 }
 
+static void _oniontraceplayer_addCircuit(OnionTracePlayer* player, OnionTraceCircuit* circuit) {
+    g_assert(player);
+    g_assert(circuit);
+
+    player->numParsedCircuits++;
+
+    const gchar* sessionID = oniontracecircuit_getSessionID(circuit);
+
+    if(!sessionID || !oniontracecircuit_hasPath(circuit)) {
+        /* there is no session id or path, so we do not need to track it */
+        oniontracecircuit_free(circuit);
+        return;
+    }
+
+    /* the path used to be stored as a string, which we count to show what the relay ids save */
+    player->numPathTextBytes += oniontracecircuit_getPathTextLength(circuit) + 1;
+
+    oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_NONE);
+
+    /* store it in the appropriate session */
+    Session* session = g_hash_table_lookup(player->sessions, sessionID);
+
+    if(!session) {
+        session = _oniontraceplayer_newSession(sessionID);
+        g_hash_table_replace(player->sessions, session->id, session);
+    }
+
+    /* circuits usually arrive in launch order, so we search from the end. we never
+     * insert before the current circuit, since it may already be in use. */
+    guint index = session->circuitsSorted->len;
+    guint minIndex = MIN(session->circuitsHead + 1, session->circuitsSorted->len);
+    while(index > minIndex && oniontracecircuit_compareLaunchTime(
+            g_ptr_array_index(session->circuitsSorted, index - 1), circuit, NULL) > 0) {
+        index--;
+    }
+    g_ptr_array_insert(session->circuitsSorted, (gint)index, circuit);
+    player->numSessionCircuits++;
+
+    /* also store launch info so we can build it preemptively, the build lead before it's needed */
+    LaunchInfo launch;
+    launch.session = session;
+    launch.abstime = *oniontracecircuit_getLaunchTime(circuit);
+
+    index = player->launches->len;
+    while(index > player->launchesHead) {
+        LaunchInfo* previous = &g_array_index(player->launches, LaunchInfo, index - 1);
+        if(previous->abstime.tv_sec < launch.abstime.tv_sec ||
+                (previous->abstime.tv_sec == launch.abstime.tv_sec &&
+                        previous->abstime.tv_nsec <= launch.abstime.tv_nsec)) {
+            break;
+        }
+        index--;
+    }
+    g_array_insert_val(player->launches, index, launch);
+    session->numLaunchesScheduled++;
+}
+
+static void _oniontraceplayer_logPathBytes(OnionTracePlayer* player) {
+    if(player->numSessionCircuits == 0) {
+        return;
+    }
+
+    /* each heap string also costs a pointer and the allocator's overhead, which we leave out */
+    gdouble textBytes = (gdouble)player->numPathTextBytes / (gdouble)player->numSessionCircuits;
+    gsize idBytes = sizeof(OnionTraceRelayID) * ONIONTRACE_CIRCUIT_MAX_HOPS;
+
+    message("%s: circuit paths take %"G_GSIZE_FORMAT" bytes as relay ids instead of %.1f bytes "
+            "as text on average, with %u distinct relays in the process",
+            player->id, idBytes, textBytes, oniontracerelay_getNumRelays());
+}
+
+/* reads circuits from the trace file until we have all of those that launch
+ * within the configured window from now */
+static void _oniontraceplayer_streamCircuits(OnionTracePlayer* player, struct timespec* now) {
+    g_assert(player);
+    g_assert(player->streamFile);
+
+    time_t windowEnd = now->tv_sec + (time_t)player->streamWindowSeconds;
+    struct timespec buildTime;
+
+    while(TRUE) {
+        if(!player->streamNextCircuit) {
+            player->streamNextCircuit = oniontracefile_readCircuit(player->streamFile, &player->startTime);
+
+            if(!player->streamNextCircuit) {
+                /* we reached the end of the trace */
+                message("%s: finished streaming %u circuits (%u with sessions) from tracefile",
+                        player->id, player->numParsedCircuits, player->numSessionCircuits);
+                _oniontraceplayer_logPathBytes(player);
+                oniontracefile_free(player->streamFile);
+                player->streamFile = NULL;
+                return;
+            }
+        }
+
+        _oniontraceplayer_getBuildTime(player, oniontracecircuit_getLaunchTime(player->streamNextCircuit), &buildTime);
+        if(buildTime.tv_sec > windowEnd) {
+            /* keep it until the window moves far enough */
+            return;
+        }
+
+        _oniontraceplayer_addCircuit(player, player->streamNextCircuit);
+        player->streamNextCircuit = NULL;
+    }
+}
+
+static gboolean _oniontraceplayer_isSessionDone(OnionTracePlayer* player, Session* session, time_t now) {
+    if(session->numLaunchesScheduled > 0 || session->waitingStreams->len > 0 ||
+            session->retryTimerID != 0 ||
+            now - session->lastActiveTime < PLAYER_SESSION_IDLE_TIMEOUT_SECONDS) {
+        return FALSE;
+    }
+
+    /* we only free sessions that have no more circuits coming */
+    if(_oniontraceplayer_peekSessionCircuit(session, 1)) {
+        return FALSE;
+    }
+
+    OnionTraceCircuit* circuit = _oniontraceplayer_peekSessionCircuit(session, 0);
+    if(circuit && oniontracecircuit_getCircuitStatus(circuit) == CIRCUIT_STATUS_LAUNCHED) {
+        /* tor still owes us a reply that refers to this session */
+        return FALSE;
+    }
+
+    return g_queue_find(player->sessionAssignmentBacklog, session) == NULL;
+}
+
+/* frees sessions that used all of their circuits and have been idle for a while,
+ * so memory does not grow with the length of the trace */
+static void _oniontraceplayer_reapSessions(OnionTracePlayer* player, time_t now) {
+    g_assert(player);
+
+    player->lastReapTime = now;
+    guint numReaped = 0;
+
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, player->sessions);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+        Session* session = value;
+
+        if(!_oniontraceplayer_isSessionDone(player, session, now)) {
+            continue;
+        }
+
+        /* make sure we don't keep pointers to the circuit we are about to free */
+        OnionTraceCircuit* circuit = _oniontraceplayer_peekSessionCircuit(session, 0);
+        if(circuit) {
+            gint circuitID = oniontracecircuit_getCircuitID(circuit);
+            if(g_hash_table_lookup(player->circuits, &circuitID) == circuit) {
+                g_hash_table_remove(player->circuits, &circuitID);
+            }
+        }
+
+        g_hash_table_iter_remove(&iter);
+        _oniontraceplayer_freeSession(session);
+        numReaped++;
+    }
+
+    if(numReaped > 0) {
+        info("%s: freed %u idle sessions, %u remain", player->id, numReaped,
+                g_hash_table_size(player->sessions));
+    }
+}
+
 /* gets the elapsed time from now until we should build another circuit.
  * returns the relative time, which is 0 if we have no more circuits to build. */
 struct timespec oniontraceplayer_launchNextCircuit(OnionTracePlayer* player) {
@@ -394,41 +1102,103 @@ struct timespec oniontraceplayer_launchNextCircuit(OnionTracePlayer* player) {
     struct timespec nextLaunchTime;
     memset(&nextLaunchTime, 0, sizeof(struct timespec));
 
-    LaunchInfo* launch = g_queue_peek_head(player->launches);
-    if(!launch) {
-        /* return 0 to stop trying to launch more */
-        return nextLaunchTime;
-    }
-
     /* what time is it now */
     struct timespec now;
     memset(&now, 0, sizeof(struct timespec));
     clock_gettime(CLOCK_REALTIME, &now);
 
+    if(player->streamFile) {
+        _oniontraceplayer_streamCircuits(player, &now);
+    }
+
+    /* when the whole trace was loaded up front, it is small enough to keep.
+     * the window stays set after the stream file is exhausted, so we keep reaping. */
+    if(player->streamWindowSeconds > 0 &&
+            now.tv_sec - player->lastReapTime >= PLAYER_SESSION_REAP_INTERVAL_SECONDS) {
+        _oniontraceplayer_reapSessions(player, now.tv_sec);
+    }
+
+    LaunchInfo* launch = (player->launchesHead < player->launches->len) ?
+            &g_array_index(player->launches, LaunchInfo, player->launchesHead) : NULL;
+    if(!launch && !player->streamNextCircuit) {
+        /* return 0 to stop trying to launch more */
+        return nextLaunchTime;
+    }
+
     gboolean callHandleSession = FALSE;
+    struct timespec buildTime;
 
     /* prepare to launch a circuit if its time to do so */
-    while(launch != NULL && (launch->abstime.tv_sec < now.tv_sec ||
-            (launch->abstime.tv_sec == now.tv_sec && launch->abstime.tv_nsec <= now.tv_nsec))) {
+    while(launch != NULL) {
+        /* the lead follows the build times we measure, so it may have changed since we scheduled it */
+        _oniontraceplayer_getBuildTime(player, &launch->abstime, &buildTime);
+        if(buildTime.tv_sec > now.tv_sec ||
+                (buildTime.tv_sec == now.tv_sec && buildTime.tv_nsec > now.tv_nsec)) {
+            break;
+        }
+
+        /* launches scheduled before playback started can't be on time, so we
+         * count those from when we started */
+        struct timespec* dueTime = &buildTime;
+        if(dueTime->tv_sec < player->startTime.tv_sec ||
+                (dueTime->tv_sec == player->startTime.tv_sec && dueTime->tv_nsec < player->startTime.tv_nsec)) {
+            dueTime = &player->startTime;
+        }
+
+        oniontracehistogram_add(player->launchLateness, _oniontraceplayer_getElapsedMicros(dueTime, &now));
+
         /* the circuit should have been launched in the past or now.
          * use negative stream id to build circuit but skip the actual stream assignment */
-        g_queue_push_tail(launch->session->waitingStreamIDs, GINT_TO_POINTER(-1));
+        _oniontraceplayer_addWaitingStream(launch->session, -1, &now);
         g_queue_push_tail(player->sessionAssignmentBacklog, launch->session);
+        launch->session->numLaunchesScheduled--;
 
         callHandleSession = TRUE;
 
         /* now update for the next circuit launch */
-        g_free(g_queue_pop_head(player->launches));
-        launch = g_queue_peek_head(player->launches);
+        player->launchesHead++;
+        launch = (player->launchesHead < player->launches->len) ?
+                &g_array_index(player->launches, LaunchInfo, player->launchesHead) : NULL;
     }
 
     if(callHandleSession) {
         _oniontraceplayer_handleSessionBacklog(player);
     }
 
+    /* drop the launched entries once they make up most of the schedule */
+    if(player->launchesHead >= 1024 && player->launchesHead * 2 >= player->launches->len) {
+        g_array_remove_range(player->launches, 0, player->launchesHead);
+        player->launchesHead = 0;
+        launch = (player->launchesHead < player->launches->len) ?
+                &g_array_index(player->launches, LaunchInfo, player->launchesHead) : NULL;
+    }
+
+    /* we wake up for the next launch, or to read more of the trace, whichever is first */
+    struct timespec wakeTime;
+    memset(&wakeTime, 0, sizeof(struct timespec));
+
     if(launch) {
+        _oniontraceplayer_getBuildTime(player, &launch->abstime, &wakeTime);
+    }
+
+    if(player->streamNextCircuit) {
+        struct timespec readTime;
+        _oniontraceplayer_getBuildTime(player, oniontracecircuit_getLaunchTime(player->streamNextCircuit), &readTime);
+        readTime.tv_sec -= player->streamWindowSeconds;
+
+        if(!launch || readTime.tv_sec < wakeTime.tv_sec ||
+                (readTime.tv_sec == wakeTime.tv_sec && readTime.tv_nsec < wakeTime.tv_nsec)) {
+            wakeTime = readTime;
+        }
+    }
+
+    if(wakeTime.tv_sec > now.tv_sec ||
+            (wakeTime.tv_sec == now.tv_sec && wakeTime.tv_nsec > now.tv_nsec)) {
         /* compute how much time we have from now until the next circuit should launch */
-        oniontracetimer_timespecsubtract(&nextLaunchTime, &now, &launch->abstime);
+        oniontracetimer_timespecsubtract(&nextLaunchTime, &now, &wakeTime);
+    } else {
+        /* we are already late, so try again as soon as possible */
+        nextLaunchTime.tv_nsec = 1;
     }
 
     return nextLaunchTime;
@@ -438,15 +1208,25 @@ gchar* oniontraceplayer_toString(OnionTracePlayer* player) {
     GString* string = g_string_new("");
     g_string_append_printf(string,
             "n_strms_assigning=%u n_strms_assigned=%u n_strms_succeeded=%u n_strms_failed=%u n_strms_detached=%u "
-            "n_circs_building=%u n_circs_built=%u n_circs_failed=%u",
+            "n_circs_launching=%u n_circs_building=%u n_circs_built=%u n_circs_failed=%u "
+            "n_circs_backing_off=%u n_circs_retried=%u retry_backoff_s=%"G_GUINT64_FORMAT" "
+            "n_relays_substituted=%u n_relays_avoided=%u n_paths_dropped=%u "
+            "circ_build_lead_ms=%"G_GUINT64_FORMAT" strm_wait_p50_ms=%"G_GUINT64_FORMAT" strm_wait_p90_ms=%"G_GUINT64_FORMAT,
             player->counts.streamsAssigning, player->counts.streamsAssigned,
             player->counts.streamsSucceeded, player->counts.streamsFailed,
-            player->counts.streamsDetached, player->counts.circuitsBuilding,
-            player->counts.circuitsBuilt, player->counts.circuitsFailed);
+            player->counts.streamsDetached, player->numLaunchesPending, player->counts.circuitsBuilding,
+            player->counts.circuitsBuilt, player->counts.circuitsFailed,
+            player->numRetriesPending, player->counts.circuitsRetried, player->retryBackoffMicros / 1000000,
+            player->counts.relaysSubstituted, player->counts.relaysAvoided, player->counts.pathsDropped,
+            ((guint64)player->buildLead.tv_sec * 1000) + ((guint64)player->buildLead.tv_nsec / 1000000),
+            oniontracehistogram_getQuantile(player->streamWaitTimes, 0.5) / 1000,
+            oniontracehistogram_getQuantile(player->streamWaitTimes, 0.9) / 1000);
     return g_string_free(string, FALSE);
 }
 
-OnionTracePlayer* oniontraceplayer_new(OnionTraceTorCtl* torctl, const gchar* filename) {
+OnionTracePlayer* oniontraceplayer_new(OnionTraceEventManager* manager, OnionTraceTorCtl* torctl,
+        const gchar* filename, guint maxLaunchesPending, guint windowSeconds) {
+    g_assert(manager);
     g_assert(torctl);
 
     struct timespec now;
@@ -461,73 +1241,66 @@ OnionTracePlayer* oniontraceplayer_new(OnionTraceTorCtl* torctl, const gchar* fi
         return NULL;
     }
 
-    /* get the circuits we should create, sorted by launch times */
-    GQueue* parsedCircuits = oniontracefile_parseCircuits(otfile, &now);
-    oniontracefile_free(otfile);
-
-    if(!parsedCircuits) {
-        critical("Error parsing circuits, cannot proceed");
-        return NULL;
-    }
-
     OnionTracePlayer* player = g_new0(OnionTracePlayer, 1);
     player->startTime = now;
+    player->manager = manager;
     player->torctl = torctl;
+    player->maxLaunchesPending = MAX(maxLaunchesPending, 1);
+    player->lastReapTime = now.tv_sec;
 
     player->sessions = g_hash_table_new(g_str_hash, g_str_equal);
     player->circuits = g_hash_table_new(g_int_hash, g_int_equal);
-    player->launches = g_queue_new();
+    player->launches = g_array_new(FALSE, FALSE, sizeof(LaunchInfo));
 
     player->sessionAssignmentBacklog = g_queue_new();
+    player->pathBuffer = g_string_new(NULL);
+    player->relayHealth = g_array_new(FALSE, TRUE, sizeof(RelayHealth));
+    player->launchLateness = oniontracehistogram_new();
+    player->buildTimes = oniontracehistogram_new();
+    player->streamWaitTimes = oniontracehistogram_new();
+
+    /* until it is configured, build between 1 and 10 seconds early */
+    player->buildLeadQuantile = 0.9;
+    player->buildLeadMinMicros = 1000000;
+    player->buildLeadMaxMicros = 10000000;
+    _oniontraceplayer_updateBuildLead(player);
 
     GString* idbuf = g_string_new(NULL);
     g_string_printf(idbuf, "Player");
     player->id = g_string_free(idbuf, FALSE);
 
-    guint numParsedCircuits = g_queue_get_length(parsedCircuits);
-    guint numSessionCircuits = 0;
-
-    /* store the circuits with session ids so we can build them when needed */
-    while(!g_queue_is_empty(parsedCircuits)) {
-        OnionTraceCircuit* circuit = g_queue_pop_head(parsedCircuits);
-
-        const gchar* sessionID = oniontracecircuit_getSessionID(circuit);
-        const gchar* path = oniontracecircuit_getPath(circuit);
-
-        if(sessionID && path) {
-            oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_NONE);
-
-            /* store it in the appropriate session */
-            Session* session = g_hash_table_lookup(player->sessions, sessionID);
-
-            if(!session) {
-                session = _oniontraceplayer_newSession(sessionID);
-                g_hash_table_replace(player->sessions, session->id, session);
-            }
-
-            g_queue_insert_sorted(session->circuitsSorted, circuit,
-                    (GCompareDataFunc)oniontracecircuit_compareLaunchTime, NULL);
-            numSessionCircuits++;
+    if(windowSeconds > 0) {
+        /* keep the file open and only read the part of the trace we need soon */
+        player->streamFile = otfile;
+        player->streamWindowSeconds = windowSeconds;
+        _oniontraceplayer_streamCircuits(player, &now);
 
-            /* also store launch info so we can launch it before its needed */
-            LaunchInfo* launch = g_new0(LaunchInfo, 1);
-            launch->session = session;
-            launch->abstime = *oniontracecircuit_getLaunchTime(circuit);
-
-            /* we will try to build circuits preemptively */
-            launch->abstime.tv_sec -= 10; /* build 10 seconds early */
+        message("%s: streaming circuits from tracefile %s with a %u second window",
+                player->id, filename, windowSeconds);
+    } else {
+        /* get the circuits we should create, sorted by launch times */
+        GPtrArray* parsedCircuits = oniontracefile_parseCircuits(otfile, &now);
+        oniontracefile_free(otfile);
+
+        if(!parsedCircuits) {
+            critical("Error parsing circuits, cannot proceed");
+            oniontraceplayer_free(player);
+            return NULL;
+        }
 
-            g_queue_push_tail(player->launches, launch);
-        } else {
-            /* there is no session id or path, so we do not need to track it */
-            oniontracecircuit_free(circuit);
+        /* store the circuits with session ids so we can build them when needed. the parsed
+         * circuits are already sorted, so each one is appended to its session's circuits
+         * and to the launch schedule. */
+        for(guint i = 0; i < parsedCircuits->len; i++) {
+            _oniontraceplayer_addCircuit(player, g_ptr_array_index(parsedCircuits, i));
         }
-    }
 
-    g_queue_free(parsedCircuits);
+        g_ptr_array_free(parsedCircuits, TRUE);
 
-    message("%s: successfully parsed %u circuits (%u with sessions) from tracefile %s",
-            player->id, numParsedCircuits, numSessionCircuits, filename);
+        message("%s: successfully parsed %u circuits (%u with sessions) from tracefile %s",
+                player->id, player->numParsedCircuits, player->numSessionCircuits, filename);
+        _oniontraceplayer_logPathBytes(player);
+    }
 
     /* we will watch status on circuits and streams asynchronously.
      * set this before we tell Tor to stop attaching streams for us. */
@@ -535,6 +1308,8 @@ OnionTracePlayer* oniontraceplayer_new(OnionTraceTorCtl* torctl, const gchar* fi
             (OnCircuitStatusFunc)_oniontraceplayer_onCircuitStatus, player);
     oniontracetorctl_setStreamStatusCallback(player->torctl,
             (OnStreamStatusFunc)_oniontraceplayer_onStreamStatus, player);
+    oniontracetorctl_setCircuitLaunchedCallback(player->torctl,
+            (OnCircuitLaunchedFunc)_oniontraceplayer_onCircuitLaunched, player);
 
     /* set the config for Tor so streams stay unattached */
     oniontracetorctl_commandSetupTorConfig(player->torctl);
@@ -545,6 +1320,34 @@ OnionTracePlayer* oniontraceplayer_new(OnionTraceTorCtl* torctl, const gchar* fi
     return player;
 }
 
+void oniontraceplayer_setBuildLead(OnionTracePlayer* player, gdouble quantile,
+        guint minMillis, guint maxMillis) {
+    g_assert(player);
+
+    player->buildLeadQuantile = CLAMP(quantile, 0.0, 1.0);
+    player->buildLeadMinMicros = (guint64)minMillis * 1000;
+    player->buildLeadMaxMicros = MAX((guint64)maxMillis * 1000, player->buildLeadMinMicros);
+    _oniontraceplayer_updateBuildLead(player);
+
+    message("%s: building circuits ahead of their launch time by the p%.0f build time, "
+            "between %u and %u milliseconds", player->id, player->buildLeadQuantile * 100,
+            minMillis, maxMillis);
+}
+
+/* the consensus is not owned by the player and must outlive it */
+void oniontraceplayer_setConsensus(OnionTracePlayer* player, OnionTraceConsensus* consensus) {
+    g_assert(player);
+    g_assert(consensus);
+
+    player->consensus = consensus;
+    if(!player->relayStatuses) {
+        player->relayStatuses = g_ptr_array_new();
+    }
+
+    message("%s: checking circuit paths against the %u relays in the consensus",
+            player->id, oniontraceconsensus_getNumRelays(consensus));
+}
+
 void oniontraceplayer_free(OnionTracePlayer* player) {
     g_assert(player);
 
@@ -557,7 +1360,15 @@ void oniontraceplayer_free(OnionTracePlayer* player) {
     }
 
     if(player->launches) {
-        g_queue_free_full(player->launches, g_free);
+        g_array_free(player->launches, TRUE);
+    }
+
+    if(player->streamNextCircuit) {
+        oniontracecircuit_free(player->streamNextCircuit);
+    }
+
+    if(player->streamFile) {
+        oniontracefile_free(player->streamFile);
     }
 
     if(player->sessions) {
@@ -568,6 +1379,9 @@ void oniontraceplayer_free(OnionTracePlayer* player) {
         while (g_hash_table_iter_next(&iter, &key, &value)) {
             Session* session = value;
             if(session) {
+                if(session->retryTimerID != 0) {
+                    oniontraceeventmanager_cancelTimer(player->manager, session->retryTimerID);
+                }
                 _oniontraceplayer_freeSession(session);
             }
         }
@@ -575,6 +1389,51 @@ void oniontraceplayer_free(OnionTracePlayer* player) {
         g_hash_table_destroy(player->sessions);
     }
 
+    if(player->launchLateness) {
+        if(oniontracehistogram_getCount(player->launchLateness) > 0) {
+            gchar* lateness = oniontracehistogram_toString(player->launchLateness);
+            message("%s: circuit launch lateness in microseconds: %s", player->id, lateness);
+            g_free(lateness);
+        }
+        oniontracehistogram_free(player->launchLateness);
+    }
+
+    if(player->buildTimes) {
+        if(oniontracehistogram_getCount(player->buildTimes) > 0) {
+            gchar* buildTimes = oniontracehistogram_toString(player->buildTimes);
+            message("%s: circuit build times in microseconds: %s", player->id, buildTimes);
+            g_free(buildTimes);
+        }
+        oniontracehistogram_free(player->buildTimes);
+    }
+
+    if(player->streamWaitTimes) {
+        if(oniontracehistogram_getCount(player->streamWaitTimes) > 0) {
+            gchar* waitTimes = oniontracehistogram_toString(player->streamWaitTimes);
+            message("%s: stream attach wait times in microseconds: %s", player->id, waitTimes);
+            g_free(waitTimes);
+        }
+        oniontracehistogram_free(player->streamWaitTimes);
+    }
+
+    if(player->pathBuffer) {
+        g_string_free(player->pathBuffer, TRUE);
+    }
+
+    if(player->relayStatuses) {
+        g_ptr_array_free(player->relayStatuses, TRUE);
+    }
+
+    if(player->relayHealth) {
+        g_array_free(player->relayHealth, TRUE);
+    }
+
+    for(guint i = 0; i < PLAYER_NUM_HOP_KINDS; i++) {
+        if(player->substituteCandidates[i]) {
+            g_array_free(player->substituteCandidates[i], TRUE);
+        }
+    }
+
     if(player->id) {
         g_free(player->id);
     }
@@ -8,13 +8,26 @@
 #include <time.h>
 #include <glib.h>
 
+#include "oniontrace-event-manager.h"
 #include "oniontrace-torctl.h"
+#include "oniontrace-consensus.h"
 
 typedef struct _OnionTracePlayer OnionTracePlayer;
 
-OnionTracePlayer* oniontraceplayer_new(OnionTraceTorCtl* torctl, const gchar* filename);
+/* the manager runs the timers that retry failed circuits */
+OnionTracePlayer* oniontraceplayer_new(OnionTraceEventManager* manager, OnionTraceTorCtl* torctl,
+        const gchar* filename, guint maxLaunchesPending, guint windowSeconds);
 void oniontraceplayer_free(OnionTracePlayer* player);
 
+/* circuits are built ahead of their recorded launch time by the given quantile of
+ * the build times we measured, but at least minMillis and at most maxMillis */
+void oniontraceplayer_setBuildLead(OnionTracePlayer* player, gdouble quantile,
+        guint minMillis, guint maxMillis);
+
+/* if set, relays tor can't use or that keep failing our circuits are replaced in
+ * paths before they are launched */
+void oniontraceplayer_setConsensus(OnionTracePlayer* player, OnionTraceConsensus* consensus);
+
 gchar* oniontraceplayer_toString(OnionTracePlayer* player);
 
 struct timespec oniontraceplayer_launchNextCircuit(OnionTracePlayer* player);
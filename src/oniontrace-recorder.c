@@ -12,7 +12,15 @@ struct _OnionTraceRecorder {
     gchar* id;
     struct timespec startTime;
 
+    /* the open circuits by id. all circuits are kept in launchOrder, which owns
+     * them, until they closed and all circuits launched before them were written.
+     * that way the trace is in launch order, which is what play mode reads. a
+     * circuit that is open for longer than reorderSeconds stops holding back the
+     * others, and is written out of order once it closes. */
     GHashTable* circuits;
+    GQueue* launchOrder;
+    guint numCircuitsHeld;
+    guint reorderSeconds;
 
     OnionTraceFile* otfile;
 
@@ -20,6 +28,37 @@ struct _OnionTraceRecorder {
     gsize streamCountTotal;
 };
 
+/* writes the closed circuits at the front of the launch order, up to the first
+ * circuit that is still open and was launched within the reorder window */
+static void _oniontracerecorder_writeClosedCircuits(OnionTraceRecorder* recorder) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    GList* link = g_queue_peek_head_link(recorder->launchOrder);
+    while(link != NULL) {
+        OnionTraceCircuit* circuit = link->data;
+        GList* next = link->next;
+
+        if(oniontracecircuit_getCircuitStatus(circuit) == CIRCUIT_STATUS_CLOSED) {
+            g_queue_delete_link(recorder->launchOrder, link);
+            recorder->numCircuitsHeld--;
+
+            /* only write the circuit if it was build and we have a path for it */
+            if(oniontracecircuit_hasPath(circuit)) {
+                oniontracefile_writeCircuit(recorder->otfile, circuit, &recorder->startTime);
+            }
+
+            info("%s: freeing circuit %i", recorder->id, oniontracecircuit_getCircuitID(circuit));
+            oniontracecircuit_free(circuit);
+        } else if(now.tv_sec - oniontracecircuit_getLaunchTime(circuit)->tv_sec < (time_t)recorder->reorderSeconds) {
+            /* all circuits after this one launched later, so they wait for it */
+            break;
+        }
+
+        link = next;
+    }
+}
+
 static void _oniontracerecorder_onStreamStatus(OnionTraceRecorder* recorder,
         StreamStatus status, gint circuitID, gint streamID, gchar* username) {
     g_assert(recorder);
@@ -82,10 +121,10 @@ static void _oniontracerecorder_onStreamStatus(OnionTraceRecorder* recorder,
 }
 
 static void _oniontracerecorder_onCircuitStatus(OnionTraceRecorder* recorder,
-        CircuitStatus status, gint circuitID, gchar* path) {
+        CircuitStatus status, gint circuitID, gchar* path, gchar* reason) {
     g_assert(recorder);
 
-    /* path is non-null only on EXTENDED and BUILT */
+    /* path is non-null only on EXTENDED, BUILT, FAILED, and CLOSED */
 
     switch(status) {
         /* if we build a custom circuit, Tor will assign your path a
@@ -114,6 +153,7 @@ static void _oniontracerecorder_onCircuitStatus(OnionTraceRecorder* recorder,
                 }
 
                 g_hash_table_replace(recorder->circuits, oniontracecircuit_getID(circuit), circuit);
+                g_queue_push_tail(recorder->launchOrder, circuit);
             }
 
             break;
@@ -142,15 +182,13 @@ static void _oniontracerecorder_onCircuitStatus(OnionTraceRecorder* recorder,
 
             OnionTraceCircuit* circuit = g_hash_table_lookup(recorder->circuits, &circuitID);
             if(circuit) {
-                /* only write the circuit if it was build and we have a path for it */
-                if(oniontracecircuit_getPath(circuit) != NULL) {
-                    /* write the circuit record to disk */
-                    oniontracefile_writeCircuit(recorder->otfile, circuit, &recorder->startTime);
-                }
-
-                /* remove it from our table, which will also free the circuit memory */
-                info("%s: removing and freeing circuit %i", recorder->id, circuitID);
+                /* it is written once all circuits launched before it are closed too */
+                info("%s: removing circuit %i", recorder->id, circuitID);
                 g_hash_table_remove(recorder->circuits, &circuitID);
+
+                oniontracecircuit_setCircuitStatus(circuit, CIRCUIT_STATUS_CLOSED);
+                recorder->numCircuitsHeld++;
+                _oniontracerecorder_writeClosedCircuits(recorder);
             }
 
             break;
@@ -165,6 +203,14 @@ static void _oniontracerecorder_onCircuitStatus(OnionTraceRecorder* recorder,
     }
 }
 
+/* writes all buffered circuit records to the trace file */
+void oniontracerecorder_flush(OnionTraceRecorder* recorder) {
+    g_assert(recorder);
+    /* circuits held back by one that has been open too long are due now */
+    _oniontracerecorder_writeClosedCircuits(recorder);
+    oniontracefile_flush(recorder->otfile);
+}
+
 void oniontracerecorder_cleanup(OnionTraceRecorder* recorder) {
     oniontracetorctl_commandGetAllCircuitStatusCleanup(recorder->torctl);
 }
@@ -186,18 +232,23 @@ gchar* oniontracerecorder_toString(OnionTraceRecorder* recorder) {
 
     GString* string = g_string_new("");
     g_string_append_printf(string,
-            "n_circs_act=%u n_strms_act=%u n_circs_tot=%zu n_strms_tot=%zu",
+            "n_circs_act=%u n_strms_act=%u n_circs_tot=%zu n_strms_tot=%zu n_circs_held=%u n_bytes_pending=%zu",
             circuitCountActive, streamCountActive,
-            recorder->circuitCountTotal, recorder->streamCountTotal);
+            recorder->circuitCountTotal, recorder->streamCountTotal,
+            recorder->numCircuitsHeld, oniontracefile_getPendingBytes(recorder->otfile));
     return g_string_free(string, FALSE);
 }
 
-OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar* filename) {
+OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar* filename,
+        gsize flushBytes, guint flushCircuits, guint reorderSeconds) {
     OnionTraceFile* otfile = oniontracefile_newWriter(filename);
     if(!otfile) {
         return NULL;
     }
 
+    /* records are buffered and written out in batches */
+    oniontracefile_setFlushPolicy(otfile, flushBytes, flushCircuits);
+
     OnionTraceRecorder* recorder = g_new0(OnionTraceRecorder, 1);
 
     recorder->torctl = torctl;
@@ -209,8 +260,9 @@ OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar
     g_string_printf(idbuf, "Recorder");
     recorder->id = g_string_free(idbuf, FALSE);
 
-    recorder->circuits = g_hash_table_new_full(g_int_hash, g_int_equal, NULL,
-            (GDestroyNotify)oniontracecircuit_free);
+    recorder->circuits = g_hash_table_new(g_int_hash, g_int_equal);
+    recorder->launchOrder = g_queue_new();
+    recorder->reorderSeconds = reorderSeconds;
 
     /* we will watch status on circuits and streams asynchronously.
      * set these before we start listening for circuit and stream events. */
@@ -233,25 +285,24 @@ OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar
 void oniontracerecorder_free(OnionTraceRecorder* recorder) {
     g_assert(recorder);
 
-    if(recorder->circuits) {
-        /* record any leftover circuits */
-        GHashTableIter iter;
-        gpointer key, value;
-
-        g_hash_table_iter_init(&iter, recorder->circuits);
-        while (g_hash_table_iter_next(&iter, &key, &value)) {
-            OnionTraceCircuit* circuit = value;
-            /* only write the circuit if it was build and we have a path for it */
-            if(circuit && oniontracecircuit_getPath(circuit) != NULL) {
-                oniontracefile_writeCircuit(recorder->otfile, circuit, &recorder->startTime);
+    if(recorder->launchOrder) {
+        /* record any leftover circuits, in launch order like the others */
+        for(GList* link = g_queue_peek_head_link(recorder->launchOrder); link != NULL; link = link->next) {
+            if(oniontracecircuit_getCircuitStatus(link->data) != CIRCUIT_STATUS_CLOSED) {
+                oniontracecircuit_setCircuitStatus(link->data, CIRCUIT_STATUS_CLOSED);
+                recorder->numCircuitsHeld++;
             }
         }
+        _oniontracerecorder_writeClosedCircuits(recorder);
+        g_queue_free(recorder->launchOrder);
+    }
 
-        /* free all of the circuits */
+    if(recorder->circuits) {
         g_hash_table_destroy(recorder->circuits);
     }
 
     if(recorder->otfile) {
+        /* this flushes everything we still have buffered */
         oniontracefile_free(recorder->otfile);
     }
 
@@ -9,10 +9,15 @@
 
 typedef struct _OnionTraceRecorder OnionTraceRecorder;
 
-OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar* filename);
+/* tor's default MaxCircuitDirtiness, so that only unusually long-lived circuits are written out of order */
+#define ONIONTRACE_RECORDER_DEFAULT_REORDER_SECONDS 600
+
+OnionTraceRecorder* oniontracerecorder_new(OnionTraceTorCtl* torctl, const gchar* filename,
+        gsize flushBytes, guint flushCircuits, guint reorderSeconds);
 void oniontracerecorder_free(OnionTraceRecorder* recorder);
 
 void oniontracerecorder_cleanup(OnionTraceRecorder* recorder);
+void oniontracerecorder_flush(OnionTraceRecorder* recorder);
 
 gchar* oniontracerecorder_toString(OnionTraceRecorder* recorder);
 
@@ -0,0 +1,154 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "oniontrace.h"
+
+/* the names are kept in fixed pages that never move once allocated, so we can
+ * look up a name without taking the lock. a thread only learns an id from
+ * intern(), which takes the lock after the page was stored. */
+#define RELAY_PAGE_BITS 12
+#define RELAY_PAGE_SIZE (1 << RELAY_PAGE_BITS)
+#define RELAY_MAX_PAGES 1024
+
+/* '$' followed by the hex encoded identity */
+#define RELAY_FINGERPRINT_LENGTH 41
+
+typedef struct _OnionTraceRelay {
+    /* the fingerprint, or the whole path entry if it has none */
+    gchar* key;
+    /* the path entry we saw first, which includes the nickname */
+    gchar* name;
+    gsize length;
+} OnionTraceRelay;
+
+static GMutex relayLock;
+/* key string to id + 1, so that a missing entry is NULL */
+static GHashTable* relayIDs = NULL;
+static OnionTraceRelay* relayPages[RELAY_MAX_PAGES];
+static guint numRelays = 0;
+
+/* each thread keeps its own key to id + 1 table in front of the shared one, so the
+ * lock is only taken the first time a thread sees a relay. the keys are the keys
+ * in the pages, which are never freed. */
+static GPrivate threadRelayIDs = G_PRIVATE_INIT((GDestroyNotify)g_hash_table_destroy);
+
+/* returns the length of the part of the path entry that identifies the relay */
+static gsize _oniontracerelay_getKeyLength(const gchar* name, gsize length) {
+    if(length < RELAY_FINGERPRINT_LENGTH || name[0] != '$') {
+        return length;
+    }
+    for(gsize i = 1; i < RELAY_FINGERPRINT_LENGTH; i++) {
+        if(!g_ascii_isxdigit(name[i])) {
+            return length;
+        }
+    }
+    /* '$FP', '$FP~nick' or '$FP=nick' */
+    if(length > RELAY_FINGERPRINT_LENGTH &&
+            name[RELAY_FINGERPRINT_LENGTH] != '~' && name[RELAY_FINGERPRINT_LENGTH] != '=') {
+        return length;
+    }
+    return RELAY_FINGERPRINT_LENGTH;
+}
+
+static OnionTraceRelayID _oniontracerelay_internShared(const gchar* key, const gchar* name, gsize length) {
+    g_mutex_lock(&relayLock);
+
+    if(!relayIDs) {
+        relayIDs = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
+    OnionTraceRelayID relayID;
+    gpointer value = g_hash_table_lookup(relayIDs, key);
+
+    if(value) {
+        relayID = GPOINTER_TO_UINT(value) - 1;
+    } else {
+        relayID = numRelays;
+
+        guint page = relayID >> RELAY_PAGE_BITS;
+        if(page >= RELAY_MAX_PAGES) {
+            error("too many distinct relays in circuit paths, at most %u are supported",
+                    RELAY_MAX_PAGES * RELAY_PAGE_SIZE);
+            g_mutex_unlock(&relayLock);
+            abort();
+        }
+        if(!relayPages[page]) {
+            relayPages[page] = g_new0(OnionTraceRelay, RELAY_PAGE_SIZE);
+        }
+
+        OnionTraceRelay* relay = &relayPages[page][relayID & (RELAY_PAGE_SIZE - 1)];
+        relay->key = g_strdup(key);
+        relay->name = g_strndup(name, length);
+        relay->length = length;
+
+        g_hash_table_insert(relayIDs, relay->key, GUINT_TO_POINTER(relayID + 1));
+        numRelays++;
+    }
+
+    g_mutex_unlock(&relayLock);
+
+    return relayID;
+}
+
+static OnionTraceRelay* _oniontracerelay_get(OnionTraceRelayID relayID) {
+    OnionTraceRelay* page = relayPages[relayID >> RELAY_PAGE_BITS];
+    g_assert(page);
+    return &page[relayID & (RELAY_PAGE_SIZE - 1)];
+}
+
+OnionTraceRelayID oniontracerelay_intern(const gchar* name, gsize length) {
+    g_assert(name);
+
+    gsize keyLength = _oniontracerelay_getKeyLength(name, length);
+
+    /* the common path entries are short, so we avoid allocating just to look them up */
+    gchar keyBuffer[128];
+    gchar* key = (keyLength < sizeof(keyBuffer)) ? keyBuffer : g_malloc(keyLength + 1);
+    memcpy(key, name, keyLength);
+    key[keyLength] = '\0';
+    if(keyLength == RELAY_FINGERPRINT_LENGTH) {
+        /* tor writes fingerprints in upper case, but we don't rely on it */
+        for(gsize i = 1; i < keyLength; i++) {
+            key[i] = g_ascii_toupper(key[i]);
+        }
+    }
+
+    GHashTable* threadIDs = g_private_get(&threadRelayIDs);
+    if(!threadIDs) {
+        threadIDs = g_hash_table_new(g_str_hash, g_str_equal);
+        g_private_set(&threadRelayIDs, threadIDs);
+    }
+
+    OnionTraceRelayID relayID;
+    gpointer value = g_hash_table_lookup(threadIDs, key);
+
+    if(value) {
+        relayID = GPOINTER_TO_UINT(value) - 1;
+    } else {
+        relayID = _oniontracerelay_internShared(key, name, length);
+        g_hash_table_insert(threadIDs, _oniontracerelay_get(relayID)->key,
+                GUINT_TO_POINTER(relayID + 1));
+    }
+
+    if(key != keyBuffer) {
+        g_free(key);
+    }
+
+    return relayID;
+}
+
+const gchar* oniontracerelay_getName(OnionTraceRelayID relayID) {
+    return _oniontracerelay_get(relayID)->name;
+}
+
+gsize oniontracerelay_getNameLength(OnionTraceRelayID relayID) {
+    return _oniontracerelay_get(relayID)->length;
+}
+
+guint oniontracerelay_getNumRelays() {
+    g_mutex_lock(&relayLock);
+    guint count = numRelays;
+    g_mutex_unlock(&relayLock);
+    return count;
+}
@@ -0,0 +1,29 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef SRC_ONIONTRACE_RELAY_H_
+#define SRC_ONIONTRACE_RELAY_H_
+
+#include <glib.h>
+
+/* traces name the same few thousand relays over and over, so each relay is
+ * stored once for the whole process and circuits refer to it by id. a relay is
+ * identified by the '$FINGERPRINT' of its path entry, so a relay that changed
+ * its nickname keeps its id and the path entry of its first sighting. entries
+ * without a fingerprint are identified by the whole entry. the table is shared
+ * by all shard threads, and relays are never removed from it. each thread
+ * caches the ids it has seen, so only the first sighting of a relay in a
+ * thread takes the table's lock. */
+typedef guint32 OnionTraceRelayID;
+
+/* returns the id of the relay of the given path entry, which need not be NUL-terminated */
+OnionTraceRelayID oniontracerelay_intern(const gchar* name, gsize length);
+
+/* returns the path entry of an id returned by intern(); the string stays valid forever */
+const gchar* oniontracerelay_getName(OnionTraceRelayID relayID);
+gsize oniontracerelay_getNameLength(OnionTraceRelayID relayID);
+
+guint oniontracerelay_getNumRelays();
+
+#endif /* SRC_ONIONTRACE_RELAY_H_ */
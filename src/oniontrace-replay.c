@@ -0,0 +1,311 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* replays a capture file written with the CaptureFile option through a
+ * controller and the recorder, player, or logger, as fast as possible. the
+ * bytes are fed in the chunks that we received them in, or in chunks of a
+ * fixed size, and we report how many lines per second we handled and how
+ * many allocations each line cost. commands are dropped, so a player only
+ * sees the replies that tor sent to the original session. */
+
+#include "oniontrace.h"
+#include "oniontrace-allocations.h"
+
+typedef struct _ReplayConfig {
+    gchar* captureFilename;
+    OnionTraceMode mode;
+    GLogLevelFlags logLevel;
+    /* 0 feeds the chunks as they were captured */
+    gsize chunkSize;
+    guint repeat;
+    gchar* traceFilename;
+    OnionTraceOutputFormat outputFormat;
+    gchar* outputFilename;
+} ReplayConfig;
+
+typedef struct _OnionTraceReplay {
+    ReplayConfig config;
+
+    /* the received bytes from the capture, and the length of each captured chunk */
+    GByteArray* stream;
+    GArray* chunkLengths;
+
+    /* we never run its main loop, so the player's retry timers never fire */
+    OnionTraceEventManager* manager;
+    OnionTraceTorCtl* torctl;
+    OnionTraceRecorder* recorder;
+    OnionTracePlayer* player;
+    OnionTraceLogger* logger;
+} OnionTraceReplay;
+
+static gboolean _oniontracereplay_parseConfigEntry(ReplayConfig* config, const gchar* key, gchar* value) {
+    gboolean isValid = TRUE;
+
+    if(!g_ascii_strcasecmp(key, "CaptureFile")) {
+        g_free(config->captureFilename);
+        config->captureFilename = g_strdup(value);
+    } else if(!g_ascii_strcasecmp(key, "Mode")) {
+        if(!g_ascii_strcasecmp(value, "log")) {
+            config->mode = ONIONTRACE_MODE_LOG;
+        } else if(!g_ascii_strcasecmp(value, "record")) {
+            config->mode = ONIONTRACE_MODE_RECORD;
+        } else if(!g_ascii_strcasecmp(value, "play")) {
+            config->mode = ONIONTRACE_MODE_PLAY;
+        } else {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "LogLevel")) {
+        isValid = oniontraceconfig_parseLogLevel(value, &config->logLevel);
+    } else if(!g_ascii_strcasecmp(key, "ChunkSize")) {
+        gint64 chunkSize = g_ascii_strtoll(value, NULL, 10);
+        isValid = (chunkSize >= 0);
+        config->chunkSize = (gsize)MAX(chunkSize, 0);
+    } else if(!g_ascii_strcasecmp(key, "Repeat")) {
+        gint repeat = atoi(value);
+        isValid = (repeat > 0);
+        config->repeat = (guint)MAX(repeat, 0);
+    } else if(!g_ascii_strcasecmp(key, "TraceFile")) {
+        g_free(config->traceFilename);
+        config->traceFilename = g_strdup(value);
+    } else if(!g_ascii_strcasecmp(key, "OutputFormat")) {
+        if(!g_ascii_strcasecmp(value, "text")) {
+            config->outputFormat = ONIONTRACE_OUTPUT_TEXT;
+        } else if(!g_ascii_strcasecmp(value, "jsonl")) {
+            config->outputFormat = ONIONTRACE_OUTPUT_JSONL;
+        } else if(!g_ascii_strcasecmp(value, "binary")) {
+            config->outputFormat = ONIONTRACE_OUTPUT_BINARY;
+        } else {
+            isValid = FALSE;
+        }
+    } else if(!g_ascii_strcasecmp(key, "OutputFile")) {
+        g_free(config->outputFilename);
+        config->outputFilename = g_strdup(value);
+    } else {
+        warning("unrecognized key '%s' in config", key);
+        isValid = FALSE;
+    }
+
+    return isValid;
+}
+
+static gboolean _oniontracereplay_parseConfig(ReplayConfig* config, gint argc, gchar* argv[]) {
+    config->mode = ONIONTRACE_MODE_LOG;
+    config->logLevel = G_LOG_LEVEL_MESSAGE;
+    config->chunkSize = 0;
+    config->repeat = 1;
+    config->outputFormat = ONIONTRACE_OUTPUT_TEXT;
+
+    if(!oniontraceconfig_parseArgs(argc, argv, (OnionTraceConfigEntryFunc)_oniontracereplay_parseConfigEntry, config)) {
+        return FALSE;
+    }
+
+    if(!config->captureFilename) {
+        critical("missing required argument `CaptureFile`");
+        return FALSE;
+    }
+
+    if(config->mode == ONIONTRACE_MODE_PLAY && !config->traceFilename) {
+        critical("missing required argument `TraceFile` in play mode");
+        return FALSE;
+    }
+
+    /* we only care about how fast we are, not about the trace we record */
+    if(config->mode == ONIONTRACE_MODE_RECORD && !config->traceFilename) {
+        config->traceFilename = g_strdup("/dev/null");
+    }
+
+    /* structured output needs a file, and the benchmark does not need to keep it */
+    if(config->outputFormat != ONIONTRACE_OUTPUT_TEXT && !config->outputFilename) {
+        config->outputFilename = g_strdup("/dev/null");
+    }
+
+    return TRUE;
+}
+
+/* reads the received bytes out of the capture before we start the clock */
+static gboolean _oniontracereplay_loadCapture(OnionTraceReplay* replay) {
+    gchar* contents = NULL;
+    gsize length = 0;
+    GError* error = NULL;
+
+    if(!g_file_get_contents(replay->config.captureFilename, &contents, &length, &error)) {
+        critical("unable to read capture '%s': %s", replay->config.captureFilename, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    if(length < TORCTL_CAPTURE_HEADER_LENGTH ||
+            memcmp(contents, TORCTL_CAPTURE_MAGIC, TORCTL_CAPTURE_MAGIC_LENGTH) != 0) {
+        critical("'%s' is not a capture file", replay->config.captureFilename);
+        g_free(contents);
+        return FALSE;
+    }
+
+    replay->stream = g_byte_array_sized_new((guint)length);
+    replay->chunkLengths = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+    gsize offset = TORCTL_CAPTURE_HEADER_LENGTH;
+    while(offset + TORCTL_CAPTURE_RECORD_HEADER_LENGTH <= length) {
+        /* the timestamp comes first, we replay as fast as possible so we skip it */
+        guint32 chunkLength;
+        memcpy(&chunkLength, &contents[offset + sizeof(guint64)], sizeof(chunkLength));
+        chunkLength = GUINT32_FROM_LE(chunkLength);
+        offset += TORCTL_CAPTURE_RECORD_HEADER_LENGTH;
+
+        if(offset + chunkLength > length) {
+            /* oniontrace was probably killed while writing the capture */
+            warning("ignoring the truncated last chunk of capture '%s'", replay->config.captureFilename);
+            break;
+        }
+
+        g_byte_array_append(replay->stream, (const guint8*)&contents[offset], chunkLength);
+        g_array_append_val(replay->chunkLengths, chunkLength);
+        offset += chunkLength;
+    }
+
+    g_free(contents);
+
+    message("Replay: loaded %u chunks with %u bytes from capture '%s'", replay->chunkLengths->len,
+            replay->stream->len, replay->config.captureFilename);
+    return replay->stream->len > 0;
+}
+
+static gboolean _oniontracereplay_start(OnionTraceReplay* replay) {
+    ReplayConfig* config = &replay->config;
+
+    replay->torctl = oniontracetorctl_newReplay();
+
+    if(config->mode == ONIONTRACE_MODE_RECORD) {
+        replay->recorder = oniontracerecorder_new(replay->torctl, config->traceFilename, 65536, 0,
+                ONIONTRACE_RECORDER_DEFAULT_REORDER_SECONDS);
+        return replay->recorder != NULL;
+    } else if(config->mode == ONIONTRACE_MODE_PLAY) {
+        replay->manager = oniontraceeventmanager_new();
+        replay->player = oniontraceplayer_new(replay->manager, replay->torctl, config->traceFilename, 10, 0);
+        return replay->player != NULL;
+    } else {
+        replay->logger = oniontracelogger_new(replay->torctl, "BW", config->outputFormat,
+                config->outputFilename, 65536, FALSE, FALSE, NULL);
+        return replay->logger != NULL;
+    }
+}
+
+static void _oniontracereplay_feed(OnionTraceReplay* replay, const gchar* bytes, gsize length) {
+    oniontracetorctl_replayBytes(replay->torctl, bytes, length);
+
+    /* give the player a chance to launch the circuits that are due */
+    if(replay->player) {
+        oniontraceplayer_launchNextCircuit(replay->player);
+    }
+}
+
+static void _oniontracereplay_run(OnionTraceReplay* replay) {
+    const gchar* stream = (const gchar*)replay->stream->data;
+    gsize streamLength = replay->stream->len;
+    gsize chunkSize = replay->config.chunkSize;
+    gsize numChunks = 0;
+
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+    gsize allocationsBefore = oniontraceallocations_getCount();
+#endif
+    guint64 startTime = oniontracetimer_getMonotonicNanos();
+
+    for(guint i = 0; i < replay->config.repeat; i++) {
+        if(chunkSize == 0) {
+            gsize offset = 0;
+            for(guint j = 0; j < replay->chunkLengths->len; j++) {
+                guint32 chunkLength = g_array_index(replay->chunkLengths, guint32, j);
+                _oniontracereplay_feed(replay, &stream[offset], chunkLength);
+                offset += chunkLength;
+            }
+            numChunks += replay->chunkLengths->len;
+        } else {
+            for(gsize offset = 0; offset < streamLength; offset += chunkSize) {
+                _oniontracereplay_feed(replay, &stream[offset], MIN(chunkSize, streamLength - offset));
+                numChunks++;
+            }
+        }
+    }
+
+    guint64 elapsed = oniontracetimer_getMonotonicNanos() - startTime;
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+    gsize allocations = oniontraceallocations_getCount() - allocationsBefore;
+#endif
+
+    /* make sure the replay's own log lines are not part of the time */
+    oniontrace_flushLog();
+
+    gsize lines = oniontracetorctl_getNumLinesReceived(replay->torctl);
+    gdouble seconds = (gdouble)elapsed / 1000000000.0;
+
+    message("Replay: handled %zu lines (%zu bytes in %zu chunks) in %.3f seconds (%.1f lines/s)",
+            lines, streamLength * replay->config.repeat, numChunks, seconds,
+            seconds > 0.0 ? (gdouble)lines / seconds : 0.0);
+#ifdef ONIONTRACE_COUNT_ALLOCATIONS
+    message("Replay: made %zu allocations (%.2f allocations/line)",
+            allocations, lines > 0 ? (gdouble)allocations / (gdouble)lines : 0.0);
+#else
+    message("Replay: allocations are only counted in builds with glibc and without sanitizers");
+#endif
+
+    gchar* status = NULL;
+    if(replay->recorder) {
+        status = oniontracerecorder_toString(replay->recorder);
+    } else if(replay->player) {
+        status = oniontraceplayer_toString(replay->player);
+    } else if(replay->logger) {
+        status = oniontracelogger_toString(replay->logger);
+    }
+    if(status) {
+        message("Replay: %s", status);
+        g_free(status);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    OnionTraceReplay replay;
+    memset(&replay, 0, sizeof(OnionTraceReplay));
+
+    if(!_oniontracereplay_parseConfig(&replay.config, argc, argv)) {
+        oniontrace_flushLog();
+        return EXIT_FAILURE;
+    }
+    globalLogFilterLevel = replay.config.logLevel;
+
+    gboolean success = _oniontracereplay_loadCapture(&replay) && _oniontracereplay_start(&replay);
+
+    if(success) {
+        _oniontracereplay_run(&replay);
+    } else {
+        critical("Replay: error setting up the replay, cannot proceed");
+    }
+
+    if(replay.recorder) {
+        oniontracerecorder_free(replay.recorder);
+    }
+    if(replay.player) {
+        oniontraceplayer_free(replay.player);
+    }
+    if(replay.logger) {
+        oniontracelogger_free(replay.logger);
+    }
+    if(replay.torctl) {
+        oniontracetorctl_free(replay.torctl);
+    }
+    if(replay.manager) {
+        oniontraceeventmanager_free(replay.manager);
+    }
+    if(replay.stream) {
+        g_byte_array_free(replay.stream, TRUE);
+    }
+    if(replay.chunkLengths) {
+        g_array_free(replay.chunkLengths, TRUE);
+    }
+    g_free(replay.config.captureFilename);
+    g_free(replay.config.traceFilename);
+    g_free(replay.config.outputFilename);
+
+    oniontrace_flushLog();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
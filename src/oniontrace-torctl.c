@@ -4,10 +4,41 @@
 
 #include "oniontrace.h"
 
+/* initial size of the receive buffer, which grows if a line does not fit */
+#define TORCTL_RECEIVE_BUFFER_SIZE 16384
+/* max number of queued commands we hand to a single writev() call */
+#define TORCTL_MAX_SEND_IOVECS 64
+
 typedef enum {
     TORCTL_NONE, TORCTL_AUTHENTICATE, TORCTL_BOOTSTRAP, TORCTL_PROCESSING
 } TorCtlState;
 
+/* the kinds of commands whose replies we need to match up with the command */
+typedef enum {
+    TORCTL_COMMAND_OTHER, TORCTL_COMMAND_EXTENDCIRCUIT, TORCTL_COMMAND_GETINFO
+} TorCtlCommandType;
+
+/* how a received line fits into the replies to our commands */
+typedef enum {
+    TORCTL_LINE_EVENT,       /* an async event, or a line we don't understand */
+    TORCTL_LINE_REPLY,       /* a mid reply line, like '250-key=value' */
+    TORCTL_LINE_DATA_BEGIN,  /* a line like '250+key=', which is followed by a data block */
+    TORCTL_LINE_DATA,        /* a line inside of a data block */
+    TORCTL_LINE_DATA_END,    /* the '.' line that ends a data block */
+    TORCTL_LINE_FINAL_REPLY  /* the last line of a reply to one of our commands */
+} TorCtlLineKind;
+
+/* a command that was sent to tor and is still waiting for its final reply line */
+typedef struct _TorCtlPendingCommand {
+    TorCtlCommandType type;
+    /* the launch arg for EXTENDCIRCUIT, or the user data of the data reply handler */
+    gpointer arg;
+    const TorCtlDataReplyHandler* dataReply;
+    /* CLOCK_MONOTONIC time in nanoseconds when the last byte of the command was
+     * written, or 0 while it waits to be written */
+    guint64 sentTime;
+} TorCtlPendingCommand;
+
 struct _OnionTraceTorCtl {
     OnionTraceEventManager* manager;
 
@@ -16,252 +47,290 @@ struct _OnionTraceTorCtl {
     in_port_t controlClientPort;
     TorCtlState state;
     GQueue* commands;
+    /* number of bytes of the command at the head of the queue already sent */
+    gsize commandsHeadOffset;
+    /* the descriptor stays registered for reading once connected, and we only
+     * ask for write events while commands are waiting to be sent */
+    gboolean isConnected;
+    gboolean isWriteEventSet;
+    /* set once tor closed the connection; commands are dropped from then on */
+    gboolean isDisconnected;
+    gsize numCommandsDropped;
+
+    /* tor replies to commands in order, so we keep them in a FIFO until the reply arrives */
+    GQueue* pendingCommands;
+    gboolean isReceivingDataReply;
+    /* the pending command whose handler gets the lines of the current data block */
+    TorCtlPendingCommand* dataReplyCommand;
+    /* microseconds from queueing each command until its final reply line arrived */
+    OnionTraceHistogram* commandRoundTripTimes;
 
     /* flag used for watch bootstrapping status */
     gboolean isStatusEventSet;
 
-    /* flags used for parsing descriptors */
-    gboolean waitingGetDescriptorsResponse;
-    gboolean currentlyReceivingDescriptors;
-    GQueue* descriptorLines;
-
-    /* flags used for parsing circuits */
-    gboolean circuitStatusCleanup;
-    gboolean waitingCircuitStatusResponse;
-    gboolean currentlyReceivingCircuitStatuses;
-    GQueue* circuitStatusLines;
-
-    GString* receiveLineBuffer;
+    /* persistent receive buffer; complete lines are framed in place */
+    gchar* receiveBuffer;
+    gsize receiveBufferSize;
+    gsize receiveBufferStart;
+    gsize receiveBufferEnd;
+    gsize receiveBufferScanned;
+    /* number of complete lines we handled, for throughput reports */
+    gsize linesReceived;
+
+    /* if set, we append every chunk of bytes we receive to this capture file */
+    OnionTraceFile* captureFile;
+    /* a replay controller has no socket, it is fed bytes from a capture file.
+     * commands are dropped instead of sent, but still wait for their reply. */
+    gboolean isReplay;
 
     OnConnectedFunc onConnected;
     gpointer onConnectedArg;
+    OnDisconnectedFunc onDisconnected;
+    gpointer onDisconnectedArg;
     OnAuthenticatedFunc onAuthenticated;
     gpointer onAuthenticatedArg;
     OnBootstrappedFunc onBootstrapped;
     gpointer onBootstrappedArg;
-    OnDescriptorsReceivedFunc onDescriptorsReceived;
-    gpointer onDescriptorsReceivedArg;
     OnCircuitStatusFunc onCircuitStatus;
     gpointer onCircuitStatusArg;
     OnStreamStatusFunc onStreamStatus;
     gpointer onStreamStatusArg;
     OnLineReceivedFunc onLineReceived;
     gpointer onLineReceivedArg;
+    OnCircuitLaunchedFunc onCircuitLaunched;
+    gpointer onCircuitLaunchedArg;
 
     gchar* id;
 };
 
 static void _oniontracetorctl_commandWatchBootstrapStatus(OnionTraceTorCtl* torctl);
 
-static gint _oniontracetorctl_parseCode(gchar* line) {
-    gchar** parts1 = g_strsplit(line, " ", 0);
-    gchar** parts2 = g_strsplit_set(parts1[0], "-+", 0);
-    gint code = atoi(parts2[0]);
-    g_strfreev(parts1);
-    g_strfreev(parts2);
+static gint _oniontracetorctl_parseCode(const gchar* line, gsize length) {
+    gint code = 0;
+    for(gsize i = 0; i < length && g_ascii_isdigit(line[i]); i++) {
+        code = (code * 10) + (line[i] - '0');
+    }
     return code;
 }
 
-static gint _oniontracetorctl_parseBootstrapProgress(gchar* line) {
-    gint progress = -1;
-    gchar** parts = g_strsplit(line, " ", 0);
-    gchar* part = NULL;
-    gboolean foundBootstrap = FALSE;
-    for(gint j = 0; (part = parts[j]) != NULL; j++) {
-        gchar** subparts = g_strsplit(part, "=", 0);
-        if(!g_ascii_strncasecmp(subparts[0], "BOOTSTRAP", 9)) {
-            foundBootstrap = TRUE;
-        } else if(foundBootstrap && !g_ascii_strncasecmp(subparts[0], "PROGRESS", 8)) {
-            progress = atoi(subparts[1]);
-        }
-        g_strfreev(subparts);
-    }
-    g_strfreev(parts);
-    return progress;
+static gint _oniontracetorctl_tokenToInt(TorCtlToken* token) {
+    return token ? _oniontracetorctl_parseCode(token->str, token->len) : 0;
 }
 
-static void _oniontracetorctl_processDescriptorLine(OnionTraceTorCtl* torctl, GString* linebuf) {
-    /* handle descriptor info */
-    if(!torctl->descriptorLines &&
-            !g_ascii_strncasecmp(linebuf->str, "250+ns/all=", MIN(linebuf->len, 11))) {
-        info("%s: 'GETINFO ns/all\\r\\n' command successful, descriptor response coming next", torctl->id);
-        torctl->descriptorLines = g_queue_new();
+gboolean oniontracetorctl_tokenEquals(TorCtlToken* token, const gchar* str) {
+    gsize len = strlen(str);
+    return token->len == len && !g_ascii_strncasecmp(token->str, str, len);
+}
+
+/* splits the line into its parts in a single forward pass without copying anything.
+ * if hasCode is FALSE, the line is a data reply line and has no code or keyword. */
+void oniontracetorctl_tokenize(gchar* line, gsize length, gboolean hasCode, TorCtlLine* parsed) {
+    parsed->code = 0;
+    parsed->separator = 0;
+    parsed->keyword.str = NULL;
+    parsed->keyword.len = 0;
+    parsed->numArgs = 0;
+    parsed->numKeywords = 0;
+    parsed->isExit = FALSE;
+
+    gsize i = 0;
+    gboolean needKeyword = hasCode;
+
+    if(hasCode) {
+        for(; i < length && g_ascii_isdigit(line[i]); i++) {
+            parsed->code = (parsed->code * 10) + (line[i] - '0');
+        }
+        if(i < length) {
+            /* one of ' ', '-', or '+', the keyword starts right after it */
+            parsed->separator = line[i++];
+        }
     }
 
-    if(torctl->descriptorLines) {
-        /* descriptors coming */
-        if(!g_ascii_strncasecmp(linebuf->str, "250+ns/all=", MIN(linebuf->len, 11))) {
-            /* header */
-            debug("%s: got descriptor response header '%s'", torctl->id, linebuf->str);
-            torctl->currentlyReceivingDescriptors = TRUE;
-            torctl->waitingGetDescriptorsResponse = FALSE;
-        } else if(linebuf->str[0] == '.') {
-            /* footer */
-            debug("%s: got descriptor response footer '%s'", torctl->id, linebuf->str);
-        } else if(!g_ascii_strncasecmp(linebuf->str, "250 OK", MIN(linebuf->len, 6))) {
-            /* all done with descriptors */
-            info("%s: finished getting descriptors with success code '%s'", torctl->id, linebuf->str);
+    while(i < length) {
+        /* skip the spaces between tokens */
+        while(i < length && line[i] == ' ') {
+            i++;
+        }
+        if(i >= length) {
+            break;
+        }
 
-            torctl->currentlyReceivingDescriptors = FALSE;
+        gsize start = i;
+        gsize equals = 0;
+        gboolean isKeyName = TRUE;
 
-            if(torctl->onDescriptorsReceived) {
-                torctl->onDescriptorsReceived(torctl->onDescriptorsReceivedArg, torctl->descriptorLines);
+        for(; i < length && line[i] != ' '; i++) {
+            gchar c = line[i];
+            if(c == '=') {
+                /* paths may contain '=' in long names, but keys are plain words */
+                if(!equals && isKeyName && i > start) {
+                    equals = i;
+                }
+                isKeyName = FALSE;
+            } else if(c == '.') {
+                if(length - i >= 5 && !memcmp(&line[i+1], "exit", 4)) {
+                    parsed->isExit = TRUE;
+                }
+                isKeyName = FALSE;
+            } else if(isKeyName && !g_ascii_isalnum(c) && c != '_') {
+                isKeyName = FALSE;
             }
+        }
 
-            /* clean up any leftover lines */
-            while(g_queue_get_length(torctl->descriptorLines) > 0) {
-                g_free(g_queue_pop_head(torctl->descriptorLines));
+        if(needKeyword) {
+            parsed->keyword.str = &line[start];
+            parsed->keyword.len = i - start;
+            needKeyword = FALSE;
+        } else if(equals) {
+            if(parsed->numKeywords < TORCTL_MAX_KEYWORDS) {
+                TorCtlKeyword* keyword = &parsed->keywords[parsed->numKeywords++];
+                keyword->key.str = &line[start];
+                keyword->key.len = equals - start;
+                keyword->value.str = &line[equals+1];
+                keyword->value.len = i - equals - 1;
             }
-            g_queue_free(torctl->descriptorLines);
-            torctl->descriptorLines = NULL;
-        } else {
-            /* real descriptor lines */
-            g_queue_push_tail(torctl->descriptorLines, g_strdup(linebuf->str));
+        } else if(parsed->numArgs < TORCTL_MAX_ARGS) {
+            TorCtlToken* arg = &parsed->args[parsed->numArgs++];
+            arg->str = &line[start];
+            arg->len = i - start;
         }
     }
 }
 
-static void _oniontracetorctl_handleCircuitStatuses(OnionTraceTorCtl* torctl) {
-    if(!torctl || !torctl->circuitStatusLines) {
-        return;
-    }
+TorCtlToken* oniontracetorctl_getArg(TorCtlLine* parsed, guint index) {
+    return index < parsed->numArgs ? &parsed->args[index] : NULL;
+}
 
-    /* if there is no callback set, we will take no action so no need to parse anything */
-    if(!torctl->onCircuitStatus) {
-        return;
+/* returns the value of the last keyword arg with the given key, or NULL */
+TorCtlToken* oniontracetorctl_getKeywordValue(TorCtlLine* parsed, const gchar* key) {
+    for(gint i = (gint)parsed->numKeywords - 1; i >= 0; i--) {
+        if(oniontracetorctl_tokenEquals(&parsed->keywords[i].key, key)) {
+            return &parsed->keywords[i].value;
+        }
     }
+    return NULL;
+}
 
-    while(g_queue_get_length(torctl->circuitStatusLines) > 0) {
-        gchar* line = g_queue_pop_head(torctl->circuitStatusLines);
-        info("GETINFO circuit-status result: %s", line);
-
-        gint circuitID = 0;
-        gchar* path = NULL;
+/* terminates the token in place so it can be passed on as a string. this
+ * overwrites the space following the token, so only do it after tokenizing. */
+static gchar* _oniontracetorctl_terminateToken(TorCtlToken* token) {
+    if(!token) {
+        return NULL;
+    }
+    token->str[token->len] = '\0';
+    return token->str;
+}
 
-        gchar** parts = g_strsplit(line, " ", 0);
-        if(parts[0] != NULL) {
-            circuitID = atoi(parts[0]);
-        }
-        if(parts[2] != NULL) {
-            path = g_strdup(parts[2]);
-        }
-        g_strfreev(parts);
+static gint _oniontracetorctl_parseBootstrapProgress(gchar* line, gsize length) {
+    /* lines look like: 250-status/bootstrap-phase=NOTICE BOOTSTRAP PROGRESS=100 TAG=done ...
+     * or like: 650 STATUS_CLIENT NOTICE BOOTSTRAP PROGRESS=100 TAG=done ... */
+    TorCtlLine parsed;
+    oniontracetorctl_tokenize(line, length, TRUE, &parsed);
 
-        if(torctl->circuitStatusCleanup) {
-            /* simulate a close event so recorder can clean up circuit */
-            torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_CLOSED, circuitID, path);
-        } else {
-            /* simulate a create event so recorder can log circuit */
-            torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_ASSIGNED, circuitID, NULL);
-            torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_BUILT, circuitID, path);
+    gboolean foundBootstrap = FALSE;
+    for(guint i = 0; i < parsed.numArgs; i++) {
+        if(oniontracetorctl_tokenEquals(&parsed.args[i], "BOOTSTRAP")) {
+            foundBootstrap = TRUE;
         }
+    }
 
-        if(path != NULL) {
-            g_free(path);
-        }
+    TorCtlToken* progress = oniontracetorctl_getKeywordValue(&parsed, "PROGRESS");
+    if(foundBootstrap && progress) {
+        return _oniontracetorctl_tokenToInt(progress);
+    } else {
+        return -1;
     }
 }
 
-static void _oniontracetorctl_processCircuitStatusLine(OnionTraceTorCtl* torctl, GString* linebuf) {
-    /* handle descriptor info */
-    if(!torctl->circuitStatusLines &&
-            !g_ascii_strncasecmp(linebuf->str, "250+circuit-status=", MIN(linebuf->len, 19))) {
-        info("%s: 'GETINFO circuit-status\\r\\n' command successful, circuit-status coming next", torctl->id);
-        torctl->circuitStatusLines = g_queue_new();
+/* lines look like: 3 BUILT <path> BUILD_FLAGS=... */
+static void _oniontracetorctl_processCircuitStatusLine(OnionTraceTorCtl* torctl,
+        gchar* line, gsize length, gboolean isCleanup) {
+    /* if there is no callback set, we will take no action so no need to parse anything */
+    if(!torctl->onCircuitStatus || length == 0) {
+        return;
     }
 
-    if(torctl->circuitStatusLines) {
-        /* circuits coming */
-        if(!g_ascii_strncasecmp(linebuf->str, "250+circuit-status=", MIN(linebuf->len, 19))) {
-            /* header */
-            debug("%s: got circuit-status response header '%s'", torctl->id, linebuf->str);
-            torctl->currentlyReceivingCircuitStatuses = TRUE;
-            torctl->waitingCircuitStatusResponse = FALSE;
-        } else if(linebuf->str[0] == '.') {
-            /* footer */
-            debug("%s: got circuit-status response footer '%s'", torctl->id, linebuf->str);
-        } else if(!g_ascii_strncasecmp(linebuf->str, "250 OK", MIN(linebuf->len, 6))) {
-            /* all done with descriptors */
-            info("%s: finished getting circuit-status with success code '%s'", torctl->id, linebuf->str);
+    info("GETINFO circuit-status result: %s", line);
 
-            torctl->currentlyReceivingCircuitStatuses = FALSE;
+    TorCtlLine parsed;
+    oniontracetorctl_tokenize(line, length, FALSE, &parsed);
 
-            _oniontracetorctl_handleCircuitStatuses(torctl);
+    gint circuitID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 0));
+    gchar* path = _oniontracetorctl_terminateToken(oniontracetorctl_getArg(&parsed, 2));
 
-            /* clean up any leftover lines */
-            while(g_queue_get_length(torctl->circuitStatusLines) > 0) {
-                g_free(g_queue_pop_head(torctl->circuitStatusLines));
-            }
-            g_queue_free(torctl->circuitStatusLines);
-            torctl->circuitStatusLines = NULL;
-        } else {
-            /* real descriptor lines */
-            g_queue_push_tail(torctl->circuitStatusLines, g_strdup(linebuf->str));
-        }
+    if(isCleanup) {
+        /* simulate a close event so recorder can clean up circuit */
+        torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_CLOSED, circuitID, path, NULL);
+    } else {
+        /* simulate a create event so recorder can log circuit */
+        torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_ASSIGNED, circuitID, NULL, NULL);
+        torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_BUILT, circuitID, path, NULL);
     }
 }
 
-static in_port_t _oniontracetorctl_scanSourcePort(gchar** parts) {
-    in_port_t sourcePort = 0;
-    for(gint i = 0; parts != NULL && parts[i] != NULL; i++) {
-        if(!g_ascii_strncasecmp(parts[i], "SOURCE_ADDR=", 12)) {
-            gchar** sourceParts = g_strsplit(&parts[i][12], ":", 0);
-
-            if(sourceParts[0] && sourceParts[1]) {
-                sourcePort = (in_port_t)atoi(sourceParts[1]);
-            }
+static void _oniontracetorctl_onCircuitStatusLine(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    _oniontracetorctl_processCircuitStatusLine(torctl, line, length, FALSE);
+}
 
-            g_strfreev(sourceParts);
-        }
-    }
-    return sourcePort;
+static void _oniontracetorctl_onCircuitStatusCleanupLine(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    _oniontracetorctl_processCircuitStatusLine(torctl, line, length, TRUE);
 }
 
-static gchar* _oniontracetorctl_scanUsername(gchar** parts) {
-    gchar* username = NULL;
-    for(gint i = 0; parts != NULL && parts[i] != NULL; i++) {
-        if(!g_ascii_strncasecmp(parts[i], "USERNAME=", 9)) {
-            username = g_strdup(&parts[i][9]);
-        }
+static void _oniontracetorctl_onCircuitStatusEnd(OnionTraceTorCtl* torctl, gboolean success) {
+    if(success) {
+        info("%s: finished getting circuit-status", torctl->id);
+    } else {
+        warning("%s: tor refused to give us the circuit-status", torctl->id);
     }
-    return username;
 }
 
-static StreamStatus _oniontracetorctl_parseStreamStatus(gchar* statusStr) {
-    if(statusStr != NULL) {
-        if(!g_ascii_strncasecmp(statusStr, "NEW", 3)) {
+static const TorCtlDataReplyHandler circuitStatusHandler = {
+    NULL, (OnDataReplyLineFunc)_oniontracetorctl_onCircuitStatusLine,
+    (OnDataReplyEndFunc)_oniontracetorctl_onCircuitStatusEnd
+};
+
+static const TorCtlDataReplyHandler circuitStatusCleanupHandler = {
+    NULL, (OnDataReplyLineFunc)_oniontracetorctl_onCircuitStatusCleanupLine,
+    (OnDataReplyEndFunc)_oniontracetorctl_onCircuitStatusEnd
+};
+
+StreamStatus oniontracetorctl_parseStreamStatus(TorCtlToken* statusStr) {
+    /* only the first 3 characters are significant */
+    if(statusStr != NULL && statusStr->len >= 3) {
+        if(!g_ascii_strncasecmp(statusStr->str, "NEW", 3)) {
             return STREAM_STATUS_NEW;
-        } else if(!g_ascii_strncasecmp(statusStr, "SUCCEEDED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "SUCCEEDED", 3)) {
             return STREAM_STATUS_SUCCEEDED;
-        } else if(!g_ascii_strncasecmp(statusStr, "DETACHED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "DETACHED", 3)) {
             return STREAM_STATUS_DETACHED;
-        } else if(!g_ascii_strncasecmp(statusStr, "FAILED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "FAILED", 3)) {
             return STREAM_STATUS_FAILED;
-        } else if(!g_ascii_strncasecmp(statusStr, "CLOSED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "CLOSED", 3)) {
             return STREAM_STATUS_CLOSED;
         }
     }
     return STREAM_STATUS_NONE;
 }
 
-static CircuitStatus _oniontracetorctl_parseCircuitStatus(gchar* statusStr) {
-    if(statusStr != NULL) {
-        if(!g_ascii_strncasecmp(statusStr, "LAUNCHED", 3)) {
+CircuitStatus oniontracetorctl_parseCircuitStatus(TorCtlToken* statusStr) {
+    /* only the first 3 characters are significant */
+    if(statusStr != NULL && statusStr->len >= 3) {
+        if(!g_ascii_strncasecmp(statusStr->str, "LAUNCHED", 3)) {
             return CIRCUIT_STATUS_LAUNCHED;
-        } else if(!g_ascii_strncasecmp(statusStr, "EXTENDED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "EXTENDED", 3)) {
             return CIRCUIT_STATUS_EXTENDED;
-        } else if(!g_ascii_strncasecmp(statusStr, "BUILT", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "BUILT", 3)) {
             return CIRCUIT_STATUS_BUILT;
-        } else if(!g_ascii_strncasecmp(statusStr, "FAILED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "FAILED", 3)) {
             return CIRCUIT_STATUS_FAILED;
-        } else if(!g_ascii_strncasecmp(statusStr, "CLOSED", 3)) {
+        } else if(!g_ascii_strncasecmp(statusStr->str, "CLOSED", 3)) {
             return CIRCUIT_STATUS_CLOSED;
         }
     }
     return CIRCUIT_STATUS_NONE;
 }
 
-static void _oniontracetorctl_processLineHelper(OnionTraceTorCtl* torctl, GString* linebuf) {
+static void _oniontracetorctl_processLineHelper(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
     /* circuit responses that we care about:
      *   250 EXTENDED 3    (in response to an EXTEND command)
      *   650 CIRC 3 LAUNCHED ...
@@ -281,131 +350,225 @@ static void _oniontracetorctl_processLineHelper(OnionTraceTorCtl* torctl, GStrin
      *   650 STREAM 21 CLOSED 20 11.0.0.6:18080 ...
      */
 
-    if(torctl->currentlyReceivingDescriptors) {
-        _oniontracetorctl_processDescriptorLine(torctl, linebuf);
-        return;
-    } else if(torctl->currentlyReceivingCircuitStatuses) {
-        _oniontracetorctl_processCircuitStatusLine(torctl, linebuf);
-        return;
-    }
-
-    gint code = _oniontracetorctl_parseCode(linebuf->str);
-
-    if(code == 250) {
-        if(torctl->waitingGetDescriptorsResponse &&
-                !g_ascii_strncasecmp(linebuf->str, "250+ns/all=", MIN(linebuf->len, 11))) {
-            _oniontracetorctl_processDescriptorLine(torctl, linebuf);
-        } else if(torctl->waitingCircuitStatusResponse &&
-                !g_ascii_strncasecmp(linebuf->str, "250+circuit-status=", MIN(linebuf->len, 19))) {
-            _oniontracetorctl_processCircuitStatusLine(torctl, linebuf);
-        } else if(!g_ascii_strncasecmp(linebuf->str, "250 EXTENDED ", MIN(linebuf->len, 13))) {
-            gchar** parts = g_strsplit(linebuf->str, " ", 0);
+    TorCtlLine parsed;
+    oniontracetorctl_tokenize(line, length, TRUE, &parsed);
 
-            gint circuitID = 0;
-
-            if(parts[0] && parts[1] && parts[2]) {
-                circuitID = atoi(parts[2]);
-            }
-
-            g_strfreev(parts);
+    if(parsed.code == 250) {
+        if(parsed.separator == ' ' && oniontracetorctl_tokenEquals(&parsed.keyword, "EXTENDED")) {
+            gint circuitID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 0));
 
             if(torctl->onCircuitStatus) {
-                torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_ASSIGNED, circuitID, NULL);
+                torctl->onCircuitStatus(torctl->onCircuitStatusArg, CIRCUIT_STATUS_ASSIGNED, circuitID, NULL, NULL);
             }
         }
-    } else if(code == 650) {
+    } else if(parsed.code == 650 && parsed.separator == ' ') {
         /* ignore internal .exit streams/circuits */
-        if(g_strstr_len(linebuf->str, linebuf->len, ".exit")) {
-            debug("%s: ignoring tor-internal response '%s'", torctl->id, linebuf->str);
+        if(parsed.isExit) {
+            debug("%s: ignoring tor-internal response '%s'", torctl->id, line);
             return;
         }
 
-        if(!g_ascii_strncasecmp(linebuf->str, "650 CIRC ", MIN(linebuf->len, 9))) {
-            gchar** parts = g_strsplit(linebuf->str, " ", 0);
-
-            gint circuitID = 0;
-            CircuitStatus status = CIRCUIT_STATUS_NONE;
+        if(oniontracetorctl_tokenEquals(&parsed.keyword, "CIRC")) {
+            /* args are: <circuitID> <status> [<path>] */
+            gint circuitID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 0));
+            CircuitStatus status = oniontracetorctl_parseCircuitStatus(oniontracetorctl_getArg(&parsed, 1));
             gchar* path = NULL;
-
-            if(parts[0] && parts[1] && parts[2]) {
-                circuitID = atoi(parts[2]);
-                if(parts[3]) {
-                    status = _oniontracetorctl_parseCircuitStatus(parts[3]);
-
-                    /* get path if we can */
-                    if(status == CIRCUIT_STATUS_EXTENDED ||
-                            status == CIRCUIT_STATUS_BUILT ||
-                            status == CIRCUIT_STATUS_CLOSED) {
-                        if(parts[4]) {
-                            path = g_strdup(parts[4]);
-                        }
-                    }
-                }
+            gchar* reason = NULL;
+
+            /* get path if we can */
+            if(status == CIRCUIT_STATUS_EXTENDED ||
+                    status == CIRCUIT_STATUS_BUILT ||
+                    status == CIRCUIT_STATUS_FAILED ||
+                    status == CIRCUIT_STATUS_CLOSED) {
+                path = _oniontracetorctl_terminateToken(oniontracetorctl_getArg(&parsed, 2));
             }
 
-            g_strfreev(parts);
+            /* tor tells us why the circuit failed or closed */
+            if(status == CIRCUIT_STATUS_FAILED || status == CIRCUIT_STATUS_CLOSED) {
+                reason = _oniontracetorctl_terminateToken(oniontracetorctl_getKeywordValue(&parsed, "REASON"));
+            }
 
             if(torctl->onCircuitStatus) {
-                torctl->onCircuitStatus(torctl->onCircuitStatusArg, status, circuitID, path);
+                torctl->onCircuitStatus(torctl->onCircuitStatusArg, status, circuitID, path, reason);
             }
-            if(path != NULL) {
-                g_free(path);
-            }
-        } else if(!g_ascii_strncasecmp(linebuf->str, "650 STREAM ", MIN(linebuf->len, 11))) {
-            gchar** parts = g_strsplit(linebuf->str, " ", 0);
-
-            gint streamID = 0, circuitID = 0;
-            in_port_t clientPort = 0;
+        } else if(oniontracetorctl_tokenEquals(&parsed.keyword, "STREAM")) {
+            /* args are: <streamID> <status> <circuitID> <target> */
+            gint streamID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 0));
+            gint circuitID = 0;
             StreamStatus status = STREAM_STATUS_NONE;
             gchar* username = NULL;
 
-            if(parts[0] && parts[1] && parts[2]) {
-                streamID = atoi(parts[2]);
-                if(parts[3] && parts[4]) {
-                    status = _oniontracetorctl_parseStreamStatus(parts[3]);
-                    circuitID = atoi(parts[4]);
-                    /* note: the sourcePort is only valid for STREAM_STATUS_NEW, otherwise its 0 */
-                    clientPort = _oniontracetorctl_scanSourcePort(&parts[5]);
-                    username = _oniontracetorctl_scanUsername(&parts[5]);
-                }
+            if(parsed.numArgs >= 3) {
+                status = oniontracetorctl_parseStreamStatus(oniontracetorctl_getArg(&parsed, 1));
+                circuitID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 2));
+                username = _oniontracetorctl_terminateToken(oniontracetorctl_getKeywordValue(&parsed, "USERNAME"));
             }
 
-            g_strfreev(parts);
-
             if(torctl->onStreamStatus) {
                 torctl->onStreamStatus(torctl->onStreamStatusArg, status, circuitID, streamID, username);
             }
-            if(username) {
-                g_free(username);
-            }
         }
     } else {
-        debug("%s: ignoring code %i", torctl->id, code);
+        debug("%s: ignoring code %i", torctl->id, parsed.code);
+    }
+}
+
+static TorCtlLineKind _oniontracetorctl_classifyLine(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    if(torctl->isReceivingDataReply) {
+        /* the body of a data reply ends with a line containing a single '.' */
+        if(length == 1 && line[0] == '.') {
+            torctl->isReceivingDataReply = FALSE;
+            return TORCTL_LINE_DATA_END;
+        }
+        return TORCTL_LINE_DATA;
+    }
+
+    if(length < 4 || !g_ascii_isdigit(line[0]) || !g_ascii_isdigit(line[1]) || !g_ascii_isdigit(line[2])) {
+        return TORCTL_LINE_EVENT;
+    }
+
+    if(line[3] == '+') {
+        /* a data block follows, which may also belong to an async event */
+        torctl->isReceivingDataReply = TRUE;
+        return TORCTL_LINE_DATA_BEGIN;
+    }
+
+    /* 6xx lines are async events, not replies to our commands */
+    if(line[0] == '6') {
+        return TORCTL_LINE_EVENT;
+    } else if(line[3] == ' ') {
+        return TORCTL_LINE_FINAL_REPLY;
+    } else if(line[3] == '-') {
+        return TORCTL_LINE_REPLY;
+    } else {
+        return TORCTL_LINE_EVENT;
+    }
+}
+
+/* handles a '250-key=value' or '250+key=' line in the reply to a GETINFO command */
+static void _oniontracetorctl_processDataReplyKey(OnionTraceTorCtl* torctl,
+        gchar* line, gsize length, gboolean hasDataBlock) {
+    TorCtlPendingCommand* command = g_queue_peek_head(torctl->pendingCommands);
+    if(!command || !command->dataReply || line[0] == '6') {
+        return;
+    }
+
+    /* the key starts after the code and separator, and ends at the '=' */
+    gchar* key = &line[4];
+    gchar* equals = memchr(key, '=', length - 4);
+    if(!equals) {
+        debug("%s: ignoring reply line '%s' without a key", torctl->id, line);
+        return;
     }
+
+    const TorCtlDataReplyHandler* handler = command->dataReply;
+
+    if(handler->onBegin) {
+        TorCtlToken keyToken = {key, (gsize)(equals - key)};
+        handler->onBegin(command->arg, &keyToken);
+    }
+
+    if(hasDataBlock) {
+        /* the value is in the lines that follow */
+        torctl->dataReplyCommand = command;
+    } else if(handler->onLine) {
+        gchar* value = equals + 1;
+        handler->onLine(command->arg, value, length - (gsize)(value - line));
+    }
+}
+
+static void _oniontracetorctl_processDataLine(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    TorCtlPendingCommand* command = torctl->dataReplyCommand;
+    if(!command || !command->dataReply->onLine) {
+        return;
+    }
+
+    /* lines starting with a '.' get another one so they don't end the block */
+    if(line[0] == '.') {
+        line++;
+        length--;
+    }
+
+    command->dataReply->onLine(command->arg, line, length);
 }
 
-static void _oniontracetorctl_processLine(OnionTraceTorCtl* torctl, GString* linebuf) {
+static void _oniontracetorctl_processFinalReply(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    TorCtlPendingCommand* command = g_queue_pop_head(torctl->pendingCommands);
+    if(!command) {
+        /* a capture has the replies to all of the commands of the original session */
+        if(torctl->isReplay) {
+            debug("%s: received reply '%s' without a pending command", torctl->id, line);
+        } else {
+            warning("%s: received reply '%s' without a pending command", torctl->id, line);
+        }
+        return;
+    }
+
+    /* the time a command waited to be written is ours, not tor's */
+    guint64 now = oniontracetimer_getMonotonicNanos();
+    if(!torctl->isReplay && command->sentTime > 0 && now > command->sentTime) {
+        oniontracehistogram_add(torctl->commandRoundTripTimes, (now - command->sentTime) / 1000);
+    }
+
+    gint code = _oniontracetorctl_parseCode(line, length);
+
+    if(command->dataReply) {
+        if(code >= 400) {
+            info("%s: GETINFO command failed with reply '%s'", torctl->id, line);
+        }
+        if(command->dataReply->onEnd) {
+            command->dataReply->onEnd(command->arg, code == 250);
+        }
+    } else if(command->type == TORCTL_COMMAND_EXTENDCIRCUIT) {
+        /* successful replies look like '250 EXTENDED 3' */
+        gint circuitID = 0;
+
+        if(code == 250) {
+            TorCtlLine parsed;
+            oniontracetorctl_tokenize(line, length, TRUE, &parsed);
+            circuitID = _oniontracetorctl_tokenToInt(oniontracetorctl_getArg(&parsed, 0));
+        } else {
+            info("%s: tor failed to launch circuit: '%s'", torctl->id, line);
+        }
+
+        if(torctl->onCircuitLaunched) {
+            torctl->onCircuitLaunched(torctl->onCircuitLaunchedArg, command->arg, circuitID);
+        }
+    } else if(code >= 400) {
+        info("%s: command failed with reply '%s'", torctl->id, line);
+    }
+
+    if(torctl->dataReplyCommand == command) {
+        torctl->dataReplyCommand = NULL;
+    }
+    g_free(command);
+}
+
+static void _oniontracetorctl_processLine(OnionTraceTorCtl* torctl, gchar* line, gsize length) {
+    /* check before the line handlers get to modify the line in place */
+    TorCtlLineKind kind = _oniontracetorctl_classifyLine(torctl, line, length);
+
     switch(torctl->state) {
 
         case TORCTL_AUTHENTICATE: {
-            gint code = _oniontracetorctl_parseCode(linebuf->str);
+            gint code = _oniontracetorctl_parseCode(line, length);
             if(code == 250) {
-                info("%s: successfully received auth response '%s'", torctl->id, linebuf->str);
+                info("%s: successfully received auth response '%s'", torctl->id, line);
 
                 if(torctl->onAuthenticated) {
                     torctl->onAuthenticated(torctl->onAuthenticatedArg);
                 }
             } else {
-                critical("%s: received failed auth response '%s'", torctl->id, linebuf->str);
+                critical("%s: received failed auth response '%s'", torctl->id, line);
             }
             break;
         }
 
         case TORCTL_BOOTSTRAP: {
             /* we will be getting all client status events, not all of them have bootstrap status */
-            gint progress = _oniontracetorctl_parseBootstrapProgress(linebuf->str);
+            gint progress = _oniontracetorctl_parseBootstrapProgress(line, length);
             if(progress >= 0) {
-                info("%s: successfully received bootstrap phase response '%s'", torctl->id, linebuf->str);
+                info("%s: successfully received bootstrap phase response '%s'", torctl->id, line);
                 if(progress >= 100) {
                     message("%s: torctl client is now ready (Bootstrapped 100)", torctl->id);
 
@@ -433,12 +596,14 @@ static void _oniontracetorctl_processLine(OnionTraceTorCtl* torctl, GString* lin
         case TORCTL_PROCESSING: {
             /* if someone (the logger) wants the raw line, send it */
             if(torctl->onLineReceived) {
-                torctl->onLineReceived(torctl->onLineReceivedArg, linebuf->str);
+                torctl->onLineReceived(torctl->onLineReceivedArg, line, length);
             }
 
-            /* we only need to parse the line if we actually have a function that cares about it */
-            if(torctl->onDescriptorsReceived || torctl->onCircuitStatus || torctl->onStreamStatus) {
-                _oniontracetorctl_processLineHelper(torctl, linebuf);
+            /* we only need to parse the line if we actually have a function that cares about it.
+             * the lines of data replies go to the handler of their command below. */
+            if((kind == TORCTL_LINE_EVENT || kind == TORCTL_LINE_FINAL_REPLY) &&
+                    (torctl->onCircuitStatus || torctl->onStreamStatus)) {
+                _oniontracetorctl_processLineHelper(torctl, line, length);
             }
             break;
         }
@@ -449,121 +614,334 @@ static void _oniontracetorctl_processLine(OnionTraceTorCtl* torctl, GString* lin
             g_assert(FALSE);
             break;
     }
+
+    switch(kind) {
+        case TORCTL_LINE_REPLY:
+            _oniontracetorctl_processDataReplyKey(torctl, line, length, FALSE);
+            break;
+        case TORCTL_LINE_DATA_BEGIN:
+            _oniontracetorctl_processDataReplyKey(torctl, line, length, TRUE);
+            break;
+        case TORCTL_LINE_DATA:
+            _oniontracetorctl_processDataLine(torctl, line, length);
+            break;
+        case TORCTL_LINE_DATA_END:
+            torctl->dataReplyCommand = NULL;
+            break;
+        case TORCTL_LINE_FINAL_REPLY:
+            _oniontracetorctl_processFinalReply(torctl, line, length);
+            break;
+        case TORCTL_LINE_EVENT:
+        default:
+            break;
+    }
 }
 
-static void _oniontracetorctl_receiveLines(OnionTraceTorCtl* torctl, OnionTraceEventFlag eventType) {
+static void _oniontracetorctl_processReceivedLines(OnionTraceTorCtl* torctl) {
     g_assert(torctl);
 
-    if(eventType & ONIONTRACE_EVENT_READ) {
-        debug("%s: descriptor %i is readable", torctl->id, torctl->descriptor);
+    gchar* buffer = torctl->receiveBuffer;
 
-        gchar recvbuf[10240];
-        memset(recvbuf, 0, 10240);
-        gssize bytes = 0;
+    /* only search the bytes that we have not already searched for a line ending */
+    while(torctl->receiveBufferScanned < torctl->receiveBufferEnd) {
+        gsize scanned = torctl->receiveBufferScanned;
+        gchar* lineFeed = memchr(&buffer[scanned], '\n', torctl->receiveBufferEnd - scanned);
 
-        while((bytes = recv(torctl->descriptor, recvbuf, 10000, 0)) > 0) {
-            recvbuf[bytes] = '\0';
-            debug("%s: recvbuf:%s", torctl->id, recvbuf);
+        if(!lineFeed) {
+            /* the last line is not all here yet */
+            torctl->receiveBufferScanned = torctl->receiveBufferEnd;
+            break;
+        }
 
-            gboolean isLastLineIncomplete = FALSE;
-            if(bytes < 2 || recvbuf[bytes-2] != '\r' || recvbuf[bytes-1] != '\n') {
-                isLastLineIncomplete = TRUE;
-            }
+        gsize lineFeedOffset = (gsize)(lineFeed - buffer);
+        torctl->receiveBufferScanned = lineFeedOffset + 1;
 
-            //Check for corner case where first element is \r\n
-            gboolean isStartCRLF = FALSE;
-            if(recvbuf[0] == '\r' && recvbuf[1] == '\n') {
-                isStartCRLF = TRUE;
-            }
+        /* lines are terminated by CRLF, a bare LF is part of the line */
+        if(lineFeedOffset == torctl->receiveBufferStart || buffer[lineFeedOffset-1] != '\r') {
+            continue;
+        }
 
-            gchar** lines = g_strsplit(recvbuf, "\r\n", 0);
-            gchar* line = NULL;
-            for(gint i = 0; (line = lines[i]) != NULL; i++) {
-                if(!torctl->receiveLineBuffer) {
-                    torctl->receiveLineBuffer = g_string_new(line);
-                } else if (isStartCRLF && i == 0 &&
-                        !g_ascii_strcasecmp(line, "")) {
-                    /* do nothing; we want to process the line in buffer already */
-                } else {
-                    g_string_append_printf(torctl->receiveLineBuffer, "%s", line);
-                }
+        gchar* line = &buffer[torctl->receiveBufferStart];
+        gsize length = lineFeedOffset - 1 - torctl->receiveBufferStart;
+        torctl->receiveBufferStart = torctl->receiveBufferScanned;
 
-                if(!(isStartCRLF && i == 0) && (!g_ascii_strcasecmp(line, "") ||
-                        (isLastLineIncomplete && lines[i+1] == NULL))) {
-                    /* this is '', or the last line, and its not all here yet */
-                    continue;
-                } else {
-                    /* we have a full line in our buffer */
-                    debug("%s: received '%s'", torctl->id, torctl->receiveLineBuffer->str);
+        /* ignore empty lines */
+        if(length == 0) {
+            continue;
+        }
 
-                    _oniontracetorctl_processLine(torctl, torctl->receiveLineBuffer);
+        /* we have a full line in our buffer, terminate it in place over the CR */
+        line[length] = '\0';
+        debug("%s: received '%s'", torctl->id, line);
+        torctl->linesReceived++;
 
-                    g_string_free(torctl->receiveLineBuffer, TRUE);
-                    torctl->receiveLineBuffer = NULL;
-                }
-            }
-            g_strfreev(lines);
-        }
+        _oniontracetorctl_processLine(torctl, line, length);
+    }
+
+    if(torctl->receiveBufferStart == torctl->receiveBufferEnd) {
+        /* everything was consumed, so we can start again at the front */
+        torctl->receiveBufferStart = 0;
+        torctl->receiveBufferEnd = 0;
+        torctl->receiveBufferScanned = 0;
     }
 }
 
-static void _oniontracetorctl_flushCommands(OnionTraceTorCtl* torctl, OnionTraceEventFlag eventType) {
+static void _oniontracetorctl_prepareReceiveBuffer(OnionTraceTorCtl* torctl) {
     g_assert(torctl);
 
+    if(!torctl->receiveBuffer) {
+        torctl->receiveBufferSize = TORCTL_RECEIVE_BUFFER_SIZE;
+        torctl->receiveBuffer = g_malloc(torctl->receiveBufferSize);
+        return;
+    }
+
+    /* keep at least a quarter of the buffer free for the next recv */
+    gsize minFree = torctl->receiveBufferSize / 4;
+
+    if(torctl->receiveBufferSize - torctl->receiveBufferEnd >= minFree) {
+        return;
+    }
+
+    /* move the partial line at the end of the buffer back to the front */
+    if(torctl->receiveBufferStart > 0) {
+        gsize pending = torctl->receiveBufferEnd - torctl->receiveBufferStart;
+        memmove(torctl->receiveBuffer, &torctl->receiveBuffer[torctl->receiveBufferStart], pending);
+        torctl->receiveBufferScanned -= torctl->receiveBufferStart;
+        torctl->receiveBufferEnd = pending;
+        torctl->receiveBufferStart = 0;
+    }
+
+    /* the partial line is still too long, so we need more space */
+    if(torctl->receiveBufferSize - torctl->receiveBufferEnd < minFree) {
+        torctl->receiveBufferSize *= 2;
+        torctl->receiveBuffer = g_realloc(torctl->receiveBuffer, torctl->receiveBufferSize);
+        debug("%s: grew receive buffer to %"G_GSIZE_FORMAT" bytes", torctl->id, torctl->receiveBufferSize);
+    }
+}
+
+/* stops watching a connection that tor closed or that failed, so that we don't
+ * spin on its events. other instances sharing the main loop carry on. */
+static void _oniontracetorctl_disconnect(OnionTraceTorCtl* torctl, gint errorCode) {
+    if(!torctl->isConnected) {
+        return;
+    }
+
+    if(errorCode) {
+        warning("%s: connection to Tor on descriptor %i failed: error %i: %s",
+                torctl->id, torctl->descriptor, errorCode, g_strerror(errorCode));
+    } else {
+        warning("%s: Tor closed the connection on descriptor %i", torctl->id, torctl->descriptor);
+    }
+
     oniontraceeventmanager_deregister(torctl->manager, torctl->descriptor);
+    torctl->isConnected = FALSE;
+    torctl->isWriteEventSet = FALSE;
+    torctl->isDisconnected = TRUE;
 
-    /* send all queued commands */
-    if(eventType & ONIONTRACE_EVENT_WRITE) {
-        debug("%s: descriptor %i is writable", torctl->id, torctl->descriptor);
+    /* nothing we queued can be sent anymore */
+    while(!g_queue_is_empty(torctl->commands)) {
+        g_string_free(g_queue_pop_head(torctl->commands), TRUE);
+    }
+    torctl->commandsHeadOffset = 0;
 
-        while(!g_queue_is_empty(torctl->commands)) {
-            GString* command = g_queue_pop_head(torctl->commands);
+    if(torctl->onDisconnected) {
+        torctl->onDisconnected(torctl->onDisconnectedArg);
+    }
+}
+
+static void _oniontracetorctl_captureBytes(OnionTraceTorCtl* torctl, const gchar* bytes, gsize length) {
+    GString* buffer = oniontracefile_beginRecord(torctl->captureFile);
+
+    guint64 timestamp = GUINT64_TO_LE(oniontracetimer_getMonotonicNanos());
+    guint32 length32 = GUINT32_TO_LE((guint32)length);
+    g_string_append_len(buffer, (const gchar*)&timestamp, sizeof(timestamp));
+    g_string_append_len(buffer, (const gchar*)&length32, sizeof(length32));
+    g_string_append_len(buffer, bytes, (gssize)length);
+
+    oniontracefile_endRecord(torctl->captureFile);
+}
+
+/* handles the bytes that were just appended at the end of the receive buffer */
+static void _oniontracetorctl_processReceivedBytes(OnionTraceTorCtl* torctl, gsize length) {
+    debug("%s: received %"G_GSIZE_FORMAT" bytes", torctl->id, length);
+
+    /* capture before the lines are terminated in place */
+    if(torctl->captureFile) {
+        _oniontracetorctl_captureBytes(torctl, &torctl->receiveBuffer[torctl->receiveBufferEnd], length);
+    }
+
+    torctl->receiveBufferEnd += length;
+    _oniontracetorctl_processReceivedLines(torctl);
+}
 
-            gssize bytes = send(torctl->descriptor, command->str, command->len, 0);
+static void _oniontracetorctl_receiveLines(OnionTraceTorCtl* torctl) {
+    g_assert(torctl);
+
+    debug("%s: descriptor %i is readable", torctl->id, torctl->descriptor);
+
+    while(TRUE) {
+        _oniontracetorctl_prepareReceiveBuffer(torctl);
+
+        gssize bytes = recv(torctl->descriptor, &torctl->receiveBuffer[torctl->receiveBufferEnd],
+                torctl->receiveBufferSize - torctl->receiveBufferEnd, 0);
+
+        if(bytes == 0 || (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            _oniontracetorctl_disconnect(torctl, bytes == 0 ? 0 : errno);
+            break;
+        } else if(bytes < 0) {
+            break;
+        }
 
-            if(bytes > 0) {
-                /* at least some parts of the command were sent successfully */
-                GString* sent = g_string_new(command->str);
-                sent = g_string_truncate(sent, bytes);
-                debug("%s: sent '%s'", torctl->id, g_strchomp(sent->str));
-                g_string_free(sent, TRUE);
-            } else if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        _oniontracetorctl_processReceivedBytes(torctl, (gsize)bytes);
+    }
+}
+
+/* handles the bytes as if they were received from tor, in receive buffer sized pieces */
+void oniontracetorctl_replayBytes(OnionTraceTorCtl* torctl, const gchar* bytes, gsize length) {
+    g_assert(torctl);
+    g_assert(torctl->isReplay);
+
+    gsize offset = 0;
+    while(offset < length) {
+        _oniontracetorctl_prepareReceiveBuffer(torctl);
+
+        gsize chunk = MIN(length - offset, torctl->receiveBufferSize - torctl->receiveBufferEnd);
+        memcpy(&torctl->receiveBuffer[torctl->receiveBufferEnd], &bytes[offset], chunk);
+        offset += chunk;
+
+        _oniontracetorctl_processReceivedBytes(torctl, chunk);
+    }
+}
+
+static void _oniontracetorctl_onDescriptorEvent(OnionTraceTorCtl* torctl, OnionTraceEventFlag eventType);
+
+static void _oniontracetorctl_setWriteEvent(OnionTraceTorCtl* torctl, gboolean wantWrite) {
+    g_assert(torctl);
+
+    if(!torctl->isConnected || torctl->isWriteEventSet == wantWrite) {
+        return;
+    }
+
+    OnionTraceEventFlag eventType = ONIONTRACE_EVENT_READ;
+    if(wantWrite) {
+        eventType |= ONIONTRACE_EVENT_WRITE;
+    }
+
+    gboolean success = oniontraceeventmanager_register(torctl->manager, torctl->descriptor, eventType,
+            (OnionTraceOnEventFunc)_oniontracetorctl_onDescriptorEvent, torctl);
+
+    if(success) {
+        torctl->isWriteEventSet = wantWrite;
+    } else {
+        warning("%s: Unable to register descriptor %i with event manager", torctl->id, torctl->descriptor);
+    }
+}
+
+static void _oniontracetorctl_flushCommands(OnionTraceTorCtl* torctl) {
+    g_assert(torctl);
+
+    debug("%s: descriptor %i is writable", torctl->id, torctl->descriptor);
+
+    /* send as many of the queued commands as we can in one call */
+    guint64 sentTime = 0;
+    while(!g_queue_is_empty(torctl->commands)) {
+        struct iovec iov[TORCTL_MAX_SEND_IOVECS];
+        gint numIOVecs = 0;
+
+        for(GList* link = g_queue_peek_head_link(torctl->commands);
+                link && numIOVecs < TORCTL_MAX_SEND_IOVECS; link = link->next) {
+            GString* command = link->data;
+            gsize offset = (numIOVecs == 0) ? torctl->commandsHeadOffset : 0;
+            iov[numIOVecs].iov_base = command->str + offset;
+            iov[numIOVecs].iov_len = command->len - offset;
+            numIOVecs++;
+        }
+
+        gssize bytes = writev(torctl->descriptor, iov, numIOVecs);
+
+        if(bytes < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
                 warning("%s: problem writing to descriptor %i: error %i: %s",
                         torctl->id, torctl->descriptor, errno, g_strerror(errno));
+                _oniontracetorctl_disconnect(torctl, errno);
+                return;
             }
+            break;
+        }
 
-            if(bytes == command->len) {
-                g_string_free(command, TRUE);
-            } else {
-                /* partial or no send */
-                command = g_string_erase(command, (gssize)0, (gssize)bytes);
-                g_queue_push_head(torctl->commands, command);
+        if(bytes > 0) {
+            sentTime = oniontracetimer_getMonotonicNanos();
+        }
+
+        /* drop the commands that were sent completely */
+        gsize remaining = (gsize)bytes;
+        while(remaining > 0) {
+            GString* command = g_queue_peek_head(torctl->commands);
+            gsize unsent = command->len - torctl->commandsHeadOffset;
+
+            if(remaining < unsent) {
+                /* partial send, remember where to continue next time */
+                torctl->commandsHeadOffset += remaining;
                 break;
             }
+
+            remaining -= unsent;
+            torctl->commandsHeadOffset = 0;
+
+            /* the unsent commands are the newest of the pending ones */
+            guint index = g_queue_get_length(torctl->pendingCommands) - g_queue_get_length(torctl->commands);
+            TorCtlPendingCommand* pending = g_queue_peek_nth(torctl->pendingCommands, index);
+            if(pending) {
+                pending->sentTime = sentTime;
+            }
+
+            g_queue_pop_head(torctl->commands);
+
+            debug("%s: sent '%s'", torctl->id, g_strchomp(command->str));
+            g_string_free(command, TRUE);
+        }
+
+        if(!g_queue_is_empty(torctl->commands) && torctl->commandsHeadOffset > 0) {
+            /* the socket buffer is full, wait until we are writable again */
+            break;
         }
     }
 
-    gboolean success = TRUE;
+    /* only keep asking for write events while we still have something to write */
+    _oniontracetorctl_setWriteEvent(torctl, !g_queue_is_empty(torctl->commands));
+}
 
-    if(g_queue_is_empty(torctl->commands)) {
-        /* we wrote all of the commands, go back into reading mode */
-        success = oniontraceeventmanager_register(torctl->manager, torctl->descriptor, ONIONTRACE_EVENT_READ,
-                (OnionTraceOnEventFunc)_oniontracetorctl_receiveLines, torctl);
-    } else {
-        /* we still want to write more */
-        success = oniontraceeventmanager_register(torctl->manager, torctl->descriptor, ONIONTRACE_EVENT_WRITE,
-                (OnionTraceOnEventFunc)_oniontracetorctl_flushCommands, torctl);
-    }
+static void _oniontracetorctl_onDescriptorEvent(OnionTraceTorCtl* torctl, OnionTraceEventFlag eventType) {
+    g_assert(torctl);
 
-    if(!success) {
-        warning("%s: Unable to register descriptor %i with event manager", torctl->id, torctl->descriptor);
+    if(eventType & ONIONTRACE_EVENT_READ) {
+        _oniontracetorctl_receiveLines(torctl);
     }
 
+    /* reading may have found that the connection is gone */
+    if((eventType & ONIONTRACE_EVENT_WRITE) && torctl->isConnected) {
+        _oniontracetorctl_flushCommands(torctl);
+    }
 }
 
 static void _oniontracetorctl_onConnected(OnionTraceTorCtl* torctl, OnionTraceEventFlag type) {
     g_assert(torctl);
-    oniontraceeventmanager_deregister(torctl->manager, torctl->descriptor);
+
+    /* from now on we always want to read, and write only when we have commands queued */
+    torctl->isConnected = TRUE;
+    torctl->isWriteEventSet = !g_queue_is_empty(torctl->commands);
+
+    OnionTraceEventFlag eventType = ONIONTRACE_EVENT_READ;
+    if(torctl->isWriteEventSet) {
+        eventType |= ONIONTRACE_EVENT_WRITE;
+    }
+
+    gboolean success = oniontraceeventmanager_register(torctl->manager, torctl->descriptor, eventType,
+            (OnionTraceOnEventFunc)_oniontracetorctl_onDescriptorEvent, torctl);
+    if(!success) {
+        warning("%s: Unable to register descriptor %i with event manager", torctl->id, torctl->descriptor);
+    }
+
     if(torctl->onConnected) {
         torctl->onConnected(torctl->onConnectedArg);
     }
@@ -575,6 +953,8 @@ OnionTraceTorCtl* oniontracetorctl_new(OnionTraceEventManager* manager, in_port_
 
     torctl->manager = manager;
     torctl->commands = g_queue_new();
+    torctl->pendingCommands = g_queue_new();
+    torctl->commandRoundTripTimes = oniontracehistogram_new();
 
     /* set our ID string for logging purposes */
     GString* idbuf = g_string_new(NULL);
@@ -645,18 +1025,77 @@ OnionTraceTorCtl* oniontracetorctl_new(OnionTraceEventManager* manager, in_port_
     return torctl;
 }
 
+OnionTraceTorCtl* oniontracetorctl_newReplay() {
+    OnionTraceTorCtl* torctl = g_new0(OnionTraceTorCtl, 1);
+
+    torctl->isReplay = TRUE;
+    torctl->descriptor = -1;
+    torctl->commands = g_queue_new();
+    torctl->pendingCommands = g_queue_new();
+    torctl->commandRoundTripTimes = oniontracehistogram_new();
+    torctl->id = g_strdup("Controller-replay");
+
+    /* a capture starts wherever the original controller was, so we pass every line on */
+    torctl->state = TORCTL_PROCESSING;
+
+    return torctl;
+}
+
+/* from now on, append the bytes we receive from tor to a new capture file. the
+ * format is described with TORCTL_CAPTURE_MAGIC. */
+gboolean oniontracetorctl_setCaptureFile(OnionTraceTorCtl* torctl, const gchar* filename) {
+    g_assert(torctl);
+    g_assert(!torctl->captureFile);
+
+    torctl->captureFile = oniontracefile_newWriter(filename);
+    if(!torctl->captureFile) {
+        return FALSE;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    guint64 timestamp = GUINT64_TO_LE(oniontracetimer_getMonotonicNanos());
+    guint64 unixNanos = GUINT64_TO_LE(((guint64)now.tv_sec * 1000000000UL) + (guint64)now.tv_nsec);
+
+    GString* buffer = oniontracefile_beginRecord(torctl->captureFile);
+    g_string_append_len(buffer, TORCTL_CAPTURE_MAGIC, TORCTL_CAPTURE_MAGIC_LENGTH);
+    g_string_append_len(buffer, (const gchar*)&timestamp, sizeof(timestamp));
+    g_string_append_len(buffer, (const gchar*)&unixNanos, sizeof(unixNanos));
+    oniontracefile_endRecord(torctl->captureFile);
+
+    info("%s: capturing the bytes we receive to %s", torctl->id, filename);
+    return TRUE;
+}
+
+gsize oniontracetorctl_getNumLinesReceived(OnionTraceTorCtl* torctl) {
+    g_assert(torctl);
+    return torctl->linesReceived;
+}
+
 void oniontracetorctl_free(OnionTraceTorCtl* torctl) {
     g_assert(torctl);
 
-    /* make sure we dont get a callback on our torctl instance which we are about to free and invalidate */
-    oniontraceeventmanager_deregister(torctl->manager, torctl->descriptor);
+    if(!torctl->isReplay) {
+        /* make sure we dont get a callback on our torctl instance which we are about to free and invalidate */
+        oniontraceeventmanager_deregister(torctl->manager, torctl->descriptor);
 
-    if(torctl->descriptor) {
-        close(torctl->descriptor);
+        if(torctl->descriptor) {
+            close(torctl->descriptor);
+        }
     }
 
-    if(torctl->receiveLineBuffer) {
-        g_string_free(torctl->receiveLineBuffer, TRUE);
+    if(torctl->captureFile) {
+        /* this writes out the bytes that are still buffered */
+        oniontracefile_free(torctl->captureFile);
+    }
+
+    if(torctl->receiveBuffer) {
+        g_free(torctl->receiveBuffer);
+    }
+
+    if(torctl->numCommandsDropped > 0) {
+        message("%s: dropped %"G_GSIZE_FORMAT" commands after Tor closed the connection",
+                torctl->id, torctl->numCommandsDropped);
     }
 
     if(torctl->commands) {
@@ -666,6 +1105,19 @@ void oniontracetorctl_free(OnionTraceTorCtl* torctl) {
         g_queue_free(torctl->commands);
     }
 
+    if(torctl->pendingCommands) {
+        g_queue_free_full(torctl->pendingCommands, g_free);
+    }
+
+    if(torctl->commandRoundTripTimes) {
+        if(oniontracehistogram_getCount(torctl->commandRoundTripTimes) > 0) {
+            gchar* times = oniontracehistogram_toString(torctl->commandRoundTripTimes);
+            message("%s: command round trip times in microseconds: %s", torctl->id, times);
+            g_free(times);
+        }
+        oniontracehistogram_free(torctl->commandRoundTripTimes);
+    }
+
     if(torctl->id) {
         g_free(torctl->id);
     }
@@ -692,6 +1144,13 @@ void oniontracetorctl_setStreamStatusCallback(OnionTraceTorCtl* torctl,
     torctl->onStreamStatusArg = onStreamStatusArg;
 }
 
+void oniontracetorctl_setCircuitLaunchedCallback(OnionTraceTorCtl* torctl,
+        OnCircuitLaunchedFunc onCircuitLaunched, gpointer onCircuitLaunchedArg) {
+    g_assert(torctl);
+    torctl->onCircuitLaunched = onCircuitLaunched;
+    torctl->onCircuitLaunchedArg = onCircuitLaunchedArg;
+}
+
 void oniontracetorctl_setLineReceivedCallback(OnionTraceTorCtl* torctl,
         OnLineReceivedFunc onLineReceived, gpointer onLineReceivedArg) {
     g_assert(torctl);
@@ -699,23 +1158,62 @@ void oniontracetorctl_setLineReceivedCallback(OnionTraceTorCtl* torctl,
     torctl->onLineReceivedArg = onLineReceivedArg;
 }
 
-static void _oniontracetorctl_commandHelperV(OnionTraceTorCtl* torctl, const gchar *format, va_list vargs) {
+void oniontracetorctl_setDisconnectedCallback(OnionTraceTorCtl* torctl,
+        OnDisconnectedFunc onDisconnected, gpointer onDisconnectedArg) {
+    g_assert(torctl);
+    torctl->onDisconnected = onDisconnected;
+    torctl->onDisconnectedArg = onDisconnectedArg;
+}
+
+static void _oniontracetorctl_commandHelperV(OnionTraceTorCtl* torctl, TorCtlCommandType type,
+        gpointer arg, const TorCtlDataReplyHandler* dataReply, const gchar *format, va_list vargs) {
     g_assert(torctl);
 
+    /* tor will never reply, so we don't let the queues grow while the owner winds down */
+    if(torctl->isDisconnected) {
+        if(torctl->numCommandsDropped++ == 0) {
+            warning("%s: dropping commands because Tor closed the connection", torctl->id);
+        }
+        return;
+    }
+
     GString* command = g_string_new(NULL);
     g_string_append_vprintf(command, format, vargs);
-    g_queue_push_tail(torctl->commands, command);
 
+    /* remember the command so we can match it to its reply */
+    TorCtlPendingCommand* pending = g_new0(TorCtlPendingCommand, 1);
+    pending->type = type;
+    pending->arg = arg;
+    pending->dataReply = dataReply;
+    g_queue_push_tail(torctl->pendingCommands, pending);
+
+    /* there is nobody to send the command to when replaying a capture */
+    if(torctl->isReplay) {
+        debug("%s: dropped torctl command '%s'", torctl->id, command->str);
+        g_string_free(command, TRUE);
+        return;
+    }
+
+    g_queue_push_tail(torctl->commands, command);
     debug("%s: queued torctl command '%s'", torctl->id, command->str);
 
-    /* send the commands */
-    _oniontracetorctl_flushCommands(torctl, ONIONTRACE_EVENT_NONE);
+    /* the commands go out together once the descriptor is writable, so all
+     * commands queued in the same main loop iteration share one writev() */
+    _oniontracetorctl_setWriteEvent(torctl, TRUE);
 }
 
 static void _oniontracetorctl_commandHelper(OnionTraceTorCtl* torctl, const gchar *format, ...) {
     va_list vargs;
     va_start(vargs, format);
-    _oniontracetorctl_commandHelperV(torctl, format, vargs);
+    _oniontracetorctl_commandHelperV(torctl, TORCTL_COMMAND_OTHER, NULL, NULL, format, vargs);
+    va_end(vargs);
+}
+
+static void _oniontracetorctl_commandHelperWithReply(OnionTraceTorCtl* torctl,
+        TorCtlCommandType type, gpointer arg, const gchar *format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+    _oniontracetorctl_commandHelperV(torctl, type, arg, NULL, format, vargs);
     va_end(vargs);
 }
 
@@ -763,23 +1261,34 @@ void oniontracetorctl_commandDisableEvents(OnionTraceTorCtl* torctl) {
     _oniontracetorctl_commandHelper(torctl, "SETEVENTS\r\n");
 }
 
-void oniontracetorctl_commandGetDescriptorInfo(OnionTraceTorCtl* torctl,
-        OnDescriptorsReceivedFunc onDescriptorsReceived, gpointer onDescriptorsReceivedArg) {
+static void _oniontracetorctl_commandGetInfoHelper(OnionTraceTorCtl* torctl,
+        const TorCtlDataReplyHandler* handler, gpointer userData, const gchar *format, ...) {
+    va_list vargs;
+    va_start(vargs, format);
+    _oniontracetorctl_commandHelperV(torctl, TORCTL_COMMAND_GETINFO, userData, handler, format, vargs);
+    va_end(vargs);
+}
+
+void oniontracetorctl_commandGetInfo(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedKeys,
+        const TorCtlDataReplyHandler* handler, gpointer userData) {
     g_assert(torctl);
+    g_assert(handler);
+    _oniontracetorctl_commandGetInfoHelper(torctl, handler, userData, "GETINFO %s\r\n", spaceDelimitedKeys);
+}
 
-    torctl->onDescriptorsReceived = onDescriptorsReceived;
-    torctl->onDescriptorsReceivedArg = onDescriptorsReceivedArg;
-    torctl->waitingGetDescriptorsResponse = TRUE;
-    //g_string_printf(command, "GETINFO dir/status-vote/current/consensus\r\n");
-    _oniontracetorctl_commandHelper(torctl, "GETINFO ns/all\r\n");
+void oniontracetorctl_commandGetDescriptorInfo(OnionTraceTorCtl* torctl,
+        const TorCtlDataReplyHandler* handler, gpointer userData) {
+    oniontracetorctl_commandGetInfo(torctl, "ns/all", handler, userData);
 }
 
-void oniontracetorctl_commandBuildNewCircuit(OnionTraceTorCtl* torctl, const gchar* path) {
+void oniontracetorctl_commandBuildNewCircuit(OnionTraceTorCtl* torctl, const gchar* path, gpointer launchArg) {
     g_assert(torctl);
     if(path) {
-        _oniontracetorctl_commandHelper(torctl, "EXTENDCIRCUIT 0 %s\r\n", path);
+        _oniontracetorctl_commandHelperWithReply(torctl, TORCTL_COMMAND_EXTENDCIRCUIT, launchArg,
+                "EXTENDCIRCUIT 0 %s\r\n", path);
     } else {
-        _oniontracetorctl_commandHelper(torctl, "EXTENDCIRCUIT 0\r\n");
+        _oniontracetorctl_commandHelperWithReply(torctl, TORCTL_COMMAND_EXTENDCIRCUIT, launchArg,
+                "EXTENDCIRCUIT 0\r\n");
     }
 }
 
@@ -801,13 +1310,9 @@ void oniontracetorctl_commandCloseStream(OnionTraceTorCtl* torctl, gint streamID
 }
 
 void oniontracetorctl_commandGetAllCircuitStatus(OnionTraceTorCtl* torctl) {
-    g_assert(torctl);
-    torctl->waitingCircuitStatusResponse = TRUE;
-    _oniontracetorctl_commandHelper(torctl, "GETINFO circuit-status\r\n");
+    oniontracetorctl_commandGetInfo(torctl, "circuit-status", &circuitStatusHandler, torctl);
 }
 
 void oniontracetorctl_commandGetAllCircuitStatusCleanup(OnionTraceTorCtl* torctl) {
-    g_assert(torctl);
-    torctl->circuitStatusCleanup = TRUE;
-    oniontracetorctl_commandGetAllCircuitStatus(torctl);
+    oniontracetorctl_commandGetInfo(torctl, "circuit-status", &circuitStatusCleanupHandler, torctl);
 }
@@ -30,47 +30,128 @@ enum _CircuitStatus {
     CIRCUIT_STATUS_CLOSED    /* circuit closed (was built) */
 };
 
+/* a view into a line, usually in the receive buffer, which is not NUL-terminated */
+typedef struct _TorCtlToken {
+    gchar* str;
+    gsize len;
+} TorCtlToken;
+
+typedef struct _TorCtlKeyword {
+    TorCtlToken key;
+    TorCtlToken value;
+} TorCtlKeyword;
+
+#define TORCTL_MAX_ARGS 8
+#define TORCTL_MAX_KEYWORDS 16
+
+/* the parts of a reply or event line. for example, the line
+ *   650 STREAM 21 NEW 0 11.0.0.6:18080 SOURCE_ADDR=127.0.0.1:21437 USERNAME=MYUSER
+ * has code 650, separator ' ', keyword STREAM, the positional args
+ * [21, NEW, 0, 11.0.0.6:18080], and the keyword args SOURCE_ADDR and USERNAME.
+ * args and keyword args beyond the maximums are dropped. */
+typedef struct _TorCtlLine {
+    gint code;
+    gchar separator;
+    TorCtlToken keyword;
+    TorCtlToken args[TORCTL_MAX_ARGS];
+    guint numArgs;
+    TorCtlKeyword keywords[TORCTL_MAX_KEYWORDS];
+    guint numKeywords;
+    /* TRUE if the line mentions a tor-internal '.exit' address */
+    gboolean isExit;
+} TorCtlLine;
+
+/* a capture file holds the raw bytes received on the control socket. all integers
+ * are little-endian. the file starts with the magic bytes, the u64 CLOCK_MONOTONIC
+ * time in nanoseconds when the capture started, and the u64 unix time in
+ * nanoseconds at the same moment. then each chunk of bytes returned by recv() is
+ * a record of the u64 monotonic ns when we received it, the u32 length, and the bytes. */
+#define TORCTL_CAPTURE_MAGIC "OTCAPT01"
+#define TORCTL_CAPTURE_MAGIC_LENGTH 8
+#define TORCTL_CAPTURE_HEADER_LENGTH (TORCTL_CAPTURE_MAGIC_LENGTH + 16)
+#define TORCTL_CAPTURE_RECORD_HEADER_LENGTH 12
+
 typedef struct _OnionTraceTorCtl OnionTraceTorCtl;
 
 typedef void (*OnConnectedFunc)(gpointer userData);
+/* called when tor closes an established connection or it fails */
+typedef void (*OnDisconnectedFunc)(gpointer userData);
 typedef void (*OnAuthenticatedFunc)(gpointer userData);
 typedef void (*OnBootstrappedFunc)(gpointer userData);
 
-typedef void (*OnDescriptorsReceivedFunc)(gpointer userData, GQueue* descriptorLines);
-
-typedef void (*OnCircuitStatusFunc)(gpointer userData, CircuitStatus status, gint circuitID, gchar* path);
+/* handles the reply to a GETINFO command as it arrives, instead of buffering it.
+ * onBegin is called for each key in the reply, and then onLine for each line of
+ * its value; single-line values like '250-key=value' get one call, and data
+ * blocks get one call per line with the '.' stuffing removed. onEnd is called
+ * once with the final reply line, and success is FALSE if tor refused the command.
+ * the key and lines point into the receive buffer and are only valid until the
+ * callback returns. any of the functions may be NULL. */
+typedef void (*OnDataReplyBeginFunc)(gpointer userData, TorCtlToken* key);
+typedef void (*OnDataReplyLineFunc)(gpointer userData, gchar* line, gsize length);
+typedef void (*OnDataReplyEndFunc)(gpointer userData, gboolean success);
+
+typedef struct _TorCtlDataReplyHandler {
+    OnDataReplyBeginFunc onBegin;
+    OnDataReplyLineFunc onLine;
+    OnDataReplyEndFunc onEnd;
+} TorCtlDataReplyHandler;
+
+/* path, reason, and username point into the receive buffer and are only valid until the
+ * callback returns. reason is the REASON of FAILED and CLOSED events, and NULL otherwise. */
+typedef void (*OnCircuitStatusFunc)(gpointer userData, CircuitStatus status, gint circuitID,
+        gchar* path, gchar* reason);
 typedef void (*OnStreamStatusFunc)(gpointer userData, StreamStatus status, gint circuitID, gint streamID, gchar* username);
 
-typedef void (*OnLineReceivedFunc)(gpointer userData, gchar* line);
+/* called once tor replies to a command to build a new circuit. launchArg is the
+ * argument given with the command, and circuitID is 0 if tor refused to launch it. */
+typedef void (*OnCircuitLaunchedFunc)(gpointer userData, gpointer launchArg, gint circuitID);
+
+/* the line points into the receive buffer and is only valid until the callback returns.
+ * it is NUL-terminated, and length is the number of bytes before the NUL. */
+typedef void (*OnLineReceivedFunc)(gpointer userData, gchar* line, gsize length);
 
 OnionTraceTorCtl* oniontracetorctl_new(OnionTraceEventManager* manager, in_port_t controlPort,
         OnConnectedFunc onConnected, gpointer onConnectedArg);
 void oniontracetorctl_free(OnionTraceTorCtl* torctl);
 
+/* a controller without a connection, which handles the bytes of a capture file */
+OnionTraceTorCtl* oniontracetorctl_newReplay();
+void oniontracetorctl_replayBytes(OnionTraceTorCtl* torctl, const gchar* bytes, gsize length);
+
+gboolean oniontracetorctl_setCaptureFile(OnionTraceTorCtl* torctl, const gchar* filename);
+
 in_port_t oniontracetorctl_getControlClientPort(OnionTraceTorCtl* torctl);
+gsize oniontracetorctl_getNumLinesReceived(OnionTraceTorCtl* torctl);
 
 /* set the callbacks for torctl status updates */
 void oniontracetorctl_setCircuitStatusCallback(OnionTraceTorCtl* torctl,
         OnCircuitStatusFunc onCircuitStatus, gpointer onCircuitStatusArg);
 void oniontracetorctl_setStreamStatusCallback(OnionTraceTorCtl* torctl,
         OnStreamStatusFunc onStreamStatus, gpointer onStreamStatusArg);
+void oniontracetorctl_setCircuitLaunchedCallback(OnionTraceTorCtl* torctl,
+        OnCircuitLaunchedFunc onCircuitLaunched, gpointer onCircuitLaunchedArg);
 void oniontracetorctl_setLineReceivedCallback(OnionTraceTorCtl* torctl,
         OnLineReceivedFunc onLineReceived, gpointer onLineReceivedArg);
+void oniontracetorctl_setDisconnectedCallback(OnionTraceTorCtl* torctl,
+        OnDisconnectedFunc onDisconnected, gpointer onDisconnectedArg);
 
 /* controller commands with callbacks when they complete */
 void oniontracetorctl_commandAuthenticate(OnionTraceTorCtl* torctl,
         OnAuthenticatedFunc onAuthenticated, gpointer onAuthenticatedArg);
 void oniontracetorctl_commandGetBootstrapStatus(OnionTraceTorCtl* torctl,
         OnBootstrappedFunc onBootstrapped, gpointer onBootstrappedArg);
+/* the handler must stay valid until the reply arrives; a static const struct works well */
+void oniontracetorctl_commandGetInfo(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedKeys,
+        const TorCtlDataReplyHandler* handler, gpointer userData);
 void oniontracetorctl_commandGetDescriptorInfo(OnionTraceTorCtl* torctl,
-        OnDescriptorsReceivedFunc onDescriptorsReceived, gpointer onDescriptorsReceivedArg);
+        const TorCtlDataReplyHandler* handler, gpointer userData);
 
 /* controller commands without callbacks */
 void oniontracetorctl_commandSetupTorConfig(OnionTraceTorCtl* torctl);
 void oniontracetorctl_commandEnableEvents(OnionTraceTorCtl* torctl, const gchar* spaceDelimitedEvents);
 void oniontracetorctl_commandDisableEvents(OnionTraceTorCtl* torctl);
 
-void oniontracetorctl_commandBuildNewCircuit(OnionTraceTorCtl* torctl, const gchar* path);
+void oniontracetorctl_commandBuildNewCircuit(OnionTraceTorCtl* torctl, const gchar* path, gpointer launchArg);
 void oniontracetorctl_commandAttachStreamToCircuit(OnionTraceTorCtl* torctl, gint streamID, gint circuitID);
 
 void oniontracetorctl_commandCloseCircuit(OnionTraceTorCtl* torctl, gint crcuitID);
@@ -79,4 +160,12 @@ void oniontracetorctl_commandCloseStream(OnionTraceTorCtl* torctl, gint streamID
 void oniontracetorctl_commandGetAllCircuitStatus(OnionTraceTorCtl* torctl);
 void oniontracetorctl_commandGetAllCircuitStatusCleanup(OnionTraceTorCtl* torctl);
 
+/* helpers for parsing control lines; the tokens point into the given line */
+void oniontracetorctl_tokenize(gchar* line, gsize length, gboolean hasCode, TorCtlLine* parsed);
+gboolean oniontracetorctl_tokenEquals(TorCtlToken* token, const gchar* str);
+TorCtlToken* oniontracetorctl_getArg(TorCtlLine* parsed, guint index);
+TorCtlToken* oniontracetorctl_getKeywordValue(TorCtlLine* parsed, const gchar* key);
+CircuitStatus oniontracetorctl_parseCircuitStatus(TorCtlToken* statusStr);
+StreamStatus oniontracetorctl_parseStreamStatus(TorCtlToken* statusStr);
+
 #endif /* SRC_ONIONTRACE_TORCTL_H_ */
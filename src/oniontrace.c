@@ -4,7 +4,7 @@
 
 #include "oniontrace.h"
 
-static GLogLevelFlags globalLogFilterLevel = G_LOG_LEVEL_INFO;
+GLogLevelFlags globalLogFilterLevel = G_LOG_LEVEL_INFO;
 
 static const gchar* _oniontrace_logLevelToString(GLogLevelFlags logLevel) {
     switch (logLevel) {
@@ -25,87 +25,146 @@ static const gchar* _oniontrace_logLevelToString(GLogLevelFlags logLevel) {
     }
 }
 
-void oniontrace_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
-    if(level > globalLogFilterLevel) {
+/* log lines are collected here and written to stdout in batches. each shard
+ * thread has its own buffer, and only ever writes whole lines. */
+#define ONIONTRACE_LOG_BUFFER_SIZE 65536
+
+static __thread gchar logBuffer[ONIONTRACE_LOG_BUFFER_SIZE];
+static __thread gsize logBufferLength = 0;
+
+/* the local date and time prefix only changes once per second, so we cache it */
+static __thread time_t logCachedSecond = -1;
+static __thread gchar logCachedDateTime[32];
+static __thread gsize logCachedDateTimeLength = 0;
+
+static void _oniontrace_writeLog(const gchar* buffer, gsize length) {
+    gsize offset = 0;
+    while(offset < length) {
+        gssize bytes = write(STDOUT_FILENO, &buffer[offset], length - offset);
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            /* there is nowhere left to report this, so drop the output */
+            break;
+        }
+        offset += (gsize)bytes;
+    }
+}
+
+/* writes all buffered log lines to stdout */
+void oniontrace_flushLog() {
+    if(logBufferLength > 0) {
+        _oniontrace_writeLog(logBuffer, logBufferLength);
+        logBufferLength = 0;
+    }
+}
+
+static void _oniontrace_updateCachedDateTime(time_t second) {
+    if(second == logCachedSecond) {
         return;
     }
 
-    va_list vargs;
-    va_start(vargs, format);
+    /* make sure localtime_r knows our time zone. tzset is not safe to call
+     * while other shard threads might be reading the time zone. */
+    static gsize isTimeZoneSet = 0;
+    if(g_once_init_enter(&isTimeZoneSet)) {
+        tzset();
+        g_once_init_leave(&isTimeZoneSet, 1);
+    }
 
-    GDateTime* dt = g_date_time_new_now_local();
-    GString* newformat = g_string_new(NULL);
+    struct tm brokenDown;
+    localtime_r(&second, &brokenDown);
 
-    g_string_append_printf(newformat, "%04i-%02i-%02i %02i:%02i:%02i %"G_GINT64_FORMAT".%06i [%s] [%s] %s",
-            g_date_time_get_year(dt), g_date_time_get_month(dt), g_date_time_get_day_of_month(dt),
-            g_date_time_get_hour(dt), g_date_time_get_minute(dt), g_date_time_get_second(dt),
-            g_date_time_to_unix(dt), g_date_time_get_microsecond(dt),
-            _oniontrace_logLevelToString(level), functionName, format);
+    logCachedDateTimeLength = strftime(logCachedDateTime, sizeof(logCachedDateTime),
+            "%Y-%m-%d %H:%M:%S", &brokenDown);
+    logCachedSecond = second;
+}
 
-    gchar* message = g_strdup_vprintf(newformat->str, vargs);
-    g_print("%s\n", message);
-    g_free(message);
+/* formats the line into the buffer, returns the length it needs including the newline */
+static gsize _oniontrace_formatLog(gchar* buffer, gsize bufferSize, struct timespec* now,
+        GLogLevelFlags level, const gchar* functionName, const gchar* format, va_list vargs) {
+    gint prefixLength = snprintf(buffer, bufferSize, "%s %"G_GINT64_FORMAT".%06li [%s] [%s] ",
+            logCachedDateTime, (gint64)now->tv_sec, now->tv_nsec / 1000,
+            _oniontrace_logLevelToString(level), functionName);
 
-    g_string_free(newformat, TRUE);
-    g_date_time_unref(dt);
+    if(prefixLength < 0) {
+        return 0;
+    }
 
-    va_end(vargs);
-}
+    gsize used = MIN((gsize)prefixLength, bufferSize);
+    gint messageLength = vsnprintf(&buffer[used], bufferSize - used, format, vargs);
 
-int main(int argc, char *argv[]) {
-    gchar hostname[128];
-    memset(hostname, 0, 128);
-    gethostname(hostname, 128);
-    message("Starting OnionTrace v%s on host %s process id %i",
-            ONIONTRACE_VERSION, hostname, (gint )getpid());
-
-    message("Parsing program arguments");
-    OnionTraceConfig* config = oniontraceconfig_new(argc, argv);
-    if (config == NULL) {
-        message("Parsing config failed, exiting with failure");
-        return EXIT_FAILURE;
+    if(messageLength < 0) {
+        return 0;
     }
 
-    /* update to the configured log level */
-    globalLogFilterLevel = oniontraceconfig_getLogLevel(config);
+    gsize lineLength = (gsize)prefixLength + (gsize)messageLength + 1;
+    if(lineLength <= bufferSize) {
+        buffer[lineLength - 1] = '\n';
+    }
+    return lineLength;
+}
 
-    message("Creating event manager to run main loop");
-    OnionTraceEventManager* manager = oniontraceeventmanager_new();
-    if (manager == NULL) {
-        message("Creating event manager failed, exiting with failure");
-        return EXIT_FAILURE;
+void oniontrace_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
+    if(level > globalLogFilterLevel) {
+        return;
     }
 
-    OnionTraceMode mode = oniontraceconfig_getMode(config);
-    OnionTraceDriver* driver = NULL;
-    gboolean success = TRUE;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    _oniontrace_updateCachedDateTime(now.tv_sec);
 
-    message("Creating driver");
+    va_list vargs;
+    va_start(vargs, format);
 
-    driver = oniontracedriver_new(config, manager);
-    if (driver == NULL) {
-        message("Creating driver failed, exiting with failure");
-        success = FALSE;
-    } else {
-        success = oniontracedriver_start(driver);
+    /* try to format straight into the free space at the end of the buffer */
+    va_list vargsCopy;
+    va_copy(vargsCopy, vargs);
+    gsize lineLength = _oniontrace_formatLog(&logBuffer[logBufferLength],
+            ONIONTRACE_LOG_BUFFER_SIZE - logBufferLength, &now, level, functionName, format, vargsCopy);
+    va_end(vargsCopy);
+
+    if(lineLength > 0 && logBufferLength + lineLength <= ONIONTRACE_LOG_BUFFER_SIZE) {
+        logBufferLength += lineLength;
+    } else if(lineLength > 0) {
+        /* it did not fit, so make room and try again */
+        oniontrace_flushLog();
+
+        if(lineLength <= ONIONTRACE_LOG_BUFFER_SIZE) {
+            lineLength = _oniontrace_formatLog(logBuffer, ONIONTRACE_LOG_BUFFER_SIZE,
+                    &now, level, functionName, format, vargs);
+            logBufferLength = lineLength;
+        } else {
+            /* the line is larger than our whole buffer, write it on its own */
+            gchar* line = g_malloc(lineLength);
+            _oniontrace_formatLog(line, lineLength, &now, level, functionName, format, vargs);
+            _oniontrace_writeLog(line, lineLength);
+            g_free(line);
+        }
     }
 
-    if (success) {
-        /* the recorder should be waiting for circuit and stream events, and
-         * when those occur, new actions will be taken. */
-        message("Running main loop");
-        success = oniontraceeventmanager_runMainLoop(manager);
-        message("Main loop returned, cleaning up");
-    }
+    va_end(vargs);
 
-    if (driver != NULL) {
-        oniontracedriver_stop(driver);
-        oniontracedriver_free(driver);
+    /* don't sit on serious problems, we might be about to exit */
+    if(level <= G_LOG_LEVEL_CRITICAL) {
+        oniontrace_flushLog();
     }
+}
+
+void oniontrace_formatLog(GString* buffer, GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    _oniontrace_updateCachedDateTime(now.tv_sec);
+
+    g_string_append_printf(buffer, "%s %"G_GINT64_FORMAT".%06li [%s] [%s] ",
+            logCachedDateTime, (gint64)now.tv_sec, now.tv_nsec / 1000,
+            _oniontrace_logLevelToString(level), functionName);
 
-    oniontraceeventmanager_free(manager);
-    oniontraceconfig_free(config);
+    va_list vargs;
+    va_start(vargs, format);
+    g_string_append_vprintf(buffer, format, vargs);
+    va_end(vargs);
 
-    message("Exiting cleanly with %s code", success ? "success" : "failure");
-    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+    g_string_append_c(buffer, '\n');
 }
@@ -13,11 +13,16 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <math.h>
 
 #include <glib.h>
@@ -28,7 +33,10 @@
 #include "oniontrace-peer.h"
 #include "oniontrace-timer.h"
 #include "oniontrace-torctl.h"
+#include "oniontrace-relay.h"
+#include "oniontrace-consensus.h"
 #include "oniontrace-circuit.h"
+#include "oniontrace-histogram.h"
 #include "oniontrace-file.h"
 #include "oniontrace-logger.h"
 #include "oniontrace-player.h"
@@ -39,16 +47,63 @@
 
 /* logging facility */
 void oniontrace_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...);
+/* log lines are buffered; this writes them out, and is called once per main loop iteration */
+void oniontrace_flushLog();
+/* appends a line formatted like those we log, for components that log to their own file */
+void oniontrace_formatLog(GString* buffer, GLogLevelFlags level, const gchar* functionName, const gchar* format, ...);
 
-#ifdef DEBUG
-#define debug(...) oniontrace_log(G_LOG_LEVEL_DEBUG, __FUNCTION__, __VA_ARGS__)
+/* the configured runtime log level; messages less severe than this are filtered */
+extern GLogLevelFlags globalLogFilterLevel;
+
+/* numeric log levels for the preprocessor, from most to least severe */
+#define ONIONTRACE_LOG_LEVEL_ERROR 1
+#define ONIONTRACE_LOG_LEVEL_CRITICAL 2
+#define ONIONTRACE_LOG_LEVEL_WARNING 3
+#define ONIONTRACE_LOG_LEVEL_MESSAGE 4
+#define ONIONTRACE_LOG_LEVEL_INFO 5
+#define ONIONTRACE_LOG_LEVEL_DEBUG 6
+
+/* the least severe level that is compiled in at all; calls to the macros for
+ * less severe levels become no-ops and their arguments are not evaluated.
+ * set with the ONIONTRACE_MIN_LOG_LEVEL cmake option. */
+#ifndef ONIONTRACE_MIN_LOG_LEVEL
+#define ONIONTRACE_MIN_LOG_LEVEL ONIONTRACE_LOG_LEVEL_DEBUG
+#endif
+
+/* check the runtime level inline, so filtered messages don't pay for the call and varargs.
+ * the verbose levels are usually filtered in production, so we hint the branch that way. */
+#define _oniontrace_logChecked(level, ...) \
+    do { if((level) <= globalLogFilterLevel) oniontrace_log((level), __FUNCTION__, __VA_ARGS__); } while(0)
+#define _oniontrace_logCheckedUnlikely(level, ...) \
+    do { if(G_UNLIKELY((level) <= globalLogFilterLevel)) oniontrace_log((level), __FUNCTION__, __VA_ARGS__); } while(0)
+#define _oniontrace_logDisabled(...) do {} while(0)
+
+#if defined(DEBUG) && ONIONTRACE_MIN_LOG_LEVEL >= ONIONTRACE_LOG_LEVEL_DEBUG
+#define debug(...) _oniontrace_logCheckedUnlikely(G_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define debug(...) _oniontrace_logDisabled(__VA_ARGS__)
+#endif
+
+#if ONIONTRACE_MIN_LOG_LEVEL >= ONIONTRACE_LOG_LEVEL_INFO
+#define info(...) _oniontrace_logCheckedUnlikely(G_LOG_LEVEL_INFO, __VA_ARGS__)
 #else
-#define debug(...)
+#define info(...) _oniontrace_logDisabled(__VA_ARGS__)
 #endif
-#define info(...) oniontrace_log(G_LOG_LEVEL_INFO, __FUNCTION__, __VA_ARGS__)
-#define message(...) oniontrace_log(G_LOG_LEVEL_MESSAGE, __FUNCTION__, __VA_ARGS__)
-#define warning(...) oniontrace_log(G_LOG_LEVEL_WARNING, __FUNCTION__, __VA_ARGS__)
-#define critical(...) oniontrace_log(G_LOG_LEVEL_CRITICAL, __FUNCTION__, __VA_ARGS__)
-#define error(...) oniontrace_log(G_LOG_LEVEL_ERROR, __FUNCTION__, __VA_ARGS__)
+
+#if ONIONTRACE_MIN_LOG_LEVEL >= ONIONTRACE_LOG_LEVEL_MESSAGE
+#define message(...) _oniontrace_logChecked(G_LOG_LEVEL_MESSAGE, __VA_ARGS__)
+#else
+#define message(...) _oniontrace_logDisabled(__VA_ARGS__)
+#endif
+
+#if ONIONTRACE_MIN_LOG_LEVEL >= ONIONTRACE_LOG_LEVEL_WARNING
+#define warning(...) _oniontrace_logChecked(G_LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define warning(...) _oniontrace_logDisabled(__VA_ARGS__)
+#endif
+
+/* serious problems are always logged */
+#define critical(...) _oniontrace_logChecked(G_LOG_LEVEL_CRITICAL, __VA_ARGS__)
+#define error(...) _oniontrace_logChecked(G_LOG_LEVEL_ERROR, __VA_ARGS__)
 
 #endif /* SRC_ONIONTRACE_H_ */
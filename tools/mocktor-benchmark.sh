@@ -0,0 +1,83 @@
+#!/usr/bin/env bash
+#
+# Runs oniontrace against oniontrace-mocktor in each mode and reports the
+# rate of control lines handled in log mode, the command round trip times,
+# and how late the player launched its circuits.
+#
+# usage: mocktor-benchmark.sh [build_dir] [seconds]
+#
+# the event rates can be changed with the LOG_BW_RATE, RECORD_CIRCUIT_RATE,
+# and RECORD_STREAM_RATE environment variables, and the first control port
+# used with BENCH_PORT. set KEEP_WORK_DIR=1 to keep the logs of each run.
+
+set -e
+
+BUILD_DIR=${1:-build}
+SECONDS_PER_RUN=${2:-10}
+LOG_BW_RATE=${LOG_BW_RATE:-200000}
+RECORD_CIRCUIT_RATE=${RECORD_CIRCUIT_RATE:-20}
+RECORD_STREAM_RATE=${RECORD_STREAM_RATE:-50}
+BENCH_PORT=${BENCH_PORT:-19500}
+
+ONIONTRACE=${BUILD_DIR}/oniontrace
+MOCKTOR=${BUILD_DIR}/oniontrace-mocktor
+
+for program in ${ONIONTRACE} ${MOCKTOR}; do
+    if [ ! -x ${program} ]; then
+        echo "missing ${program}, build it first or pass the build directory" >&2
+        exit 1
+    fi
+done
+
+WORK_DIR=$(mktemp -d)
+MOCKTOR_PID=
+trap '[ -n "${MOCKTOR_PID}" ] && kill ${MOCKTOR_PID} 2>/dev/null; [ -z "${KEEP_WORK_DIR}" ] && rm -rf ${WORK_DIR}' EXIT
+
+# run_mode <name> <port> <mocktor args> -- <oniontrace args>
+run_mode() {
+    local name=$1 port=$2
+    shift 2
+
+    local mocktor_args=()
+    while [ "$1" != "--" ]; do
+        mocktor_args+=("$1")
+        shift
+    done
+    shift
+
+    ${MOCKTOR} ControlPort=${port} RunTime=$((SECONDS_PER_RUN + 5)) "${mocktor_args[@]}" \
+        > ${WORK_DIR}/${name}.mocktor.log &
+    MOCKTOR_PID=$!
+    sleep 0.5
+
+    ${ONIONTRACE} TorControlPort=${port} RunTime=${SECONDS_PER_RUN} "$@" > ${WORK_DIR}/${name}.log
+
+    kill ${MOCKTOR_PID} 2>/dev/null || true
+    wait ${MOCKTOR_PID} 2>/dev/null || true
+    MOCKTOR_PID=
+}
+
+# field <name> <pattern> <key>
+field() {
+    grep "$2" ${WORK_DIR}/$1.log | tail -n 1 | tr ' ' '\n' | grep "^$3=" | cut -d= -f2
+}
+
+report() {
+    local name=$1
+    local rate=$(grep "control lines in" ${WORK_DIR}/${name}.log | tail -n 1 | sed 's/.*(\([0-9.]*\) lines\/s).*/\1/')
+    printf "%-8s %14s %12s %12s %14s %14s\n" ${name} "${rate:--}" \
+        "$(field ${name} "round trip times" p50)" "$(field ${name} "round trip times" p99)" \
+        "$(field ${name} "launch lateness" p50)" "$(field ${name} "launch lateness" p99)"
+}
+
+run_mode log ${BENCH_PORT} BWRate=${LOG_BW_RATE} -- Mode=log Events=BW
+run_mode record $((BENCH_PORT + 1)) BWRate=0 CircuitRate=${RECORD_CIRCUIT_RATE} \
+    StreamRate=${RECORD_STREAM_RATE} CircuitLifetime=1000 -- Mode=record TraceFile=${WORK_DIR}/trace.csv
+
+run_mode play $((BENCH_PORT + 2)) BWRate=0 -- Mode=play TraceFile=${WORK_DIR}/trace.csv
+
+echo "round trip times and launch lateness are in microseconds"
+printf "%-8s %14s %12s %12s %14s %14s\n" mode lines_per_sec rtt_p50 rtt_p99 lateness_p50 lateness_p99
+for name in log record play; do
+    report ${name}
+done
@@ -0,0 +1,100 @@
+#!/usr/bin/env bash
+#
+# Measures how log mode scales with the number of shard threads. One oniontrace
+# process traces many instances of oniontrace-mocktor, once for each value of
+# Shards, and we report the control lines per second that all instances handled
+# together and the speedup over a single shard.
+#
+# usage: mocktor-scaling.sh [build_dir] [seconds] [max_shards]
+#
+# max_shards defaults to the number of cores, and shards are doubled from 1 up
+# to it. the number of instances is set with NUM_INSTANCES (default 64), the
+# BW events per second sent to each instance with BW_RATE, and the number of
+# mock processes the instances are spread over with MOCKTOR_PROCS (default 4).
+# the mocks need cores of their own, so the rates are only meaningful while
+# they keep up; compare the offered load with the handled rates. the first
+# control port is BENCH_PORT. set KEEP_WORK_DIR=1 to keep the logs of each run.
+
+set -e
+
+BUILD_DIR=${1:-build}
+SECONDS_PER_RUN=${2:-10}
+MAX_SHARDS=${3:-$(nproc)}
+NUM_INSTANCES=${NUM_INSTANCES:-64}
+BW_RATE=${BW_RATE:-20000}
+MOCKTOR_PROCS=${MOCKTOR_PROCS:-4}
+BENCH_PORT=${BENCH_PORT:-19600}
+
+ONIONTRACE=${BUILD_DIR}/oniontrace
+MOCKTOR=${BUILD_DIR}/oniontrace-mocktor
+
+for program in ${ONIONTRACE} ${MOCKTOR}; do
+    if [ ! -x ${program} ]; then
+        echo "missing ${program}, build it first or pass the build directory" >&2
+        exit 1
+    fi
+done
+
+if [ ${MOCKTOR_PROCS} -gt ${NUM_INSTANCES} ]; then
+    MOCKTOR_PROCS=${NUM_INSTANCES}
+fi
+
+WORK_DIR=$(mktemp -d)
+MOCKTOR_PIDS=()
+trap '[ ${#MOCKTOR_PIDS[@]} -gt 0 ] && kill ${MOCKTOR_PIDS[@]} 2>/dev/null; [ -z "${KEEP_WORK_DIR}" ] && rm -rf ${WORK_DIR}' EXIT
+
+# run_shards <shards>
+run_shards() {
+    local shards=$1
+    local per_proc=$(( (NUM_INSTANCES + MOCKTOR_PROCS - 1) / MOCKTOR_PROCS ))
+
+    # each mock serves a consecutive range of the instances' control ports
+    MOCKTOR_PIDS=()
+    for ((i = 0; i < MOCKTOR_PROCS; i++)); do
+        local first=$((BENCH_PORT + i * per_proc))
+        local last=$((first + per_proc - 1))
+        if [ ${last} -ge $((BENCH_PORT + NUM_INSTANCES)) ]; then
+            last=$((BENCH_PORT + NUM_INSTANCES - 1))
+        fi
+        [ ${first} -gt ${last} ] && break
+
+        ${MOCKTOR} ControlPort=${first}-${last} RunTime=$((SECONDS_PER_RUN + 5)) BWRate=${BW_RATE} \
+            > ${WORK_DIR}/shards${shards}.mocktor${i}.log &
+        MOCKTOR_PIDS+=($!)
+    done
+    sleep 0.5
+
+    (cd ${WORK_DIR} && ${ONIONTRACE} TorControlPort=${BENCH_PORT}-$((BENCH_PORT + NUM_INSTANCES - 1)) \
+        Shards=${shards} RunTime=${SECONDS_PER_RUN} Mode=log Events=BW \
+        > ${WORK_DIR}/shards${shards}.log)
+
+    kill ${MOCKTOR_PIDS[@]} 2>/dev/null || true
+    wait ${MOCKTOR_PIDS[@]} 2>/dev/null || true
+    MOCKTOR_PIDS=()
+}
+
+# the sum over all instances of the lines per second each one handled
+handled_rate() {
+    grep "control lines in" ${WORK_DIR}/shards$1.log | \
+        sed 's/.*(\([0-9.]*\) lines\/s).*/\1/' | awk '{sum += $1} END {printf "%.0f", sum}'
+}
+
+SHARD_COUNTS=()
+for ((shards = 1; shards < MAX_SHARDS; shards *= 2)); do
+    SHARD_COUNTS+=(${shards})
+done
+SHARD_COUNTS+=(${MAX_SHARDS})
+[ ${MAX_SHARDS} -eq 1 ] && SHARD_COUNTS=(1)
+
+echo "${NUM_INSTANCES} instances over ${MOCKTOR_PROCS} mocks, ${BW_RATE} BW events/s sent to each"
+echo "(offered load $((NUM_INSTANCES * BW_RATE)) lines/s)"
+printf "%-8s %16s %10s\n" shards lines_per_sec speedup
+
+BASE_RATE=
+for shards in ${SHARD_COUNTS[@]}; do
+    run_shards ${shards}
+    rate=$(handled_rate ${shards})
+    [ -z "${BASE_RATE}" ] && BASE_RATE=${rate}
+    printf "%-8s %16s %10s\n" ${shards} ${rate} \
+        $(awk "BEGIN {printf \"%.2f\", ${BASE_RATE} > 0 ? ${rate} / ${BASE_RATE} : 0}")
+done
@@ -248,6 +248,7 @@ class OnionTraceParser(Parser):
         self.boot_succeeded = False
         self.start_ts = None
         self.circuit_ids_built = set()
+        self.logged_summary = None
 
     def __is_date_valid(self, date_to_check):
         if self.date_filter is None:
@@ -313,6 +314,11 @@ class OnionTraceParser(Parser):
                 self.bootstrapping[second] = 100
                 self.boot_succeeded = True
 
+        elif self.boot_succeeded and re.search("Logger:\ssummary\s", line) is not None:
+            # OnionTrace aggregated the events itself (with SummaryInterval), and each
+            # summary holds the totals since it started, so the last one wins
+            self.logged_summary = json.loads(line.split("Logger: summary ", 1)[1])
+
         elif self.boot_succeeded and re.search("Logger:\s650\sBW\s", line) is not None:
             parts = line.strip().split()
 
@@ -459,12 +465,20 @@ class OnionTraceParser(Parser):
     def get_data(self):
         have_bw = True if len(self.bandwidth['bytes_read']) > 0 and len(self.bandwidth['bytes_written']) > 0 else False
         have_cbt = True if len(self.circuit['build_time']) > 0 else False
+        bandwidth_summary = self.bandwidth_summary if have_bw else None
+        circuit_summary = self.circuit_summary if have_cbt else None
+        # fall back to the summaries OnionTrace logged if the raw events were not logged
+        if self.logged_summary is not None:
+            if bandwidth_summary is None:
+                bandwidth_summary = self.logged_summary['bandwidth_summary']
+            if circuit_summary is None:
+                circuit_summary = self.logged_summary['circuit_summary']
         return {
             'bootstrapping': self.bootstrapping if len(self.bootstrapping) > 0 else None,
             'bandwidth': self.bandwidth if have_bw else None,
-            'bandwidth_summary': self.bandwidth_summary if have_bw else None,
+            'bandwidth_summary': bandwidth_summary,
             'circuit': self.circuit if have_cbt else None,
-            'circuit_summary': self.circuit_summary if have_cbt else None,
+            'circuit_summary': circuit_summary,
         }
 
     def get_name(self):